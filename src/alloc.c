@@ -159,6 +159,8 @@ static void free_block(arc *c, void *blk, void *prevblk)
 {
   Bhdr *h, *p;
 
+  if (c->aprof != NULL)
+    __arc_aprof_free(c, (value)blk);
   D2B(h, blk);
   /* Unlink the block from the alloc list. */
   if (prevblk == NULL) {
@@ -385,6 +387,8 @@ static int gc(arc *c)
     retval = 1;
     free_unused_bibop(c);
     malloc_trim(0);
+    if (c->aprof != NULL)
+      __arc_aprof_gc(c);
   }
   nprop = 0;
  endgc:
@@ -403,10 +407,14 @@ static void markroots(arc *c)
   MARKPROP(c->typedesc);
   MARKPROP(c->curthread);
   MARKPROP(c->vmthreads);
+  __arc_thread_mark(c, MARKPROP);
+  __arc_iopool_mark(c, MARKPROP);
   MARKPROP(c->declarations);
 #ifdef HAVE_TRACING
   MARKPROP(c->tracethread);
 #endif
+  __arc_vmprof_mark(c, MARKPROP);
+  __arc_aprof_mark(c, MARKPROP);
 }
 
 value arc_current_gc_milliseconds(arc *c)
@@ -0,0 +1,432 @@
+/*
+  Copyright (C) 2013 Rafael R. Sevilla
+
+  This file is part of Arcueid
+
+  Arcueid is free software: you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this library. If not, see <http://www.gnu.org/licenses/>
+*/
+
+/* The allocation profiler.  Rather than record every allocation, it
+   samples one byte in every so many allocated, at a randomised
+   interval averaging the sampling rate, and charges the object which
+   contains it, in units of the rate, to the site which allocated it.
+   A site is the instruction of the Arc function being executed by the
+   current thread, or if a C function is being executed, the name of
+   the C function together with the instruction of the Arc function
+   that called it, and the type of object allocated.
+
+   The sampled objects are remembered until they are freed, so at the
+   end of every garbage collection epoch, the amount of memory
+   allocated at each site which is still live can be estimated too.
+   Everything is kept outside the Arc heap, since it is updated from
+   within the allocator. */
+#include <stdlib.h>
+#include <string.h>
+#include "arcueid.h"
+#include "vmengine.h"
+#include "../config.h"
+
+#ifdef HAVE_ALLOCA_H
+# include <alloca.h>
+#elif defined __GNUC__
+#ifndef alloca
+# define alloca __builtin_alloca
+#endif
+#elif defined _AIX
+# define alloca __alloca
+#elif defined _MSC_VER
+# include <malloc.h>
+# define alloca _alloca
+#else
+# include <stddef.h>
+void *alloca (size_t);
+#endif
+
+#define APROF_DEFAULT_RATE 16384
+#define APROF_SITEBITS 10
+#define APROF_OBJBITS 12
+#define APROF_DUMPMAX 40
+
+struct aprof_site {
+  value code;			/* code of the function, or nil */
+  int ofs;			/* offset of the instruction in the code */
+  value cname;			/* name of the C function, if any */
+  int type;			/* type of object allocated */
+  unsigned long long samples;	/* number of samples */
+  unsigned long long live;	/* samples still live after the last GC */
+  struct aprof_site *next;
+};
+
+struct aprof_obj {
+  value obj;
+  unsigned long long samples;
+  struct aprof_site *site;
+  struct aprof_obj *next;
+};
+
+struct aprofile {
+  long rate;
+  long long countdown;
+  unsigned long rnd;
+  unsigned long long epochs;	/* GC epochs completed while profiling */
+  struct aprof_site *sites[1 << APROF_SITEBITS];
+  struct aprof_obj *objs[1 << APROF_OBJBITS];
+};
+
+#define OBJHASH(v) ((((unsigned long)(v)) >> 4) & ((1 << APROF_OBJBITS) - 1))
+
+/* The next sampling interval, uniformly distributed between half and
+   one and a half times the rate, so that allocations which happen in
+   a regular pattern are not always sampled at the same place. */
+static long next_interval(struct aprofile *prof)
+{
+  prof->rnd ^= prof->rnd << 13;
+  prof->rnd ^= prof->rnd >> 7;
+  prof->rnd ^= prof->rnd << 17;
+  return(prof->rate/2 + (long)(prof->rnd % prof->rate) + 1);
+}
+
+/* Find the site of an allocation by the current thread.  This must
+   not allocate anything itself. */
+static void alloc_site(arc *c, value *code, int *ofs, value *cname)
+{
+  value thr = c->curthread, cont, f;
+  int o;
+
+  *code = *cname = CNIL;
+  *ofs = 0;
+  if (TYPE(thr) != T_THREAD)
+    return;
+  f = TFUNR(thr);
+  if (TYPE(f) == T_CLOS) {
+    *code = CLOS_CODE(f);
+    *ofs = TIPP(thr) - &XVINDEX(CODE_CODE(*code), 0);
+    return;
+  }
+  if (TYPE(f) != T_CCODE)
+    return;
+  *cname = __arc_ccode_name(c, f);
+  /* Charge it to the Arc function which called the C function */
+  for (cont = TCONR(thr); !NIL_P(cont);) {
+    cont = __arc_cont_frame(c, thr, cont, &f, &o);
+    if (TYPE(f) == T_CLOS) {
+      *code = CLOS_CODE(f);
+      *ofs = o;
+      return;
+    }
+  }
+}
+
+void __arc_aprof_alloc(arc *c, value obj, size_t size, int type)
+{
+  struct aprofile *prof = c->aprof;
+  struct aprof_site *site;
+  struct aprof_obj *ao;
+  unsigned long long samples = 0;
+  value code, cname;
+  int ofs, h;
+
+  prof->countdown -= size;
+  if (prof->countdown > 0)
+    return;
+  while (prof->countdown <= 0) {
+    samples++;
+    prof->countdown += next_interval(prof);
+  }
+
+  alloc_site(c, &code, &ofs, &cname);
+  h = ((((unsigned long)code) >> 4) + ofs * 31 + type)
+    & ((1 << APROF_SITEBITS) - 1);
+  for (site = prof->sites[h]; site != NULL; site = site->next) {
+    if (site->code == code && site->ofs == ofs && site->type == type
+	&& site->cname == cname)
+      break;
+  }
+  if (site == NULL) {
+    site = (struct aprof_site *)calloc(1, sizeof(struct aprof_site));
+    site->code = code;
+    site->ofs = ofs;
+    site->cname = cname;
+    site->type = type;
+    site->next = prof->sites[h];
+    prof->sites[h] = site;
+  }
+  site->samples += samples;
+
+  ao = (struct aprof_obj *)malloc(sizeof(struct aprof_obj));
+  ao->obj = obj;
+  ao->samples = samples;
+  ao->site = site;
+  h = OBJHASH(obj);
+  ao->next = prof->objs[h];
+  prof->objs[h] = ao;
+}
+
+/* Called by the allocator for every object freed while profiling */
+void __arc_aprof_free(arc *c, value obj)
+{
+  struct aprof_obj *ao, **prev;
+
+  prev = &c->aprof->objs[OBJHASH(obj)];
+  for (ao = *prev; ao != NULL; prev = &ao->next, ao = ao->next) {
+    if (ao->obj == obj) {
+      *prev = ao->next;
+      free(ao);
+      return;
+    }
+  }
+}
+
+/* Called at the end of every garbage collection epoch.  Every sampled
+   object not yet freed is live. */
+void __arc_aprof_gc(arc *c)
+{
+  struct aprofile *prof = c->aprof;
+  struct aprof_site *site;
+  struct aprof_obj *ao;
+  int i;
+
+  prof->epochs++;
+  for (i=0; i<(1 << APROF_SITEBITS); i++) {
+    for (site = prof->sites[i]; site != NULL; site = site->next)
+      site->live = 0;
+  }
+  for (i=0; i<(1 << APROF_OBJBITS); i++) {
+    for (ao = prof->objs[i]; ao != NULL; ao = ao->next)
+      ao->site->live += ao->samples;
+  }
+}
+
+void __arc_aprof_mark(arc *c, void (*markfn)(value))
+{
+  struct aprof_site *site;
+  int i;
+
+  if (c->aprof == NULL)
+    return;
+  for (i=0; i<(1 << APROF_SITEBITS); i++) {
+    for (site = c->aprof->sites[i]; site != NULL; site = site->next) {
+      markfn(site->code);
+      markfn(site->cname);
+    }
+  }
+}
+
+/* Start sampling one in every rate bytes allocated, discarding any
+   earlier samples. */
+int arc_aprof_start(arc *c, long rate)
+{
+  arc_aprof_stop(c);
+  c->aprof = (struct aprofile *)calloc(1, sizeof(struct aprofile));
+  if (c->aprof == NULL)
+    return(-1);
+  c->aprof->rate = (rate <= 0) ? APROF_DEFAULT_RATE : rate;
+  c->aprof->rnd = 2463534242UL;
+  c->aprof->countdown = next_interval(c->aprof);
+  return(0);
+}
+
+/* Stop sampling and discard the samples */
+void arc_aprof_stop(arc *c)
+{
+  struct aprof_site *site, *nsite;
+  struct aprof_obj *ao, *nao;
+  int i;
+
+  if (c->aprof == NULL)
+    return;
+  for (i=0; i<(1 << APROF_SITEBITS); i++) {
+    for (site = c->aprof->sites[i]; site != NULL; site = nsite) {
+      nsite = site->next;
+      free(site);
+    }
+  }
+  for (i=0; i<(1 << APROF_OBJBITS); i++) {
+    for (ao = c->aprof->objs[i]; ao != NULL; ao = nao) {
+      nao = ao->next;
+      free(ao);
+    }
+  }
+  free(c->aprof);
+  c->aprof = NULL;
+}
+
+static int site_cmp(const void *a, const void *b)
+{
+  const struct aprof_site *sa = *(struct aprof_site **)a;
+  const struct aprof_site *sb = *(struct aprof_site **)b;
+
+  if (sa->samples != sb->samples)
+    return((sa->samples < sb->samples) ? 1 : -1);
+  if (sa->live != sb->live)
+    return((sa->live < sb->live) ? 1 : -1);
+  return(0);
+}
+
+/* All the sites, in descending order of the memory allocated there */
+static struct aprof_site **sorted_sites(struct aprofile *prof, int *n)
+{
+  struct aprof_site **sites, *site;
+  int i;
+
+  *n = 0;
+  for (i=0; i<(1 << APROF_SITEBITS); i++) {
+    for (site = prof->sites[i]; site != NULL; site = site->next)
+      (*n)++;
+  }
+  sites = malloc(sizeof(struct aprof_site *) * (*n + 1));
+  *n = 0;
+  for (i=0; i<(1 << APROF_SITEBITS); i++) {
+    for (site = prof->sites[i]; site != NULL; site = site->next)
+      sites[(*n)++] = site;
+  }
+  qsort(sites, *n, sizeof(struct aprof_site *), site_cmp);
+  return(sites);
+}
+
+static value site_fnname(arc *c, struct aprof_site *site)
+{
+  value src;
+
+  if (NIL_P(site->code))
+    return(CNIL);
+  src = CODE_SRC(site->code);
+  return((NIL_P(src)) ? CNIL : SRC_FUNCNAME(src));
+}
+
+static value site_fileline(arc *c, struct aprof_site *site)
+{
+  int ofs = site->ofs;
+
+  if (NIL_P(site->code))
+    return(CUNBOUND);
+  /* The offset is that of the instruction after the allocating one,
+     if the allocation happened within the virtual machine. */
+  if (ofs > 0)
+    ofs--;
+  return(__arc_code_lineno(c, arc_mkclos(c, site->code, CNIL),
+			   &XVINDEX(CODE_CODE(site->code), ofs)));
+}
+
+/* The samples as a list, in descending order of memory allocated, of
+   lists of the name, file, and line of the function where the
+   allocation happened, the name of the C function doing the
+   allocation if any, the type of object allocated, the estimated
+   number of bytes allocated there, and the estimated number of them
+   still live after the last garbage collection. */
+value arc_aprof_report(arc *c)
+{
+  struct aprofile *prof = c->aprof;
+  struct aprof_site **sites;
+  value res = CNIL, fileline, elt;
+  int i, n;
+
+  if (prof == NULL)
+    return(CNIL);
+  sites = sorted_sites(prof, &n);
+  for (i=n-1; i>=0; i--) {
+    fileline = site_fileline(c, sites[i]);
+    if (!BOUND_P(fileline))
+      fileline = cons(c, CNIL, CNIL);
+    elt = cons(c, __arc_ull2val(c, sites[i]->live * prof->rate), CNIL);
+    elt = cons(c, __arc_ull2val(c, sites[i]->samples * prof->rate), elt);
+    elt = cons(c, arc_intern_cstr(c, TYPENAME(sites[i]->type)), elt);
+    elt = cons(c, sites[i]->cname, elt);
+    elt = cons(c, cdr(fileline), elt);
+    elt = cons(c, car(fileline), elt);
+    elt = cons(c, site_fnname(c, sites[i]), elt);
+    res = cons(c, elt, res);
+  }
+  free(sites);
+  return(res);
+}
+
+static void dump_name(arc *c, FILE *fp, value name, const char *dflt)
+{
+  char *cstr;
+
+  if (SYMBOL_P(name))
+    name = arc_sym2name(c, name);
+  if (TYPE(name) != T_STRING) {
+    fputs(dflt, fp);
+    return;
+  }
+  cstr = alloca(sizeof(char)*(FIX2INT(arc_strutflen(c, name)) + 1));
+  arc_str2cstr(c, name, cstr);
+  fputs(cstr, fp);
+}
+
+/* Print the sites at which the most memory was allocated */
+void arc_aprof_dump(arc *c, FILE *fp)
+{
+  struct aprofile *prof = c->aprof;
+  struct aprof_site **sites;
+  unsigned long long total = 0, live = 0;
+  value fileline;
+  int i, n;
+
+  if (prof == NULL)
+    return;
+  sites = sorted_sites(prof, &n);
+  for (i=0; i<n; i++) {
+    total += sites[i]->samples;
+    live += sites[i]->live;
+  }
+  fprintf(fp, "%llu bytes allocated, %llu live after %llu GC epochs"
+	  " (sampled every %ld bytes)\n\n", total * prof->rate,
+	  live * prof->rate, prof->epochs, prof->rate);
+  fprintf(fp, "%14s %14s  %-10s %s\n", "bytes", "live", "type", "site");
+  for (i=0; i<n && i<APROF_DUMPMAX; i++) {
+    fprintf(fp, "%14llu %14llu  %-10s ", sites[i]->samples * prof->rate,
+	    sites[i]->live * prof->rate, TYPENAME(sites[i]->type));
+    if (!NIL_P(sites[i]->cname)) {
+      dump_name(c, fp, sites[i]->cname, "");
+      fputs(" in ", fp);
+    }
+    dump_name(c, fp, site_fnname(c, sites[i]), "<anonymous>");
+    fileline = site_fileline(c, sites[i]);
+    if (BOUND_P(fileline)) {
+      fputs(" (", fp);
+      dump_name(c, fp, car(fileline), "");
+      fprintf(fp, ":%ld)", FIX2INT(cdr(fileline)));
+    }
+    fputs("\n", fp);
+  }
+  free(sites);
+}
+
+/* (alloc-profile t [rate]) starts sampling one in every rate bytes
+   allocated, (alloc-profile) gets the samples, and (alloc-profile nil)
+   stops sampling. */
+AFFDEF(arc_alloc_profile)
+{
+  AOARG(on, rate);
+  AFBEGIN;
+  if (!BOUND_P(AV(on)))
+    ARETURN(arc_aprof_report(c));
+  if (NIL_P(AV(on))) {
+    arc_aprof_stop(c);
+    ARETURN(CNIL);
+  }
+  if (BOUND_P(AV(rate))) {
+    TYPECHECK(AV(rate), T_FIXNUM);
+  }
+  if (arc_aprof_start(c, BOUND_P(AV(rate)) ? FIX2INT(AV(rate)) : 0) < 0) {
+    arc_err_cstrfmt(c, "cannot start allocation profiler");
+    ARETURN(CNIL);
+  }
+  ARETURN(CTRUE);
+  AFEND;
+}
+AFFEND
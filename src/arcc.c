@@ -0,0 +1,615 @@
+/*
+  Copyright (C) 2013 Rafael R. Sevilla
+
+  This file is part of Arcueid
+
+  Arcueid is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; either version 3 of the
+  License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/* Precompiled code files.  When a file foo.arc is loaded, the T_CODE
+   objects produced by compiling each of its top-level expressions are
+   saved in foo.arcc, and the next time foo.arc is loaded the code in
+   foo.arcc is run instead, provided it is newer, and provided that
+   what compiling foo.arc depended on besides foo.arc itself is still
+   the same (see arc_arcc_deps).
+
+   The file format is as follows: the magic bytes ARCC, the format
+   version, the dependency hash, and the number of code objects,
+   followed by the code objects themselves.  Each object is a tag byte followed by its contents.
+   All integers are stored as variable-length integers, seven bits to a
+   byte, least significant bits first.  Symbols are stored by name, so
+   they are interned again when read.  Only the kinds of objects that
+   may appear as literals in compiled code are supported: if anything
+   else turns up, no file is written at all.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "arcueid.h"
+#include "vmengine.h"
+#include "builtins.h"
+#include "compiler.h"
+#include "hash.h"
+#include "arith.h"
+#include "../config.h"
+
+#define ARCC_MAGIC "ARCC"
+#define ARCC_VERSION 6
+
+/* Maximum nesting depth of objects, to catch circular structure */
+#define ARCC_MAXDEPTH 10000
+
+enum arcc_tags {
+  A_NIL = 'n',
+  A_TRUE = 't',
+  A_UNBOUND = 'u',
+  A_FIXNUM = 'i',
+  A_FLONUM = 'f',
+  A_COMPLEX = 'z',
+  A_BIGNUM = 'b',
+  A_RATIONAL = 'r',
+  A_CHAR = 'c',
+  A_STRING = 's',
+  A_SYMBOL = 'y',
+  A_CONS = 'p',
+  A_VECTOR = 'v',
+  A_CODE = 'C'
+};
+
+struct arcc_buf {
+  unsigned char *data;
+  size_t len, size, ptr;
+};
+
+static int putbyte(struct arcc_buf *buf, int byte)
+{
+  unsigned char *ndata;
+
+  if (buf->len >= buf->size) {
+    buf->size = (buf->size == 0) ? 4096 : 2*buf->size;
+    ndata = realloc(buf->data, buf->size);
+    if (ndata == NULL)
+      return(-1);
+    buf->data = ndata;
+  }
+  buf->data[buf->len++] = byte;
+  return(0);
+}
+
+static int putuint(struct arcc_buf *buf, unsigned long long n)
+{
+  while (n >= 0x80) {
+    if (putbyte(buf, (n & 0x7f) | 0x80) < 0)
+      return(-1);
+    n >>= 7;
+  }
+  return(putbyte(buf, n));
+}
+
+static int putint(struct arcc_buf *buf, long long n)
+{
+  return(putuint(buf, (n < 0) ? ((~(unsigned long long)n) << 1) | 1
+		 : ((unsigned long long)n) << 1));
+}
+
+static int putdouble(struct arcc_buf *buf, double d)
+{
+  unsigned long long bits;
+
+  memcpy(&bits, &d, sizeof(double));
+  return(putuint(buf, bits));
+}
+
+static int putstr(arc *c, struct arcc_buf *buf, value str)
+{
+  int i, len;
+
+  len = arc_strlen(c, str);
+  if (putuint(buf, len) < 0)
+    return(-1);
+  for (i=0; i<len; i++) {
+    if (putuint(buf, arc_strindex(c, str, i)) < 0)
+      return(-1);
+  }
+  return(0);
+}
+
+#ifdef HAVE_GMP_H
+static int putcstr(struct arcc_buf *buf, char *s)
+{
+  int ret = 0;
+
+  if (s == NULL)
+    return(-1);
+  if (putuint(buf, strlen(s)) < 0)
+    ret = -1;
+  while (ret == 0 && *s)
+    ret = putbyte(buf, *s++);
+  return(ret);
+}
+#endif
+
+static int putobj(arc *c, struct arcc_buf *buf, value obj, int depth)
+{
+  int i;
+#ifdef HAVE_GMP_H
+  char *s;
+  int ret;
+#endif
+
+  if (depth > ARCC_MAXDEPTH)
+    return(-1);
+  if (NIL_P(obj))
+    return(putbyte(buf, A_NIL));
+  if (obj == CTRUE)
+    return(putbyte(buf, A_TRUE));
+  if (obj == CUNBOUND)
+    return(putbyte(buf, A_UNBOUND));
+
+  switch (TYPE(obj)) {
+  case T_FIXNUM:
+    if (putbyte(buf, A_FIXNUM) < 0)
+      return(-1);
+    return(putint(buf, FIX2INT(obj)));
+  case T_FLONUM:
+    if (putbyte(buf, A_FLONUM) < 0)
+      return(-1);
+    return(putdouble(buf, REPFLO(obj)));
+  case T_COMPLEX:
+    if (putbyte(buf, A_COMPLEX) < 0 || putdouble(buf, creal(REPCPX(obj))) < 0)
+      return(-1);
+    return(putdouble(buf, cimag(REPCPX(obj))));
+#ifdef HAVE_GMP_H
+  case T_BIGNUM:
+    if (putbyte(buf, A_BIGNUM) < 0)
+      return(-1);
+    s = mpz_get_str(NULL, 16, REPBNUM(obj));
+    ret = putcstr(buf, s);
+    free(s);
+    return(ret);
+  case T_RATIONAL:
+    if (putbyte(buf, A_RATIONAL) < 0)
+      return(-1);
+    s = mpq_get_str(NULL, 16, REPRAT(obj));
+    ret = putcstr(buf, s);
+    free(s);
+    return(ret);
+#endif
+  case T_CHAR:
+    if (putbyte(buf, A_CHAR) < 0)
+      return(-1);
+    return(putuint(buf, arc_char2rune(c, obj)));
+  case T_STRING:
+    if (putbyte(buf, A_STRING) < 0)
+      return(-1);
+    return(putstr(c, buf, obj));
+  case T_SYMBOL:
+    if (putbyte(buf, A_SYMBOL) < 0)
+      return(-1);
+    return(putstr(c, buf, arc_sym2name(c, obj)));
+  case T_CONS:
+    /* iterate over the cdrs so long lists don't use up the depth */
+    for (; TYPE(obj) == T_CONS; obj = cdr(obj)) {
+      if (putbyte(buf, A_CONS) < 0 || putobj(c, buf, car(obj), depth+1) < 0)
+	return(-1);
+    }
+    return(putobj(c, buf, obj, depth+1));
+  case T_VECTOR:
+  case T_CODE:
+    if (putbyte(buf, (TYPE(obj) == T_CODE) ? A_CODE : A_VECTOR) < 0
+	|| putuint(buf, VECLEN(obj)) < 0)
+      return(-1);
+    for (i=0; i<VECLEN(obj); i++) {
+      if (putobj(c, buf, VINDEX(obj, i), depth+1) < 0)
+	return(-1);
+    }
+    return(0);
+  default:
+    break;
+  }
+  /* Anything else can't be saved */
+  return(-1);
+}
+
+/* FNV-1a, over the bytes of buf */
+static unsigned long hashbuf(struct arcc_buf *buf)
+{
+  unsigned long h = 2166136261UL;
+  size_t i;
+
+  for (i=0; i<buf->len; i++)
+    h = (h ^ buf->data[i]) * 16777619UL;
+  return(h & 0xffffffffUL);
+}
+
+/* Write out what makes the code of a macro what it is: its
+   instructions and literals, but neither its source information nor
+   the state of its inline expansions, which change as it runs. */
+static int putmacro(arc *c, struct arcc_buf *buf, value code, int depth)
+{
+  value lit;
+  int i, ret;
+
+  if (depth > ARCC_MAXDEPTH || putobj(c, buf, CODE_CODE(code), depth+1) < 0)
+    return(-1);
+  for (i=0; i<VECLEN(code)-2; i++) {
+    lit = CODE_LITERAL(code, i);
+    if (TYPE(lit) == T_CODE)
+      ret = putmacro(c, buf, lit, depth+1);
+    else if (TYPE(lit) == T_VECTOR && VECLEN(lit) == INL_SIZE)
+      ret = (putobj(c, buf, INL_NAME(lit), depth+1) < 0) ? -1
+	: putobj(c, buf, INL_SRC(lit), depth+1);
+    else
+      ret = putobj(c, buf, lit, depth+1);
+    if (ret < 0)
+      return(-1);
+  }
+  return(0);
+}
+
+/* A hash of what compiling a file depends on besides the file itself,
+   as things stand before it is loaded: the macros defined by other
+   files, and which of the operators the compiler folds or expands
+   inline are still the builtins it assumes (__arc_compile_assumes).
+   Each macro is hashed by its name and its code, so the hash only
+   changes when a macro does.  A macro whose code can't be written out
+   is hashed by name alone. */
+unsigned long arc_arcc_deps(arc *c)
+{
+  struct arcc_buf buf;
+  unsigned long deps;
+  value sym, val;
+  size_t len;
+  int i = 0;
+
+  memset(&buf, 0, sizeof(buf));
+  deps = __arc_compile_assumes(c);
+  while (__arc_hash_next(c, c->genv, &i, &sym, &val)) {
+    if (!(__arc_symflags(c, sym) & SYMF_MACRO))
+      continue;
+    buf.len = 0;
+    if (putstr(c, &buf, arc_sym2name(c, sym)) < 0)
+      continue;
+    if (arc_type(c, val) == ARC_BUILTIN(c, S_MAC)
+	&& TYPE(arc_rep(c, val)) == T_CLOS) {
+      len = buf.len;
+      if (putmacro(c, &buf, CLOS_CODE(arc_rep(c, val)), 0) < 0)
+	buf.len = len;
+    } else if (SYMBOL_P(val)) {
+      putobj(c, &buf, val, 0);
+    } else {
+      continue;
+    }
+    /* a sum, as the order of the global table may differ */
+    deps += hashbuf(&buf);
+  }
+  free(buf.data);
+  return(deps & 0x3fffffffUL);
+}
+
+/* Write the list of T_CODE objects codes to arccfile.  The file is
+   written under a temporary name first and renamed, so a partially
+   written file is never seen.  deps should be what arc_arcc_deps
+   returned before the file was loaded.  Returns 0 if successful, -1 if the
+   file could not be written or the code contains objects which can't
+   be saved. */
+int arc_arcc_write(arc *c, const char *arccfile, value codes,
+		   unsigned long deps)
+{
+  struct arcc_buf buf;
+  value cl;
+  char *tmpname = NULL;
+  const char *m;
+  FILE *fp;
+  int ret = -1;
+
+  memset(&buf, 0, sizeof(buf));
+  for (m = ARCC_MAGIC; *m; m++) {
+    if (putbyte(&buf, *m) < 0)
+      goto done;
+  }
+  if (putuint(&buf, ARCC_VERSION) < 0 || putuint(&buf, deps) < 0
+      || putuint(&buf, FIX2INT(arc_list_length(c, codes))) < 0)
+    goto done;
+  for (cl = codes; !NIL_P(cl); cl = cdr(cl)) {
+    if (putobj(c, &buf, car(cl), 0) < 0)
+      goto done;
+  }
+
+  tmpname = malloc(strlen(arccfile) + 32);
+  if (tmpname == NULL)
+    goto done;
+  sprintf(tmpname, "%s.%ld", arccfile, (long)getpid());
+  fp = fopen(tmpname, "wb");
+  if (fp == NULL)
+    goto done;
+  if (fwrite(buf.data, 1, buf.len, fp) != buf.len) {
+    fclose(fp);
+    unlink(tmpname);
+    goto done;
+  }
+  if (fclose(fp) != 0 || rename(tmpname, arccfile) != 0) {
+    unlink(tmpname);
+    goto done;
+  }
+  ret = 0;
+ done:
+  free(tmpname);
+  free(buf.data);
+  return(ret);
+}
+
+/* The reader functions return -1 if the data is truncated or malformed */
+static int getbyte(struct arcc_buf *buf)
+{
+  if (buf->ptr >= buf->len)
+    return(-1);
+  return(buf->data[buf->ptr++]);
+}
+
+static int getuint(struct arcc_buf *buf, unsigned long long *n)
+{
+  int byte, shift = 0;
+
+  *n = 0;
+  do {
+    if ((byte = getbyte(buf)) < 0 || shift > 63)
+      return(-1);
+    *n |= ((unsigned long long)(byte & 0x7f)) << shift;
+    shift += 7;
+  } while (byte & 0x80);
+  return(0);
+}
+
+static int getint(struct arcc_buf *buf, long long *n)
+{
+  unsigned long long zz;
+
+  if (getuint(buf, &zz) < 0)
+    return(-1);
+  *n = (zz & 1) ? (long long)~(zz >> 1) : (long long)(zz >> 1);
+  return(0);
+}
+
+static int getdouble(struct arcc_buf *buf, double *d)
+{
+  unsigned long long bits;
+
+  if (getuint(buf, &bits) < 0)
+    return(-1);
+  memcpy(d, &bits, sizeof(double));
+  return(0);
+}
+
+/* Get a length, which should be no more than the data remaining */
+static int getlen(struct arcc_buf *buf, int *len)
+{
+  unsigned long long n;
+
+  if (getuint(buf, &n) < 0 || n > buf->len - buf->ptr)
+    return(-1);
+  *len = (int)n;
+  return(0);
+}
+
+static int getstr(arc *c, struct arcc_buf *buf, value *str)
+{
+  int i, len;
+  unsigned long long r;
+
+  if (getlen(buf, &len) < 0)
+    return(-1);
+  *str = arc_mkstringlen(c, len);
+  for (i=0; i<len; i++) {
+    if (getuint(buf, &r) < 0)
+      return(-1);
+    arc_strsetindex(c, *str, i, (Rune)r);
+  }
+  return(0);
+}
+
+#ifdef HAVE_GMP_H
+static char *getcstr(struct arcc_buf *buf)
+{
+  char *s;
+  int len;
+
+  if (getlen(buf, &len) < 0 || (s = malloc(len + 1)) == NULL)
+    return(NULL);
+  memcpy(s, buf->data + buf->ptr, len);
+  s[len] = 0;
+  buf->ptr += len;
+  return(s);
+}
+#endif
+
+static int getobj(arc *c, struct arcc_buf *buf, value *obj, int depth)
+{
+  int tag, i, len;
+  long long n;
+  unsigned long long r;
+  double re, im;
+  value str, cell, last;
+#ifdef HAVE_GMP_H
+  char *s;
+  int ret;
+#endif
+
+  if (depth > ARCC_MAXDEPTH || (tag = getbyte(buf)) < 0)
+    return(-1);
+  switch (tag) {
+  case A_NIL:
+    *obj = CNIL;
+    return(0);
+  case A_TRUE:
+    *obj = CTRUE;
+    return(0);
+  case A_UNBOUND:
+    *obj = CUNBOUND;
+    return(0);
+  case A_FIXNUM:
+    if (getint(buf, &n) < 0)
+      return(-1);
+    *obj = INT2FIX(n);
+    return(0);
+  case A_FLONUM:
+    if (getdouble(buf, &re) < 0)
+      return(-1);
+    *obj = arc_mkflonum(c, re);
+    return(0);
+  case A_COMPLEX:
+    if (getdouble(buf, &re) < 0 || getdouble(buf, &im) < 0)
+      return(-1);
+    *obj = arc_mkcomplex(c, re + I*im);
+    return(0);
+#ifdef HAVE_GMP_H
+  case A_BIGNUM:
+    if ((s = getcstr(buf)) == NULL)
+      return(-1);
+    *obj = arc_mkbignuml(c, 0);
+    ret = mpz_set_str(REPBNUM(*obj), s, 16);
+    free(s);
+    return(ret);
+  case A_RATIONAL:
+    if ((s = getcstr(buf)) == NULL)
+      return(-1);
+    *obj = arc_mkrationall(c, 0, 1);
+    ret = mpq_set_str(REPRAT(*obj), s, 16);
+    mpq_canonicalize(REPRAT(*obj));
+    free(s);
+    return(ret);
+#endif
+  case A_CHAR:
+    if (getuint(buf, &r) < 0)
+      return(-1);
+    *obj = arc_mkchar(c, (Rune)r);
+    return(0);
+  case A_STRING:
+    return(getstr(c, buf, obj));
+  case A_SYMBOL:
+    if (getstr(c, buf, &str) < 0)
+      return(-1);
+    *obj = arc_intern(c, str);
+    __arc_uniq_reserve(c, *obj);
+    return(0);
+  case A_CONS:
+    /* A list is a run of A_CONS tags, each followed by the car, and
+       then the final cdr. */
+    *obj = last = CNIL;
+    do {
+      if (getobj(c, buf, &str, depth+1) < 0)
+	return(-1);
+      cell = cons(c, str, CNIL);
+      if (NIL_P(last))
+	*obj = cell;
+      else
+	scdr(last, cell);
+      last = cell;
+      if (buf->ptr < buf->len && buf->data[buf->ptr] == A_CONS)
+	buf->ptr++;
+      else
+	break;
+    } while (1);
+    if (getobj(c, buf, &str, depth+1) < 0)
+      return(-1);
+    scdr(last, str);
+    return(0);
+  case A_VECTOR:
+  case A_CODE:
+    if (getlen(buf, &len) < 0)
+      return(-1);
+    if (tag == A_CODE) {
+      if (len < 2)
+	return(-1);
+      *obj = arc_mkcode(c, 0, len-2);
+    } else {
+      *obj = arc_mkvector(c, len);
+    }
+    for (i=0; i<len; i++) {
+      if (getobj(c, buf, &str, depth+1) < 0)
+	return(-1);
+      SVINDEX(*obj, i, str);
+    }
+    /* The code vector and the source information must be vectors */
+    if (tag == A_CODE && (TYPE(CODE_CODE(*obj)) != T_VECTOR
+			  || (!NIL_P(CODE_SRC(*obj))
+			      && TYPE(CODE_SRC(*obj)) != T_VECTOR)))
+      return(-1);
+    if (tag == A_CODE)
+      __arc_inline_reset(c, *obj);
+    return(0);
+  default:
+    break;
+  }
+  return(-1);
+}
+
+/* Read the precompiled code for arcfile from arccfile, returning a list
+   of the T_CODE objects for each of the top-level expressions in the
+   file.  Returns CUNBOUND if arccfile doesn't exist, is not newer than
+   arcfile, is not a valid precompiled code file, or was compiled with
+   dependencies other than deps. */
+value arc_arcc_read(arc *c, const char *arcfile, const char *arccfile,
+		    unsigned long deps)
+{
+  struct stat arcst, arccst;
+  struct arcc_buf buf;
+  value codes, code, last, cell;
+  unsigned long long version, fdeps, count, i;
+  const char *m;
+  FILE *fp;
+
+  if (stat(arcfile, &arcst) < 0 || stat(arccfile, &arccst) < 0
+      || arccst.st_mtime <= arcst.st_mtime)
+    return(CUNBOUND);
+
+  memset(&buf, 0, sizeof(buf));
+  buf.len = arccst.st_size;
+  if ((buf.data = malloc(buf.len + 1)) == NULL)
+    return(CUNBOUND);
+  fp = fopen(arccfile, "rb");
+  if (fp == NULL) {
+    free(buf.data);
+    return(CUNBOUND);
+  }
+  buf.len = fread(buf.data, 1, buf.len, fp);
+  fclose(fp);
+
+  codes = CUNBOUND;
+  for (m = ARCC_MAGIC; *m; m++) {
+    if (getbyte(&buf) != *m)
+      goto done;
+  }
+  if (getuint(&buf, &version) < 0 || version != ARCC_VERSION
+      || getuint(&buf, &fdeps) < 0 || fdeps != deps
+      || getuint(&buf, &count) < 0)
+    goto done;
+  codes = last = CNIL;
+  for (i=0; i<count; i++) {
+    if (getobj(c, &buf, &code, 0) < 0 || TYPE(code) != T_CODE) {
+      codes = CUNBOUND;
+      goto done;
+    }
+    cell = cons(c, code, CNIL);
+    if (NIL_P(last))
+      codes = cell;
+    else
+      scdr(last, cell);
+    last = cell;
+  }
+ done:
+  free(buf.data);
+  return(codes);
+}
@@ -25,6 +25,7 @@
 #include <math.h>
 #include <float.h>
 #include <inttypes.h>
+#include <limits.h>
 #include "arcueid.h"
 #include "arith.h"
 #include "builtins.h"
@@ -70,6 +71,11 @@ value arc_mkobject(arc *c, size_t size, int type)
 
   cc = (struct cell *)c->alloc(c, sizeof(struct cell) + size - sizeof(value));
   cc->_type = type;
+  c->allocated += size;
+  if (c->allocated > c->alloclimit)
+    __arc_alloc_limit(c);
+  if (c->aprof != NULL)
+    __arc_aprof_alloc(c, (value)cc, size, type);
   return((value)cc);
 }
 
@@ -206,6 +212,14 @@ typefn_t *__arc_typefn(arc *c, value v)
   return((typefn_t *)REP(typedesc));
 }
 
+const char *__arc_typenames[] = {
+  "nil", "true", "fixnum", "bignum", "flonum", "rational", "complex",
+  "char", "string", "symbol", "cons", "table", "tablevec", "tbucket",
+  "tagged", "exception", "input", "output", "thread", "vector",
+  "continuation", "closure", "code", "environment", "ccode", "custom",
+  "channel", "typedesc", "wtable", "num", "int", "regexp"
+};
+
 value arc_type(arc *c, value obj)
 {
   switch (TYPE(obj)) {
@@ -540,57 +554,32 @@ value arc_cmp(arc *c, value v1, value v2)
   return(CNIL);
 }
 
-/* Similar to pairwise except that it steps through each element one
-   at a time and checks its neighbor as well. */
-static AFFDEF(pairwise2)
+/* Comparing each argument with its neighbour needs nothing but arc_cmp,
+   so > and < look at their arguments where they are on the stack. */
+AFFDEF(arc_gt)
 {
-  AARG(pred, lst);
+  ASARG(args);
+  int i;
   AFBEGIN;
-
-  for (;;) {
-    if (NIL_P(AV(lst)))
-      ARETURN(CTRUE);
-    if (NIL_P(cdr(AV(lst))))
-      ARETURN(CTRUE);
-    AFCALL(AV(pred), car(AV(lst)), cadr(AV(lst)));
-    if (NIL_P(AFCRV))
+  for (i=0; i<ARESTC(args)-1; i++) {
+    if (FIX2INT(arc_cmp(c, ARESTV(args, i), ARESTV(args, i+1))) <= 0)
       ARETURN(CNIL);
-    WV(lst, cdr(AV(lst)));
   }
-  AFEND;
-}
-AFFEND
-
-static value gt2(arc *c, value v1, value v2)
-{
-  return((FIX2INT(arc_cmp(c, v1, v2)) > 0) ? CTRUE : CNIL);
-}
-
-static value lt2(arc *c, value v1, value v2)
-{
-  return((FIX2INT(arc_cmp(c, v1, v2)) < 0) ? CTRUE : CNIL);
-}
-
-AFFDEF(arc_gt)
-{
-  ARARG(list);
-  AFBEGIN;
-  /* tail call */
-  AFTCALL(arc_mkaff(c, pairwise2, CNIL),
-	  arc_mkccode(c, 2, gt2, CNIL),
-	  AV(list));
+  ARETURN(CTRUE);
   AFEND;
 }
 AFFEND
 
 AFFDEF(arc_lt)
 {
-  ARARG(list);
+  ASARG(args);
+  int i;
   AFBEGIN;
-  /* tail call */
-  AFTCALL(arc_mkaff(c, pairwise2, CNIL),
-	  arc_mkccode(c, 2, lt2, CNIL),
-	  AV(list));
+  for (i=0; i<ARESTC(args)-1; i++) {
+    if (FIX2INT(arc_cmp(c, ARESTV(args, i), ARESTV(args, i+1))) >= 0)
+      ARETURN(CNIL);
+  }
+  ARETURN(CTRUE);
   AFEND;
 }
 AFFEND
@@ -840,7 +829,7 @@ static struct {
   { "disp", -2, arc_disp },
   { "close", -2, arc_close },
   { "force-close", -2, arc_close },
-  { "flushout", 0, arc_flushout },
+  { "flushout", -2, arc_flushout },
   { "pipe-from", 1, arc_pipe_from },
   { "seek", -2, arc_seek },
   { "tell", -2, arc_tell },
@@ -859,9 +848,17 @@ static struct {
   { "join-thread", -2, arc_join_thread },
   { "sleep", -2, arc_sleep },
   { "dead", 1, arc_dead },
-  { "chan", 0, arc_mkchan },
+  { "threads", 0, arc_threads },
+  { "thread-stats", 1, arc_thread_stats },
+  { "thread-limit", 3, arc_thread_limit },
+  { "thread-priority", -2, arc_thread_priority },
+  { "thread-backtrace", 1, arc_thread_backtrace },
+  { "deadlocks", -2, arc_deadlocks },
+  { "deadlock-watchdog", -2, arc_deadlock_watchdog },
+  { "chan", -2, arc_chan },
   { "<-", -2, arc_recv_channel },
   { "<-=", -2, arc_send_channel },
+  { "alt", -2, arc_alt },
   { "scmark", 2, arc_scmark },
   { "ccmark", 1, arc_ccmark },
   { "cmark", 1, arc_cmark },
@@ -875,9 +872,9 @@ static struct {
   { "client-ip", 1, arc_client_ip },
 
   /* File system operations */
-  { "dir", 1, arc_dir },
-  { "dir-exists", 1, arc_dir_exists },
-  { "file-exists", 1, arc_file_exists },
+  { "dir", -2, arc_dir },
+  { "dir-exists", -2, arc_dir_exists },
+  { "file-exists", -2, arc_file_exists },
   { "rmfile", 1, arc_rmfile },
   { "mvfile", 2, arc_mvfile },
   { "realpath", 1, arc_realpath },
@@ -888,6 +885,7 @@ static struct {
 
   /* Error handling and continuations */
   { "ccc", -2, arc_callcc },
+  { "ecc", -2, arc_callec },
   { "dynamic-wind", -2, arc_dynamic_wind },
   { "details", 1, arc_details },
   { "err", -2, arc_err },
@@ -909,6 +907,10 @@ static struct {
   { "quit", -2, arc_quit },
   { "setuid", 1, arc_setuid },
   { "memory", 0, arc_memory },
+  { "dump-image", 1, arc_dump_image },
+  { "vm-profile", -2, arc_vm_profile },
+  { "sample-profile", -2, arc_sample_profile },
+  { "alloc-profile", -2, arc_alloc_profile },
   /* miscellaneous */
   { "sref", -2, arc_sref },
   { "len", 1, arc_len },
@@ -919,11 +921,27 @@ static struct {
 
 value arc_bound(arc *c, value sym)
 {
-  return((arc_hash_lookup(c, c->genv, sym) == CUNBOUND) ? CNIL: CTRUE);
+  value binding = arc_hash_lookup(c, c->genv, sym);
+
+  if (!NIL_P(c->curthread) && TMACREADS(c->curthread) != CUNBOUND)
+    __arc_macex_read(c, c->curthread, sym, binding);
+  return((binding == CUNBOUND) ? CNIL: CTRUE);
 }
 
 value arc_bindsym(arc *c, value sym, value binding)
 {
+  int flags;
+
+  /* Code which expanded the old binding inline must stop using it */
+  if (__arc_symflags(c, sym) & SYMF_INLINED)
+    __arc_inline_invalidate(c, sym);
+  __arc_macex_rebind(c, sym, binding);
+  /* Compiled code compares fixnums with < and > by itself only for as
+     long as they are bound to the builtins */
+  flags = __arc_symflags(c, sym) & ~SYMF_BUILTIN;
+  if (TYPE(binding) == T_CCODE && __arc_ccode_name(c, binding) == sym)
+    flags |= SYMF_BUILTIN;
+  __arc_setsymflags(c, sym, flags);
   return(arc_hash_insert(c, c->genv, sym, binding));
 }
 
@@ -995,6 +1013,11 @@ void arc_init_builtins(arc *c)
 void arc_init(arc *c)
 {
   c->ctrue = (value)2; /* stand-in for CTRUE until properly defined */
+  c->vmprof = NULL;
+  c->sprof = NULL;
+  c->aprof = NULL;
+  c->allocated = 0LL;
+  c->alloclimit = ULLONG_MAX;
   /* Initialise memory manager first */
   arc_init_memmgr(c);
   /* Initialise built-in data type definitions */
@@ -1034,11 +1057,14 @@ void arc_deinit(arc *c)
   c->builtins = CNIL;
   c->typedesc = CNIL;
   c->curthread = CNIL;
-  c->vmthreads = CNIL;
+  arc_deinit_threads(c);
   c->declarations = CNIL;
 #ifdef HAVE_TRACING
   c->tracethread = CNIL;
 #endif
+  arc_vmprof_stop(c);
+  arc_sprof_stop(c);
+  arc_aprof_stop(c);
   /* perform three iterations to clear */
   while (c->gc(c) == 0)
     ;
@@ -1048,4 +1074,7 @@ void arc_deinit(arc *c)
     ;
   free(c->alloc_ctx);
   c->alloc_ctx = NULL;
+  free(c->symflags);
+  c->symflags = NULL;
+  c->nsymflags = 0;
 }
@@ -79,6 +79,12 @@ enum arc_types {
 };
 
 struct arc;
+struct vmprofile;
+struct sprofile;
+struct aprofile;
+struct iofd;
+struct uring;
+struct iopool;
 
 /* Trampoline states */
 enum tr_states_t {
@@ -140,23 +146,48 @@ struct arc {
   /* Type functions and type descriptors */
   typefn_t *typefns[T_MAX+1];	/* type functions */
   value typedesc;		/* type descriptor hash */
+  unsigned long long allocated;	/* bytes allocated by arc_mkobject */
+  unsigned long long alloclimit; /* allocated beyond which the running
+				   thread exceeds its allocation limit */
 
   /* Symbol table and global environment */
   value symtable;		/* global symbol table */
   value rsymtable;		/* reverse global symbol table */
   int lastsym;			/* last symbol index created */
+  unsigned char *symflags;	/* flags for each symbol, by symbol ID */
+  int nsymflags;		/* size of symflags */
   value genv;			/* global environment */
   value builtins;		/* built-in data */
   value ctrue;			/* true */
 
   /* Threading and scheduler */
-  value vmthreads;		/* virtual machine thread objects (head) */
-  value vmthrtail;		/* virtual machine thread objects (tail) */
+  value vmthreads;		/* run queue of ready threads (head) */
+  value vmthrtail;		/* run queue of ready threads (tail) */
+  value expressq;		/* threads to run before the others (head) */
+  value exprtail;		/* threads to run before the others (tail) */
+  value *sleepers;		/* heap of sleeping threads by wakeup time */
+  int nsleepers;		/* number of sleeping threads */
+  int sleepersize;		/* allocated size of the sleep heap */
+  struct iofd *iofds;		/* threads waiting on I/O, by descriptor */
+  int niofds;			/* size of the descriptor table */
+  int niowait;			/* number of threads waiting on I/O */
+  int epollfd;			/* descriptor for epoll, if used */
+  struct uring *uring;		/* io_uring, if used */
+  int nouring;			/* io_uring could not be set up */
+  struct iopool *iopool;	/* helper threads for blocking I/O */
+  int indispatch;		/* is the dispatcher running? */
   value curthread;		/* current thread */
+  value allthreads;		/* threads not yet released, by ID */
   int tid_nonce;		/* nonce for thread IDs */
   int stksize;			/* default stack size for threads */
   value tracethread;		/* tracing thread */
+  struct vmprofile *vmprof;	/* bytecode profile, if profiling */
+  struct sprofile *sprof;	/* sampling profile, if sampling */
+  struct aprofile *aprof;	/* allocation profile, if profiling */
   unsigned long quantum;	/* default quantum */
+  int watchdog;			/* is the deadlock watchdog on? */
+  unsigned long long wdstall;	/* watchdog reports waits this long (usec) */
+  unsigned long long wdchecked;	/* when the watchdog last checked */
   void (*errhandler)(struct arc *, value, value); /* catch-all error handler */
 
   /* declarations */
@@ -361,14 +392,48 @@ extern value arc_mkccode(arc *c, int argc, value (*cfunc)(),
 extern value arc_mkaff(arc *c, int (*aff)(arc *, value), value name);
 extern value arc_mkaff2(arc *c, int (*aff)(arc *, value), value name,
 			value env);
+extern value __arc_ccode_name(arc *c, value cfn);
 extern int __arc_affapply(arc *c, value thr, value ccont, value func, ...);
 extern int __arc_affapply2(arc *c, value thr, value ccont, value func,
 			   value args);
 extern int __arc_affyield(arc *c, value thr, int line);
 extern int __arc_affiowait(arc *c, value thr, int line, int fd, int rw);
+extern int __arc_affiorecv(arc *c, value thr, int line, int fd, size_t len);
+extern int __arc_iorecv(arc *c, value thr, int fd, void *buf, size_t len);
+
+/* A blocking operation for the I/O pool to perform on behalf of a
+   thread.  fn runs on one of the pool's helper threads, and must not
+   touch anything that belongs to the interpreter.  If the thread that
+   wanted the job done is no longer around to see it completed,
+   discard (if not NULL) is called to undo it.  obj is kept from being
+   collected as long as the job exists. */
+struct iojob {
+  void (*fn)(struct iojob *);
+  void (*discard)(struct iojob *);
+  void *ptr;			/* argument and/or result */
+  void *serial;			/* jobs with the same ptr go one by one */
+  long res;			/* result */
+  int err;			/* errno after the operation */
+  int done;			/* has fn finished? */
+  int abandoned;		/* has its thread gone? */
+  value obj;
+  struct iojob *next;		/* next job waiting for a helper */
+  struct iojob *lnext;		/* next job in the list of all jobs */
+  char data[1];			/* e.g. the path name to operate on */
+};
+
+extern struct iojob *__arc_mkiojob(arc *c, void (*fn)(struct iojob *),
+				   void *ptr, value obj, size_t len);
+extern void __arc_iojob_submit(arc *c, value thr, struct iojob *job);
+extern int __arc_iojob_done(arc *c, value thr);
+extern int __arc_iojob_ready(arc *c, value thr, int fd, int first);
+extern int __arc_iojob_fd(arc *c);
+extern struct iojob *__arc_iojob_finish(arc *c, value thr);
+extern void __arc_iojob_abandon(arc *c, value thr);
 extern void __arc_affenv(arc *c, value thr, int nargs, int optargs,
 			 int localvars, int rest);
 extern int __arc_affip(arc *c, value thr);
+extern value __arc_restlist(arc *c, value thr, int idx);
 extern value arc_thr_valr(arc *c, value thr);
 extern value arc_thr_set_valr(arc *c, value thr, value v);
 extern int arc_thr_argc(arc *c, value thr);
@@ -425,6 +490,14 @@ extern value arc_bindcstr(arc *c, const char *csym, value binding);
 extern value arc_gbind_cstr(arc *c, const char *csym);
 extern value arc_gbind(arc *c, value sym);
 
+/* Symbol flags, computed when a symbol is first interned */
+#define SYMF_SSYNTAX 0x01	/* name contains ssyntax characters */
+#define SYMF_INLINED 0x02	/* global binding inlined by compiled code */
+#define SYMF_MACRO 0x04		/* global binding may be a macro */
+#define SYMF_BUILTIN 0x08	/* global binding is the builtin of that name */
+extern int __arc_symflags(arc *c, value sym);
+extern void __arc_setsymflags(arc *c, value sym, int flags);
+
 /* Environments */
 extern void __arc_mkenv(arc *c, value thr, int prevsize, int extrasize);
 extern value __arc_getenv(arc *c, value thr, int depth, int index);
@@ -435,6 +508,10 @@ extern void arc_init_memmgr(arc *c);
 extern void arc_init_datatypes(arc *c);
 extern void arc_init_symtable(arc *c);
 extern void arc_init_threads(arc *c);
+extern void arc_deinit_threads(arc *c);
+extern void __arc_thread_mark(arc *c, void (*markfn)(value));
+extern void __arc_iopool_mark(arc *c, void (*markfn)(value));
+extern void __arc_iopool_free(arc *c);
 extern void arc_init(arc *c);
 extern void arc_deinit(arc *c);
 
@@ -442,6 +519,7 @@ extern void arc_deinit(arc *c);
 extern void arc_err_cstrfmt(arc *c, const char *fmt, ...);
 extern void arc_err_cstrfmt_line(arc *c, value fileline, const char *fmt, ...);
 extern int arc_callcc(arc *c, value thr);
+extern int arc_callec(arc *c, value thr);
 extern int arc_dynamic_wind(arc *c, value thr);
 extern int arc_err(arc *c, value thr);
 extern int arc_on_err(arc *c, value thr);
@@ -455,6 +533,37 @@ extern value arc_bound(arc *c, value sym);
 extern value arc_declare(arc *c, value decl, value val);
 extern value arc_declared(arc *c, value decl);
 
+/* Heap images */
+extern int arc_image_save(arc *c, const char *file, value *skipped);
+extern int arc_image_load(arc *c, const char *file);
+extern value arc_dump_image(arc *c, value file);
+
+/* Bytecode profiler */
+extern int arc_vmprof_start(arc *c);
+extern void arc_vmprof_stop(arc *c);
+extern value arc_vmprof_report(arc *c);
+extern void arc_vmprof_dump(arc *c, FILE *fp);
+extern int arc_vm_profile(arc *c, value thr);
+extern void __arc_vmprof_mark(arc *c, void (*markfn)(value));
+
+/* Sampling profiler */
+extern int arc_sprof_start(arc *c, int hz);
+extern void arc_sprof_stop(arc *c);
+extern value arc_sprof_report(arc *c);
+extern void arc_sprof_dump(arc *c, FILE *fp);
+extern int arc_sample_profile(arc *c, value thr);
+
+/* Allocation profiler */
+extern int arc_aprof_start(arc *c, long rate);
+extern void arc_aprof_stop(arc *c);
+extern value arc_aprof_report(arc *c);
+extern void arc_aprof_dump(arc *c, FILE *fp);
+extern int arc_alloc_profile(arc *c, value thr);
+extern void __arc_aprof_alloc(arc *c, value obj, size_t size, int type);
+extern void __arc_aprof_free(arc *c, value obj);
+extern void __arc_aprof_gc(arc *c);
+extern void __arc_aprof_mark(arc *c, void (*markfn)(value));
+
 /* Arcueid Foreign Functions.  This is possibly the most insane abuse
    of the C preprocessor I have ever done.  The technique used for defining
    parameters and variables using variadic macros used here is inspired by
@@ -498,6 +607,16 @@ extern value arc_declared(arc *c, value decl);
 
 #define ARARG(x) const char x = __nargs__ + __optargs__ + __localvars__; __restarg__ = 1
 
+/* A rest parameter which is left on the stack instead of being made
+   into a list, for functions which only need to look at each of the
+   rest arguments.  ARESTC gives the number of them and ARESTV the ith,
+   and ARESTLIST makes a list of them if they have to be kept. */
+#define ASTKREST 2
+#define ASARG(x) const char x = __nargs__ + __optargs__ + __localvars__; __restarg__ = ASTKREST
+#define ARESTC(x) (FIX2INT(AV(x)))
+#define ARESTV(x, i) (__arc_getenv(c, thr, 0, (x) + 1 + (i)))
+#define ARESTLIST(x) (__arc_restlist(c, thr, x))
+
 #define ADEFVAR(x) const char x = __nargs__ + __optargs__ + __localvars__++;
 
 #define AARG(...) FOR_EACH(ADEFARG, __VA_ARGS__)
@@ -556,6 +675,24 @@ extern value arc_declared(arc *c, value decl);
     return(__arc_affiowait(c, thr, __LINE__, fd, 1)); case __LINE__:;	\
   } while (0)
 
+/* Wait until a receive from a socket which __arc_iorecv found would
+   block can go ahead; __arc_iorecv then gets what was received */
+#define AIORECV(fd, len)						\
+  do {									\
+    return(__arc_affiorecv(c, thr, __LINE__, fd, len)); case __LINE__:; \
+  } while (0)
+
+/* Have the I/O pool do job, waiting until it is done.  The job can
+   then be had from __arc_iojob_finish, and should be freed after. */
+#define AIOJOB(job)							\
+  do {									\
+    __arc_iojob_submit(c, thr, job);					\
+    while (!__arc_iojob_done(c, thr)) {					\
+      return(__arc_affiowait(c, thr, __LINE__, __arc_iojob_fd(c), 0));	\
+    case __LINE__:;							\
+    }									\
+  } while (0)
+
 #define ARETURN(val)			\
   do {						\
     arc_thr_set_valr(c, thr, val);		\
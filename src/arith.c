@@ -1281,43 +1281,36 @@ value __arc_add2(arc *c, value arg1, value arg2)
    disabled */
 AFFDEF(__arc_add)
 {
-  ARARG(list);
+  ASARG(args);
   value sum = INT2FIX(0);
+  int i;
   AFBEGIN;
-  if (arc_thr_argc(c, thr) > 0 && (NIL_P(car(AV(list))) || CONS_P(car(AV(list))) || TYPE(car(AV(list))) == T_STRING))
+  if (ARESTC(args) > 0 && (NIL_P(ARESTV(args, 0)) || CONS_P(ARESTV(args, 0))
+			   || TYPE(ARESTV(args, 0)) == T_STRING))
     sum = CNIL;
-  while (CONS_P(AV(list))) {
-    sum = __arc_add2(c, sum, car(AV(list)));
-    WV(list, cdr(AV(list)));
-  }
-  if (!NIL_P(AV(list)))
-    arc_err_cstrfmt(c, "proper list expected");
+  for (i=0; i<ARESTC(args); i++)
+    sum = __arc_add2(c, sum, ARESTV(args, i));
   ARETURN(sum);
   AFEND;
 }
 AFFEND
 
+/* With a single argument, - and / give its negation and reciprocal */
 AFFDEF(__arc_sub)
 {
-  ARARG(list);
-  value diff;
+  ASARG(args);
+  value diff = INT2FIX(0);
+  int i = 0;
   AFBEGIN;
-  if (arc_thr_argc(c, thr) < 1) {
+  if (ARESTC(args) < 1) {
     arc_err_cstrfmt(c, "-: expects at least 1 argument, given %d",
-		    arc_thr_argc(c, thr));
+		    ARESTC(args));
     return(CNIL);
   }
-  if (arc_thr_argc(c, thr) > 1) {
-    diff = car(AV(list));
-    WV(list, cdr(AV(list)));
-  }
-
-  while (CONS_P(AV(list))) {
-    diff = __arc_sub2(c, diff, car(AV(list)));
-    WV(list, cdr(AV(list)));
-  }
-  if (!NIL_P(AV(list)))
-    arc_err_cstrfmt(c, "proper list expected");
+  if (ARESTC(args) > 1)
+    diff = ARESTV(args, i++);
+  for (; i<ARESTC(args); i++)
+    diff = __arc_sub2(c, diff, ARESTV(args, i));
   ARETURN(diff);
   AFEND;
 }
@@ -1325,15 +1318,12 @@ AFFEND
 
 AFFDEF(__arc_mul)
 {
-  ARARG(list);
+  ASARG(args);
   value prod = INT2FIX(1);
+  int i;
   AFBEGIN;
-  while (CONS_P(AV(list))) {
-    prod = __arc_mul2(c, car(AV(list)), prod);
-    WV(list, cdr(AV(list)));
-  }
-  if (!NIL_P(AV(list)))
-    arc_err_cstrfmt(c, "proper list expected");
+  for (i=0; i<ARESTC(args); i++)
+    prod = __arc_mul2(c, ARESTV(args, i), prod);
   ARETURN(prod);
   AFEND;
 }
@@ -1341,25 +1331,19 @@ AFFEND
 
 AFFDEF(__arc_div)
 {
-  ARARG(list);
-  value quot;
+  ASARG(args);
+  value quot = INT2FIX(1);
+  int i = 0;
   AFBEGIN;
-  if (arc_thr_argc(c, thr) < 1) {
+  if (ARESTC(args) < 1) {
     arc_err_cstrfmt(c, "/: expects at least 1 argument, given %d",
-		    arc_thr_argc(c, thr));
+		    ARESTC(args));
     return(CNIL);
   }
-  if (arc_thr_argc(c, thr) > 1) {
-    quot = car(AV(list));
-    WV(list, cdr(AV(list)));
-  }
-
-  while (CONS_P(AV(list))) {
-    quot = __arc_div2(c, quot, car(AV(list)));
-    WV(list, cdr(AV(list)));
-  }
-  if (!NIL_P(AV(list)))
-    arc_err_cstrfmt(c, "proper list expected");
+  if (ARESTC(args) > 1)
+    quot = ARESTV(args, i++);
+  for (; i<ARESTC(args); i++)
+    quot = __arc_div2(c, quot, ARESTV(args, i));
   ARETURN(quot);
   AFEND;
 }
@@ -25,7 +25,10 @@ enum {
   BI_io=0,			/* builtin I/O data */
   BI_syms=1,			/* builtin symbols */
   BI_charesc=2,			/* character escapes */
-  BI_last=2
+  BI_ssyntax=3,			/* ssyntax expansions */
+  BI_inline=4,			/* code which inlined each global */
+  BI_macex=5,			/* macro expansion cache */
+  BI_last=5
 };
 
 enum builtin_syms {
@@ -89,6 +92,9 @@ enum builtin_syms {
   S_MINUS,			/* - */
   S_TIMES,			/* * */
   S_DIV,			/* / */
+  S_LT,				/* < */
+  S_GT,				/* > */
+  S_LEN,			/* len */
   S_AND,			/* and */
   S_APPLY,			/* apply */
   S_CHAN,			/* chan */
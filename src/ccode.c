@@ -118,6 +118,17 @@ value arc_mkaff(arc *c, int (*xaff)(arc *, value), value name)
   return(arc_mkaff2(c, xaff, name, CNIL));
 }
 
+/* Get the name of a C function.  C functions with a saved environment
+   are not identified by their name alone, so nil is returned for them. */
+value __arc_ccode_name(arc *c, value cfn)
+{
+  struct cfunc_t *rcfn = (struct cfunc_t *)REP(cfn);
+
+  if (rcfn->argc == -2 && !NIL_P(rcfn->cfunc.aff_t.env))
+    return(CNIL);
+  return(rcfn->name);
+}
+
 /* same as below, but with rest arguments */
 static void affenvr(arc *c, value thr, int minenv, int optenv, int dsenv)
 {
@@ -143,6 +154,45 @@ static void affenvr(arc *c, value thr, int minenv, int optenv, int dsenv)
   }
 }
 
+/* Like affenvr, but leave the rest arguments in the environment,
+   after the local variables and a count of them, rather than making
+   a list of them.  They are copied aside first, since the local
+   variables have to come before them. */
+static void affenvs(arc *c, value thr, int minenv, int optenv, int dsenv)
+{
+  int i, nrest;
+  value *rest;
+
+  if (TARGC(thr) < minenv) {
+    arc_err_cstrfmt(c, "too few arguments, at least %d required, %d passed", minenv, TARGC(thr));
+    return;
+  }
+  nrest = TARGC(thr) - (minenv + optenv);
+  if (nrest < 0)
+    nrest = 0;
+  rest = alloca(sizeof(value)*(nrest+1));
+  for (i=nrest-1; i>=0; i--)
+    rest[i] = CPOP(thr);
+  i = TARGC(thr) - nrest;
+  __arc_mkenv(c, thr, i, minenv + optenv - i + dsenv + 1 + nrest);
+  __arc_putenv(c, thr, 0, minenv + optenv + dsenv, INT2FIX(nrest));
+  for (i=0; i<nrest; i++)
+    __arc_putenv(c, thr, 0, minenv + optenv + dsenv + 1 + i, rest[i]);
+}
+
+/* Make a list of the rest arguments left in the environment by
+   affenvs, starting at index idx, for when they must outlive the
+   call. */
+value __arc_restlist(arc *c, value thr, int idx)
+{
+  int i;
+  value list = CNIL;
+
+  for (i=FIX2INT(__arc_getenv(c, thr, 0, idx)); i>0; i--)
+    list = cons(c, __arc_getenv(c, thr, 0, idx + i), list);
+  return(list);
+}
+
 /* Initialize the environment of an Arcueid foreign function.  This
    essentially creates the AFF's local environment if it is not yet
    there (i.e. the the TENVR of the thread is nil.  It will also take
@@ -157,6 +207,11 @@ void __arc_affenv(arc *c, value thr, int nargs, int optargs, int localvars,
   if (TIP(thr).aff_line != 0)
     return;
 
+  if (restarg == ASTKREST) {
+    affenvs(c, thr, nargs, optargs, localvars);
+    return;
+  }
+
   if (restarg) {
     affenvr(c, thr, nargs, optargs, localvars);
     return;
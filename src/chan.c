@@ -18,15 +18,27 @@
 */
 #include "arcueid.h"
 #include "vmengine.h"
+#include "arith.h"
+#include "builtins.h"
+#include "osdep.h"
 
 /* A channel is again a vector with the following entries:
-   0 - whether the channel has data or not (CTRUE or CNIL)
-   1 - Data in the channel, if any (whatever)
+   0 - number of values in the channel (fixnum)
+   1 - slot of the first value in the channel (fixnum)
    2 - Head of list of threads waiting to receive from the channel (cons)
    3 - Tail of list of threads waiting to receive from the channel
    4 - Head of list of threads waiting to send to the channel (cons)
-       This is actually a list of thread-value pairs.
    5 - Tail of list of threads waiting to send to the channel
+   6 - ID of the last thread to receive from the channel, or nil
+   7 - ID of the last thread to send to the channel, or nil
+   8 onwards - a ring buffer of slots for the values, as many as the
+       capacity of the channel.  A channel made with no capacity given
+       has a single slot.
+
+   The IDs of the last threads to use the channel are kept for finding
+   deadlocks.  They are IDs rather than the threads themselves so that
+   a channel does not keep a terminated thread and its stack from
+   being collected.
  */
 
 #define XCHAN_RHEAD(chan) (REP((chan))[3])
@@ -34,35 +46,73 @@
 #define XCHAN_SHEAD(chan) (REP((chan))[5])
 #define XCHAN_STAIL(chan) (REP((chan))[6])
 
-#define CHAN_HASDATA(chan) (VINDEX(chan, 0))
-#define CHAN_DATA(chan) (VINDEX(chan, 1))
+#define CHAN_COUNT(chan) (VINDEX(chan, 0))
+#define CHAN_FIRST(chan) (VINDEX(chan, 1))
 #define CHAN_RHEAD(chan) (VINDEX(chan, 2))
 #define CHAN_RTAIL(chan) (VINDEX(chan, 3))
 #define CHAN_SHEAD(chan) (VINDEX(chan, 4))
 #define CHAN_STAIL(chan) (VINDEX(chan, 5))
+#define CHAN_RECEIVER(chan) (VINDEX(chan, 6))
+#define CHAN_SENDER(chan) (VINDEX(chan, 7))
+#define CHAN_SLOT(chan, i) (VINDEX(chan, CHAN_SIZE + (i)))
 
-#define SCHAN_HASDATA(chan, val) (SVINDEX(chan, 0, val))
-#define SCHAN_DATA(chan, val) (SVINDEX(chan, 1, val))
+#define SCHAN_COUNT(chan, val) (SVINDEX(chan, 0, val))
+#define SCHAN_FIRST(chan, val) (SVINDEX(chan, 1, val))
 #define SCHAN_RHEAD(chan, val) (SVINDEX(chan, 2, val))
 #define SCHAN_RTAIL(chan, val) (SVINDEX(chan, 3, val))
 #define SCHAN_SHEAD(chan, val) (SVINDEX(chan, 4, val))
 #define SCHAN_STAIL(chan, val) (SVINDEX(chan, 5, val))
-#define CHAN_SIZE 6
+#define SCHAN_RECEIVER(chan, val) (SVINDEX(chan, 6, val))
+#define SCHAN_SENDER(chan, val) (SVINDEX(chan, 7, val))
+#define SCHAN_SLOT(chan, i, val) (SVINDEX(chan, CHAN_SIZE + (i), val))
+#define CHAN_SIZE 8
 
-value arc_mkchan(arc *c)
+#define CHAN_CAPACITY(chan) (VECLEN(chan) - CHAN_SIZE)
+#define CHAN_FULL(chan) (FIX2INT(CHAN_COUNT(chan)) >= CHAN_CAPACITY(chan))
+#define CHAN_EMPTY(chan) (FIX2INT(CHAN_COUNT(chan)) == 0)
+
+value arc_mkchanbuf(arc *c, int capacity)
 {
-  value chan = arc_mkvector(c, CHAN_SIZE);
+  value chan = arc_mkvector(c, CHAN_SIZE + capacity);
+  int i;
 
   ((struct cell *)chan)->_type = T_CHAN;
-  SCHAN_HASDATA(chan, CNIL);
-  SCHAN_DATA(chan, CNIL);
+  SCHAN_COUNT(chan, INT2FIX(0));
+  SCHAN_FIRST(chan, INT2FIX(0));
   SCHAN_RHEAD(chan, CNIL);
   SCHAN_RTAIL(chan, CNIL);
   SCHAN_SHEAD(chan, CNIL);
   SCHAN_STAIL(chan, CNIL);
+  SCHAN_RECEIVER(chan, CNIL);
+  SCHAN_SENDER(chan, CNIL);
+  for (i=0; i<capacity; i++)
+    SCHAN_SLOT(chan, i, CNIL);
   return(chan);
 }
 
+value arc_mkchan(arc *c)
+{
+  return(arc_mkchanbuf(c, 1));
+}
+
+/* (chan [capacity]) makes a channel which can hold up to capacity
+   values before senders have to wait for a receiver. */
+AFFDEF(arc_chan)
+{
+  AOARG(capacity);
+  AFBEGIN;
+  if (!BOUND_P(AV(capacity)))
+    ARETURN(arc_mkchan(c));
+  TYPECHECK(AV(capacity), T_FIXNUM);
+  if (FIX2INT(AV(capacity)) < 1) {
+    arc_err_cstrfmt(c, "channel capacity must be positive");
+    ARETURN(CNIL);
+  }
+  ARETURN(arc_mkchanbuf(c, FIX2INT(AV(capacity))));
+  AFEND;
+}
+AFFEND
+
 static AFFDEF(chan_pprint)
 {
   AARG(sexpr, disp, fp);
@@ -76,33 +126,62 @@ static AFFDEF(chan_pprint)
 }
 AFFEND
 
+/* Take the first value out of a channel which is not empty, and wake
+   up the first of any threads waiting to send to it, now that there
+   is room. */
+static value chan_take(arc *c, value chan)
+{
+  value val, xthr;
+  int first;
+
+  first = FIX2INT(CHAN_FIRST(chan));
+  val = CHAN_SLOT(chan, first);
+  SCHAN_SLOT(chan, first, CNIL);
+  SCHAN_FIRST(chan, INT2FIX((first + 1) % CHAN_CAPACITY(chan)));
+  SCHAN_COUNT(chan, INT2FIX(FIX2INT(CHAN_COUNT(chan)) - 1));
+  xthr = __arc_dequeue(c, &XCHAN_SHEAD(chan), &XCHAN_STAIL(chan));
+  if (!NIL_P(xthr))
+    __arc_thr_wakeup(c, xthr);
+  return(val);
+}
+
+/* Put a value at the end of a channel which is not full, and wake up
+   the first of any threads waiting to receive from it. */
+static void chan_put(arc *c, value chan, value val)
+{
+  value xthr;
+  int last;
+
+  last = (FIX2INT(CHAN_FIRST(chan)) + FIX2INT(CHAN_COUNT(chan)))
+    % CHAN_CAPACITY(chan);
+  SCHAN_SLOT(chan, last, val);
+  SCHAN_COUNT(chan, INT2FIX(FIX2INT(CHAN_COUNT(chan)) + 1));
+  xthr = __arc_dequeue(c, &XCHAN_RHEAD(chan), &XCHAN_RTAIL(chan));
+  if (!NIL_P(xthr))
+    __arc_thr_wakeup(c, xthr);
+}
+
 AFFDEF(arc_recv_channel)
 {
   AARG(chan);
-  value val, xthr;
   AFBEGIN;
 
   TYPECHECK(AV(chan), T_CHAN);
-  while (NIL_P(CHAN_HASDATA(AV(chan)))) {
+  while (CHAN_EMPTY(AV(chan))) {
     /* We have no value that can be received from the channel.  Enqueue
        the calling thread and freeze it into Trecv state.  This should
        never happen with a recursive call to arc_recv_channel. */
     __arc_enqueue(c, thr, &XCHAN_RHEAD(AV(chan)), &XCHAN_RTAIL(AV(chan)));
     TSTATE(thr) = Trecv;
+    __arc_wb(TWAITON(thr), AV(chan));
+    TWAITON(thr) = AV(chan);
     AYIELD();
   }
 
   /* If we get here, there is a value that can be received from the
-     channel. Read it, and see if there is any thread waiting to send. */
-  SCHAN_HASDATA(AV(chan), CNIL);
-  val = CHAN_DATA(AV(chan));
-  xthr = __arc_dequeue(c, &XCHAN_SHEAD(AV(chan)), &XCHAN_STAIL(AV(chan)));
-  if (!NIL_P(xthr)) {
-    /* There is at least one thread waiting to send on this channel.
-       Wake it up so it can send already. */
-    TSTATE(xthr) = Tready;
-  }
-  ARETURN(val);
+     channel. */
+  SCHAN_RECEIVER(AV(chan), INT2FIX(TTID(thr)));
+  ARETURN(chan_take(c, AV(chan)));
   AFEND;
 }
 AFFEND
@@ -110,12 +189,11 @@ AFFEND
 AFFDEF(arc_send_channel)
 {
   AARG(chan, val);
-  value xthr;
   AFBEGIN;
 
   TYPECHECK(AV(chan), T_CHAN);
-  while (!NIL_P(CHAN_HASDATA(AV(chan)))) {
-    /* There is a value in the channel that was written that has not
+  while (CHAN_FULL(AV(chan))) {
+    /* The channel is full of values that were written that have not
        yet been read.  Enqueue the thread. */
     __arc_enqueue(c, thr, &XCHAN_SHEAD(AV(chan)), &XCHAN_STAIL(AV(chan)));
     /* Change state to Tsend, which is not runnable, and toss us back
@@ -123,24 +201,144 @@ AFFDEF(arc_send_channel)
        runnable and return us to the dispatcher so some other thread
        can be made to run instead. */
     TSTATE(thr) = Tsend;
+    __arc_wb(TWAITON(thr), AV(chan));
+    TWAITON(thr) = AV(chan);
     AYIELD();
   }
 
-  /* If we get here, we are clear to send to the channel. Read it, and
-     see if there is any thread waiting to receive. */
-  SCHAN_HASDATA(AV(chan), CTRUE);
-  SCHAN_DATA(AV(chan), AV(val));
-  xthr = __arc_dequeue(c, &XCHAN_RHEAD(AV(chan)), &XCHAN_RTAIL(AV(chan)));
-  if (!NIL_P(xthr)) {
-    /* There is at least one thread waiting to receive on this channel.
-       Wake it up so it can receive. */
-    TSTATE(xthr) = Tready;
-  }
+  /* If we get here, we are clear to send to the channel. */
+  SCHAN_SENDER(AV(chan), INT2FIX(TTID(thr)));
+  chan_put(c, AV(chan), AV(val));
   ARETURN(AV(val));
   AFEND;
 }
 AFFEND
 
+/* Take thr out of a queue of waiting threads.  Returns false if it
+   was not there. */
+static int chan_unqueue(arc *c, value thr, value *head, value *tail)
+{
+  value q, prev = CNIL;
+
+  for (q = *head; !NIL_P(q); prev = q, q = cdr(q)) {
+    if (car(q) != thr)
+      continue;
+    if (NIL_P(prev)) {
+      __arc_wb(*head, cdr(q));
+      *head = cdr(q);
+    } else {
+      scdr(prev, cdr(q));
+    }
+    if (*tail == q) {
+      __arc_wb(*tail, prev);
+      *tail = prev;
+    }
+    return(1);
+  }
+  return(0);
+}
+
+/* An alternative of alt: a channel to receive from, or a cons of a
+   channel and a value to send to it. */
+#define ALT_SEND_P(alt) (TYPE(alt) == T_CONS)
+#define ALT_CHAN(alt) (ALT_SEND_P(alt) ? car(alt) : (alt))
+
+/* Take a thread blocked in alt out of the queues of all of the
+   channels it was waiting on.  A channel which dequeued it to wake it
+   up, other than the one whose alternative it went ahead with (used),
+   passes the wakeup on to the next thread waiting on it, which might
+   otherwise never be woken. */
+static void alt_unqueue(arc *c, value thr, value alts, value used)
+{
+  value alt, chan, *head, *tail, xthr;
+
+  for (; !NIL_P(alts); alts = cdr(alts)) {
+    alt = car(alts);
+    chan = ALT_CHAN(alt);
+    head = ALT_SEND_P(alt) ? &XCHAN_SHEAD(chan) : &XCHAN_RHEAD(chan);
+    tail = ALT_SEND_P(alt) ? &XCHAN_STAIL(chan) : &XCHAN_RTAIL(chan);
+    if (chan_unqueue(c, thr, head, tail) || alt == used)
+      continue;
+    xthr = __arc_dequeue(c, head, tail);
+    if (!NIL_P(xthr))
+      __arc_thr_wakeup(c, xthr);
+  }
+}
+
+/* (alt alts [timeout]) waits until one of the alternatives in the
+   list alts can go ahead, and makes it.  An alternative is either a
+   channel, to receive a value from it, or a cons of a channel and a
+   value, to send the value to it.  When several can go ahead, the
+   first in the list is taken.  Returns a list of the channel and the
+   value received or sent, or nil if timeout seconds pass before any
+   alternative can go ahead. */
+AFFDEF(arc_alt)
+{
+  AARG(alts);
+  AOARG(timeout);
+  AVAR(queued);
+  value alt, chan;
+  AFBEGIN;
+
+  for (alt = AV(alts); !NIL_P(alt); alt = cdr(alt)) {
+    TYPECHECK(alt, T_CONS);
+    chan = ALT_CHAN(car(alt));
+    TYPECHECK(chan, T_CHAN);
+  }
+  TWAKEUP(thr) = 0LL;
+  if (BOUND_P(AV(timeout))) {
+    AFCALL(arc_mkaff(c, arc_coerce, CNIL), AV(timeout),
+	   ARC_BUILTIN(c, S_FLONUM));
+    if (REPFLO(AFCRV) < 0.0) {
+      arc_err_cstrfmt(c, "negative alt timeout");
+      ARETURN(CNIL);
+    }
+    TWAKEUP(thr) = __arc_milliseconds()
+      + (unsigned long long)(REPFLO(AFCRV)*1000.0);
+  }
+  WV(queued, CNIL);
+
+  for (;;) {
+    for (alt = AV(alts); !NIL_P(alt); alt = cdr(alt)) {
+      chan = ALT_CHAN(car(alt));
+      if (ALT_SEND_P(car(alt)) ? CHAN_FULL(chan) : CHAN_EMPTY(chan))
+	continue;
+      if (!NIL_P(AV(queued)))
+	alt_unqueue(c, thr, AV(alts), car(alt));
+      TWAKEUP(thr) = 0LL;
+      if (ALT_SEND_P(car(alt))) {
+	SCHAN_SENDER(chan, INT2FIX(TTID(thr)));
+	chan_put(c, chan, cdr(car(alt)));
+	ARETURN(cons(c, chan, cons(c, cdr(car(alt)), CNIL)));
+      }
+      SCHAN_RECEIVER(chan, INT2FIX(TTID(thr)));
+      ARETURN(cons(c, chan, cons(c, chan_take(c, chan), CNIL)));
+    }
+
+    /* Nothing can go ahead yet */
+    if (!NIL_P(AV(queued)))
+      alt_unqueue(c, thr, AV(alts), CNIL);
+    if (TWAKEUP(thr) != 0LL && __arc_milliseconds() >= TWAKEUP(thr)) {
+      TWAKEUP(thr) = 0LL;
+      ARETURN(CNIL);
+    }
+    for (alt = AV(alts); !NIL_P(alt); alt = cdr(alt)) {
+      chan = ALT_CHAN(car(alt));
+      if (ALT_SEND_P(car(alt)))
+	__arc_enqueue(c, thr, &XCHAN_SHEAD(chan), &XCHAN_STAIL(chan));
+      else
+	__arc_enqueue(c, thr, &XCHAN_RHEAD(chan), &XCHAN_RTAIL(chan));
+    }
+    WV(queued, CTRUE);
+    /* Wait in Talt until a channel wakes us, or the timeout passes */
+    TSTATE(thr) = Talt;
+    __arc_wb(TWAITON(thr), AV(alts));
+    TWAITON(thr) = AV(alts);
+    AYIELD();
+  }
+  AFEND;
+}
+AFFEND
 
 /* A thread's RVCHAN has slightly different behaviour from a normal
    channel.  When such a channel is written to, all threads waiting
@@ -151,17 +349,19 @@ AFFDEF(__arc_recv_rvchan)
   AFBEGIN;
 
   TYPECHECK(AV(chan), T_CHAN);
-  while (NIL_P(CHAN_HASDATA(AV(chan)))) {
+  while (CHAN_EMPTY(AV(chan))) {
     /* We have no value that can be received from the channel.  Enqueue
        the calling thread and freeze it into Trecv state.  This should
        never happen with a recursive call to arc_recv_channel. */
     __arc_enqueue(c, thr, &XCHAN_RHEAD(AV(chan)), &XCHAN_RTAIL(AV(chan)));
     TSTATE(thr) = Trecv;
+    __arc_wb(TWAITON(thr), AV(chan));
+    TWAITON(thr) = AV(chan);
     AYIELD();
   }
 
-  /* Return the channel data */
-  ARETURN(CHAN_DATA(AV(chan)));
+  /* Return the channel data, leaving it there for any other threads */
+  ARETURN(CHAN_SLOT(AV(chan), 0));
   AFEND;
 }
 AFFEND
@@ -170,17 +370,65 @@ value __arc_send_rvchan(arc *c, value chan, value val)
 {
   value xthr;
 
-  SCHAN_HASDATA(chan, CTRUE);
-  SCHAN_DATA(chan, val);
-  ;
+  SCHAN_COUNT(chan, INT2FIX(1));
+  SCHAN_SLOT(chan, 0, val);
   while ((xthr = __arc_dequeue(c, &XCHAN_RHEAD(chan), &XCHAN_RTAIL(chan))) != CNIL) {
     /* There is at least one thread waiting to receive on this channel.
        Wake it up so it can receive. */
-    TSTATE(xthr) = Tready;
+    __arc_thr_wakeup(c, xthr);
   }
   return(val);
 }
 
+/* Make thr the thread expected to send to chan, as the thread whose
+   return value channel it is will be. */
+void __arc_chan_sender(arc *c, value chan, value thr)
+{
+  SCHAN_SENDER(chan, INT2FIX(TTID(thr)));
+}
+
+/* The ID of the thread a thread waiting on chan is most likely waiting
+   for: the last thread to receive from it if the thread is waiting to
+   send, and the last to send to it if it is waiting to receive.  Nil
+   if no thread has yet. */
+value __arc_chan_peer(arc *c, value chan, int send)
+{
+  return((send) ? CHAN_RECEIVER(chan) : CHAN_SENDER(chan));
+}
+
+/* Take thr, which is being killed, out of the queues of the channels
+   it is waiting on.  A channel may already have taken it off its queue
+   to wake it up, and the wakeup is passed on to the next thread
+   waiting there, which might otherwise never be woken. */
+void __arc_chan_abandon(arc *c, value thr)
+{
+  value waiton = TWAITON(thr), chan, xthr;
+
+  while (!NIL_P(waiton)) {
+    if (TYPE(waiton) == T_CHAN) {
+      chan = waiton;
+      waiton = CNIL;
+    } else {
+      chan = ALT_CHAN(car(waiton));
+      waiton = cdr(waiton);
+    }
+    chan_unqueue(c, thr, &XCHAN_RHEAD(chan), &XCHAN_RTAIL(chan));
+    chan_unqueue(c, thr, &XCHAN_SHEAD(chan), &XCHAN_STAIL(chan));
+    if (!CHAN_EMPTY(chan)) {
+      xthr = __arc_dequeue(c, &XCHAN_RHEAD(chan), &XCHAN_RTAIL(chan));
+      if (!NIL_P(xthr))
+	__arc_thr_wakeup(c, xthr);
+    }
+    if (!CHAN_FULL(chan)) {
+      xthr = __arc_dequeue(c, &XCHAN_SHEAD(chan), &XCHAN_STAIL(chan));
+      if (!NIL_P(xthr))
+	__arc_thr_wakeup(c, xthr);
+    }
+  }
+  __arc_wb(TWAITON(thr), CNIL);
+  TWAITON(thr) = CNIL;
+}
+
 typefn_t __arc_chan_typefn__ = {
   __arc_vector_marker,
   __arc_null_sweeper,
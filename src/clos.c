@@ -58,6 +58,10 @@ static int clos_apply(arc *c, value thr, value clos)
   TIPP(thr) = &XVINDEX(CODE_CODE(code), 0);
   SENVR(thr, env);
   SFUNR(thr, clos);
+#ifdef HAVE_PROFILING
+  if (c->vmprof != NULL)
+    __arc_vmprof_fn(c, code)->calls++;
+#endif
   /* Return to the trampoline to make it resume */
   return(TR_RESUME);
 }
@@ -25,7 +25,6 @@
 #include <string.h>
 #include "arcueid.h"
 #include "vmengine.h"
-#include "hash.h"
 
 /* Create an empty code generation context. This is just a plain vector */
 value arc_mkcctx(arc *c)
@@ -36,12 +35,27 @@ value arc_mkcctx(arc *c)
   SCCTX_VCPTR(cctx, SCCTX_LITS(cctx, INT2FIX(0)));
   SCCTX_VCODE(cctx, SCCTX_LITS(cctx, CNIL));
   SCCTX_SRC(cctx, CNIL);
+  SCCTX_LITIDX(cctx, CNIL);
+  SCCTX_SELF(cctx, SCCTX_SELFENV(cctx, CNIL));
+  SCCTX_INLINE(cctx, SCCTX_INLINED(cctx, SCCTX_INLINING(cctx, CNIL)));
+  SCCTX_FXVARS(cctx, SCCTX_FXARGS(cctx, CNIL));
   return(cctx);
 }
 
+static value mksrc(arc *c)
+{
+  value src;
+
+  src = arc_mkvector(c, SRC_SIZE);
+  SSRC_NBYTES(src, INT2FIX(0));
+  SSRC_LASTOFS(src, INT2FIX(0));
+  SSRC_LASTLINE(src, INT2FIX(0));
+  return(src);
+}
+
 value arc_cctx_mksrc(arc *c, value cctx)
 {
-  SCCTX_SRC(cctx, arc_mkhash(c, ARC_HASHBITS));
+  SCCTX_SRC(cctx, mksrc(c));
   return(cctx);
 }
 
@@ -81,16 +95,83 @@ static value __resize_literals(arc *c, value cctx)
 
 #define VMCODEP(cctx) ((Inst *)(&VINDEX(VINDEX(cctx, 1), FIX2INT(VINDEX(cctx, 0)))))
 
-/* Add line number information */
-static void add_lninfo(arc *c, value cctx, value lineno)
+/* Append a byte to the line number table of src, growing it as needed */
+static void src_putbyte(arc *c, value src, int byte)
+{
+  value lines, nlines;
+  int nbytes, idx, i;
+  long word;
+
+  nbytes = FIX2INT(SRC_NBYTES(src));
+  idx = nbytes / SRC_BYTESPERFIX;
+  lines = SRC_LINES(src);
+  if (NIL_P(lines) || idx >= VECLEN(lines)) {
+    nlines = arc_mkvector(c, (NIL_P(lines)) ? 4 : 2*VECLEN(lines));
+    for (i=0; i<VECLEN(nlines); i++)
+      XVINDEX(nlines, i) = (NIL_P(lines) || i >= VECLEN(lines))
+	? INT2FIX(0) : XVINDEX(lines, i);
+    SSRC_LINES(src, nlines);
+    lines = nlines;
+  }
+  word = FIX2INT(VINDEX(lines, idx));
+  word |= ((long)byte) << ((nbytes % SRC_BYTESPERFIX)*8);
+  SVINDEX(lines, idx, INT2FIX(word));
+  SSRC_NBYTES(src, INT2FIX(nbytes+1));
+}
+
+static int src_getbyte(value lines, int i)
+{
+  return((FIX2INT(VINDEX(lines, i / SRC_BYTESPERFIX))
+	  >> ((i % SRC_BYTESPERFIX)*8)) & 0xff);
+}
+
+/* Unsigned LEB128-style variable-length integer */
+static void src_putvarint(arc *c, value src, unsigned long n)
 {
-  value src, vptr;
+  while (n >= 0x80) {
+    src_putbyte(c, src, (n & 0x7f) | 0x80);
+    n >>= 7;
+  }
+  src_putbyte(c, src, n);
+}
+
+static unsigned long src_getvarint(value lines, int *ip)
+{
+  unsigned long n = 0;
+  int shift = 0, byte;
+
+  do {
+    byte = src_getbyte(lines, (*ip)++);
+    n |= ((unsigned long)(byte & 0x7f)) << shift;
+    shift += 7;
+  } while (byte & 0x80);
+  return(n);
+}
+
+/* Add line number information.  The fileline is the (file . line) pair
+   obtained from the reader's line number data.  Nothing is recorded
+   unless the line differs from that of the previous instruction. */
+static void add_lninfo(arc *c, value cctx, value fileline)
+{
+  value src;
+  long line, delta;
+  int vptr;
 
   src = CCTX_SRC(cctx);
-  if (NIL_P(src) || !BOUND_P(lineno) || NIL_P(lineno))
+  if (NIL_P(src) || !BOUND_P(fileline) || NIL_P(fileline)
+      || TYPE(cdr(fileline)) != T_FIXNUM)
+    return;
+  line = FIX2INT(cdr(fileline));
+  if (NIL_P(SRC_FILENAME(src)))
+    SSRC_FILENAME(src, car(fileline));
+  delta = line - FIX2INT(SRC_LASTLINE(src));
+  if (delta == 0)
     return;
-  vptr = CCTX_VCPTR(cctx);
-  arc_hash_insert(c, src, vptr, lineno);
+  vptr = FIX2INT(CCTX_VCPTR(cctx));
+  src_putvarint(c, src, vptr - FIX2INT(SRC_LASTOFS(src)));
+  src_putvarint(c, src, (delta < 0) ? ((-delta) << 1) - 1 : delta << 1);
+  SSRC_LASTOFS(src, INT2FIX(vptr));
+  SSRC_LASTLINE(src, INT2FIX(line));
 }
 
 void arc_emit(arc *c, value cctx, int inst, value fl)
@@ -199,7 +280,7 @@ static AFFDEF(code_pprint)
     AFCALL(AV(wc), arc_mkchar(c, ':'), AV(fp));
     AFCALL(AV(wc), arc_mkchar(c, ' '), AV(fp));
     src = CODE_SRC(AV(sexpr));
-    fname = arc_hash_lookup(c, src, INT2FIX(SRC_FUNCNAME));
+    fname = SRC_FUNCNAME(src);
     AFCALL(AV(dw), fname, CTRUE, AV(fp), AV(visithash));
   }
   AFCALL(AV(wc), arc_mkchar(c, '>'), AV(fp));
@@ -243,36 +324,84 @@ value arc_code_setname(arc *c, value code, value name)
     return(CNIL);
   }
   if (NIL_P(CODE_SRC(code))) {
-    SCODE_SRC(code, arc_mkhash(c, ARC_HASHBITS));
+    SCODE_SRC(code, mksrc(c));
   }
-  arc_hash_insert(c, CODE_SRC(code), INT2FIX(SRC_FUNCNAME), name);
+  SSRC_FUNCNAME(CODE_SRC(code), name);
   return(orgcode);
 }
 
+/* Get the (file . line) pair for the instruction at ipptr in the
+   closure fun.  This decodes the line number table up to the
+   instruction, so it should only be used when the information is
+   actually needed, e.g. for error messages. */
 value __arc_code_lineno(arc *c, value fun, value *ipptr)
 {
-  int vptr;
-  value code;
+  int vptr, i, nbytes, ofs;
+  long line;
+  unsigned long zz;
+  value code, src, lines, lineno;
 
   if (TYPE(fun) != T_CLOS)
     return(CUNBOUND);
   code = CLOS_CODE(fun);
-  if (TYPE(CODE_SRC(code)) != T_TABLE)
+  src = CODE_SRC(code);
+  if (NIL_P(src))
     return(CUNBOUND);
   vptr = ipptr - &XVINDEX(CODE_CODE(code), 0);
-  return(arc_hash_lookup(c, CODE_SRC(code), INT2FIX(vptr)));
+  lines = SRC_LINES(src);
+  nbytes = FIX2INT(SRC_NBYTES(src));
+  lineno = CUNBOUND;
+  ofs = 0;
+  line = 0;
+  for (i=0; i<nbytes;) {
+    ofs += src_getvarint(lines, &i);
+    if (ofs > vptr)
+      break;
+    zz = src_getvarint(lines, &i);
+    line += (zz & 1) ? -(long)((zz + 1) >> 1) : (long)(zz >> 1);
+    lineno = INT2FIX(line);
+  }
+  if (!BOUND_P(lineno))
+    return(CUNBOUND);
+  return(cons(c, SRC_FILENAME(src), lineno));
 }
 
 value arc_cctx2code(arc *c, value cctx)
 {
-  value func;
+  value func, src, nsrc;
+  int nbytes, nfix;
 
-  func = arc_mkcode(c, CCTX_VCPTR(cctx), CCTX_LPTR(cctx));
+  func = arc_mkcode(c, FIX2INT(CCTX_VCPTR(cctx)), FIX2INT(CCTX_LPTR(cctx)));
   memcpy(&XVINDEX(CODE_CODE(func), 0), &XVINDEX(CCTX_VCODE(cctx), 0),
 	 FIX2INT(CCTX_VCPTR(cctx))*sizeof(value));
   memcpy(&XCODE_LITERAL(func, 0), &XVINDEX(CCTX_LITS(cctx), 0),
 	 FIX2INT(CCTX_LPTR(cctx))*sizeof(value));
-  SCODE_SRC(func, CCTX_SRC(cctx));
+  src = CCTX_SRC(cctx);
+  if (!NIL_P(src)) {
+    /* Trim the line number table and drop the state only used while
+       it was being built. */
+    nsrc = mksrc(c);
+    nbytes = FIX2INT(SRC_NBYTES(src));
+    if (nbytes > 0) {
+      nfix = (nbytes + SRC_BYTESPERFIX - 1) / SRC_BYTESPERFIX;
+      SSRC_LINES(nsrc, arc_mkvector(c, nfix));
+      memcpy(&XVINDEX(SRC_LINES(nsrc), 0), &XVINDEX(SRC_LINES(src), 0),
+	     nfix*sizeof(value));
+    }
+    SSRC_NBYTES(nsrc, INT2FIX(nbytes));
+    SSRC_FILENAME(nsrc, SRC_FILENAME(src));
+    SSRC_FUNCNAME(nsrc, SRC_FUNCNAME(src));
+    src = nsrc;
+  }
+  if (!NIL_P(CCTX_INLINE(cctx)) || !NIL_P(CCTX_INLINED(cctx))) {
+    if (NIL_P(src))
+      src = mksrc(c);
+    SSRC_INLINE(src, CCTX_INLINE(cctx));
+    SSRC_INLINED(src, CCTX_INLINED(cctx));
+  }
+  SCODE_SRC(func, src);
+  /* The literal index is only needed during compilation */
+  SCCTX_LITIDX(cctx, CNIL);
   return(func);
 }
 
@@ -21,6 +21,7 @@
 #include "vmengine.h"
 #include "compiler.h"
 #include "hash.h"
+#include "arith.h"
 
 /* Get the closest line number for obj */
 static value get_lineno(arc *c, value obj)
@@ -34,9 +35,13 @@ static value get_lineno(arc *c, value obj)
 }
 
 /* Given a symbol op, return the macro corresponding to it, if any.  If
-   it is not a macro, return nil. */
-static int ismacro(arc *c, value op)
+   it is not a macro, return nil.  Only symbols whose global binding is
+   a macro, or another symbol which might name one, are flagged by
+   __arc_macex_rebind, so anything else can be rejected at once. */
+static value ismacro(arc *c, value op)
 {
+  if (!SYMBOL_P(op) || !(__arc_symflags(c, op) & SYMF_MACRO))
+    return(CNIL);
   while (arc_type(c, op = arc_hash_lookup(c, c->genv, op)) == T_SYMBOL)
     ;
   if (arc_type(c, op) == ARC_BUILTIN(c, S_MAC))
@@ -44,6 +49,225 @@ static int ismacro(arc *c, value op)
   return(CNIL);
 }
 
+/* Called by arc_bindsym before sym is bound to binding */
+void __arc_macex_rebind(arc *c, value sym, value binding)
+{
+  int flags = __arc_symflags(c, sym) & ~SYMF_MACRO;
+
+  if (SYMBOL_P(binding) || arc_type(c, binding) == ARC_BUILTIN(c, S_MAC))
+    flags |= SYMF_MACRO;
+  __arc_setsymflags(c, sym, flags);
+}
+
+/* The expansions of recently expanded macro forms are cached, so that
+   the same source which is evaluated over and over is only expanded
+   once.  The cache is keyed by the identity of the form, and is direct
+   mapped by its address, so it never holds more than MACEX_CACHE_SIZE
+   forms.  A cached expansion is used only for as long as nothing it was
+   made from has changed since:
+
+   - the form, which is compared with a copy taken when it was expanded,
+     and likewise the expansion, which whoever it was given to may have
+     changed;
+   - the macro bound to the operator of the form;
+   - every global the macro read while it ran, each of which must still
+     be bound to the same value (see __arc_macex_read); and
+   - the operators the compiler folds (__arc_compile_assumes).
+
+   An expansion which could depend on anything else is not cached at
+   all.  That is the expansion of a macro which closes over variables,
+   which assigns a global, or which reads one bound to something that
+   can be changed in place, such as a cons, a table, or a closure over
+   variables. */
+#define MACEX_CACHE_SIZE 1024
+#define MACEX_SLOT(form) ((((unsigned long)(form)) >> 4) \
+			  & (MACEX_CACHE_SIZE - 1))
+/* An expansion which reads more globals than this is not cached */
+#define MACEX_MAXREADS 64
+
+/* Each cached expansion is a vector of these */
+#define MCE_FORM(x) (VINDEX((x), 0))
+#define MCE_FCOPY(x) (VINDEX((x), 1))
+#define MCE_MACRO(x) (VINDEX((x), 2))
+#define MCE_ASSUMES(x) (VINDEX((x), 3))
+#define MCE_READS(x) (VINDEX((x), 4))
+#define MCE_EXP(x) (VINDEX((x), 5))
+#define MCE_ECOPY(x) (VINDEX((x), 6))
+#define MCE_SIZE 7
+
+void __arc_macex_flush(arc *c)
+{
+  SVINDEX(c->builtins, BI_macex, arc_mkvector(c, MACEX_CACHE_SIZE));
+}
+
+/* Whether x can be relied upon not to change while it is bound to the
+   same global or is part of the same form */
+static int macex_fixed(arc *c, value x)
+{
+  if (IMMEDIATE_P(x))
+    return(1);
+  switch (TYPE(x)) {
+  case T_SYMBOL:
+  case T_BIGNUM:
+  case T_FLONUM:
+  case T_RATIONAL:
+  case T_COMPLEX:
+  case T_CHAR:
+  case T_CCODE:
+    return(1);
+  case T_CLOS:
+    /* Heap environments are vectors of the variables which follow a
+       link to the next one, so a closure made where there are no
+       variables has only empty ones. */
+    for (x = CLOS_ENV(x); TYPE(x) == T_VECTOR; x = VINDEX(x, 0)) {
+      if (VECLEN(x) > 1)
+	return(0);
+    }
+    return(NIL_P(x));
+  case T_TAGGED:
+    return(macex_fixed(c, arc_rep(c, x)));
+  default:
+    break;
+  }
+  return(0);
+}
+
+/* A copy of the conses and strings of x, to tell later whether x has
+   been changed, or CUNBOUND if there is anything else in x that might
+   change. */
+static value macex_copy(arc *c, value x)
+{
+  value car_, cdr_;
+
+  if (TYPE(x) == T_STRING)
+    return(arc_substr(c, x, 0, arc_strlen(c, x)));
+  if (!CONS_P(x))
+    return(macex_fixed(c, x) ? x : CUNBOUND);
+  if ((car_ = macex_copy(c, car(x))) == CUNBOUND
+      || (cdr_ = macex_copy(c, cdr(x))) == CUNBOUND)
+    return(CUNBOUND);
+  return(cons(c, car_, cdr_));
+}
+
+/* Whether x is still the same as the copy made of it by macex_copy */
+static int macex_same(arc *c, value x, value copy)
+{
+  for (; CONS_P(x); x = cdr(x), copy = cdr(copy)) {
+    if (!CONS_P(copy) || !macex_same(c, car(x), car(copy)))
+      return(0);
+  }
+  if (TYPE(x) == T_STRING)
+    return(TYPE(copy) == T_STRING && arc_strcmp(c, x, copy) == 0);
+  return(x == copy);
+}
+
+/* Called by the virtual machine whenever a global sym is read while a
+   macro is being expanded, with the value val it was bound to.  The
+   globals read are collected in the thread until the expansion is
+   done, or it is found that it cannot be cached, when that is marked
+   by CTRUE instead.  An error raised meanwhile stops the recording
+   (see arc_err), which also leaves the expansion uncached. */
+void __arc_macex_read(arc *c, value thr, value sym, value val)
+{
+  value reads = TMACREADS(thr), x;
+  int n = 0;
+
+  if (reads == CTRUE)
+    return;
+  for (x = reads; CONS_P(x); x = cdr(x), n++) {
+    if (car(car(x)) == sym)
+      return;
+  }
+  if (n >= MACEX_MAXREADS || !macex_fixed(c, val))
+    reads = CTRUE;
+  else
+    reads = cons(c, cons(c, sym, val), reads);
+  __arc_wb(TMACREADS(thr), reads);
+  TMACREADS(thr) = reads;
+}
+
+/* Called by the virtual machine whenever a global is assigned while a
+   macro is being expanded */
+void __arc_macex_write(arc *c, value thr)
+{
+  __arc_wb(TMACREADS(thr), CTRUE);
+  TMACREADS(thr) = CTRUE;
+}
+
+/* The cached expansion of form by the macro mac, or CUNBOUND */
+static value macex_lookup(arc *c, value form, value mac)
+{
+  value entry = VINDEX(VINDEX(c->builtins, BI_macex), MACEX_SLOT(form));
+  value reads;
+
+  if (NIL_P(entry) || MCE_FORM(entry) != form || MCE_MACRO(entry) != mac
+      || MCE_ASSUMES(entry) != INT2FIX(__arc_compile_assumes(c))
+      || !macex_same(c, form, MCE_FCOPY(entry))
+      || !macex_same(c, MCE_EXP(entry), MCE_ECOPY(entry)))
+    return(CUNBOUND);
+  for (reads = MCE_READS(entry); CONS_P(reads); reads = cdr(reads)) {
+    if (arc_hash_lookup(c, c->genv, car(car(reads))) != cdr(car(reads)))
+      return(CUNBOUND);
+  }
+  return(MCE_EXP(entry));
+}
+
+static void macex_store(arc *c, value form, value mac, value reads,
+			value expansion)
+{
+  value entry, fcopy, ecopy;
+
+  if ((fcopy = macex_copy(c, form)) == CUNBOUND
+      || (ecopy = macex_copy(c, expansion)) == CUNBOUND)
+    return;
+  entry = arc_mkvector(c, MCE_SIZE);
+  SVINDEX(entry, 0, form);
+  SVINDEX(entry, 1, fcopy);
+  SVINDEX(entry, 2, mac);
+  SVINDEX(entry, 3, INT2FIX(__arc_compile_assumes(c)));
+  SVINDEX(entry, 4, reads);
+  SVINDEX(entry, 5, expansion);
+  SVINDEX(entry, 6, ecopy);
+  SVINDEX(VINDEX(c->builtins, BI_macex), MACEX_SLOT(form), entry);
+}
+
+/* Apply the macro mac to the arguments of form, or take the expansion
+   from the cache if it is still good.  The globals read by a macro
+   also count as read by any macro whose expansion is expanding it. */
+static AFFDEF(macex_apply)
+{
+  AARG(form, mac);
+  AVAR(outer);
+  value exp, reads;
+  AFBEGIN;
+  if ((exp = macex_lookup(c, AV(form), AV(mac))) != CUNBOUND)
+    ARETURN(exp);
+  WV(outer, TMACREADS(thr));
+  reads = macex_fixed(c, AV(mac)) ? CNIL : CTRUE;
+  __arc_wb(TMACREADS(thr), reads);
+  TMACREADS(thr) = reads;
+  AFCALL2(arc_rep(c, AV(mac)), cdr(AV(form)));
+  exp = AFCRV;
+  reads = TMACREADS(thr);
+  __arc_wb(TMACREADS(thr), AV(outer));
+  TMACREADS(thr) = AV(outer);
+  if (reads == CTRUE || reads == CUNBOUND) {
+    if (AV(outer) != CUNBOUND)
+      __arc_macex_write(c, thr);
+    ARETURN(exp);
+  }
+  if (AV(outer) != CUNBOUND) {
+    value x;
+
+    for (x = reads; CONS_P(x); x = cdr(x))
+      __arc_macex_read(c, thr, car(car(x)), cdr(car(x)));
+  }
+  macex_store(c, AV(form), AV(mac), reads, exp);
+  ARETURN(exp);
+  AFEND;
+}
+AFFEND
+
 /* Macro expansion.  This will look for any macro applications in e
    and attempt to expand them.
 
@@ -80,7 +304,7 @@ static AFFDEF(macex)
     if (NIL_P(AV(op)))
       ARETURN(AV(e));		/* not a macro */
 
-    AFCALL2(arc_rep(c, AV(op)), cdr(AV(e)));
+    AFCALL(arc_mkaff(c, macex_apply, CNIL), AV(e), AV(op));
     WV(expansion, AFCRV);
     WV(e, AV(expansion));
   } while (AV(once) == CTRUE);
@@ -98,22 +322,42 @@ static value compile_continuation(arc *c, value ctx, value cont)
 extern void __arc_print_string(arc *c, value ppstr);
 
 /* Find a literal lit in ctx.  If not found, create it and add it to the
-   literals in the ctx. */
+   literals in the ctx.  Literals which can be is without being the same
+   object (symbols, strings, characters, and numbers) are looked up in a
+   hash table index kept in the ctx.  Any other literal is only ever is
+   to itself, and the compiler generally does not see the same one twice,
+   so these are simply added. */
 static value find_literal(arc *c, value ctx, value lit)
 {
-  value lits;
-  int i;
+  value idx, lidx;
+
+  switch (TYPE(lit)) {
+  case T_SYMBOL:
+  case T_STRING:
+  case T_CHAR:
+  case T_FIXNUM:
+  case T_BIGNUM:
+  case T_FLONUM:
+  case T_RATIONAL:
+  case T_COMPLEX:
+    break;
+  default:
+    return(INT2FIX(arc_literal(c, ctx, lit)));
+  }
 
-  lits = CCTX_LITS(ctx);
-  if (!NIL_P(lits)) {
-    for (i=0; i<VECLEN(lits); i++) {
-      if (arc_is2(c, VINDEX(lits, i), lit))
-	return(INT2FIX(i));
-    }
+  idx = CCTX_LITIDX(ctx);
+  if (NIL_P(idx)) {
+    idx = arc_mkhash(c, ARC_HASHBITS);
+    SCCTX_LITIDX(ctx, idx);
   }
+  lidx = arc_hash_lookup(c, idx, lit);
+  if (BOUND_P(lidx))
+    return(lidx);
 
   /* create the literal since it doesn't exist */
-  return(INT2FIX(arc_literal(c, ctx, lit)));
+  lidx = INT2FIX(arc_literal(c, ctx, lit));
+  arc_hash_insert(c, idx, lit, lidx);
+  return(lidx);
 }
 
 static value compile_literal(arc *c, value lit, value ctx, value cont)
@@ -152,13 +396,32 @@ static value find_var(arc *c, value var, value env, int *frameno, int *idx)
   return(CNIL);
 }
 
+/* Whether var is the rest parameter of the fn whose frame of env it is
+   found in.  Its index is kept in the frame under nil, which can never
+   name a variable.  A rest parameter is always read with irest, so
+   that the arguments can be left on the stack until a list of them is
+   wanted (see compile_fn). */
+static int rest_var(arc *c, value var, value env, int *frameno, int *idx)
+{
+  int i;
+
+  if (!SYMBOL_P(var) || find_var(c, var, env, frameno, idx) != CTRUE)
+    return(0);
+  for (i=0; i<*frameno; i++)
+    env = cdr(env);
+  return(arc_hash_lookup(c, car(env), CNIL) == INT2FIX(*idx));
+}
+
 static value compile_ident(arc *c, value ident, value ctx, value env,
 			   value cont)
 {
   int level, offset;
 
   /* look for the variable in the environment first */
-  if (find_var(c, ident, env, &level, &offset) == CTRUE) {
+  if (rest_var(c, ident, env, &level, &offset)) {
+    arc_emit3(c, ctx, irest, INT2FIX(level), INT2FIX(offset),
+	      INT2FIX(IREST_LIST), get_lineno(c, CNIL));
+  } else if (find_var(c, ident, env, &level, &offset) == CTRUE) {
     arc_emit2(c, ctx, ilde, INT2FIX(level), INT2FIX(offset),
 	      get_lineno(c, CNIL));
   } else {
@@ -170,10 +433,152 @@ static value compile_ident(arc *c, value ident, value ctx, value env,
 
 }
 
+static int zerop(value x)
+{
+  switch (TYPE(x)) {
+  case T_FIXNUM:
+    return(x == INT2FIX(0));
+  case T_FLONUM:
+    return(REPFLO(x) == 0.0);
+  case T_COMPLEX:
+    return(REPCPX(x) == 0.0);
+  default:
+    break;
+  }
+  /* bignums and rationals are never zero */
+  return(0);
+}
+
+static value inline_fnsrc(arc *c, value fn);
+
+#define NIL_SYM_P(c, x) (NIL_P(x) || (x) == ARC_BUILTIN(c, S_NIL))
+
+/* Whether applications of op can be folded.  No operator is folded
+   where it is a local variable or a macro, the arithmetic operators
+   only while they are bound to the builtins, and no only while it is
+   still the (fn (x) (is x nil)) of arc.arc. */
+static int fold_op(arc *c, value op, value env)
+{
+  value src, body;
+  int frameno, idx;
+
+  if (!SYMBOL_P(op) || find_var(c, op, env, &frameno, &idx) == CTRUE
+      || !NIL_P(ismacro(c, op)))
+    return(0);
+  if (op != ARC_BUILTIN(c, S_NO))
+    return((__arc_symflags(c, op) & SYMF_BUILTIN) != 0);
+  src = inline_fnsrc(c, arc_gbind(c, op));
+  if (!CONS_P(src) || !CONS_P(car(src)) || !NIL_P(cdr(car(src))))
+    return(0);
+  /* the reader gives nil as the empty list, not the symbol */
+  body = cadr(src);
+  return(CONS_P(body) && car(body) == ARC_BUILTIN(c, S_IS)
+	 && CONS_P(cdr(body)) && CONS_P(cddr(body)) && NIL_P(cdr(cddr(body)))
+	 && ((cadr(body) == car(car(src)) && NIL_SYM_P(c, car(cddr(body))))
+	     || (NIL_SYM_P(c, cadr(body))
+		 && car(cddr(body)) == car(car(src)))));
+}
+
+/* Which of the operators that are folded or expanded inline are, as
+   fold_op judges, still what the compiler assumes them to be, as a bit
+   mask.  Code compiled with one mask may be wrong under another, so
+   precompiled code files record it (see arc_arcc_deps). */
+int __arc_compile_assumes(arc *c)
+{
+  static const int ops[] = { S_PLUS, S_TIMES, S_MINUS, S_DIV, S_LT, S_GT,
+			     S_NO };
+  int i, mask = 0;
+
+  for (i=0; i<(int)(sizeof(ops)/sizeof(ops[0])); i++) {
+    if (fold_op(c, ARC_BUILTIN(c, ops[i]), CNIL))
+      mask |= 1 << i;
+  }
+  return(mask);
+}
+
+/* Compile-time evaluation of constant expressions.  This returns the
+   value of expr if it can be computed without running anything, or
+   CUNBOUND if it can't.  Constants are literals and quoted objects, and
+   applications of the arithmetic operators to constant numbers and of
+   no to constants, so long as fold_op allows it.
+
+   Only expressions whose values are immutable or are shared anyway are
+   folded, so cons is not: each time it is evaluated a new cons has to
+   be made. */
+static value constfold(arc *c, value expr, value env)
+{
+  value op, args, acc, x;
+  value (*fn)(arc *, value, value);
+
+  if (NIL_P(expr) || expr == ARC_BUILTIN(c, S_NIL))
+    return(CNIL);
+  if (expr == CTRUE || expr == ARC_BUILTIN(c, S_T))
+    return(CTRUE);
+  if (LITERAL_P(expr))
+    return(expr);
+  if (!CONS_P(expr))
+    return(CUNBOUND);
+
+  op = car(expr);
+  args = cdr(expr);
+  if (op == ARC_BUILTIN(c, S_QUOTE))
+    return(CONS_P(args) ? car(args) : CUNBOUND);
+  if (!fold_op(c, op, env))
+    return(CUNBOUND);
+
+  if (op == ARC_BUILTIN(c, S_NO)) {
+    if (!CONS_P(args) || !NIL_P(cdr(args)))
+      return(CUNBOUND);
+    x = constfold(c, car(args), env);
+    if (x == CUNBOUND)
+      return(CUNBOUND);
+    return(NIL_P(x) ? CTRUE : CNIL);
+  }
+
+  /* The arithmetic operators fold left, the way inline_plus and the
+     rest compile them, with the same identities for the base. */
+  if (op == ARC_BUILTIN(c, S_PLUS)) {
+    fn = __arc_add2;
+    acc = INT2FIX(0);
+  } else if (op == ARC_BUILTIN(c, S_TIMES)) {
+    fn = __arc_mul2;
+    acc = INT2FIX(1);
+  } else if (op == ARC_BUILTIN(c, S_MINUS)) {
+    fn = __arc_sub2;
+    acc = INT2FIX(0);
+  } else if (op == ARC_BUILTIN(c, S_DIV)) {
+    fn = __arc_div2;
+    acc = INT2FIX(1);
+  } else {
+    return(CUNBOUND);
+  }
+  /* +, - and / use the first argument as the base if there are more,
+     and (+ x) is just x */
+  if (fn != __arc_mul2 && CONS_P(args)
+      && (CONS_P(cdr(args)) || fn == __arc_add2)) {
+    acc = constfold(c, car(args), env);
+    if (!NUMERIC_P(acc))
+      return(CUNBOUND);
+    args = cdr(args);
+  } else if (fn != __arc_mul2 && fn != __arc_add2 && !CONS_P(args)) {
+    return(CUNBOUND);
+  }
+  for (; CONS_P(args); args = cdr(args)) {
+    x = constfold(c, car(args), env);
+    /* leave division by zero to raise its error at run time */
+    if (!NUMERIC_P(x) || (fn == __arc_div2 && zerop(x)))
+      return(CUNBOUND);
+    acc = fn(c, acc, x);
+  }
+  return(NIL_P(args) ? acc : CUNBOUND);
+}
+
 static AFFDEF(compile_if)
 {
   AARG(args, ctx, env, cont);
   AVAR(jumpaddr, jumpaddr2);
+  value test;
+  int level, idx;
   AFBEGIN;
   /* if we run out of arguments, the last value becomes nil */
   if (NIL_P(AV(args))) {
@@ -188,11 +593,42 @@ static AFFDEF(compile_if)
 	    AV(env), AV(cont));
   }
 
+  /* If the conditional is a constant, only the branch it selects need
+     be compiled */
+  test = constfold(c, car(AV(args)), AV(env));
+  if (test != CUNBOUND) {
+    if (!NIL_P(test)) {
+      AFTCALL(arc_mkaff(c, arc_compile, CNIL), cadr(AV(args)), AV(ctx),
+	      AV(env), AV(cont));
+    }
+    AFTCALL(arc_mkaff(c, compile_if, CNIL), cddr(AV(args)), AV(ctx),
+	    AV(env), AV(cont));
+  }
+
   /* In the final case, we have the conditional (car), the then portion
      (cadr), and the else portion (cddr). */
-  /* First, compile the conditional */
-  AFCALL(arc_mkaff(c, arc_compile, CNIL), car(AV(args)), AV(ctx),
-	 AV(env), CNIL);
+  /* First, compile the conditional.  A rest parameter need only be
+     tested for whether it is empty. */
+  if (rest_var(c, car(AV(args)), AV(env), &level, &idx)) {
+    arc_emit3(c, AV(ctx), irest, INT2FIX(level), INT2FIX(idx),
+	      INT2FIX(IREST_SOME), get_lineno(c, AV(args)));
+  } else {
+    AFCALL(arc_mkaff(c, arc_compile, CNIL), car(AV(args)), AV(ctx),
+	   AV(env), CNIL);
+  }
+  if (!NIL_P(AV(cont))) {
+    /* If the if is in tail position, so are both of its branches.  Each
+       of them returns by itself, and no jump past the else portion is
+       needed. */
+    WV(jumpaddr, CCTX_VCPTR(AV(ctx)));
+    arc_emit1(c, AV(ctx), ijf, INT2FIX(0), get_lineno(c, AV(args)));
+    AFCALL(arc_mkaff(c, arc_compile, CNIL), cadr(AV(args)), AV(ctx),
+	   AV(env), AV(cont));
+    arc_jmpoffset(c, AV(ctx), FIX2INT(AV(jumpaddr)),
+		  FIX2INT(CCTX_VCPTR(AV(ctx))));
+    AFTCALL(arc_mkaff(c, compile_if, CNIL), cddr(AV(args)), AV(ctx),
+	    AV(env), AV(cont));
+  }
   /* this jump address will be the address of the jf instruction
      which we are about to generate.  We have to patch it with the
      address of the start of the else portion once we know it. */
@@ -350,6 +786,7 @@ static AFFDEF(compile_args)
        name and a list containing the name of the sole argument. */
     WV(nframe, arc_mkhash(c, ARC_HASHBITS));
     add_env_name(c, AV(nframe), AV(args), INT2FIX(0));
+    arc_hash_insert(c, AV(nframe), CNIL, INT2FIX(0));
     arc_emit3(c, AV(ctx), ienvr, INT2FIX(0), INT2FIX(0), INT2FIX(0),
 	      get_lineno(c, AV(args)));
     WV(env, cons(c, AV(nframe), AV(env)));
@@ -431,6 +868,7 @@ static AFFDEF(compile_args)
     if (SYMBOL_P(cdr(AV(args)))) {
       /* rest arg */
       add_env_name(c, AV(nframe), cdr(AV(args)), AV(idx));
+      arc_hash_insert(c, AV(nframe), CNIL, AV(idx));
       /* change to envr instr. */
       SVINDEX(CCTX_VCODE(AV(ctx)), FIX2INT(AV(envptr)), INT2FIX(ienvr));
       FIXINC(idx);
@@ -468,21 +906,128 @@ static AFFDEF(compile_args)
 }
 AFFEND
 
+/* Count the arguments of a fn if they are all plain names, or return
+   -1 if any are optional, destructured, or rest arguments. */
+static int simple_args(value args)
+{
+  int n;
+
+  for (n=0; CONS_P(args); args = cdr(args), n++) {
+    if (!SYMBOL_P(car(args)))
+      return(-1);
+  }
+  return(NIL_P(args) ? n : -1);
+}
+
+/* Inline expansion of small global functions.  A fn with only plain
+   arguments assigned to a global at the top level, whose body is a
+   single small expression with no fn or assign in it and no reference
+   to the function itself, keeps its source in its code object.  Calls
+   to the global are then compiled as expansions of that body, guarded
+   by an iinl instruction which jumps to an ordinary call instead once
+   the global has been redefined.  The sites which expanded the current
+   definition of a global share a single site object, kept under the
+   global's name in the BI_inline table, and arc_bindsym invalidates it
+   when the global is bound again. */
+#define INLINE_MAXSIZE 16	/* most atoms in a body expanded inline */
+#define INLINE_MAXDEPTH 4	/* most expansions nested in one another */
+
+/* Count the atoms in x, which is part of the body of the function
+   name, adding them to size.  Returns -1 if the body cannot be
+   expanded inline. */
+static int inline_size(arc *c, value x, value name, int size)
+{
+  if (size < 0 || size > INLINE_MAXSIZE)
+    return(-1);
+  if (SYMBOL_P(x)) {
+    if (x == name || (__arc_symflags(c, x) & SYMF_SSYNTAX))
+      return(-1);
+    return(size + 1);
+  }
+  if (!CONS_P(x) || car(x) == ARC_BUILTIN(c, S_QUOTE))
+    return(size + 1);
+  if (car(x) == ARC_BUILTIN(c, S_FN) || car(x) == ARC_BUILTIN(c, S_ASSIGN))
+    return(-1);
+  for (; CONS_P(x); x = cdr(x))
+    size = inline_size(c, car(x), name, size);
+  return((NIL_P(x) && size <= INLINE_MAXSIZE) ? size : -1);
+}
+
+/* The number of operands of the instruction op */
+static int inst_nargs(int op)
+{
+  if (op == icont)
+    return(1);
+  return(op >> 6);
+}
+
+/* Whether code or any function within it refers to the variable idx
+   of the environment level frames up from it */
+static int env_refers(arc *c, value code, int level, int idx)
+{
+  value vc = CODE_CODE(code), lit;
+  int i, op;
+
+  for (i=0; i<VECLEN(vc); i += 1 + inst_nargs(op)) {
+    op = FIX2INT(XVINDEX(vc, i));
+    if ((op == ilde || op == iste || op == irest) && i+2 < VECLEN(vc)
+	&& FIX2INT(XVINDEX(vc, i+1)) == level
+	&& FIX2INT(XVINDEX(vc, i+2)) == idx)
+      return(1);
+  }
+  /* functions with arguments of their own add a frame */
+  for (i=0; i<VECLEN(code)-2; i++) {
+    lit = CODE_LITERAL(code, i);
+    if (TYPE(lit) != T_CODE)
+      continue;
+    op = FIX2INT(XVINDEX(CODE_CODE(lit), 0));
+    if (env_refers(c, lit, (op == ienv || op == ienvr || op == ienvd
+			    || op == ienvs)
+		   ? level + 1 : level, idx))
+      return(1);
+  }
+  return(0);
+}
+
 static AFFDEF(compile_fn)
 {
   AARG(expr, ctx, env, cont);
-  AVAR(args, body, nctx, nenv, newcode, stmts);
+  AOARG(name);
+  AVAR(args, body, nctx, nenv, newcode, stmts, fxargs);
+  int nargs;
   AFBEGIN;
 
   WV(stmts, INT2FIX(0));
   WV(args, car(AV(expr)));
   WV(body, cdr(AV(expr)));
   WV(nctx, arc_mkcctx(c));
-  /* copy the CODE_SRC from the original ctx to this one */
-  SCCTX_SRC(AV(nctx), CCTX_SRC(AV(ctx)));
+  WV(fxargs, CCTX_FXARGS(AV(ctx)));
+  SCCTX_FXARGS(AV(ctx), CNIL);
+  /* the new function gets its own line number table if the original
+     ctx has one */
+  if (!NIL_P(CCTX_SRC(AV(ctx))))
+    arc_cctx_mksrc(c, AV(nctx));
   AFCALL(arc_mkaff(c, compile_args, CNIL),
 	 AV(args), AV(nctx), AV(env));
   WV(nenv, AFCRV);
+  /* the fixnum locals of enclosing fns remain so in this one */
+  SCCTX_FXVARS(AV(nctx), CCTX_FXVARS(AV(ctx)));
+  for (; AV(fxargs); WV(fxargs, cdr(AV(fxargs)))) {
+    SCCTX_FXVARS(AV(nctx), cons(c, cons(c, car(AV(fxargs)), car(AV(nenv))),
+				 CCTX_FXVARS(AV(nctx))));
+  }
+  /* If the fn is being assigned to a name, tail calls to that name from
+     its body may be turned into jumps back to here. */
+  nargs = simple_args(AV(args));
+  if (BOUND_P(AV(name)) && nargs >= 0) {
+    SCCTX_SELF(AV(nctx), AV(name));
+    SCCTX_SELFENV(AV(nctx), AV(nenv));
+    SCCTX_SELFARGS(AV(nctx), INT2FIX(nargs));
+    SCCTX_SELFTOP(AV(nctx), CCTX_VCPTR(AV(nctx)));
+    if (NIL_P(AV(env)) && CONS_P(AV(body)) && NIL_P(cdr(AV(body)))
+	&& inline_size(c, car(AV(body)), AV(name), 0) >= 0)
+      SCCTX_INLINE(AV(nctx), AV(expr));
+  }
   /* the body of a fn works as an implicit do/progn */
   for (; AV(body); WV(body, cdr(AV(body)))) {
     /* The last statement in the body gets compiled with the 
@@ -502,6 +1047,19 @@ static AFFDEF(compile_fn)
      then create a closure using the code object and the current
      environment. */
   WV(newcode, arc_cctx2code(c, AV(nctx)));
+  /* A rest parameter which nothing refers to is never made into a
+     list at all.  One which is referred to has its arguments left on
+     the stack, and made into a list only by the first irest which
+     needs one, so that (car r), (no r), and r as the test of an if do
+     not cons. */
+  if (XVINDEX(CODE_CODE(AV(newcode)), 0) == INT2FIX(ienvr)
+      && XVINDEX(CODE_CODE(AV(newcode)), 2) == INT2FIX(0)) {
+    XVINDEX(CODE_CODE(AV(newcode)), 0)
+      = INT2FIX(env_refers(c, AV(newcode), 0,
+			   FIX2INT(XVINDEX(CODE_CODE(AV(newcode)), 1))
+			   + FIX2INT(XVINDEX(CODE_CODE(AV(newcode)), 3)))
+		? ienvs : ienvd);
+  }
   arc_emit1(c, AV(ctx), ildl, find_literal(c, AV(ctx), AV(newcode)),
 	    get_lineno(c, AV(expr)));
   arc_emit(c, AV(ctx), icls, get_lineno(c, AV(expr)));
@@ -717,8 +1275,14 @@ static AFFDEF(compile_assign)
     } else if (AV(a) == ARC_BUILTIN(c, S_T)) {
       arc_err_cstrfmt_line(c, get_lineno(c, AV(expr)), "Can't rebind t");
     } else {
-      AFCALL(arc_mkaff(c, arc_compile, CNIL), AV(val), AV(ctx),
-	     AV(env), CNIL);
+      if (CONS_P(AV(val)) && car(AV(val)) == ARC_BUILTIN(c, S_FN)) {
+	/* let the fn know the name it is being given */
+	AFCALL(arc_mkaff(c, compile_fn, CNIL), cdr(AV(val)), AV(ctx),
+	       AV(env), CNIL, AV(a));
+      } else {
+	AFCALL(arc_mkaff(c, arc_compile, CNIL), AV(val), AV(ctx),
+	       AV(env), CNIL);
+      }
       WV(envvar, find_var(c, AV(a), AV(env), &frameno, &idx));
       if (AV(envvar) == CTRUE) {
 	arc_emit2(c, AV(ctx), iste, INT2FIX(frameno), INT2FIX(idx),
@@ -750,6 +1314,90 @@ static int (*spform(arc *c, value ident))(arc *, value)
   return(NULL);
 }
 
+/* Local type inference for fixnum arithmetic.  An expression is
+   believed to be a fixnum if it is a fixnum literal, a call to len, a
+   local variable bound to such an expression by a fn applied directly
+   (which is what with and let, and so for, repeat and forlen, expand
+   into), or arithmetic on at least one such value and nothing known
+   not to be a number.  Arithmetic and comparisons on these use the
+   ifx instructions, which check their operands and for overflow
+   just once and otherwise fall back to the generic operation, so a
+   wrong guess costs no more than not guessing at all. */
+#define FX_NO 0			/* known not to be a fixnum */
+#define FX_MAYBE 1		/* nothing known */
+#define FX_YES 2		/* believed to be a fixnum */
+
+static int fixnum_type(arc *c, value x, value ctx, value env);
+
+/* The type of the result of arithmetic on args */
+static int fixnum_args(arc *c, value args, value ctx, value env)
+{
+  int type, res = FX_MAYBE;
+
+  for (; CONS_P(args); args = cdr(args)) {
+    type = fixnum_type(c, car(args), ctx, env);
+    if (type == FX_NO)
+      return(FX_NO);
+    if (type == FX_YES)
+      res = FX_YES;
+  }
+  return(NIL_P(args) ? res : FX_NO);
+}
+
+static int fixnum_type(arc *c, value x, value ctx, value env)
+{
+  value op, fx;
+  int frameno, idx;
+
+  if (FIXNUM_P(x))
+    return(FX_YES);
+  if (SYMBOL_P(x)) {
+    if (x == ARC_BUILTIN(c, S_T))
+      return(FX_NO);
+    /* find the frame binding a local and see if it is one of ours */
+    for (; env; env = cdr(env)) {
+      if (arc_hash_lookup(c, car(env), x) == CUNBOUND)
+	continue;
+      for (fx = CCTX_FXVARS(ctx); fx; fx = cdr(fx)) {
+	if (car(car(fx)) == x && cdr(car(fx)) == car(env))
+	  return(FX_YES);
+      }
+      break;
+    }
+    return(FX_MAYBE);
+  }
+  if (!CONS_P(x))
+    return(FX_NO);
+  op = car(x);
+  if (op == ARC_BUILTIN(c, S_QUOTE))
+    return(FX_NO);
+  if (!SYMBOL_P(op) || find_var(c, op, env, &frameno, &idx) == CTRUE
+      || !NIL_P(ismacro(c, op)))
+    return(FX_MAYBE);
+  if (op == ARC_BUILTIN(c, S_LEN))
+    return((CONS_P(cdr(x)) && NIL_P(cddr(x))) ? FX_YES : FX_MAYBE);
+  if (op == ARC_BUILTIN(c, S_PLUS) || op == ARC_BUILTIN(c, S_MINUS)
+      || op == ARC_BUILTIN(c, S_TIMES))
+    return(fixnum_args(c, cdr(x), ctx, env));
+  return(FX_MAYBE);
+}
+
+/* The names of the params of a fn applied directly to args which get
+   values believed to be fixnums */
+static value fixnum_params(arc *c, value params, value args, value ctx,
+			   value env)
+{
+  value fx = CNIL;
+
+  for (; CONS_P(params) && CONS_P(args);
+       params = cdr(params), args = cdr(args)) {
+    if (SYMBOL_P(car(params))
+	&& fixnum_type(c, car(args), ctx, env) == FX_YES)
+      fx = cons(c, car(params), fx);
+  }
+  return(fx);
+}
+
 #define INLINE_FUNC(name, instr, nargs)					\
   static AFFDEF(inline_##name)						\
   {									\
@@ -831,7 +1479,8 @@ static AFFDEF(inline_plus)
   if (xelen == INT2FIX(1))
     AFTCALL(arc_mkaff(c, arc_compile, CNIL), car(xexpr), AV(ctx),
 	    AV(env), AV(cont));
-  AFTCALL(arc_mkaff(c, compile_inlinen2, CNIL), iadd,
+  AFTCALL(arc_mkaff(c, compile_inlinen2, CNIL),
+	  (fixnum_args(c, xexpr, AV(ctx), AV(env)) == FX_YES) ? ifxadd : iadd,
 	  AV(expr), AV(ctx), AV(env), AV(cont), INT2FIX(0));
   AFEND;
 }
@@ -841,7 +1490,9 @@ static AFFDEF(inline_times)
 {
   AARG(expr, ctx, env, cont);
   AFBEGIN;
-  AFTCALL(arc_mkaff(c, compile_inlinen, CNIL), imul,
+  AFTCALL(arc_mkaff(c, compile_inlinen, CNIL),
+	  (fixnum_args(c, cdr(AV(expr)), AV(ctx), AV(env)) == FX_YES)
+	  ? ifxmul : imul,
 	  AV(expr), AV(ctx), AV(env), AV(cont), INT2FIX(1));
   AFEND;
 }
@@ -851,7 +1502,9 @@ static AFFDEF(inline_minus)
 {
   AARG(expr, ctx, env, cont);
   AFBEGIN;
-  AFTCALL(arc_mkaff(c, compile_inlinen2, CNIL), isub,
+  AFTCALL(arc_mkaff(c, compile_inlinen2, CNIL),
+	  (fixnum_args(c, cdr(AV(expr)), AV(ctx), AV(env)) == FX_YES)
+	  ? ifxsub : isub,
 	  AV(expr), AV(ctx), AV(env), AV(cont), INT2FIX(0));
   AFEND;
 }
@@ -867,8 +1520,55 @@ static AFFDEF(inline_div)
 }
 AFFEND
 
-static int (*inline_func(arc *c, value ident))(arc *, value)
+static int compile_apply(arc *c, value thr);
+
+/* Comparisons are only inlined between two values believed to be
+   fixnums.  Anything else is an ordinary call to the global. */
+static AFFDEF(inline_cmp)
+{
+  AARG(inst, expr, ctx, env, cont);
+  value args;
+  AFBEGIN;
+  args = cdr(AV(expr));
+  if (!CONS_P(args) || !CONS_P(cdr(args)) || !NIL_P(cddr(args))
+      || fixnum_args(c, args, AV(ctx), AV(env)) != FX_YES)
+    AFTCALL(arc_mkaff(c, compile_apply, CNIL), AV(expr), AV(ctx), AV(env),
+	    AV(cont));
+  AFTCALL(arc_mkaff(c, compile_inlinen2, CNIL), AV(inst),
+	  AV(expr), AV(ctx), AV(env), AV(cont), INT2FIX(0));
+  AFEND;
+}
+AFFEND
+
+static AFFDEF(inline_lt)
+{
+  AARG(expr, ctx, env, cont);
+  AFBEGIN;
+  AFTCALL(arc_mkaff(c, inline_cmp, CNIL), ifxlt,
+	  AV(expr), AV(ctx), AV(env), AV(cont));
+  AFEND;
+}
+AFFEND
+
+static AFFDEF(inline_gt)
+{
+  AARG(expr, ctx, env, cont);
+  AFBEGIN;
+  AFTCALL(arc_mkaff(c, inline_cmp, CNIL), ifxgt,
+	  AV(expr), AV(ctx), AV(env), AV(cont));
+  AFEND;
+}
+AFFEND
+
+/* The inline expansion of an application of ident, or NULL.  Nothing
+   is expanded inline where ident is a local variable, and < and > only
+   while they are bound to the builtins. */
+static int (*inline_func(arc *c, value ident, value env))(arc *, value)
 {
+  int level, idx;
+
+  if (!SYMBOL_P(ident) || find_var(c, ident, env, &level, &idx) == CTRUE)
+    return(NULL);
   if (ident == ARC_BUILTIN(c, S_CONS)) {
     return(inline_cons);
   } else if (ident == ARC_BUILTIN(c, S_CAR)) {
@@ -883,6 +1583,12 @@ static int (*inline_func(arc *c, value ident))(arc *, value)
     return(inline_minus);
   } else if (ident == ARC_BUILTIN(c, S_DIV)) {
     return(inline_div);
+  } else if (ident == ARC_BUILTIN(c, S_LT)
+	     && (__arc_symflags(c, ident) & SYMF_BUILTIN)) {
+    return(inline_lt);
+  } else if (ident == ARC_BUILTIN(c, S_GT)
+	     && (__arc_symflags(c, ident) & SYMF_BUILTIN)) {
+    return(inline_gt);
   }
   return(NULL);
 }
@@ -931,11 +1637,316 @@ static AFFDEF(compile_complement)
 }
 AFFEND
 
+/* Compare the source of two inline candidates */
+static int inline_srceq(arc *c, value a, value b)
+{
+  for (; CONS_P(a) && CONS_P(b); a = cdr(a), b = cdr(b)) {
+    if (!inline_srceq(c, car(a), car(b)))
+      return(0);
+  }
+  return(arc_is2(c, a, b) == CTRUE);
+}
+
+/* Get the site object for expansions of the present definition of
+   the global name, whose source is src. */
+static value inline_site(arc *c, value name, value src)
+{
+  value tbl = VINDEX(c->builtins, BI_inline), site;
+
+  site = arc_hash_lookup(c, tbl, name);
+  if (BOUND_P(site))
+    return(site);
+  site = arc_mkvector(c, INL_SIZE);
+  SINL_NAME(site, name);
+  SINL_SRC(site, src);
+  SINL_STATE(site, CTRUE);
+  arc_hash_insert(c, tbl, name, site);
+  __arc_setsymflags(c, name, __arc_symflags(c, name) | SYMF_INLINED);
+  return(site);
+}
+
+/* Get the source of the global function fn if it can be expanded
+   inline, or nil.  Only functions compiled with no enclosing local
+   environment ever record this, so the closure's environment is never
+   needed by the expansion. */
+static value inline_fnsrc(arc *c, value fn)
+{
+  value src;
+
+  if (TYPE(fn) != T_CLOS)
+    return(CNIL);
+  src = CODE_SRC(CLOS_CODE(fn));
+  return(NIL_P(src) ? CNIL : SRC_INLINE(src));
+}
+
+/* Called by arc_bindsym when a global which has been expanded inline
+   is bound again. */
+void __arc_inline_invalidate(arc *c, value name)
+{
+  value tbl = VINDEX(c->builtins, BI_inline), site;
+
+  site = arc_hash_lookup(c, tbl, name);
+  if (BOUND_P(site)) {
+    SINL_STATE(site, CNIL);
+    arc_hash_delete(c, tbl, name);
+  }
+  __arc_setsymflags(c, name, __arc_symflags(c, name) & ~SYMF_INLINED);
+}
+
+/* Check a site whose state is unknown, because it was loaded from a
+   precompiled code file or an image.  If the global it was expanded
+   from still has the same definition, the site is replaced by the one
+   for the present definition, or becomes it. */
+int __arc_inline_check(arc *c, value code, int idx)
+{
+  value site = CODE_LITERAL(code, idx), cur, src;
+
+  if (BOUND_P(INL_STATE(site)))
+    return(INL_STATE(site) == CTRUE);
+  cur = arc_hash_lookup(c, VINDEX(c->builtins, BI_inline), INL_NAME(site));
+  if (BOUND_P(cur)) {
+    if (!inline_srceq(c, INL_SRC(cur), INL_SRC(site))) {
+      SINL_STATE(site, CNIL);
+      return(0);
+    }
+    SCODE_LITERAL(code, idx, cur);
+    return(1);
+  }
+  src = inline_fnsrc(c, arc_gbind(c, INL_NAME(site)));
+  if (NIL_P(src) || !inline_srceq(c, src, INL_SRC(site))) {
+    SINL_STATE(site, CNIL);
+    return(0);
+  }
+  SINL_STATE(site, CTRUE);
+  arc_hash_insert(c, VINDEX(c->builtins, BI_inline), INL_NAME(site), site);
+  __arc_setsymflags(c, INL_NAME(site),
+		    __arc_symflags(c, INL_NAME(site)) | SYMF_INLINED);
+  return(1);
+}
+
+/* Mark the sites used by code as unchecked.  Called on code which has
+   just been loaded, as whatever their state was when the code was
+   saved says nothing about the globals of the running system. */
+void __arc_inline_reset(arc *c, value code)
+{
+  value src = CODE_SRC(code), x, site;
+  int idx;
+
+  if (TYPE(src) != T_VECTOR || VECLEN(src) < SRC_SIZE)
+    return;
+  for (x = SRC_INLINED(src); CONS_P(x); x = cdr(x)) {
+    if (TYPE(car(x)) != T_FIXNUM)
+      continue;
+    idx = FIX2INT(car(x));
+    if (idx < 0 || idx >= VECLEN(code) - 2)
+      continue;
+    site = CODE_LITERAL(code, idx);
+    if (TYPE(site) == T_VECTOR && VECLEN(site) == INL_SIZE)
+      SINL_STATE(site, CUNBOUND);
+  }
+}
+
+/* An argument which can be evaluated anywhere with the same result,
+   so that it can be substituted for a parameter. */
+static int inline_trivial(arc *c, value x, value env)
+{
+  int level, idx;
+
+  if (LITERAL_P(x))
+    return(1);
+  if (SYMBOL_P(x))
+    return(find_var(c, x, env, &level, &idx) == CTRUE);
+  return(CONS_P(x) && car(x) == ARC_BUILTIN(c, S_QUOTE));
+}
+
+/* Walk the body x of an inline candidate in the order it would be
+   evaluated at a call with arguments args.  Returns 0 if it applies
+   a macro, as the body was compiled before that macro was defined.
+   Clears *subst if the arguments cannot be substituted for the
+   parameters in the body compiled at the call: if a global it uses
+   is shadowed there, or if a parameter whose argument is a variable
+   is used after the body has called something that might change the
+   variable. */
+static int inline_walk(arc *c, value x, value params, value args,
+		       value env, int *called, int *subst)
+{
+  value p, a;
+  int level, idx;
+
+  if (LITERAL_P(x))
+    return(1);
+  if (SYMBOL_P(x)) {
+    for (p = params, a = args; CONS_P(p); p = cdr(p), a = cdr(a)) {
+      if (car(p) == x) {
+	if (*called && SYMBOL_P(car(a)))
+	  *subst = 0;
+	return(1);
+      }
+    }
+    if (find_var(c, x, env, &level, &idx) == CTRUE)
+      *subst = 0;
+    return(1);
+  }
+  if (!CONS_P(x) || car(x) == ARC_BUILTIN(c, S_QUOTE))
+    return(1);
+  if (car(x) == ARC_BUILTIN(c, S_IF)) {
+    for (x = cdr(x); CONS_P(x); x = cdr(x)) {
+      if (!inline_walk(c, car(x), params, args, env, called, subst))
+	return(0);
+    }
+    return(1);
+  }
+  if (SYMBOL_P(car(x)) && !NIL_P(ismacro(c, car(x))))
+    return(0);
+  for (p = cdr(x); CONS_P(p); p = cdr(p)) {
+    if (!inline_walk(c, car(p), params, args, env, called, subst))
+      return(0);
+  }
+  /* < and > may still call the global */
+  if (inline_func(c, car(x), env) != NULL
+      && car(x) != ARC_BUILTIN(c, S_LT) && car(x) != ARC_BUILTIN(c, S_GT))
+    return(1);
+  if (!inline_walk(c, car(x), params, args, env, called, subst))
+    return(0);
+  *called = 1;
+  return(1);
+}
+
+/* Substitute args for params in x */
+static value inline_subst(arc *c, value x, value params, value args)
+{
+  value p, a, y;
+
+  if (SYMBOL_P(x)) {
+    for (p = params, a = args; CONS_P(p); p = cdr(p), a = cdr(a)) {
+      if (car(p) == x)
+	return(car(a));
+    }
+    return(x);
+  }
+  if (!CONS_P(x) || car(x) == ARC_BUILTIN(c, S_QUOTE))
+    return(x);
+  for (y = CNIL; CONS_P(x); x = cdr(x))
+    y = cons(c, inline_subst(c, car(x), params, args), y);
+  return(arc_list_reverse(c, y));
+}
+
+/* Get the source of the global function fname if the call expr to it
+   can be expanded inline, or nil. */
+static value inline_source(arc *c, value expr, value ctx, value env)
+{
+  value fname = car(expr), src, x;
+  int level, idx, n, called = 0, subst = 1;
+
+  if (find_var(c, fname, env, &level, &idx) == CTRUE)
+    return(CNIL);
+  src = inline_fnsrc(c, arc_gbind(c, fname));
+  if (NIL_P(src))
+    return(CNIL);
+  n = simple_args(car(src));
+  for (x = cdr(expr); CONS_P(x); x = cdr(x))
+    n--;
+  if (n != 0 || !NIL_P(x))
+    return(CNIL);
+  for (n = 0, x = CCTX_INLINING(ctx); x; x = cdr(x), n++) {
+    if (car(x) == fname)
+      return(CNIL);
+  }
+  if (n >= INLINE_MAXDEPTH
+      || !inline_walk(c, cadr(src), car(src), cdr(expr), env, &called, &subst))
+    return(CNIL);
+  return(src);
+}
+
+/* Compile the call expr to the global function whose source is src as
+   an expansion of its body.  If all of the arguments are trivial, they
+   are substituted for the parameters in the body, which is compiled in
+   place.  Otherwise, the arguments are bound in an environment of their
+   own, just as a call would do, and the body is compiled to run in it,
+   returning through a continuation as a call would.  Either way, the
+   ordinary call follows, for use once the function is redefined. */
+static AFFDEF(compile_inline)
+{
+  AARG(expr, ctx, env, cont, src);
+  AVAR(lit, guard, jumpaddr, contaddr, nahd, nargs, nenv);
+  value x;
+  int called = 0, subst = 1;
+  AFBEGIN;
+
+  WV(lit, find_literal(c, AV(ctx), inline_site(c, car(AV(expr)), AV(src))));
+  SCCTX_INLINED(AV(ctx), cons(c, AV(lit), CCTX_INLINED(AV(ctx))));
+  SCCTX_INLINING(AV(ctx), cons(c, car(AV(expr)), CCTX_INLINING(AV(ctx))));
+  for (x = cdr(AV(expr)); x; x = cdr(x)) {
+    if (!inline_trivial(c, car(x), AV(env)))
+      subst = 0;
+  }
+  inline_walk(c, cadr(AV(src)), car(AV(src)), cdr(AV(expr)), AV(env),
+	      &called, &subst);
+  if (subst) {
+    WV(guard, CCTX_VCPTR(AV(ctx)));
+    arc_emit3(c, AV(ctx), iinl, AV(lit), INT2FIX(-1), INT2FIX(0),
+	      get_lineno(c, AV(expr)));
+    AFCALL(arc_mkaff(c, arc_compile, CNIL),
+	   inline_subst(c, cadr(AV(src)), car(AV(src)), cdr(AV(expr))),
+	   AV(ctx), AV(env), AV(cont));
+    if (NIL_P(AV(cont))) {
+      WV(jumpaddr, CCTX_VCPTR(AV(ctx)));
+      arc_emit1(c, AV(ctx), ijmp, INT2FIX(0), get_lineno(c, AV(expr)));
+    }
+    SVINDEX(CCTX_VCODE(AV(ctx)), FIX2INT(AV(guard)) + 3,
+	    INT2FIX(FIX2INT(CCTX_VCPTR(AV(ctx))) - FIX2INT(AV(guard))));
+    /* the name is still being expanded, so this is an ordinary call */
+    AFCALL(arc_mkaff(c, compile_apply, CNIL), AV(expr), AV(ctx), AV(env),
+	   AV(cont));
+    if (NIL_P(AV(cont))) {
+      arc_jmpoffset(c, AV(ctx), FIX2INT(AV(jumpaddr)),
+		    FIX2INT(CCTX_VCPTR(AV(ctx))));
+    }
+  } else {
+    if (NIL_P(AV(cont))) {
+      WV(contaddr, CCTX_VCPTR(AV(ctx)));
+      arc_emit1(c, AV(ctx), icont, INT2FIX(0), get_lineno(c, AV(expr)));
+    }
+    for (WV(nahd, cdr(AV(expr))), WV(nargs, INT2FIX(0)); AV(nahd);
+	 WV(nahd, cdr(AV(nahd))), WV(nargs, INT2FIX(FIX2INT(AV(nargs)) + 1))) {
+      AFCALL(arc_mkaff(c, arc_compile, CNIL), car(AV(nahd)),
+	     AV(ctx), AV(env), CNIL);
+      arc_emit(c, AV(ctx), ipush, get_lineno(c, AV(expr)));
+    }
+    /* In a tail call, the menv that follows sets the argument count */
+    WV(guard, CCTX_VCPTR(AV(ctx)));
+    arc_emit3(c, AV(ctx), iinl, AV(lit),
+	      NIL_P(AV(cont)) ? AV(nargs) : INT2FIX(-1), INT2FIX(0),
+	      get_lineno(c, AV(expr)));
+    if (!NIL_P(AV(cont)))
+      arc_emit1(c, AV(ctx), imenv, AV(nargs), get_lineno(c, AV(expr)));
+    AFCALL(arc_mkaff(c, compile_args, CNIL), car(AV(src)), AV(ctx), CNIL);
+    WV(nenv, AFCRV);
+    AFCALL(arc_mkaff(c, arc_compile, CNIL), cadr(AV(src)), AV(ctx),
+	   AV(nenv), CTRUE);
+    SVINDEX(CCTX_VCODE(AV(ctx)), FIX2INT(AV(guard)) + 3,
+	    INT2FIX(FIX2INT(CCTX_VCPTR(AV(ctx))) - FIX2INT(AV(guard))));
+    arc_emit1(c, AV(ctx), ildg, find_literal(c, AV(ctx), car(AV(expr))),
+	      get_lineno(c, AV(expr)));
+    if (!NIL_P(AV(cont)))
+      arc_emit1(c, AV(ctx), imenv, AV(nargs), get_lineno(c, AV(expr)));
+    arc_emit1(c, AV(ctx), iapply, AV(nargs), get_lineno(c, AV(expr)));
+    if (NIL_P(AV(cont))) {
+      arc_jmpoffset(c, AV(ctx), FIX2INT(AV(contaddr)),
+		    FIX2INT(CCTX_VCPTR(AV(ctx))));
+    }
+  }
+  SCCTX_INLINING(AV(ctx), cdr(CCTX_INLINING(AV(ctx))));
+  ARETURN(AV(ctx));
+  AFEND;
+}
+AFFEND
+
 static AFFDEF(compile_apply)
 {
   AARG(expr, ctx, env, cont);
   AVAR(fname, args, nahd, contaddr, nargs);
-  value mac;
+  value mac, inl;
   AFBEGIN;
 
   WV(fname, car(AV(expr)));
@@ -943,13 +1954,21 @@ static AFFDEF(compile_apply)
 
   /* Check to see if this is a macro application */
   if (SYMBOL_P(AV(fname)) && !NIL_P(mac = ismacro(c, AV(fname)))) {
-    /* Apply the macro by calling it.  Compile the results. */
-    AFCALL2(arc_rep(c, mac), AV(args));
+    /* Apply the macro by calling it, unless the expansion it gave for
+       this very form before is still good.  Compile the results. */
+    AFCALL(arc_mkaff(c, macex_apply, CNIL), AV(expr), mac);
     AFTCALL(arc_mkaff(c, arc_compile, CNIL), AFCRV, AV(ctx), AV(env), AV(cont));
     /* tail call: doesn't return -- never gets here */
     ARETURN(AFCRV);
   }
 
+  /* Calls to small global functions may be expanded inline */
+  if (SYMBOL_P(AV(fname))
+      && !NIL_P(inl = inline_source(c, AV(expr), AV(ctx), AV(env)))) {
+    AFTCALL(arc_mkaff(c, compile_inline, CNIL), AV(expr), AV(ctx), AV(env),
+	    AV(cont), inl);
+  }
+
   /* There are two possible cases here.  If this is not a tail call,
      cont will be nil, so we need to make a continuation. */
   if (NIL_P(AV(cont))) {
@@ -964,9 +1983,28 @@ static AFFDEF(compile_apply)
 	   AV(ctx), AV(env), CNIL);
     arc_emit(c, AV(ctx), ipush, get_lineno(c, AV(expr)));
   }
+  /* a fn applied directly learns which of its parameters are bound
+     to fixnums */
+  if (CONS_P(AV(fname)) && car(AV(fname)) == ARC_BUILTIN(c, S_FN)
+      && CONS_P(cdr(AV(fname))))
+    SCCTX_FXARGS(AV(ctx), fixnum_params(c, cadr(AV(fname)), AV(args),
+					AV(ctx), AV(env)));
   /* compile the function name, which should load it into the value register */
   AFCALL(arc_mkaff(c, arc_compile, CNIL), AV(fname), AV(ctx), AV(env), CNIL);
 
+  /* A tail call that a named function makes to itself from its own
+     environment becomes a jump back to its beginning, provided the
+     name still refers to it when the call is made. */
+  if (!NIL_P(AV(cont)) && SYMBOL_P(AV(fname))
+      && AV(fname) == CCTX_SELF(AV(ctx))
+      && AV(env) == CCTX_SELFENV(AV(ctx))
+      && AV(nargs) == CCTX_SELFARGS(AV(ctx))) {
+    arc_emit2(c, AV(ctx), iself, AV(nargs),
+	      INT2FIX(FIX2INT(CCTX_SELFTOP(AV(ctx)))
+		      - FIX2INT(CCTX_VCPTR(AV(ctx)))),
+	      get_lineno(c, AV(expr)));
+  }
+
   /* If this is a tail call, create a menv instruction to overwrite the
      current environment just before performing the application */
   if (!NIL_P(AV(cont))) {
@@ -989,6 +2027,30 @@ static AFFDEF(compile_apply)
 }
 AFFEND
 
+/* A fn with no arguments applied directly to no arguments, which is
+   what do expands into, creates no environment of its own, so its
+   body can simply be compiled in place. */
+static AFFDEF(compile_block)
+{
+  AARG(expr, ctx, env, cont);
+  AVAR(body);
+  AFBEGIN;
+
+  WV(body, cddr(car(AV(expr))));
+  if (NIL_P(AV(body))) {
+    arc_emit(c, AV(ctx), inil, get_lineno(c, AV(expr)));
+    ARETURN(compile_continuation(c, AV(ctx), AV(cont)));
+  }
+  for (; !NIL_P(cdr(AV(body))); WV(body, cdr(AV(body)))) {
+    AFCALL(arc_mkaff(c, arc_compile, CNIL), car(AV(body)), AV(ctx),
+	   AV(env), CNIL);
+  }
+  AFTCALL(arc_mkaff(c, arc_compile, CNIL), car(AV(body)), AV(ctx),
+	  AV(env), AV(cont));
+  AFEND;
+}
+AFFEND
+
 static AFFDEF(compile_andf)
 {
   AARG(expr, ctx, env, cont);
@@ -1017,6 +2079,8 @@ static AFFDEF(compile_list)
   AARG(nexpr, ctx, env, cont);
   AVAR(expr, xs);
   int (*fun)(arc *, value) = NULL;
+  value folded;
+  int level, idx, op;
   AFBEGIN;
 
   /* Special forms: if/fn/quote/quasiquote/assign */
@@ -1025,25 +2089,59 @@ static AFFDEF(compile_list)
 	    AV(cont));
   }
 
-  /* expand all ssyntax within the expression if it isn't a special form */
-  WV(expr, CNIL);
-  WV(xs, AV(nexpr));
-  while (!NIL_P(AV(xs))) {
-    value result = CNIL;
+  /* expand all ssyntax within the expression if it isn't a special form.
+     An expression without any is kept as it is, so that a macro form
+     can be found in the expansion cache again. */
+  for (folded = AV(nexpr); CONS_P(folded); folded = cdr(folded)) {
+    if (SYMBOL_P(car(folded))
+	&& (__arc_symflags(c, car(folded)) & SYMF_SSYNTAX))
+      break;
+  }
+  if (NIL_P(folded)) {
+    WV(expr, AV(nexpr));
+  } else {
+    WV(expr, CNIL);
+    WV(xs, AV(nexpr));
+    while (!NIL_P(AV(xs))) {
+      value result = CNIL;
+
+      if (SYMBOL_P(car(AV(xs)))
+	  && (__arc_symflags(c, car(AV(xs))) & SYMF_SSYNTAX)) {
+	AFCALL(arc_mkaff(c, arc_ssexpand, CNIL), car(AV(xs)));
+	result = AFCRV;
+      }
+      if (NIL_P(result))
+	result = car(AV(xs));
+      WV(expr, cons(c, result, AV(expr)));
+      WV(xs, cdr(AV(xs)));
+    }
+    WV(expr, arc_list_reverse(c, AV(expr)));
+  }
 
-    if (SYMBOL_P(car(AV(xs)))) {
-      AFCALL(arc_mkaff(c, arc_ssexpand, CNIL), car(AV(xs)));
-      result = AFCRV;
+  /* Constant expressions are compiled as their values */
+  folded = constfold(c, AV(expr), AV(env));
+  if (folded != CUNBOUND)
+    ARETURN(compile_literal(c, folded, AV(ctx), AV(cont)));
+
+  /* (car r) and (no r) of a rest parameter r read the arguments where
+     they are, without a list being made of them */
+  if (CONS_P(cdr(AV(expr))) && NIL_P(cddr(AV(expr)))
+      && rest_var(c, cadr(AV(expr)), AV(env), &level, &idx)) {
+    op = -1;
+    if (inline_func(c, car(AV(expr)), AV(env)) == inline_car)
+      op = IREST_CAR;
+    else if (car(AV(expr)) == ARC_BUILTIN(c, S_NO)
+	     && fold_op(c, car(AV(expr)), AV(env)))
+      op = IREST_NO;
+    if (op >= 0) {
+      arc_emit3(c, AV(ctx), irest, INT2FIX(level), INT2FIX(idx),
+		INT2FIX(op), get_lineno(c, AV(expr)));
+      ARETURN(compile_continuation(c, AV(ctx), AV(cont)));
     }
-    if (NIL_P(result))
-      result = car(AV(xs));
-    WV(expr, cons(c, result, AV(expr)));
-    WV(xs, cdr(AV(xs)));
   }
-  WV(expr, arc_list_reverse(c, AV(expr)));
 
-  /* Inline functions (cons, car, cdr, +, -, *, /) */
-  if ((fun = inline_func(c, car(AV(expr)))) != NULL) {
+  /* Inline functions (cons, car, cdr, +, -, *, /, <, >) */
+  if ((fun = inline_func(c, car(AV(expr)), AV(env))) != NULL) {
     AFTCALL(arc_mkaff(c, fun, CNIL), AV(expr), AV(ctx), AV(env), AV(cont));
   }
 
@@ -1067,6 +2165,14 @@ static AFFDEF(compile_list)
 	    AV(env), AV(cont));
   }
 
+  /* ((fn () ...)) */
+  if (CONS_P(car(AV(expr))) && car(car(AV(expr))) == ARC_BUILTIN(c, S_FN)
+      && CONS_P(cdr(car(AV(expr)))) && NIL_P(cadr(car(AV(expr))))
+      && NIL_P(cdr(AV(expr)))) {
+    AFTCALL(arc_mkaff(c, compile_block, CNIL), AV(expr), AV(ctx),
+	    AV(env), AV(cont));
+  }
+
   /* andf in a functional position */
   if (CONS_P(car(AV(expr))) && car(car(AV(expr))) == ARC_BUILTIN(c, S_ANDF)) {
     AFTCALL(arc_mkaff(c, compile_andf, CNIL), AV(expr), AV(ctx),
@@ -1096,6 +2202,8 @@ AFFDEF(arc_compile)
   }
 
   if (SYMBOL_P(AV(expr))) {
+    if (!(__arc_symflags(c, AV(expr)) & SYMF_SSYNTAX))
+      ARETURN(compile_ident(c, AV(expr), AV(ctx), AV(env), AV(cont)));
     AFCALL(arc_mkaff(c, arc_ssexpand, CNIL), AV(expr));
     WV(ssx, AFCRV);
     if (NIL_P(AV(ssx))) {
@@ -1136,15 +2244,41 @@ AFFEND
 #define UNIQ_START_VAL 2874
 #define UNIQ_PREFIX 'g'
 
+static unsigned long long uniqnum = UNIQ_START_VAL;
+
 value arc_uniq(arc *c)
 {
-  static unsigned long long uniqnum = UNIQ_START_VAL;
   char buffer[1024];
 
   snprintf(buffer, sizeof(buffer)/sizeof(char), "g%llu", uniqnum++);
   return(arc_intern_cstr(c, buffer));
 }
 
+/* Make sure that arc_uniq never generates sym in future.  This is used
+   when code containing symbols generated by arc_uniq in some earlier
+   session is loaded. */
+void __arc_uniq_reserve(arc *c, value sym)
+{
+  value name;
+  unsigned long long n;
+  int i, len;
+  Rune r;
+
+  name = arc_sym2name(c, sym);
+  len = arc_strlen(c, name);
+  if (len < 2 || arc_strindex(c, name, 0) != UNIQ_PREFIX)
+    return;
+  n = 0;
+  for (i=1; i<len; i++) {
+    r = arc_strindex(c, name, i);
+    if (r < '0' || r > '9')
+      return;
+    n = n*10 + (r - '0');
+  }
+  if (n >= uniqnum)
+    uniqnum = n + 1;
+}
+
 /* What we do here is store the line number hash inside a continuation
    mark named lndata.  This use of dynamic-wind ensures that the
    continuation mark gets cleared should the compilation end for
@@ -1182,12 +2316,13 @@ static AFFDEF(afterthunk)
 }
 AFFEND
 
-AFFDEF(arc_eval)
+/* Compile expr as a top-level expression, returning the T_CODE object
+   produced. */
+AFFDEF(arc_eval_compile)
 {
   AARG(expr);
   AOARG(lndata);
   AVAR(ctx);
-  value code, clos;
   AFBEGIN;
   (void)expr;
   __arc_reset_lineno(c, AV(lndata));
@@ -1201,8 +2336,19 @@ AFFDEF(arc_eval)
   /*
   AFCALL(arc_mkaff(c, arc_compile, CNIL), AV(expr), AV(ctx), CNIL, CTRUE);
   */
-  code = arc_cctx2code(c, AV(ctx));
-  clos = arc_mkclos(c, code, CNIL);
+  ARETURN(arc_cctx2code(c, AV(ctx)));
+  AFEND;
+}
+AFFEND
+
+AFFDEF(arc_eval)
+{
+  AARG(expr);
+  AOARG(lndata);
+  value clos;
+  AFBEGIN;
+  AFCALL(arc_mkaff(c, arc_eval_compile, CNIL), AV(expr), AV(lndata));
+  clos = arc_mkclos(c, AFCRV, CNIL);
   return(__arc_affapply(c, thr, CNIL, clos, CLASTARG));
   AFEND;
 }
@@ -27,11 +27,25 @@ extern int arc_ssexpand(arc *c, value thr);
 /* The compiler */
 extern int arc_compile(arc *c, value thr);
 extern int arc_eval(arc *c, value thr);
+extern int arc_eval_compile(arc *c, value thr);
 extern int arc_quasiquote(arc *c, value thr);
+extern void __arc_inline_invalidate(arc *c, value name);
+extern void __arc_inline_reset(arc *c, value code);
+extern int __arc_compile_assumes(arc *c);
 
 /* Macros */
 extern int arc_macex(arc *c, value thr);
 extern int arc_macex1(arc *c, value thr);
 extern value arc_uniq(arc *c);
+extern void __arc_macex_flush(arc *c);
+extern void __arc_macex_rebind(arc *c, value sym, value binding);
+extern void __arc_uniq_reserve(arc *c, value sym);
+
+/* Precompiled code files */
+extern unsigned long arc_arcc_deps(arc *c);
+extern value arc_arcc_read(arc *c, const char *arcfile, const char *arccfile,
+			   unsigned long deps);
+extern int arc_arcc_write(arc *c, const char *arccfile, value codes,
+			  unsigned long deps);
 
 #endif
@@ -130,6 +130,42 @@ void __arc_update_cont_envs(arc *c, value thr, value oldenv, value nenv)
   }
 }
 
+/* Get the function and code offset saved by a continuation, and
+   return the continuation it in turn saved. */
+value __arc_cont_frame(arc *c, value thr, value cont, value *fun, int *ofs)
+{
+  value *sp;
+
+  if (TYPE(cont) == T_FIXNUM) {
+    sp = TSBASE(thr) + FIX2INT(cont);
+    *fun = *(sp + 3);
+    *ofs = FIX2INT(*(sp + 5));
+    return(*(sp + 1));
+  }
+  *fun = CONT_FUN(cont);
+  *ofs = FIX2INT(CONT_OFS(cont));
+  return(CONT_CONT(cont));
+}
+
+/* Find the innermost continuation in the continuation register whose
+   saved function is fun.  Returns nil if there is no such continuation,
+   i.e. the function application that made it has already returned. */
+value __arc_findcont(arc *c, value thr, value fun)
+{
+  value cont, *sp;
+
+  for (cont=TCONR(thr); !NIL_P(cont); cont = nextcont(c, thr, cont)) {
+    if (TYPE(cont) == T_FIXNUM) {
+      sp = TSBASE(thr) + FIX2INT(cont);
+      if (*(sp + 3) == fun)
+	return(cont);
+    } else if (CONT_FUN(cont) == fun) {
+      return(cont);
+    }
+  }
+  return(CNIL);
+}
+
 /* Move a single continuation to the heap.  This will move any environments
    referenced by the continuation to the heap as well. */
 static value heap_cont(arc *c, value thr, value cont)
@@ -161,24 +197,30 @@ static value heap_cont(arc *c, value thr, value cont)
   return(ncont);
 }
 
-/* Move a continuation and all its parent continuations into the heap. */
+/* Move a continuation and all its parent continuations into the heap.
+   Each continuation moved is linked to the heap copy of its parent, so
+   that none of them are left referring to the stack, which may be
+   reused once they are. */
 value __arc_cont2heap(arc *c, value thr, value cont)
 {
-  value ncont = cont, oldcont;
+  value ncont, prev = CNIL, first = CNIL;
 
   /* Do nothing if the continuation is already on the heap */
   if (TYPE(cont) == T_CONT || NIL_P(cont))
     return(cont);
 
-  cont = CNIL;
-  do {
-    oldcont = ncont;
-    ncont = heap_cont(c, thr, oldcont);
-    if (NIL_P(cont))
-      cont = ncont;
-    ncont = nextcont(c, thr, ncont);
-  } while (!NIL_P(ncont));
-  return(cont);
+  while (!NIL_P(cont) && TYPE(cont) != T_CONT) {
+    ncont = heap_cont(c, thr, cont);
+    if (NIL_P(prev)) {
+      first = ncont;
+    } else {
+      __arc_wb(CONT_CONT(prev), ncont);
+      CONT_CONT(prev) = ncont;
+    }
+    prev = ncont;
+    cont = CONT_CONT(ncont);
+  }
+  return(first);
 }
 
 #if 0
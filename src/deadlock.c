@@ -0,0 +1,429 @@
+/*
+  Copyright (C) 2013 Rafael R. Sevilla
+
+  This file is part of Arcueid
+
+  Arcueid is free software: you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this library. If not, see <http://www.gnu.org/licenses/>
+*/
+
+/* The deadlock detector.  A thread waiting on a channel, with no
+   timeout, can only be woken by another thread using the channel, so
+   the threads form a wait-for graph, with an edge from each waiting
+   thread to each thread it waits for.  A thread which is running,
+   ready, asleep, or waiting on I/O might yet run, and so might any
+   thread which waits for such a thread.  The threads left over can
+   never run again: they are deadlocked.
+
+   Channels have no owners, so the thread waited for is taken to be
+   the one which last used the channel from the other side, e.g. the
+   last thread to send to a channel for a thread waiting to receive
+   from it.  The return value channel of a thread is always sent to by
+   that thread, which makes join-thread exact.  A thread waiting on a
+   channel which no other thread still running has used might be woken
+   by any thread at all, and is counted as waiting for all of them.
+   When a channel has several senders, the graph may show a thread as
+   deadlocked which another sender would still wake, so what is found
+   should be taken as a diagnosis, not a proof.
+
+   The watchdog runs the detector from the dispatcher about once a
+   second, and when the dispatcher finds that nothing more can run,
+   and writes what it finds to stderr. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arcueid.h"
+#include "vmengine.h"
+#include "arith.h"
+#include "builtins.h"
+#include "osdep.h"
+#include "hash.h"
+#include "../config.h"
+
+#ifdef HAVE_ALLOCA_H
+# include <alloca.h>
+#elif defined __GNUC__
+#ifndef alloca
+# define alloca __builtin_alloca
+#endif
+#elif defined _AIX
+# define alloca __alloca
+#elif defined _MSC_VER
+# include <malloc.h>
+# define alloca _alloca
+#else
+# include <stddef.h>
+void *alloca (size_t);
+#endif
+
+/* Microseconds between checks by the watchdog */
+#define WATCHDOG_INTERVAL 1000000LL
+
+/* What the watchdog has reported a wait as, from least to most
+   serious */
+enum { REP_NONE=0, REP_STALLED, REP_DEADLOCK };
+
+/* A thread in the wait-for graph */
+struct wfnode {
+  value thr;
+  int tid;
+  int waiting;			/* waits on a channel with no timeout */
+  int live;			/* might yet run */
+  int anyone;			/* might be woken by any thread */
+  int nedges;
+  int *edges;			/* the threads it waits for */
+  int walk;			/* the walk which visited it */
+  int incycle;			/* is on a cycle of deadlocked threads */
+};
+
+static int node_cmp(const void *a, const void *b)
+{
+  return(((const struct wfnode *)a)->tid - ((const struct wfnode *)b)->tid);
+}
+
+static int find_node(struct wfnode *nodes, int n, value tid)
+{
+  int lo = 0, hi = n - 1, mid;
+
+  while (lo <= hi) {
+    mid = (lo + hi) / 2;
+    if (nodes[mid].tid == FIX2INT(tid))
+      return(mid);
+    if (nodes[mid].tid < FIX2INT(tid))
+      lo = mid + 1;
+    else
+      hi = mid - 1;
+  }
+  return(-1);
+}
+
+/* Add an edge from node i to the thread last on the other side of
+   chan */
+static void add_edge(arc *c, struct wfnode *nodes, int n, int i, value chan,
+		     int send)
+{
+  value tid;
+  int j;
+
+  tid = __arc_chan_peer(c, chan, send);
+  j = (NIL_P(tid)) ? -1 : find_node(nodes, n, tid);
+  if (j < 0 || j == i) {
+    nodes[i].anyone = 1;
+    return;
+  }
+  nodes[i].edges[nodes[i].nedges++] = j;
+}
+
+/* Build the wait-for graph of all threads not yet released */
+static int build_graph(arc *c, struct wfnode **nodesp)
+{
+  struct wfnode *nodes;
+  value key, val, alt;
+  int n = 0, i, nalts;
+
+  i = 0;
+  while (__arc_hash_next(c, c->allthreads, &i, &key, &val))
+    n++;
+  nodes = (struct wfnode *)calloc((n > 0) ? n : 1, sizeof(struct wfnode));
+  i = 0;
+  n = 0;
+  while (__arc_hash_next(c, c->allthreads, &i, &key, &val)) {
+    nodes[n].thr = val;
+    nodes[n++].tid = TTID(val);
+  }
+  qsort(nodes, n, sizeof(struct wfnode), node_cmp);
+
+  for (i=0; i<n; i++) {
+    val = nodes[i].thr;
+    nodes[i].walk = -1;
+    switch (TSTATE(val)) {
+    case Trecv:
+    case Tsend:
+      if (TYPE(TWAITON(val)) != T_CHAN)
+	break;
+      nodes[i].waiting = 1;
+      nodes[i].edges = (int *)malloc(sizeof(int));
+      add_edge(c, nodes, n, i, TWAITON(val), TSTATE(val) == Tsend);
+      break;
+    case Talt:
+      if (TWAKEUP(val) != 0LL) {
+	/* it will time out */
+	nodes[i].live = 1;
+	break;
+      }
+      nodes[i].waiting = 1;
+      nalts = 0;
+      for (alt = TWAITON(val); TYPE(alt) == T_CONS; alt = cdr(alt))
+	nalts++;
+      nodes[i].edges = (int *)malloc(sizeof(int) * (nalts + 1));
+      for (alt = TWAITON(val); TYPE(alt) == T_CONS; alt = cdr(alt)) {
+	if (TYPE(car(alt)) == T_CONS)
+	  add_edge(c, nodes, n, i, car(car(alt)), 1);
+	else
+	  add_edge(c, nodes, n, i, car(alt), 0);
+      }
+      break;
+    case Trelease:
+    case Tbroken:
+      break;
+    default:
+      nodes[i].live = 1;
+      break;
+    }
+  }
+  *nodesp = nodes;
+  return(n);
+}
+
+static void free_graph(struct wfnode *nodes, int n)
+{
+  int i;
+
+  for (i=0; i<n; i++)
+    free(nodes[i].edges);
+  free(nodes);
+}
+
+/* Find which of the waiting threads might yet run */
+static void find_live(struct wfnode *nodes, int n)
+{
+  int i, j, anylive = 0, changed;
+
+  for (i=0; i<n; i++)
+    anylive |= nodes[i].live;
+  /* When nothing runs, nothing can wake a thread waiting for anyone */
+  for (i=0; i<n; i++) {
+    if (anylive && nodes[i].waiting && nodes[i].anyone)
+      nodes[i].live = 1;
+  }
+  do {
+    changed = 0;
+    for (i=0; i<n; i++) {
+      if (!nodes[i].waiting || nodes[i].live)
+	continue;
+      for (j=0; j<nodes[i].nedges; j++) {
+	if (nodes[nodes[i].edges[j]].live) {
+	  nodes[i].live = changed = 1;
+	  break;
+	}
+      }
+    }
+  } while (changed);
+}
+
+/* The next deadlocked thread that node i waits for, or -1 */
+static int next_deadlocked(struct wfnode *nodes, int i)
+{
+  int j;
+
+  for (j=0; j<nodes[i].nedges; j++) {
+    if (!nodes[nodes[i].edges[j]].live)
+      return(nodes[i].edges[j]);
+  }
+  return(-1);
+}
+
+/* Find the deadlocked threads and the threads that have waited on a
+   channel or on I/O for stall microseconds or more (none if stall is
+   0).  Returns a list of what was found, each of which is one of:
+
+   (cycle thr1 thr2 ...) - a cycle of deadlocked threads, each waiting
+   for the next, and the last for the first
+   (deadlock thr) - a deadlocked thread not on a cycle
+   (stalled thr) - a thread which has waited too long, but is not
+   known to be deadlocked */
+static value find_problems(arc *c, unsigned long long stall)
+{
+  struct wfnode *nodes;
+  int n, i, j, k, *path, len;
+  value problems = CNIL, cycle, thr;
+  unsigned long long now;
+
+  n = build_graph(c, &nodes);
+  find_live(nodes, n);
+  path = (int *)malloc(sizeof(int) * ((n > 0) ? n : 1));
+
+  /* Follow each deadlocked thread to what it waits for, until the walk
+     comes back to a thread on it, making a cycle, or comes to a thread
+     an earlier walk has been to. */
+  for (i=0; i<n; i++) {
+    if (!nodes[i].waiting || nodes[i].live || nodes[i].walk >= 0)
+      continue;
+    len = 0;
+    for (j=i; j >= 0 && nodes[j].walk < 0; j = next_deadlocked(nodes, j)) {
+      nodes[j].walk = i;
+      path[len++] = j;
+    }
+    if (j >= 0 && nodes[j].walk == i) {
+      for (k=0; path[k] != j; k++)
+	;
+      cycle = CNIL;
+      for (len--; len >= k; len--) {
+	nodes[path[len]].incycle = 1;
+	cycle = cons(c, nodes[path[len]].thr, cycle);
+      }
+      problems = cons(c, cons(c, arc_intern_cstr(c, "cycle"), cycle),
+		      problems);
+    }
+  }
+  /* The ones left are deadlocked waiting for a cycle, or for no one */
+  for (i=0; i<n; i++) {
+    if (nodes[i].waiting && !nodes[i].live && !nodes[i].incycle)
+      problems = cons(c, cons(c, arc_intern_cstr(c, "deadlock"),
+			      cons(c, nodes[i].thr, CNIL)), problems);
+  }
+
+  now = __arc_usec();
+  for (i=0; stall > 0 && i<n; i++) {
+    thr = nodes[i].thr;
+    if ((nodes[i].waiting && !nodes[i].live)
+	|| !(TSTATE(thr) == Trecv || TSTATE(thr) == Tsend
+	     || TSTATE(thr) == Talt || TSTATE(thr) == Tiowait))
+      continue;
+    if (now > TWAITSINCE(thr) && now - TWAITSINCE(thr) >= stall)
+      problems = cons(c, cons(c, arc_intern_cstr(c, "stalled"),
+			      cons(c, thr, CNIL)), problems);
+  }
+  free(path);
+  free_graph(nodes, n);
+  return(arc_list_reverse(c, problems));
+}
+
+/* (deadlocks [secs]) finds the threads which are deadlocked, and if
+   secs is given, the threads which have waited on a channel or for
+   I/O for at least secs seconds.  See find_problems for what it
+   returns. */
+AFFDEF(arc_deadlocks)
+{
+  AOARG(secs);
+  AFBEGIN;
+  if (!BOUND_P(AV(secs)) || NIL_P(AV(secs)))
+    ARETURN(find_problems(c, 0LL));
+  AFCALL(arc_mkaff(c, arc_coerce, CNIL), AV(secs), ARC_BUILTIN(c, S_FLONUM));
+  if (REPFLO(AFCRV) <= 0.0) {
+    arc_err_cstrfmt(c, "deadlocks: time must be positive");
+    ARETURN(CNIL);
+  }
+  ARETURN(find_problems(c, (unsigned long long)(REPFLO(AFCRV)*1e6)));
+  AFEND;
+}
+AFFEND
+
+/* The call stack of a thread, innermost function first */
+value arc_thread_backtrace(arc *c, value thr)
+{
+  TYPECHECK(thr, T_THREAD);
+  if (TSTATE(thr) == Trelease || TSTATE(thr) == Tbroken)
+    return(CNIL);
+  return(__arc_backtrace(c, thr));
+}
+
+static const char *wait_name(value thr)
+{
+  switch (TSTATE(thr)) {
+  case Trecv:
+    return("receiving");
+  case Tsend:
+    return("sending");
+  case Talt:
+    return("in alt");
+  case Tiowait:
+    return("waiting on I/O");
+  default:
+    return("running");
+  }
+}
+
+static void report_thread(arc *c, value thr, int kind)
+{
+  value bt;
+  char *cstr;
+
+  fprintf(stderr, "  thread %d, %s for %llu seconds\n", TTID(thr),
+	  wait_name(thr), (__arc_usec() - TWAITSINCE(thr)) / 1000000LL);
+  for (bt = __arc_backtrace(c, thr); !NIL_P(bt); bt = cdr(bt)) {
+    cstr = alloca(sizeof(char)*(FIX2INT(arc_strutflen(c, car(bt))) + 1));
+    arc_str2cstr(c, car(bt), cstr);
+    fprintf(stderr, "    %s\n", cstr);
+  }
+  TREPORTED(thr) = TWAITSINCE(thr);
+  TREPKIND(thr) = kind;
+}
+
+/* Check for deadlocked and stalled threads, writing what is found to
+   stderr.  Each wait of a thread is reported only once, unless a wait
+   reported as stalled is later found to be a deadlock.  Unless force
+   is true, this does nothing if the watchdog is off, or has checked
+   too recently. */
+void __arc_watchdog(arc *c, int force)
+{
+  value problems, p, thrs;
+  unsigned long long now;
+  int new, kind;
+
+  if (!c->watchdog)
+    return;
+  now = __arc_usec();
+  if (!force && now - c->wdchecked < WATCHDOG_INTERVAL)
+    return;
+  c->wdchecked = now;
+  problems = find_problems(c, c->wdstall);
+  for (p = problems; !NIL_P(p); p = cdr(p)) {
+    kind = (car(car(p)) == arc_intern_cstr(c, "stalled"))
+      ? REP_STALLED : REP_DEADLOCK;
+    new = 0;
+    for (thrs = cdr(car(p)); !NIL_P(thrs); thrs = cdr(thrs)) {
+      new |= (TREPORTED(car(thrs)) != TWAITSINCE(car(thrs))
+	      || TREPKIND(car(thrs)) < kind);
+    }
+    if (!new)
+      continue;
+    if (car(car(p)) == arc_intern_cstr(c, "cycle"))
+      fprintf(stderr, "arcueid: deadlock: threads each waiting for the "
+	      "next, and the last for the first\n");
+    else if (car(car(p)) == arc_intern_cstr(c, "deadlock"))
+      fprintf(stderr, "arcueid: deadlock: thread can never be woken\n");
+    else
+      fprintf(stderr, "arcueid: stalled thread\n");
+    for (thrs = cdr(car(p)); !NIL_P(thrs); thrs = cdr(thrs))
+      report_thread(c, car(thrs), kind);
+  }
+}
+
+/* (deadlock-watchdog secs) turns the watchdog on, to report deadlocked
+   threads, and threads which have waited on a channel or for I/O for
+   secs seconds or more.  (deadlock-watchdog t) turns it on to report
+   only deadlocked threads, and (deadlock-watchdog nil) turns it off. */
+AFFDEF(arc_deadlock_watchdog)
+{
+  AARG(secs);
+  AFBEGIN;
+  if (NIL_P(AV(secs))) {
+    c->watchdog = 0;
+    ARETURN(CNIL);
+  }
+  c->wdstall = 0LL;
+  if (AV(secs) != CTRUE) {
+    AFCALL(arc_mkaff(c, arc_coerce, CNIL), AV(secs), ARC_BUILTIN(c, S_FLONUM));
+    if (REPFLO(AFCRV) <= 0.0) {
+      arc_err_cstrfmt(c, "deadlock-watchdog: time must be positive");
+      ARETURN(CNIL);
+    }
+    c->wdstall = (unsigned long long)(REPFLO(AFCRV)*1e6);
+  }
+  c->watchdog = 1;
+  c->wdchecked = __arc_usec();
+  ARETURN(AV(secs));
+  AFEND;
+}
+AFFEND
@@ -54,34 +54,39 @@ void *alloca (size_t);
 
 #define DIR_SEP '/'
 
-value arc_dir(arc *c, value dirname)
+/* Jobs for the I/O pool */
+
+/* List the directory named in data.  The names are left in ptr, one
+   after the other, each terminated by a null, with res the total
+   length.  If the directory could not be opened, res is -1, and if it
+   could not be read, -2. */
+static void dir_job(struct iojob *job)
 {
-  char *utf_filename;
   DIR *dirp;
-  int en;
-  value dirlist;
   struct dirent *entry, *result;
   int delen;
+  size_t len, size, nlen;
+  char *names;
 
-  TYPECHECK(dirname, T_STRING);
-  utf_filename = alloca(FIX2INT(arc_strutflen(c, dirname)) + 1);
-  arc_str2cstr(c, dirname, utf_filename);
-  dirp = opendir(utf_filename);
+  dirp = opendir(job->data);
   if (dirp == NULL) {
-    en = errno;
-    arc_err_cstrfmt(c, "dir: cannot open directory \"%s\", (%s; errno=%d)", utf_filename, strerror(en), en);
-    return(CNIL);
+    job->err = errno;
+    job->res = -1;
+    return;
   }
-  dirlist = CNIL;
   delen = offsetof(struct dirent, d_name)
-    + pathconf(utf_filename, _PC_NAME_MAX) + 1;
+    + pathconf(job->data, _PC_NAME_MAX) + 1;
   entry = (struct dirent *)alloca(delen);
+  names = NULL;
+  len = size = 0;
   for (;;) {
     if (readdir_r(dirp, entry, &result) != 0) {
       /* error */
-      en = errno;
-      arc_err_cstrfmt(c, "dir: error reading directory \"%s\", (%s; errno=%d)", utf_filename, strerror(en), en);
-      return(CNIL);
+      job->err = errno;
+      job->res = -2;
+      free(names);
+      closedir(dirp);
+      return;
     }
     /* end of list */
     if (result == NULL)
@@ -89,43 +94,123 @@ value arc_dir(arc *c, value dirname)
     /* ignore the . and .. directories */
     if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
       continue;
-    dirlist = cons(c, arc_mkstringc(c, entry->d_name), dirlist);
+    nlen = strlen(entry->d_name) + 1;
+    if (len + nlen > size) {
+      size = (size == 0) ? 256 : size;
+      while (len + nlen > size)
+	size *= 2;
+      names = (char *)realloc(names, size);
+    }
+    memcpy(names + len, entry->d_name, nlen);
+    len += nlen;
   }
   closedir(dirp);
-  return(dirlist);
+  job->ptr = names;
+  job->res = len;
 }
 
-value arc_dir_exists(arc *c, value dirname)
+static void dir_discard(struct iojob *job)
+{
+  free(job->ptr);
+}
+
+/* Find out whether the path named in data exists, and if it does,
+   whether it is a directory: res is -1 if it does not exist, 1 if it
+   is a directory, and 0 otherwise. */
+static void stat_job(struct iojob *job)
 {
-  char *utf_filename;
   struct stat st;
 
-  TYPECHECK(dirname, T_STRING);
-  utf_filename = alloca(FIX2INT(arc_strutflen(c, dirname)) + 1);
-  arc_str2cstr(c, dirname, utf_filename);
-  if (stat(utf_filename, &st) == -1) {
-    return(CNIL);
+  if (stat(job->data, &st) == -1)
+    job->res = -1;
+  else
+    job->res = (S_ISDIR(st.st_mode)) ? 1 : 0;
+}
+
+/* Make a job to do fn to the path name */
+static struct iojob *pathjob(arc *c, void (*fn)(struct iojob *), value name)
+{
+  return(__arc_mkiojob(c, fn, NULL, CNIL,
+		       FIX2INT(arc_strutflen(c, name)) + 1));
+}
+
+AFFDEF(arc_dir)
+{
+  AARG(dirname);
+  struct iojob *job;
+  value dirlist;
+  long i;
+  AFBEGIN;
+
+  if (TYPE(AV(dirname)) != T_STRING) {
+    arc_err_cstrfmt(c, "dir: expected argument to be a string");
+    ARETURN(CNIL);
   }
-  if (S_ISDIR(st.st_mode))
-    return(dirname);
-  return(CNIL);
+  job = pathjob(c, dir_job, AV(dirname));
+  job->discard = dir_discard;
+  arc_str2cstr(c, AV(dirname), job->data);
+  AIOJOB(job);
+  job = __arc_iojob_finish(c, thr);
+  if (job->res < 0) {
+    arc_err_cstrfmt(c, "dir: %s directory \"%s\", (%s; errno=%d)",
+		    (job->res == -1) ? "cannot open" : "error reading",
+		    job->data, strerror(job->err), job->err);
+    free(job);
+    ARETURN(CNIL);
+  }
+  dirlist = CNIL;
+  for (i=0; i<job->res; i += strlen((char *)job->ptr + i) + 1)
+    dirlist = cons(c, arc_mkstringc(c, (char *)job->ptr + i), dirlist);
+  free(job->ptr);
+  free(job);
+  ARETURN(dirlist);
+  AFEND;
 }
+AFFEND
 
-value arc_file_exists(arc *c, value filename)
+/* Common code for dir-exists and file-exists, with isdir the result
+   of the stat job which makes the file name returned */
+static AFFDEF(stat_exists)
 {
-  char *utf_filename;
-  struct stat st;
+  AARG(name, isdir);
+  struct iojob *job;
+  AFBEGIN;
 
-  TYPECHECK(filename, T_STRING);
-  utf_filename = alloca(FIX2INT(arc_strutflen(c, filename)) + 1);
-  arc_str2cstr(c, filename, utf_filename);
-  if (stat(utf_filename, &st) == -1) {
-    return(CNIL);
+  if (TYPE(AV(name)) != T_STRING) {
+    arc_err_cstrfmt(c, "expected argument to be a string");
+    ARETURN(CNIL);
   }
-  if (!S_ISDIR(st.st_mode))
-    return(filename);
-  return(CNIL);
+  job = pathjob(c, stat_job, AV(name));
+  arc_str2cstr(c, AV(name), job->data);
+  AIOJOB(job);
+  job = __arc_iojob_finish(c, thr);
+  if (job->res == FIX2INT(AV(isdir))) {
+    free(job);
+    ARETURN(AV(name));
+  }
+  free(job);
+  ARETURN(CNIL);
+  AFEND;
 }
+AFFEND
+
+AFFDEF(arc_dir_exists)
+{
+  AARG(dirname);
+  AFBEGIN;
+  AFTCALL(arc_mkaff(c, stat_exists, CNIL), AV(dirname), INT2FIX(1));
+  AFEND;
+}
+AFFEND
+
+AFFDEF(arc_file_exists)
+{
+  AARG(filename);
+  AFBEGIN;
+  AFTCALL(arc_mkaff(c, stat_exists, CNIL), AV(filename), INT2FIX(0));
+  AFEND;
+}
+AFFEND
 
 value arc_rmfile(arc *c, value filename)
 {
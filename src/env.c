@@ -200,6 +200,32 @@ void __arc_menv(arc *c, value thr, int n)
   SENVR(thr, parentenv);
 }
 
+/* Rebind the current environment to the n values on top of the stack,
+   for a function that loops back to its own beginning instead of
+   calling itself.  A stack environment is simply overwritten.  An
+   environment that has been moved to the heap may have been captured
+   by closures made in the previous iteration, so a fresh one with the
+   same parent is made instead. */
+void __arc_loopenv(arc *c, value thr, int n)
+{
+  value henv;
+  int i;
+
+  if (n == 0)
+    return;
+
+  if (TYPE(TENVR(thr)) == T_ENV) {
+    for (i=n-1; i>=0; i--)
+      __arc_putenv(c, thr, 0, i, CPOP(thr));
+    return;
+  }
+  henv = VENV_CREATE(c, VECLEN(TENVR(thr)) - 1);
+  for (i=n-1; i>=0; i--)
+    VENV_INDEX(henv, i) = CPOP(thr);
+  SVENV_NEXT(henv, VENV_NEXT(TENVR(thr)));
+  SENVR(thr, henv);
+}
+
 /* Convert a single stack environment into a heap-based environment */
 static value heap_env(arc *c, value thr, value env)
 {
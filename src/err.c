@@ -38,93 +38,51 @@ void *alloca (size_t);
 
 /*
   (def on-err (handler thunk)
-    (ccc (fn (cont)
-            (let old nil
-               (dynamic-wind (fn () (= old *exh)
-                                    (= *exh (cons cont handler)))
-	                     thunk
-                             (fn () (= *exh old))))))
+    (ecc (fn (cont)
+            (let old *exh
+               (= *exh (cons cont handler))
+               (after (thunk) (= *exh old))))))
 
   ;; not counting the cases where *exh is empty
   (def err (exc)
      (let (cont . handler) *exh
         (cont (handler exc))))
 
+  The continuation used is an escape continuation (see __arc_mkecont),
+  as the continuation saved in *exh is only ever used to escape back
+  to on-err.  This makes on-err cheap, as no continuations or
+  environments need to be moved to the heap.  Invoking the escape
+  continuation also restores *exh to its old value, so the dynamic-wind
+  that would otherwise be needed to do this is also unnecessary.
  */
-
-/* For the following two functions, the environment layout is as follows:
-
-   __arc_getenv(c, 1, 0) -> cont from ccchandler
-   __arc_getenv(c, 1, 1) -> old from ccchandler
-   __arc_getenv(c, 2, 0) -> handler from arc_on_err
-   __arc_getenv(c, 2, 1) -> thunk from arc_on_err
- */
-static AFFDEF(savetexh)
+static AFFDEF(on_err_frame)
 {
-  value nexh;
+  AARG(handler, thunk);
+  AVAR(old);
+  value ret, nexh;
   AFBEGIN;
-  /* (= old *exh) */
-  __arc_putenv(c, thr, 1, 1, TEXH(thr));
-  /* (= *exh (cons cont handler)) */
-  nexh = cons(c, __arc_getenv(c, thr, 1, 0), __arc_getenv(c, thr, 2, 0));
+  WV(old, TEXH(thr));
+  nexh = cons(c, __arc_mkecont(c, thr, TFUNR(thr)), AV(handler));
   __arc_wb(TEXH(thr), nexh);
   TEXH(thr) = nexh;
+  AFCALL2(AV(thunk), CNIL);
+  __arc_wb(TEXH(thr), AV(old));
+  TEXH(thr) = AV(old);
+  ret = AFCRV;
+  if (TYPE(ret) != T_EXCEPTION)
+    ARETURN(ret);
+  AFTCALL(AV(handler), ret);
   AFEND;
 }
 AFFEND
 
-static AFFDEF(restoretexh)
-{
-  value old;
-  AFBEGIN;
-  /* (= *exh old) */
-  old = __arc_getenv(c, thr, 1, 1);
-  __arc_wb(TEXH(thr), old);
-  TEXH(thr) = old;
-  AFEND;
-}
-AFFEND
-
-/* Environment layout is as follows:
-
-   __arc_getenv(c, 0, 0) -> cont from ccchandler
-   __arc_getenv(c, 0, 1) -> old from ccchandler
-   __arc_getenv(c, 1, 0) -> handler from arc_on_err
-   __arc_getenv(c, 1, 1) -> thunk from arc_on_err
- */
-static AFFDEF(ccchandler)
-{
-  AARG(cont);
-  AVAR(old);
-  AFBEGIN;
-  (void)old;
-  (void)cont;
-  SENVR(thr, __arc_env2heap(c, thr, TENVR(thr)));
-  /* (dynamic-wind ... thunk ...) */
-  AFTCALL(arc_mkaff(c, arc_dynamic_wind, CNIL),
-	  arc_mkaff2(c, savetexh, CNIL, TENVR(thr)),
-	  __arc_getenv(c, thr, 1, 1), /* thunk from arc_on_err */
-	  arc_mkaff2(c, restoretexh, CNIL, TENVR(thr)));
-  AFEND;
-}
-AFFEND
-
+/* Each call gets a fresh frame, as with arc_callec, so that the escape
+   continuation of one on-err can never be taken for another's. */
 AFFDEF(arc_on_err)
 {
   AARG(handler, thunk);
-  value ret;
   AFBEGIN;
-  /* Silence error messages about them being unused.  They are used
-     indirectly. */
-  (void)handler;
-  (void)thunk;
-  SENVR(thr, __arc_env2heap(c, thr, TENVR(thr)));
-  AFCALL(arc_mkaff(c, arc_callcc, CNIL), arc_mkaff2(c, ccchandler, CNIL,
-						    TENVR(thr)));
-  ret = AFCRV;
-  if (TYPE(ret) != T_EXCEPTION)
-    ARETURN(ret);
-  AFTCALL(AV(handler), ret);
+  AFTCALL(arc_mkaff(c, on_err_frame, CNIL), AV(handler), AV(thunk));
   AFEND;
 }
 AFFEND
@@ -157,6 +115,10 @@ AFFDEF(arc_err)
   AVAR(exc, cont, handler);
   AFBEGIN;
   WV(exc, arc_mkexception(c, AV(str)));
+  /* Stop recording the globals read by any macro being expanded, as
+     the expansion will not be finished in the ordinary way */
+  __arc_wb(TMACREADS(thr), CUNBOUND);
+  TMACREADS(thr) = CUNBOUND;
   if (NIL_P(TEXH(thr))) {
     /* if no exception handler is available, call the default error
        handler if one is set, and longjmp away.  The thread becomes
@@ -23,6 +23,11 @@
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#ifdef HAVE_STDIO_EXT_H
+#include <stdio_ext.h>
+#endif
 #include "arcueid.h"
 #include "builtins.h"
 #include "io.h"
@@ -50,10 +55,52 @@ static typefn_t procio_tfn;
 struct fileio_t {
   FILE *fp;
   int closed;
+  int isreg;			/* is it a regular file? */
 };
 
 #define FIODATA(fio) (IODATA(fio, struct fileio_t *))
 
+/* Jobs for the I/O pool */
+
+/* Fill the read buffer of a file */
+static void fill_job(struct iojob *job)
+{
+  int ch;
+
+  ch = getc((FILE *)job->ptr);
+  if (ch != EOF)
+    ungetc(ch, (FILE *)job->ptr);
+}
+
+static void flush_job(struct iojob *job)
+{
+  job->res = fflush((FILE *)job->ptr);
+  job->err = errno;
+}
+
+static void fclose_job(struct iojob *job)
+{
+  job->res = fclose((FILE *)job->ptr);
+}
+
+static void pclose_job(struct iojob *job)
+{
+  job->res = pclose((FILE *)job->ptr);
+}
+
+/* Open the file named in data, with the mode which follows the name */
+static void fopen_job(struct iojob *job)
+{
+  job->ptr = fopen(job->data, job->data + strlen(job->data) + 1);
+  job->err = errno;
+}
+
+static void fopen_discard(struct iojob *job)
+{
+  if (job->ptr != NULL)
+    fclose((FILE *)job->ptr);
+}
+
 static void fio_marker(arc *c, value v, int depth,
 		       void (*markfn)(arc *, value, int))
 {
@@ -107,6 +154,11 @@ static AFFDEF(fio_ready)
     ARETURN(CNIL);
 
   for (;;) {
+    /* it may have been closed while we waited */
+    if (FIODATA(AV(fio))->closed) {
+      arc_err_cstrfmt(c, "port is closed");
+      ARETURN(CNIL);
+    }
     fp = FIODATA(AV(fio))->fp;
     /* XXX - NOT PORTABLE! */
 #ifdef _IO_fpos_t
@@ -116,6 +168,15 @@ static AFFDEF(fio_ready)
 #endif
     if (check)
       ARETURN(CTRUE);
+    if (FIODATA(AV(fio))->isreg) {
+      /* A regular file is always readable, but reading it may still
+	 take a long time if the disk is slow. */
+      AIOJOB(__arc_mkiojob(c, fill_job, fp, AV(fio), 0));
+      free(__arc_iojob_finish(c, thr));
+      if (FIODATA(AV(fio))->closed)
+	continue;
+      ARETURN(CTRUE);
+    }
     /* No buffered data available. See if the underlying file descriptor
        is readable. */
     FD_ZERO(&rfds);
@@ -141,12 +202,36 @@ static AFFDEF(fio_ready)
 }
 AFFEND
 
+/* Where stdio can tell how full the write buffer of a file is, the
+   I/O pool writes it out once it is full. */
+#if defined(HAVE_STDIO_EXT_H) && defined(HAVE___FPENDING) \
+  && defined(HAVE___FBUFSIZE)
+#define FIO_WBUFFULL(fp)					\
+  (__fbufsize(fp) > 0 && __fpending(fp) >= __fbufsize(fp))
+#endif
+
 static AFFDEF(fio_wready)
 {
   AARG(fio);
+#ifdef FIO_WBUFFULL
+  FILE *fp;
+#endif
   AFBEGIN;
-  (void)fio;
-  ARETURN(CTRUE);   /* XXX - make this do something more reasonable */
+#ifdef FIO_WBUFFULL
+  fp = FIODATA(AV(fio))->fp;
+  if (FIODATA(AV(fio))->isreg && FIO_WBUFFULL(fp)) {
+    /* The write buffer is full, so the next byte would have to wait
+       for it to be written out.  Have the I/O pool do that. */
+    AIOJOB(__arc_mkiojob(c, flush_job, fp, AV(fio), 0));
+    free(__arc_iojob_finish(c, thr));
+    /* it may have been closed while we waited */
+    if (FIODATA(AV(fio))->closed) {
+      arc_err_cstrfmt(c, "port is closed");
+      ARETURN(CNIL);
+    }
+  }
+#endif
+  ARETURN(CTRUE);
   AFEND;
 }
 AFFEND
@@ -237,8 +322,10 @@ static AFFDEF(pio_close)
   AARG(fio);
   AFBEGIN;
   if (FIODATA(AV(fio))->closed == 0) {
-    pclose(FIODATA(AV(fio))->fp);
+    /* waits for the process to exit */
     FIODATA(AV(fio))->closed = 1;
+    AIOJOB(__arc_mkiojob(c, pclose_job, FIODATA(AV(fio))->fp, AV(fio), 0));
+    free(__arc_iojob_finish(c, thr));
   }
   ARETURN(CNIL);
   AFEND;
@@ -250,8 +337,10 @@ static AFFDEF(fio_close)
   AARG(fio);
   AFBEGIN;
   if (FIODATA(AV(fio))->closed == 0) {
-    fclose(FIODATA(AV(fio))->fp);
+    /* writes out anything buffered */
     FIODATA(AV(fio))->closed = 1;
+    AIOJOB(__arc_mkiojob(c, fclose_job, FIODATA(AV(fio))->fp, AV(fio), 0));
+    free(__arc_iojob_finish(c, thr));
   }
   ARETURN(CNIL);
   AFEND;
@@ -261,6 +350,7 @@ AFFEND
 static value mkfio(arc *c, int type, FILE *fd, value name)
 {
   value fio;
+  struct stat st;
 
   fio = __arc_allocio(c, type, &fileio_tfn, sizeof(struct fileio_t));
   IO(fio)->flags = 0;
@@ -268,26 +358,41 @@ static value mkfio(arc *c, int type, FILE *fd, value name)
   IO(fio)->name = name;
   FIODATA(fio)->closed = 0;
   FIODATA(fio)->fp = fd;
+  FIODATA(fio)->isreg = (fd != NULL && fstat(fileno(fd), &st) == 0
+			 && S_ISREG(st.st_mode));
   return(fio);
 }
 
-static value openfio(arc *c, int type, value filename, const char *mode)
+/* Make a job to open filename with mode */
+static struct iojob *fopenjob(arc *c, value filename, const char *mode)
 {
   int len;
-  char *cfn;
-  FILE *fp;
+  struct iojob *job;
+
+  len = FIX2INT(arc_strutflen(c, filename));
+  job = __arc_mkiojob(c, fopen_job, NULL, CNIL, len + strlen(mode) + 1);
+  job->discard = fopen_discard;
+  arc_str2cstr(c, filename, job->data);
+  strcpy(job->data + len + 1, mode);
+  return(job);
+}
 
-  len = arc_strutflen(c, filename);
-  cfn = alloca(sizeof(char)*(len+2));
-  arc_str2cstr(c, filename, cfn);
-  fp = fopen(cfn, mode);
-  if (fp == NULL) {
-    int en = errno;
+/* Make a port for the file opened by the job of thr */
+static value openfio(arc *c, value thr, int type, value filename)
+{
+  struct iojob *job;
+  value fio;
+
+  job = __arc_iojob_finish(c, thr);
+  if (job->ptr == NULL) {
     arc_err_cstrfmt(c, "error opening file %s (%s; errno=%d)",
-		    cfn, strerror(en), en);
+		    job->data, strerror(job->err), job->err);
+    free(job);
     return(CNIL);
   }
-  return(mkfio(c, type, fp, filename));
+  fio = mkfio(c, type, (FILE *)job->ptr, filename);
+  free(job);
+  return(fio);
 }
 
 AFFDEF(arc_infile)
@@ -305,7 +410,8 @@ AFFDEF(arc_infile)
     arc_err_cstrfmt(c, "infile: invalid mode");
     ARETURN(CNIL);
   }
-  ARETURN(openfio(c, T_INPORT, AV(filename), cmode));
+  AIOJOB(fopenjob(c, AV(filename), cmode));
+  ARETURN(openfio(c, thr, T_INPORT, AV(filename)));
   AFEND;
 }
 AFFEND
@@ -325,7 +431,8 @@ AFFDEF(arc_outfile)
     arc_err_cstrfmt(c, "outfile: invalid mode");
     ARETURN(CNIL);
   }
-  ARETURN(openfio(c, T_OUTPORT, AV(filename), cmode));
+  AIOJOB(fopenjob(c, AV(filename), cmode));
+  ARETURN(openfio(c, thr, T_OUTPORT, AV(filename)));
   AFEND;
 }
 AFFEND
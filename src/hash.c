@@ -391,6 +391,24 @@ int arc_hash_length(arc *c, value hash)
   return(count);
 }
 
+/* Get the next binding in hash after the one at *index, which should be
+   zero for the first call.  Returns 0 if there are no more bindings. */
+int __arc_hash_next(arc *c, value hash, int *index, value *key, value *val)
+{
+  value e, tbl;
+
+  tbl = HASH_TABLE(hash);
+  while (*index < VECLEN(tbl)) {
+    e = VINDEX(tbl, (*index)++);
+    if (EMPTYP(e))
+      continue;
+    *key = BKEY(e);
+    *val = BVALUE(e);
+    return(1);
+  }
+  return(0);
+}
+
 value arc_mkhash(arc *c, int hashbits)
 {
   value hash, hv;
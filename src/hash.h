@@ -33,6 +33,8 @@ extern value arc_hash_lookup2(arc *c, value tbl, value key);
 extern value arc_hash_insert(arc *c, value hash, value key, value val);
 extern value arc_hash_delete(arc *c, value hash, value key);
 extern int arc_hash_length(arc *c, value hash);
+extern int __arc_hash_next(arc *c, value hash, int *index, value *key,
+			   value *val);
 extern int arc_xhash_lookup(arc *c, value thr);
 extern int arc_xhash_lookup2(arc *c, value thr);
 extern int arc_xhash_delete(arc *c, value thr);
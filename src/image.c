@@ -0,0 +1,905 @@
+/*
+  Copyright (C) 2013 Rafael R. Sevilla
+
+  This file is part of Arcueid
+
+  Arcueid is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; either version 3 of the
+  License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/* Heap images.  An image is a snapshot of everything reachable from
+   the global environment and the declarations, so that a fully loaded
+   system can be brought back without reading and compiling arc.arc
+   again.
+
+   The heap can't simply be copied out as is, since it is full of
+   pointers to C functions and to memory that the allocator got from
+   the system, neither of which will be at the same address the next
+   time around.  So instead each object is written as a shell (its type
+   and any atomic contents), followed by the references each object
+   holds, with pointers replaced by object indexes.  Restoring an image
+   allocates all the shells through the normal allocator, which rebuilds
+   the BiBOP pages and allocated object lists as a matter of course,
+   then fills in the references.  Symbols are written by name and
+   interned again, and C functions are written by name and looked up
+   among the builtins of the running system.
+
+   Images are made of words of the native size and byte order, and the
+   restored file is mapped into memory.  An image is only good for the
+   build of Arcueid that wrote it.
+
+   Ports, threads, and channels bound to globals are not part of the
+   image, nor are the C functions bound to globals, since the new
+   system will have fresh versions of those.  If any other objects which
+   can't be saved (continuations, exceptions, regular expressions, and
+   so on) are reachable from a global, that global is left out.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "arcueid.h"
+#include "vmengine.h"
+#include "compiler.h"
+#include "arith.h"
+#include "hash.h"
+#include "builtins.h"
+#include "../config.h"
+
+#ifdef HAVE_ALLOCA_H
+# include <alloca.h>
+#elif defined __GNUC__
+#ifndef alloca
+# define alloca __builtin_alloca
+#endif
+#elif defined _AIX
+# define alloca __alloca
+#elif defined _MSC_VER
+# include <malloc.h>
+# define alloca _alloca
+#else
+# include <stddef.h>
+void *alloca (size_t);
+#endif
+
+typedef unsigned long word;
+
+#define IMAGE_MAGIC 0x49435241UL	/* "ARCI" */
+#define IMAGE_VERSION 5
+
+/* References to objects in the image are encoded so that they can't be
+   confused with fixnums and the other immediate values, which are
+   written as is.  Object references have 0x2 (formerly CTRUE) in the
+   low four bits, and symbols are written like symbols, but with their
+   index in the image symbol table in place of the symbol ID. */
+#define OBJ_FLAG 0x02
+#define OBJREF(i) ((((word)(i)) << 4) | OBJ_FLAG)
+#define OBJREF_P(r) (((r) & 0x0f) == OBJ_FLAG)
+#define OBJIDX(r) ((r) >> 4)
+
+struct image_buf {
+  word *data;
+  size_t len, size;
+};
+
+/* Map of objects to their references in the image.  Objects taken out
+   of the map leave a tombstone, which can never be an object. */
+#define MAP_DELETED ((value)1)
+
+struct image_map {
+  value *keys;
+  word *refs;
+  size_t size, count;
+};
+
+struct image {
+  struct image_buf shells, fills, syms;
+  struct image_map map;
+  value *objs;			/* objects in the order of their indexes */
+  value *symv;			/* symbols in the order of their indexes */
+  size_t nobjs, nsyms, objsize, symsize;
+  size_t pending;		/* objects whose references are not yet seen */
+};
+
+/* Where the image was before the value of a global was added to it, so
+   the global can be left out if its value can't be saved after all. */
+struct image_mark {
+  size_t nobjs, nsyms, shells, fills, syms;
+};
+
+static int putword(struct image_buf *buf, word w)
+{
+  word *ndata;
+
+  if (buf->len >= buf->size) {
+    buf->size = (buf->size == 0) ? 4096 : 2*buf->size;
+    ndata = realloc(buf->data, buf->size*sizeof(word));
+    if (ndata == NULL)
+      return(-1);
+    buf->data = ndata;
+  }
+  buf->data[buf->len++] = w;
+  return(0);
+}
+
+static int putstr(arc *c, struct image_buf *buf, value str)
+{
+  int i, len;
+
+  len = arc_strlen(c, str);
+  if (putword(buf, len) < 0)
+    return(-1);
+  for (i=0; i<len; i++) {
+    if (putword(buf, arc_strindex(c, str, i)) < 0)
+      return(-1);
+  }
+  return(0);
+}
+
+static int putdouble(struct image_buf *buf, double d)
+{
+  word w[2] = { 0, 0 };
+
+  memcpy(w, &d, sizeof(double));
+  if (putword(buf, w[0]) < 0)
+    return(-1);
+  return((sizeof(double) > sizeof(word)) ? putword(buf, w[1]) : 0);
+}
+
+#ifdef HAVE_GMP_H
+static int putcstr(struct image_buf *buf, char *s)
+{
+  size_t len, i;
+  word w;
+
+  if (s == NULL)
+    return(-1);
+  len = strlen(s);
+  if (putword(buf, len) < 0)
+    return(-1);
+  for (i=0; i<len; i += sizeof(word)) {
+    w = 0;
+    memcpy(&w, s + i, (len - i < sizeof(word)) ? len - i : sizeof(word));
+    if (putword(buf, w) < 0)
+      return(-1);
+  }
+  return(0);
+}
+#endif
+
+static size_t mapslot(struct image_map *map, value v)
+{
+  size_t i;
+
+  i = (((word)v) >> 4) * 0x9e3779b97f4a7c15ULL;
+  for (i &= map->size - 1; map->keys[i] != 0 && map->keys[i] != v;
+       i = (i + 1) & (map->size - 1))
+    ;
+  return(i);
+}
+
+static int mapput(struct image_map *map, value v, word ref)
+{
+  struct image_map nmap;
+  size_t i, j;
+
+  if (2*(map->count + 1) > map->size) {
+    nmap.size = (map->size == 0) ? 1024 : 2*map->size;
+    nmap.count = map->count;
+    nmap.keys = calloc(nmap.size, sizeof(value));
+    nmap.refs = calloc(nmap.size, sizeof(word));
+    if (nmap.keys == NULL || nmap.refs == NULL) {
+      free(nmap.keys);
+      free(nmap.refs);
+      return(-1);
+    }
+    for (i=0; i<map->size; i++) {
+      if (map->keys[i] == 0 || map->keys[i] == MAP_DELETED)
+	continue;
+      j = mapslot(&nmap, map->keys[i]);
+      nmap.keys[j] = map->keys[i];
+      nmap.refs[j] = map->refs[i];
+    }
+    free(map->keys);
+    free(map->refs);
+    *map = nmap;
+  }
+  i = mapslot(map, v);
+  map->keys[i] = v;
+  map->refs[i] = ref;
+  map->count++;
+  return(0);
+}
+
+static void mapdel(struct image_map *map, value v)
+{
+  size_t i = mapslot(map, v);
+
+  if (map->keys[i] == v)
+    map->keys[i] = MAP_DELETED;
+}
+
+static int pushval(value **vals, size_t *size, size_t n, value v)
+{
+  value *nvals;
+
+  if (n >= *size) {
+    *size = (*size == 0) ? 1024 : 2*(*size);
+    nvals = realloc(*vals, (*size)*sizeof(value));
+    if (nvals == NULL)
+      return(-1);
+    *vals = nvals;
+  }
+  (*vals)[n] = v;
+  return(0);
+}
+
+static int storable(arc *c, value v)
+{
+  switch (TYPE(v)) {
+  case T_FLONUM:
+  case T_COMPLEX:
+#ifdef HAVE_GMP_H
+  case T_BIGNUM:
+  case T_RATIONAL:
+#endif
+  case T_CHAR:
+  case T_STRING:
+  case T_CONS:
+  case T_CLOS:
+  case T_TAGGED:
+  case T_VECTOR:
+  case T_CODE:
+  case T_TABLE:
+  case T_WTABLE:
+    return(1);
+  case T_CCODE:
+    return(!NIL_P(__arc_ccode_name(c, v)));
+  default:
+    break;
+  }
+  return(0);
+}
+
+/* Write the shell of a new object, and save it so its references will
+   be written later. */
+static int putshell(arc *c, struct image *img, value v)
+{
+  struct image_buf *buf = &img->shells;
+#ifdef HAVE_GMP_H
+  char *s;
+  int ret;
+#endif
+
+  if (pushval(&img->objs, &img->objsize, img->nobjs, v) < 0
+      || mapput(&img->map, v, OBJREF(img->nobjs)) < 0)
+    return(-1);
+  img->nobjs++;
+
+  if (putword(buf, TYPE(v)) < 0)
+    return(-1);
+  switch (TYPE(v)) {
+  case T_FLONUM:
+    return(putdouble(buf, REPFLO(v)));
+  case T_COMPLEX:
+    if (putdouble(buf, creal(REPCPX(v))) < 0)
+      return(-1);
+    return(putdouble(buf, cimag(REPCPX(v))));
+#ifdef HAVE_GMP_H
+  case T_BIGNUM:
+    s = mpz_get_str(NULL, 16, REPBNUM(v));
+    ret = putcstr(buf, s);
+    free(s);
+    return(ret);
+  case T_RATIONAL:
+    s = mpq_get_str(NULL, 16, REPRAT(v));
+    ret = putcstr(buf, s);
+    free(s);
+    return(ret);
+#endif
+  case T_CHAR:
+    return(putword(buf, arc_char2rune(c, v)));
+  case T_STRING:
+    return(putstr(c, buf, v));
+  case T_VECTOR:
+  case T_CODE:
+    return(putword(buf, VECLEN(v)));
+  case T_TABLE:
+  case T_WTABLE:
+    return(putword(buf, arc_hash_length(c, v)));
+  case T_CCODE:
+    return(putstr(c, buf, arc_sym2name(c, __arc_ccode_name(c, v))));
+  default:
+    break;
+  }
+  return(0);
+}
+
+/* Get the reference for v, adding it to the image if it hasn't been
+   seen before.  Returns -1 if v can't be saved. */
+static int getref(arc *c, struct image *img, value v, word *ref)
+{
+  size_t i;
+
+  if (v == CNIL || FIXNUM_P(v) || v == CUNDEF || v == CUNBOUND
+      || v == CLASTARG) {
+    *ref = (word)v;
+    return(0);
+  }
+  if (img->map.size > 0) {
+    i = mapslot(&img->map, v);
+    if (img->map.keys[i] == v) {
+      *ref = img->map.refs[i];
+      return(0);
+    }
+  }
+  if (SYMBOL_P(v)) {
+    *ref = (((word)img->nsyms) << 8) | SYMBOL_FLAG;
+    if (pushval(&img->symv, &img->symsize, img->nsyms, v) < 0
+	|| mapput(&img->map, v, *ref) < 0
+	|| putstr(c, &img->syms, arc_sym2name(c, v)) < 0)
+      return(-1);
+    img->nsyms++;
+    return(0);
+  }
+  if (IMMEDIATE_P(v) || !storable(c, v))
+    return(-1);
+  *ref = OBJREF(img->nobjs);
+  if (putshell(c, img, v) < 0)
+    return(-1);
+  img->pending++;
+  return(0);
+}
+
+/* Table keys have to be hashed again when the image is restored, so
+   only keys whose hashes don't depend on their addresses will do. */
+static int hashable(arc *c, value key)
+{
+  if (IMMEDIATE_P(key))
+    return(1);
+  return(__arc_typefn(c, key)->hash != NULL);
+}
+
+/* Reserve space for the references of obj in the fill section, and
+   get the references for each, adding new objects as necessary. */
+static int putfill(arc *c, struct image *img, value obj)
+{
+  struct image_buf *buf = &img->fills;
+  int i, len;
+  value key, val;
+  word ref;
+
+  switch (TYPE(obj)) {
+  case T_CONS:
+  case T_CLOS:
+  case T_TAGGED:
+    if (getref(c, img, car(obj), &ref) < 0 || putword(buf, ref) < 0
+	|| getref(c, img, cdr(obj), &ref) < 0 || putword(buf, ref) < 0)
+      return(-1);
+    break;
+  case T_VECTOR:
+  case T_CODE:
+    len = VECLEN(obj);
+    for (i=0; i<len; i++) {
+      if (getref(c, img, VINDEX(obj, i), &ref) < 0 || putword(buf, ref) < 0)
+	return(-1);
+    }
+    break;
+  case T_TABLE:
+  case T_WTABLE:
+    i = 0;
+    while (__arc_hash_next(c, obj, &i, &key, &val)) {
+      if (!hashable(c, key) || getref(c, img, key, &ref) < 0
+	  || putword(buf, ref) < 0 || getref(c, img, val, &ref) < 0
+	  || putword(buf, ref) < 0)
+	return(-1);
+    }
+    break;
+  default:
+    break;
+  }
+  return(0);
+}
+
+/* Add all the objects reachable from v.  The pending objects are
+   always the last ones added, and their references are written in the
+   order of their indexes, so the fill section has the references of
+   each object in the same order as the shells. */
+static int putgraph(arc *c, struct image *img, value v, word *ref)
+{
+  if (getref(c, img, v, ref) < 0)
+    return(-1);
+  while (img->pending > 0) {
+    if (putfill(c, img, img->objs[img->nobjs - img->pending--]) < 0)
+      return(-1);
+  }
+  return(0);
+}
+
+/* Bindings which are not saved, since the new system has its own */
+static int skipbinding(arc *c, value val)
+{
+  switch (TYPE(val)) {
+  case T_INPORT:
+  case T_OUTPORT:
+  case T_THREAD:
+  case T_CHAN:
+  case T_CCODE:
+    return(1);
+  default:
+    break;
+  }
+  return(0);
+}
+
+static void image_free(struct image *img)
+{
+  free(img->shells.data);
+  free(img->fills.data);
+  free(img->syms.data);
+  free(img->map.keys);
+  free(img->map.refs);
+  free(img->objs);
+  free(img->symv);
+}
+
+static void image_mark(struct image *img, struct image_mark *mark)
+{
+  mark->nobjs = img->nobjs;
+  mark->nsyms = img->nsyms;
+  mark->shells = img->shells.len;
+  mark->fills = img->fills.len;
+  mark->syms = img->syms.len;
+}
+
+/* Take everything added since mark back out of the image */
+static void image_rollback(struct image *img, struct image_mark *mark)
+{
+  while (img->nobjs > mark->nobjs)
+    mapdel(&img->map, img->objs[--img->nobjs]);
+  while (img->nsyms > mark->nsyms)
+    mapdel(&img->map, img->symv[--img->nsyms]);
+  img->shells.len = mark->shells;
+  img->fills.len = mark->fills;
+  img->syms.len = mark->syms;
+  img->pending = 0;
+}
+
+static int writebuf(FILE *fp, struct image_buf *buf)
+{
+  return((fwrite(buf->data, sizeof(word), buf->len, fp) == buf->len) ? 0 : -1);
+}
+
+/* Save an image of the global environment to file.  Returns 0 if the
+   image was written, or -1 if it could not be written.  Globals whose
+   values include objects which can't be saved are left out of the
+   image, and a list of them is stored in *skipped. */
+int arc_image_save(arc *c, const char *file, value *skipped)
+{
+  struct image img;
+  struct image_mark mark;
+  struct image_buf roots;
+  value sym, val;
+  word hdr[5], sref, vref;
+  int i, ret = -1;
+  char *tmpname = NULL;
+  FILE *fp;
+
+  memset(&img, 0, sizeof(img));
+  memset(&roots, 0, sizeof(roots));
+  *skipped = CNIL;
+  i = 0;
+  while (__arc_hash_next(c, c->genv, &i, &sym, &val)) {
+    if (skipbinding(c, val))
+      continue;
+    image_mark(&img, &mark);
+    if (getref(c, &img, sym, &sref) < 0 || putgraph(c, &img, val, &vref) < 0) {
+      image_rollback(&img, &mark);
+      *skipped = cons(c, sym, *skipped);
+      continue;
+    }
+    if (putword(&roots, sref) < 0 || putword(&roots, vref) < 0)
+      goto done;
+  }
+  if (putgraph(c, &img, c->declarations, &vref) < 0
+      || putword(&roots, vref) < 0)
+    goto done;
+
+  hdr[0] = IMAGE_MAGIC;
+  hdr[1] = IMAGE_VERSION;
+  hdr[2] = img.nsyms;
+  hdr[3] = img.nobjs;
+  hdr[4] = (roots.len - 1)/2;
+  tmpname = malloc(strlen(file) + 32);
+  if (tmpname == NULL)
+    goto done;
+  sprintf(tmpname, "%s.%ld", file, (long)getpid());
+  fp = fopen(tmpname, "wb");
+  if (fp == NULL)
+    goto done;
+  if (fwrite(hdr, sizeof(word), 5, fp) != 5 || writebuf(fp, &img.syms) < 0
+      || writebuf(fp, &img.shells) < 0 || writebuf(fp, &img.fills) < 0
+      || writebuf(fp, &roots) < 0) {
+    fclose(fp);
+    unlink(tmpname);
+    goto done;
+  }
+  if (fclose(fp) != 0 || rename(tmpname, file) != 0) {
+    unlink(tmpname);
+    goto done;
+  }
+  ret = 0;
+ done:
+  free(tmpname);
+  free(roots.data);
+  image_free(&img);
+  return(ret);
+}
+
+/* Save an image of the global environment to file, returning a list
+   of the globals that had to be left out of it. */
+value arc_dump_image(arc *c, value file)
+{
+  char *cfile;
+  value skipped;
+
+  TYPECHECK(file, T_STRING);
+  cfile = alloca(FIX2INT(arc_strutflen(c, file)) + 1);
+  arc_str2cstr(c, file, cfile);
+  if (arc_image_save(c, cfile, &skipped) < 0) {
+    arc_err_cstrfmt(c, "error writing image file %s", cfile);
+    return(CNIL);
+  }
+  return(skipped);
+}
+
+/* Reading images.  All reads check against the end of the image, so a
+   truncated or corrupt file only makes the load fail. */
+struct image_reader {
+  word *data;
+  size_t len, ptr;
+  value *syms, *objs;
+  size_t nsyms, nobjs;
+  word *nentries;		/* number of entries of each table */
+  word *tblofs;			/* offsets of the entries of each table */
+};
+
+static int getword(struct image_reader *rd, word *w)
+{
+  if (rd->ptr >= rd->len)
+    return(-1);
+  *w = rd->data[rd->ptr++];
+  return(0);
+}
+
+static int getlen(struct image_reader *rd, word *len)
+{
+  if (getword(rd, len) < 0 || *len > rd->len - rd->ptr)
+    return(-1);
+  return(0);
+}
+
+static int getstr(arc *c, struct image_reader *rd, value *str)
+{
+  word i, len;
+
+  if (getlen(rd, &len) < 0)
+    return(-1);
+  *str = arc_mkstringlen(c, len);
+  for (i=0; i<len; i++)
+    arc_strsetindex(c, *str, i, (Rune)rd->data[rd->ptr++]);
+  return(0);
+}
+
+static int getdouble(struct image_reader *rd, double *d)
+{
+  word w[2] = { 0, 0 };
+
+  if (getword(rd, &w[0]) < 0
+      || (sizeof(double) > sizeof(word) && getword(rd, &w[1]) < 0))
+    return(-1);
+  memcpy(d, w, sizeof(double));
+  return(0);
+}
+
+#ifdef HAVE_GMP_H
+static char *getcstr(struct image_reader *rd)
+{
+  word len, nwords;
+  char *s;
+
+  if (getword(rd, &len) < 0)
+    return(NULL);
+  nwords = (len + sizeof(word) - 1)/sizeof(word);
+  if (nwords > rd->len - rd->ptr || (s = malloc(len + 1)) == NULL)
+    return(NULL);
+  memcpy(s, rd->data + rd->ptr, len);
+  s[len] = 0;
+  rd->ptr += nwords;
+  return(s);
+}
+#endif
+
+static int readref(struct image_reader *rd, value *v)
+{
+  word ref;
+
+  if (getword(rd, &ref) < 0)
+    return(-1);
+  if (OBJREF_P(ref)) {
+    if (OBJIDX(ref) >= rd->nobjs)
+      return(-1);
+    *v = rd->objs[OBJIDX(ref)];
+    return(0);
+  }
+  if (SYMBOL_P(ref)) {
+    if (SYM2ID(ref) >= rd->nsyms)
+      return(-1);
+    *v = rd->syms[SYM2ID(ref)];
+    return(0);
+  }
+  if (FIXNUM_P(ref) || ref == CNIL || ref == CUNDEF || ref == CUNBOUND
+      || ref == CLASTARG) {
+    *v = (value)ref;
+    return(0);
+  }
+  return(-1);
+}
+
+/* Get the C functions of the running system by name */
+static value builtin_ccodes(arc *c)
+{
+  value ccodes, sym, val;
+  int i = 0;
+
+  ccodes = arc_mkhash(c, 10);
+  while (__arc_hash_next(c, c->genv, &i, &sym, &val)) {
+    if (TYPE(val) == T_TAGGED)
+      val = cdr(val);
+    if (TYPE(val) == T_CCODE && !NIL_P(__arc_ccode_name(c, val)))
+      arc_hash_insert(c, ccodes, __arc_ccode_name(c, val), val);
+  }
+  return(ccodes);
+}
+
+static int getshell(arc *c, struct image_reader *rd, value ccodes, value *v)
+{
+  word *nentries = &rd->nentries[rd->nobjs];
+  word type, len;
+  double re, im;
+  value str;
+#ifdef HAVE_GMP_H
+  char *s;
+  int ret;
+#endif
+
+  if (getword(rd, &type) < 0)
+    return(-1);
+  switch (type) {
+  case T_FLONUM:
+    if (getdouble(rd, &re) < 0)
+      return(-1);
+    *v = arc_mkflonum(c, re);
+    return(0);
+  case T_COMPLEX:
+    if (getdouble(rd, &re) < 0 || getdouble(rd, &im) < 0)
+      return(-1);
+    *v = arc_mkcomplex(c, re + I*im);
+    return(0);
+#ifdef HAVE_GMP_H
+  case T_BIGNUM:
+    if ((s = getcstr(rd)) == NULL)
+      return(-1);
+    *v = arc_mkbignuml(c, 0);
+    ret = mpz_set_str(REPBNUM(*v), s, 16);
+    free(s);
+    return(ret);
+  case T_RATIONAL:
+    if ((s = getcstr(rd)) == NULL)
+      return(-1);
+    *v = arc_mkrationall(c, 0, 1);
+    ret = mpq_set_str(REPRAT(*v), s, 16);
+    mpq_canonicalize(REPRAT(*v));
+    free(s);
+    return(ret);
+#endif
+  case T_CHAR:
+    if (getword(rd, &len) < 0)
+      return(-1);
+    *v = arc_mkchar(c, (Rune)len);
+    return(0);
+  case T_STRING:
+    return(getstr(c, rd, v));
+  case T_CONS:
+  case T_CLOS:
+  case T_TAGGED:
+    *v = cons(c, CNIL, CNIL);
+    ((struct cell *)*v)->_type = type;
+    return(0);
+  case T_VECTOR:
+  case T_CODE:
+    if (getlen(rd, &len) < 0)
+      return(-1);
+    *v = arc_mkvector(c, len);
+    ((struct cell *)*v)->_type = type;
+    return(0);
+  case T_TABLE:
+  case T_WTABLE:
+    /* The entries are inserted after everything else is filled in */
+    if (getword(rd, nentries) < 0)
+      return(-1);
+    *v = (type == T_WTABLE) ? arc_mkwtable(c, ARC_HASHBITS)
+      : arc_mkhash(c, ARC_HASHBITS);
+    return(0);
+  case T_CCODE:
+    if (getstr(c, rd, &str) < 0)
+      return(-1);
+    *v = arc_hash_lookup(c, ccodes, arc_intern(c, str));
+    return(BOUND_P(*v) ? 0 : -1);
+  default:
+    break;
+  }
+  return(-1);
+}
+
+static int getfill(arc *c, struct image_reader *rd, word idx)
+{
+  value obj = rd->objs[idx];
+  word i, len;
+  value x, y;
+
+  switch (TYPE(obj)) {
+  case T_CONS:
+  case T_CLOS:
+  case T_TAGGED:
+    if (readref(rd, &x) < 0 || readref(rd, &y) < 0)
+      return(-1);
+    scar(obj, x);
+    scdr(obj, y);
+    break;
+  case T_VECTOR:
+  case T_CODE:
+    len = VECLEN(obj);
+    for (i=0; i<len; i++) {
+      if (readref(rd, &x) < 0)
+	return(-1);
+      SVINDEX(obj, i, x);
+    }
+    break;
+  case T_TABLE:
+  case T_WTABLE:
+    /* skip over the entries for now */
+    len = rd->nentries[idx];
+    if (len > (rd->len - rd->ptr)/2)
+      return(-1);
+    rd->tblofs[idx] = rd->ptr;
+    rd->ptr += 2*len;
+    break;
+  default:
+    break;
+  }
+  return(0);
+}
+
+/* Insert the entries of each table, once the keys have all their
+   contents and can be hashed. */
+static int gettable(arc *c, struct image_reader *rd, word idx)
+{
+  word i;
+  value key, val;
+
+  rd->ptr = rd->tblofs[idx];
+  for (i=0; i<rd->nentries[idx]; i++) {
+    if (readref(rd, &key) < 0 || readref(rd, &val) < 0)
+      return(-1);
+    arc_hash_insert(c, rd->objs[idx], key, val);
+  }
+  return(0);
+}
+
+/* Restore the image in file.  This should be called on a freshly
+   initialized system, before anything is run.  Returns 0 if the image
+   was restored, or -1 if it could not be read, in which case the
+   system may have been partly restored. */
+int arc_image_load(arc *c, const char *file)
+{
+  struct image_reader rd;
+  struct stat st;
+  word hdr[5], i, nobjs, rootofs;
+  value ccodes, str, sym, val;
+  void *map;
+  int fd, ret = -1;
+
+  fd = open(file, O_RDONLY);
+  if (fd < 0)
+    return(-1);
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(hdr)) {
+    close(fd);
+    return(-1);
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return(-1);
+
+  memset(&rd, 0, sizeof(rd));
+  rd.data = map;
+  rd.len = st.st_size/sizeof(word);
+  for (i=0; i<5; i++)
+    getword(&rd, &hdr[i]);
+  if (hdr[0] != IMAGE_MAGIC || hdr[1] != IMAGE_VERSION
+      || hdr[2] > rd.len || hdr[3] > rd.len)
+    goto done;
+  nobjs = hdr[3];
+  rd.syms = malloc((hdr[2] + 1)*sizeof(value));
+  rd.objs = malloc((nobjs + 1)*sizeof(value));
+  rd.nentries = calloc(nobjs + 1, sizeof(word));
+  rd.tblofs = calloc(nobjs + 1, sizeof(word));
+  if (rd.syms == NULL || rd.objs == NULL || rd.nentries == NULL
+      || rd.tblofs == NULL)
+    goto done;
+
+  for (rd.nsyms=0; rd.nsyms<hdr[2]; rd.nsyms++) {
+    if (getstr(c, &rd, &str) < 0)
+      goto done;
+    /* Symbols in the image are never nil itself, but the symbol for
+       nil does turn up, e.g. as the key of its global binding */
+    sym = arc_intern(c, str);
+    if (NIL_P(sym))
+      sym = ARC_BUILTIN(c, S_NIL);
+    __arc_uniq_reserve(c, sym);
+    rd.syms[rd.nsyms] = sym;
+  }
+
+  /* Allocate all the objects, then fill in their references */
+  ccodes = builtin_ccodes(c);
+  for (rd.nobjs=0; rd.nobjs<nobjs; rd.nobjs++) {
+    if (getshell(c, &rd, ccodes, &rd.objs[rd.nobjs]) < 0)
+      goto done;
+  }
+  for (i=0; i<nobjs; i++) {
+    if (getfill(c, &rd, i) < 0)
+      goto done;
+  }
+  rootofs = rd.ptr;
+  for (i=0; i<nobjs; i++) {
+    if (TYPE(rd.objs[i]) != T_TABLE && TYPE(rd.objs[i]) != T_WTABLE)
+      continue;
+    if (gettable(c, &rd, i) < 0)
+      goto done;
+  }
+
+  rd.ptr = rootofs;
+  for (i=0; i<hdr[4]; i++) {
+    if (readref(&rd, &sym) < 0 || readref(&rd, &val) < 0 || !SYMBOL_P(sym))
+      goto done;
+    arc_bindsym(c, sym, val);
+  }
+  if (readref(&rd, &val) < 0 || TYPE(val) != T_TABLE)
+    goto done;
+  c->declarations = val;
+  for (i=0; i<nobjs; i++) {
+    if (TYPE(rd.objs[i]) == T_CODE)
+      __arc_inline_reset(c, rd.objs[i]);
+  }
+  ret = 0;
+ done:
+  munmap(map, st.st_size);
+  free(rd.syms);
+  free(rd.objs);
+  free(rd.nentries);
+  free(rd.tblofs);
+  return(ret);
+}
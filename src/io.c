@@ -26,6 +26,7 @@
   design, although it might not be the way the PG-Arc reference
   implementation behaves.
 */
+#include <stdlib.h>
 #include "arcueid.h"
 #include "utf.h"
 #include "builtins.h"
@@ -460,12 +461,23 @@ AFFDEF(arc_peekc)
 }
 AFFEND
 
-value arc_flushout(arc *c)
+static void flushout_job(struct iojob *job)
 {
   fflush(NULL);
-  return(CTRUE);
 }
 
+/* Write out every output file, which may take as long as the disk
+   does, so it is done by the I/O pool */
+AFFDEF(arc_flushout)
+{
+  AFBEGIN;
+  AIOJOB(__arc_mkiojob(c, flushout_job, NULL, CNIL, 0));
+  free(__arc_iojob_finish(c, thr));
+  ARETURN(CTRUE);
+  AFEND;
+}
+AFFEND
+
 value arc_portname(arc *c, value port)
 {
   return(IO(port)->name);
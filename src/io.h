@@ -95,7 +95,7 @@ extern value arc_inside(arc *c, value sio);
 /* File I/O */
 extern int arc_infile(arc *c, value thr);
 extern int arc_outfile(arc *c, value thr);
-extern value arc_flushout(arc *c);
+extern int arc_flushout(arc *c, value thr);
 
 /* Network I/O */
 extern int arc_open_socket(arc *c, value thr);
@@ -108,9 +108,9 @@ extern int arc_stdout(arc *c, value thr);
 extern int arc_stderr(arc *c, value thr);
 
 /* file system operations */
-extern value arc_dir(arc *c, value dirname);
-extern value arc_dir_exists(arc *c, value dirname);
-extern value arc_file_exists(arc *c, value filename);
+extern int arc_dir(arc *c, value thr);
+extern int arc_dir_exists(arc *c, value thr);
+extern int arc_file_exists(arc *c, value thr);
 extern value arc_rmfile(arc *c, value filename);
 extern value arc_mvfile(arc *c, value oldname, value newname);
 
@@ -141,7 +141,7 @@ extern value arc_inside(arc *c, value sio);
 /* File I/O */
 extern int arc_infile(arc *c, value thr);
 extern int arc_outfile(arc *c, value thr);
-extern value arc_flushout(arc *c);
+extern int arc_flushout(arc *c, value thr);
 
 
 /* Network I/O */
@@ -155,9 +155,9 @@ extern int arc_stdout(arc *c, value thr);
 extern int arc_stderr(arc *c, value thr);
 
 /* file system operations */
-extern value arc_dir(arc *c, value dirname);
-extern value arc_dir_exists(arc *c, value dirname);
-extern value arc_file_exists(arc *c, value filename);
+extern int arc_dir(arc *c, value thr);
+extern int arc_dir_exists(arc *c, value thr);
+extern int arc_file_exists(arc *c, value thr);
 extern value arc_rmfile(arc *c, value filename);
 extern value arc_mvfile(arc *c, value oldname, value newname);
 extern value arc_realpath(arc *c, value opath);
@@ -0,0 +1,375 @@
+/*
+  Copyright (C) 2013 Rafael R. Sevilla
+
+  This file is part of Arcueid
+
+  Arcueid is free software: you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this library. If not, see <http://www.gnu.org/licenses/>
+*/
+
+/* The I/O pool.  Reading and writing files, opening and closing them,
+   and looking at directories may all block for a long time if the
+   disk is slow, and since select and epoll will always say that a
+   file is ready, the dispatcher has no way of knowing that it will.
+   Such operations are instead done as jobs by a small pool of helper
+   threads, while the thread which wanted them done waits.
+
+   A helper which finishes a job writes a byte to a pipe, and threads
+   waiting on jobs wait for that pipe to become readable.  When it
+   does, the dispatcher wakes only those threads whose jobs are done
+   (see __arc_iojob_ready); the rest go on waiting.
+
+   Jobs made on the same stream (the same ptr) are done one at a time,
+   in the order they were submitted, so that, e.g., a file can never be
+   closed by one helper while another is still reading it.
+
+   Jobs are done by the interpreter itself if there are no helper
+   threads, and also if the thread is not being run by the dispatcher
+   (the REPL loading files before it starts, and the test programs),
+   or is in a critical section, as these have no way to wait. */
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "arcueid.h"
+#include "vmengine.h"
+#include "../config.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+
+#define IOPOOL_HELPERS 4
+
+struct iopool {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct iojob *head;		/* jobs waiting for a helper */
+  struct iojob *tail;
+  struct iojob *running;	/* jobs being done by helpers */
+  int quit;			/* helpers should exit */
+  int notify[2];		/* helpers write here after each job */
+  int nhelpers;
+  pthread_t helpers[IOPOOL_HELPERS];
+  struct iojob *jobs;		/* every job not yet freed */
+};
+
+/* Take the first waiting job whose stream no helper is using, if any.
+   Called with the lock held. */
+static struct iojob *take_job(struct iopool *p)
+{
+  struct iojob *job, *prev, *r;
+
+  for (prev = NULL, job = p->head; job != NULL; prev = job, job = job->next) {
+    for (r = p->running; r != NULL; r = r->next) {
+      if (job->serial != NULL && r->serial == job->serial)
+	break;
+    }
+    if (r == NULL)
+      break;
+  }
+  if (job == NULL)
+    return(NULL);
+  if (prev == NULL)
+    p->head = job->next;
+  else
+    prev->next = job->next;
+  if (p->tail == job)
+    p->tail = prev;
+  job->next = p->running;
+  p->running = job;
+  return(job);
+}
+
+static void *helper(void *arg)
+{
+  struct iopool *p = (struct iopool *)arg;
+  struct iojob *job, **jp;
+  char b = 0;
+
+  for (;;) {
+    pthread_mutex_lock(&p->lock);
+    while ((job = take_job(p)) == NULL && !p->quit)
+      pthread_cond_wait(&p->cond, &p->lock);
+    if (job == NULL) {
+      pthread_mutex_unlock(&p->lock);
+      return(NULL);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    job->fn(job);
+
+    pthread_mutex_lock(&p->lock);
+    job->done = 1;
+    for (jp = &p->running; *jp != job; jp = &(*jp)->next)
+      ;
+    *jp = job->next;
+    /* a job which had to wait for this one may go ahead now */
+    if (p->head != NULL)
+      pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    /* If the pipe is full, it is already readable */
+    while (write(p->notify[1], &b, 1) < 0 && errno == EINTR)
+      ;
+  }
+  return(NULL);
+}
+
+/* Get the pool, starting it if need be.  Returns NULL if helper
+   threads cannot be had. */
+static struct iopool *iopool_get(arc *c)
+{
+  struct iopool *p;
+  int i;
+
+  if (c->iopool != NULL)
+    return((c->iopool->nhelpers > 0) ? c->iopool : NULL);
+  p = (struct iopool *)calloc(1, sizeof(struct iopool));
+  c->iopool = p;
+  if (pipe(p->notify) < 0) {
+    p->notify[0] = p->notify[1] = -1;
+    return(NULL);
+  }
+  for (i=0; i<2; i++) {
+    fcntl(p->notify[i], F_SETFL, fcntl(p->notify[i], F_GETFL) | O_NONBLOCK);
+    fcntl(p->notify[i], F_SETFD, FD_CLOEXEC);
+  }
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->cond, NULL);
+  for (i=0; i<IOPOOL_HELPERS; i++) {
+    if (pthread_create(&p->helpers[p->nhelpers], NULL, helper, p) == 0)
+      p->nhelpers++;
+  }
+  return((p->nhelpers > 0) ? p : NULL);
+}
+
+#else
+
+struct iopool {
+  int notify[2];
+  struct iojob *jobs;
+};
+
+static struct iopool *iopool_get(arc *c)
+{
+  if (c->iopool == NULL) {
+    c->iopool = (struct iopool *)calloc(1, sizeof(struct iopool));
+    c->iopool->notify[0] = c->iopool->notify[1] = -1;
+  }
+  return(NULL);
+}
+
+#endif
+
+static int job_done(arc *c, struct iojob *job)
+{
+  int done;
+
+#ifdef HAVE_PTHREAD_H
+  if (c->iopool->nhelpers > 0) {
+    pthread_mutex_lock(&c->iopool->lock);
+    done = job->done;
+    pthread_mutex_unlock(&c->iopool->lock);
+    return(done);
+  }
+#endif
+  return(job->done);
+}
+
+static void job_unlink(arc *c, struct iojob *job)
+{
+  struct iojob **jp;
+
+  for (jp = &c->iopool->jobs; *jp != NULL; jp = &(*jp)->lnext) {
+    if (*jp == job) {
+      *jp = job->lnext;
+      break;
+    }
+  }
+}
+
+/* Make a job to run fn, with len bytes of space in data */
+struct iojob *__arc_mkiojob(arc *c, void (*fn)(struct iojob *),
+			    void *ptr, value obj, size_t len)
+{
+  struct iojob *job;
+
+  job = (struct iojob *)malloc(sizeof(struct iojob) + len);
+  job->fn = fn;
+  job->discard = NULL;
+  job->ptr = ptr;
+  job->serial = ptr;
+  job->res = 0;
+  job->err = 0;
+  job->done = 0;
+  job->abandoned = 0;
+  job->obj = obj;
+  job->next = job->lnext = NULL;
+  return(job);
+}
+
+/* Start doing job for the thread thr.  DO NOT USE THIS FUNCTION
+   DIRECTLY.  It should only be used from the AIOJOB macro. */
+void __arc_iojob_submit(arc *c, value thr, struct iojob *job)
+{
+  struct iopool *p;
+
+  /* a job left behind by an error */
+  __arc_iojob_abandon(c, thr);
+  p = iopool_get(c);
+  job->lnext = c->iopool->jobs;
+  c->iopool->jobs = job;
+  TIOJOB(thr) = job;
+  if (p == NULL || !c->indispatch || TSTATE(thr) == Tcritical) {
+    job->fn(job);
+    job->done = 1;
+    return;
+  }
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&p->lock);
+  if (p->tail == NULL)
+    p->head = job;
+  else
+    p->tail->next = job;
+  p->tail = job;
+  pthread_cond_signal(&p->cond);
+  pthread_mutex_unlock(&p->lock);
+#endif
+}
+
+/* Empty the pipe, so that a job finished after this will make it
+   readable again. */
+static void drain(arc *c)
+{
+  char buf[64];
+
+  if (c->iopool->notify[0] >= 0) {
+    while (read(c->iopool->notify[0], buf, sizeof(buf)) > 0)
+      ;
+  }
+}
+
+/* Has the job of thr been done?  This leaves the pipe alone, since
+   other threads may yet have to be woken for what is in it. */
+int __arc_iojob_done(arc *c, value thr)
+{
+  return(job_done(c, TIOJOB(thr)));
+}
+
+/* Called by the dispatcher when fd, on which thr is waiting, becomes
+   readable.  Tells whether thr should be woken: if fd is the pipe of
+   the pool, only if its job has been done.  first should be true for
+   the first of the threads waiting on fd to be looked at. */
+int __arc_iojob_ready(arc *c, value thr, int fd, int first)
+{
+  if (c->iopool == NULL || fd != c->iopool->notify[0]
+      || TIOJOB(thr) == NULL)
+    return(1);
+  if (first)
+    drain(c);
+  return(job_done(c, TIOJOB(thr)));
+}
+
+/* The descriptor to wait on for jobs to be done */
+int __arc_iojob_fd(arc *c)
+{
+  return(c->iopool->notify[0]);
+}
+
+/* Get the job which thr has had done */
+struct iojob *__arc_iojob_finish(arc *c, value thr)
+{
+  struct iojob *job = TIOJOB(thr);
+
+  TIOJOB(thr) = NULL;
+  job_unlink(c, job);
+  return(job);
+}
+
+/* Let go of any job thr has, it no longer wants it */
+void __arc_iojob_abandon(arc *c, value thr)
+{
+  struct iojob *job = TIOJOB(thr);
+
+  if (job == NULL)
+    return;
+  TIOJOB(thr) = NULL;
+  if (!job_done(c, job)) {
+    /* the next garbage collection gets rid of it after it is done */
+    job->abandoned = 1;
+    return;
+  }
+  if (job->discard != NULL)
+    job->discard(job);
+  job_unlink(c, job);
+  free(job);
+}
+
+/* Mark the objects of all jobs, and get rid of abandoned jobs which
+   have been done */
+void __arc_iopool_mark(arc *c, void (*markfn)(value))
+{
+  struct iojob **jp, *job;
+
+  if (c->iopool == NULL)
+    return;
+  for (jp = &c->iopool->jobs; *jp != NULL;) {
+    job = *jp;
+    if (job->abandoned && job_done(c, job)) {
+      *jp = job->lnext;
+      if (job->discard != NULL)
+	job->discard(job);
+      free(job);
+      continue;
+    }
+    markfn(job->obj);
+    jp = &job->lnext;
+  }
+}
+
+void __arc_iopool_free(arc *c)
+{
+  struct iopool *p = c->iopool;
+  struct iojob *job, *next;
+#ifdef HAVE_PTHREAD_H
+  int i;
+#endif
+
+  if (p == NULL)
+    return;
+#ifdef HAVE_PTHREAD_H
+  if (p->nhelpers > 0) {
+    /* Helpers finish what they are doing first.  Jobs never started
+       are simply freed below. */
+    pthread_mutex_lock(&p->lock);
+    p->quit = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    for (i=0; i<p->nhelpers; i++)
+      pthread_join(p->helpers[i], NULL);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->cond);
+  }
+#endif
+  for (job = p->jobs; job != NULL; job = next) {
+    next = job->lnext;
+    if (job->abandoned && job->done && job->discard != NULL)
+      job->discard(job);
+    free(job);
+  }
+  if (p->notify[0] >= 0)
+    close(p->notify[0]);
+  if (p->notify[1] >= 0)
+    close(p->notify[1]);
+  free(p);
+  c->iopool = NULL;
+}
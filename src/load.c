@@ -68,9 +68,12 @@ value arc_loadpath_add(arc *c, value path)
 
    1 0 - loadfile
    1 1 - lpath
-   1 2 - lf
+   1 2 - ldf
    1 3 - fp
    1 4 - lndata
+   1 5 - arcc
+   1 6 - codes
+   1 7 - deps
  */
 static AFFDEF(beforethunk)
 {
@@ -82,20 +85,42 @@ AFFEND
 
 #define LOAD_FP __arc_getenv(c, thr, 1, 3)
 #define LNDATA __arc_getenv(c, thr, 1, 4)
+#define ARCC __arc_getenv(c, thr, 1, 5)
+#define CODES __arc_getenv(c, thr, 1, 6)
+#define SCODES(v) __arc_putenv(c, thr, 1, 6, v)
+#define DEPS __arc_getenv(c, thr, 1, 7)
+
+/* Convert an Arcueid string into a C string allocated on the stack */
+#define STR2CSTR(str, cstr)						\
+  do {									\
+    cstr = (char *)alloca((FIX2INT(arc_strutflen(c, str)) + 1)*sizeof(char)); \
+    arc_str2cstr(c, str, cstr);						\
+  } while (0)
 
 static AFFDEF(duringthunk)
 {
-  AVAR(sread, eval, sexpr);
+  AVAR(sread, sexpr, code);
+  char *arccfile;
   AFBEGIN;
   WV(sread, arc_mkaff(c, arc_sread, CNIL));
-  WV(eval, arc_mkaff(c, arc_eval, CNIL));
   /* This performs the actual load. */
   for (;;) {
     AFCALL(AV(sread), LOAD_FP, CNIL, LNDATA);
     WV(sexpr, AFCRV);
-    if (NIL_P(AV(sexpr)))
-      ARETURN(CNIL);		/* finished */
-    AFCALL(AV(eval), AV(sexpr), LNDATA);
+    if (NIL_P(AV(sexpr))) {
+      /* finished.  Save the compiled code if we can. */
+      if (!NIL_P(ARCC)) {
+	STR2CSTR(ARCC, arccfile);
+	arc_arcc_write(c, arccfile, arc_list_reverse(c, CODES),
+		       (unsigned long)FIX2INT(DEPS));
+      }
+      ARETURN(CNIL);
+    }
+    AFCALL(arc_mkaff(c, arc_eval_compile, CNIL), AV(sexpr), LNDATA);
+    WV(code, AFCRV);
+    if (!NIL_P(ARCC))
+      SCODES(cons(c, AV(code), CODES));
+    AFCALL2(arc_mkclos(c, AV(code), CNIL), CNIL);
   }
   AFEND;
 }
@@ -110,53 +135,82 @@ static AFFDEF(afterthunk)
 }
 AFFEND
 
+/* Get the name of the precompiled code file for a file, which is
+   the file name with a c appended if it ends in .arc, and nil
+   otherwise. */
+static value arccname(arc *c, value file)
+{
+  int len;
+
+  len = arc_strlen(c, file);
+  if (len < 4 || arc_strindex(c, file, len-4) != '.'
+      || arc_strindex(c, file, len-3) != 'a'
+      || arc_strindex(c, file, len-2) != 'r'
+      || arc_strindex(c, file, len-1) != 'c')
+    return(CNIL);
+  return(arc_strcatc(c, file, 'c'));
+}
+
 /* XXX - add the ability to load dynamic shared objects */
 AFFDEF(arc_load)
 {
   AARG(loadfile);
-  AVAR(lpath, ldf, fp, lndata);
+  AVAR(lpath, ldf, fp, lndata, arcc, codes, deps);
+  char *arcfile, *arccfile;
   AFBEGIN;
 
-  /* Try to load a file specified as an absolute path directly */
   if (__arc_is_absolute_path(c, AV(loadfile))) {
-    AFCALL(arc_mkaff(c, arc_infile, CNIL), AV(loadfile));
-    WV(fp, AFCRV);
-    WV(lndata, arc_mkhash(c, ARC_HASHBITS));
-    AFCALL(arc_mkaff(c, arc_dynamic_wind, CNIL),
-	   arc_mkaff2(c, beforethunk, CNIL, TENVR(thr)),
-	   arc_mkaff2(c, duringthunk, CNIL, TENVR(thr)),
-	   arc_mkaff2(c, afterthunk, CNIL, TENVR(thr)));
-    ARETURN(CNIL);
-  }
-
-  /* Look in the loadpath for files which aren't specified as absolute */
-  WV(lpath, arc_gbind(c, ARC_BUILTIN(c, S_LOADPATH)));
-  while (!NIL_P(AV(lpath))) {
-    WV(ldf, arc_pathjoin2(c, car(AV(lpath)), AV(loadfile)));
-    if (NIL_P(arc_file_exists(c, AV(ldf)))) {
+    /* Try to load a file specified as an absolute path directly */
+    WV(ldf, AV(loadfile));
+  } else {
+    /* Look in the loadpath for files which aren't specified as
+       absolute */
+    WV(lpath, arc_gbind(c, ARC_BUILTIN(c, S_LOADPATH)));
+    while (!NIL_P(AV(lpath))) {
+      WV(ldf, arc_pathjoin2(c, car(AV(lpath)), AV(loadfile)));
+      AFCALL(arc_mkaff(c, arc_file_exists, CNIL), AV(ldf));
+      if (!NIL_P(AFCRV))
+	break;
       WV(lpath, cdr(AV(lpath)));
-      continue;
     }
-    /* first open the file. */
-    AFCALL(arc_mkaff(c, arc_infile, CNIL), AV(ldf));
-    WV(fp, AFCRV);
-    /* The actual load takes place in the duringthunk. The
-       after thunk will take care of closing the file
-       whatever happens. */
-    WV(lndata, arc_mkhash(c, ARC_HASHBITS));
-    AFCALL(arc_mkaff(c, arc_dynamic_wind, CNIL),
-	   arc_mkaff2(c, beforethunk, CNIL, TENVR(thr)),
-	   arc_mkaff2(c, duringthunk, CNIL, TENVR(thr)),
-	   arc_mkaff2(c, afterthunk, CNIL, TENVR(thr)));
-    ARETURN(CNIL);
+    if (NIL_P(AV(lpath))) {
+      char *str;
+      STR2CSTR(AV(loadfile), str);
+      arc_err_cstrfmt(c, "file %s not found in loadpath*", str);
+      ARETURN(CNIL);
+    }
   }
-  {
-    char *str;
-    str = (char *)alloca(FIX2INT(arc_strutflen(c, AV(loadfile)))*sizeof(char));
-    arc_str2cstr(c, AV(loadfile), str);
-    arc_err_cstrfmt(c, "file %s not found in loadpath*", str);
-    ARETURN(CNIL);
+
+  /* Use the precompiled code if it is up to date */
+  WV(arcc, arccname(c, AV(ldf)));
+  WV(codes, CNIL);
+  WV(deps, INT2FIX(0));
+  if (!NIL_P(AV(arcc))) {
+    STR2CSTR(AV(ldf), arcfile);
+    STR2CSTR(AV(arcc), arccfile);
+    WV(deps, INT2FIX(arc_arcc_deps(c)));
+    WV(codes, arc_arcc_read(c, arcfile, arccfile,
+			    (unsigned long)FIX2INT(AV(deps))));
+    if (BOUND_P(AV(codes))) {
+      for (; !NIL_P(AV(codes)); WV(codes, cdr(AV(codes))))
+	AFCALL2(arc_mkclos(c, car(AV(codes)), CNIL), CNIL);
+      ARETURN(CNIL);
+    }
+    WV(codes, CNIL);
   }
+
+  /* first open the file. */
+  AFCALL(arc_mkaff(c, arc_infile, CNIL), AV(ldf));
+  WV(fp, AFCRV);
+  /* The actual load takes place in the duringthunk. The
+     after thunk will take care of closing the file
+     whatever happens. */
+  WV(lndata, arc_mkhash(c, ARC_HASHBITS));
+  AFCALL(arc_mkaff(c, arc_dynamic_wind, CNIL),
+	 arc_mkaff2(c, beforethunk, CNIL, TENVR(thr)),
+	 arc_mkaff2(c, duringthunk, CNIL, TENVR(thr)),
+	 arc_mkaff2(c, afterthunk, CNIL, TENVR(thr)));
+  ARETURN(CNIL);
   AFEND;
 }
 AFFEND
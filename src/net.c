@@ -51,12 +51,18 @@
 void *alloca (size_t);
 #endif
 
+#define SOCK_BUFSIZE 4096
+
 struct sock_t {
   int closed;
   int fd;
   int ai_family;
   int socktype;
   void *addr;
+  int listening;		/* a listening socket, which cannot be read */
+  int eof;			/* has the peer closed its end? */
+  unsigned char *rbuf;		/* data received but not yet read */
+  int rpos, rlen;
 };
 
 static typefn_t sock_tfn;
@@ -79,6 +85,10 @@ static void sock_sweeper(arc *c, value v)
     free(SOCKDATA(v)->addr);
     SOCKDATA(v)->addr = NULL;
   }
+  if (SOCKDATA(v)->rbuf != NULL) {
+    free(SOCKDATA(v)->rbuf);
+    SOCKDATA(v)->rbuf = NULL;
+  }
 }
 
 
@@ -99,7 +109,8 @@ static AFFDEF(sock_closed_p)
 }
 AFFEND
 
-static AFFDEF(sock_ready)
+/* A listening socket is ready when a connection can be accepted */
+static AFFDEF(sock_lready)
 {
   AARG(sock);
   fd_set rfds;
@@ -129,6 +140,45 @@ static AFFDEF(sock_ready)
 }
 AFFEND
 
+/* Any other socket is ready when there is received data in its buffer,
+   or the peer has closed the connection.  Rather than first checking
+   whether the socket is readable and then receiving from it, which
+   would take two system calls per byte, it receives as much as it can
+   into the buffer, waiting only if nothing was there. */
+static AFFDEF(sock_ready)
+{
+  AARG(sock);
+  struct sock_t *sd;
+  int n;
+  AFBEGIN;
+  if (SOCKDATA(AV(sock))->listening)
+    AFTCALL(arc_mkaff(c, sock_lready, CNIL), AV(sock));
+  for (;;) {
+    sd = SOCKDATA(AV(sock));
+    if (sd->rpos < sd->rlen || sd->eof)
+      ARETURN(CTRUE);
+    if (sd->rbuf == NULL)
+      sd->rbuf = (unsigned char *)malloc(SOCK_BUFSIZE);
+    n = __arc_iorecv(c, thr, sd->fd, sd->rbuf, SOCK_BUFSIZE);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      AIORECV(SOCKDATA(AV(sock))->fd, SOCK_BUFSIZE);
+      continue;
+    }
+    if (n < 0) {
+      int en = errno;
+
+      arc_err_cstrfmt(c, "error reading socket (%s; errno=%d)", strerror(en), en);
+      ARETURN(CNIL);
+    }
+    sd->rpos = 0;
+    sd->rlen = n;
+    if (n == 0)
+      sd->eof = 1;
+  }
+  AFEND;
+}
+AFFEND
+
 static AFFDEF(sock_wready)
 {
   AARG(sock);
@@ -166,6 +216,10 @@ static AFFDEF(sock_getb)
   int rb;
   AFBEGIN;
 
+  if (SOCKDATA(AV(sock))->rpos < SOCKDATA(AV(sock))->rlen)
+    ARETURN(INT2FIX(SOCKDATA(AV(sock))->rbuf[SOCKDATA(AV(sock))->rpos++]));
+  if (SOCKDATA(AV(sock))->eof)
+    ARETURN(CNIL);
   rb = recv(SOCKDATA(AV(sock))->fd, (void *)&ch, sizeof(ch), 0);
   if (rb == 0)
     ARETURN(CNIL);
@@ -250,6 +304,10 @@ static value mksocket(arc *c, int type, int sockfd, int ai_family, int socktype)
   SOCKDATA(sock)->addr = NULL;
   SOCKDATA(sock)->ai_family = ai_family;
   SOCKDATA(sock)->socktype = socktype;
+  SOCKDATA(sock)->listening = 0;
+  SOCKDATA(sock)->eof = 0;
+  SOCKDATA(sock)->rbuf = NULL;
+  SOCKDATA(sock)->rpos = SOCKDATA(sock)->rlen = 0;
   return(sock);
 }
 
@@ -277,6 +335,7 @@ AFFDEF(arc_open_socket)
   int yes=1;
   char portstr[6];
   int family, socktype;
+  value sock;
   AFBEGIN;
 
   TYPECHECK(AV(port), T_FIXNUM);
@@ -329,7 +388,9 @@ AFFDEF(arc_open_socket)
     arc_err_cstrfmt(c, "open-socket: error listening (%s; errno=%d)", strerror(en), en);
     ARETURN(CNIL);
   }
-  ARETURN(mksocket(c, T_INPORT, sockfd, family, socktype));
+  sock = mksocket(c, T_INPORT, sockfd, family, socktype);
+  SOCKDATA(sock)->listening = 1;
+  ARETURN(sock);
   AFEND;
 }
 AFFEND
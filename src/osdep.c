@@ -68,6 +68,42 @@ unsigned long long __arc_milliseconds(void)
 #endif
 }
 
+/* Microseconds since some arbitrary time.  Unlike the time given by
+   __arc_milliseconds, this never goes back if the clock is set. */
+unsigned long long __arc_usec(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+  struct timespec tp;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &tp) == 0)
+    return(((unsigned long long)tp.tv_sec)*1000000LL
+	   + ((unsigned long long)tp.tv_nsec / 1000LL));
+#endif
+  return(__arc_milliseconds()*1000LL);
+}
+
+/* Microseconds of CPU time used by the interpreter, or if possible
+   only by the OS thread which is running it, leaving out the helpers
+   of the I/O pool. */
+unsigned long long __arc_cpu_usec(void)
+{
+  struct rusage usage;
+#ifdef HAVE_CLOCK_GETTIME
+  struct timespec tp;
+
+#ifdef CLOCK_THREAD_CPUTIME_ID
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &tp) == 0)
+    return(((unsigned long long)tp.tv_sec)*1000000LL
+	   + ((unsigned long long)tp.tv_nsec / 1000LL));
+#endif
+#endif
+  getrusage(RUSAGE_SELF, &usage);
+  return(((unsigned long long)usage.ru_utime.tv_sec)*1000000LL
+	 + (unsigned long long)usage.ru_utime.tv_usec
+	 + ((unsigned long long)usage.ru_stime.tv_sec)*1000000LL
+	 + (unsigned long long)usage.ru_stime.tv_usec);
+}
+
 value arc_seconds(arc *c)
 {
   return(__arc_ull2val(c, __arc_milliseconds() / 1000ULL));
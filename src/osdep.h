@@ -21,6 +21,8 @@
 
 /* OS-dependent functions */
 extern unsigned long long __arc_milliseconds(void);
+extern unsigned long long __arc_usec(void);
+extern unsigned long long __arc_cpu_usec(void);
 extern value arc_seconds(arc *c);
 extern value arc_msec(arc *c);
 extern value arc_current_process_milliseconds(arc *c);
@@ -333,8 +333,18 @@ static void help(void)
   printf("                        more than once)\n");
   printf("  --init-load           init load file (defaults to %s)\n",
 	 DEFAULT_LOADFILE);
+  printf("  -i, --image=FILE      restore the heap image FILE written by\n");
+  printf("                        dump-image instead of loading the init\n");
+  printf("                        load file\n");
   printf("  -l, --load=FILE       load FILE before dropping into the REPL\n");
   printf("                        (may be used more than once)\n");
+  printf("  -p, --profile=FILE    write a bytecode profile of the program\n");
+  printf("                        to FILE on exit\n");
+  printf("  --sample-profile=FILE write the call stacks sampled while the\n");
+  printf("                        program runs to FILE on exit, in the\n");
+  printf("                        collapsed format used by flame graphs\n");
+  printf("  --alloc-profile=FILE  write the sites where the program\n");
+  printf("                        allocated the most memory to FILE on exit\n");
   printf("  -q, --quiet           do not display banner on startup\n");
   printf("  -h, --help            display this help and exit\n");
   printf("  -v, --version         output version information and exit\n");
@@ -406,6 +416,34 @@ AFFEND
   ret = TVALR(c->curthread)
 
 static arc *c, cc;
+static const char *profile_file = NULL;
+static const char *sample_file = NULL;
+static const char *alloc_file = NULL;
+
+static void write_profile(const char *file, void (*dump)(arc *, FILE *))
+{
+  FILE *fp;
+
+  fp = fopen(file, "w");
+  if (fp == NULL) {
+    fprintf(stderr, "arcueid: could not write profile to %s\n", file);
+    return;
+  }
+  dump(c, fp);
+  fclose(fp);
+}
+
+/* Write the profiles which were requested, and shut down */
+static void finish(void)
+{
+  if (profile_file != NULL && c->vmprof != NULL)
+    write_profile(profile_file, arc_vmprof_dump);
+  if (sample_file != NULL && c->sprof != NULL)
+    write_profile(sample_file, arc_sprof_dump);
+  if (alloc_file != NULL && c->aprof != NULL)
+    write_profile(alloc_file, arc_aprof_dump);
+  arc_deinit(c);
+}
 
 void cleanup(void)
 {
@@ -426,7 +464,7 @@ void cleanup(void)
   }
 #endif
 
-  arc_deinit(c);
+  finish();
 }
 
 #ifdef HAVE_LIBREADLINE
@@ -439,7 +477,7 @@ int main(int argc, const char **argv)
 {
   value ret, cctx, code, clos;
   int i, scriptmode;
-  const char *evalcode, *loadstr, *ls;
+  const char *evalcode, *loadstr, *ls, *imagefile = NULL;
   void *options;
 
   options =
@@ -452,8 +490,16 @@ int main(int argc, const char **argv)
 				     gopt_longs("eval")),
 			 gopt_option('q', 0, gopt_shorts('q'),
 				     gopt_longs("quiet")),
+			 gopt_option('p', GOPT_ARG, gopt_shorts('p'),
+				     gopt_longs("profile")),
+			 gopt_option('S', GOPT_ARG, gopt_shorts(0),
+				     gopt_longs("sample-profile")),
+			 gopt_option('A', GOPT_ARG, gopt_shorts(0),
+				     gopt_longs("alloc-profile")),
 			 gopt_option('L', GOPT_ARG, gopt_shorts(0),
 				     gopt_longs("init-load")),
+			 gopt_option('i', GOPT_ARG, gopt_shorts('i'),
+				     gopt_longs("image")),
 			 gopt_option('I', GOPT_ARG|GOPT_REPEAT,
 				     gopt_shorts('I'),
 				     gopt_longs("include")),
@@ -494,9 +540,18 @@ int main(int argc, const char **argv)
   atexit(cleanup);
 
   c->curthread = arc_mkthread(c);
-  /* Load arc.arc into our system. */
-  arc_bindcstr(c, "initload-file", arc_mkstringc(c, loadstr));
-  EXECUTE("(load initload-file)");
+  /* Restore a heap image if one was given, otherwise load arc.arc
+     into our system. */
+  if (gopt_arg(options, 'i', &imagefile)
+      && arc_image_load(c, imagefile) < 0) {
+    fprintf(stderr, "arcueid: could not restore image %s, loading %s\n",
+	    imagefile, loadstr);
+    imagefile = NULL;
+  }
+  if (imagefile == NULL) {
+    arc_bindcstr(c, "initload-file", arc_mkstringc(c, loadstr));
+    EXECUTE("(load initload-file)");
+  }
   c->errhandler = errhandler;
   c->gc(c);
 
@@ -522,12 +577,26 @@ int main(int argc, const char **argv)
   if (!gopt_arg(options, 'e', &evalcode))
     evalcode = replcode;
 
+  /* Profile only the program itself, not the loading of arc.arc */
+  if (gopt_arg(options, 'p', &profile_file) && arc_vmprof_start(c) < 0) {
+    fprintf(stderr, "arcueid: could not start profiling\n");
+    profile_file = NULL;
+  }
+  if (gopt_arg(options, 'S', &sample_file) && arc_sprof_start(c, 0) < 0) {
+    fprintf(stderr, "arcueid: could not start sampling profiler\n");
+    sample_file = NULL;
+  }
+  if (gopt_arg(options, 'A', &alloc_file) && arc_aprof_start(c, 0) < 0) {
+    fprintf(stderr, "arcueid: could not start allocation profiler\n");
+    alloc_file = NULL;
+  }
+
   gopt_free(options);
 
   if (argc > 1 && evalcode == replcode) {
     /* load and execute file specified on command line with no -e options */
     if (setjmp(ejb) != 0) {
-      arc_deinit(c);
+      finish();
       return(EXIT_FAILURE);
     }
 
@@ -578,12 +647,12 @@ int main(int argc, const char **argv)
     clos = arc_gbind_cstr(c, "repl-code*");
     if (TYPE(clos) != T_CLOS) {
       fprintf(stderr, "bad repl code\n");
-      arc_deinit(c);
+      finish();
       return(EXIT_FAILURE);
     }
   } else if (setjmp(ejb) != 0) {
     /* if other code, just shut down */
-    arc_deinit(c);
+    finish();
     return(EXIT_FAILURE);
   }
   replthread = arc_spawn(c, clos);
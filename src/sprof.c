@@ -0,0 +1,380 @@
+/*
+  Copyright (C) 2013 Rafael R. Sevilla
+
+  This file is part of Arcueid
+
+  Arcueid is free software: you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this library. If not, see <http://www.gnu.org/licenses/>
+*/
+
+/* The sampling profiler.  A SIGPROF interval timer ticks at a fixed
+   rate of CPU time.  The signal handler does nothing but count the
+   tick, and the trampoline, which every function call and return and
+   every end of a quantum passes through, takes the sample the next
+   time it runs.  The sample is the call stack of the thread being run,
+   made by walking the continuations in its continuation register,
+   written as a line of the collapsed stack format used by flame graph
+   tools, e.g.
+
+   main (foo.arc:10);fib (foo.arc:2);fib (foo.arc:2) 12
+
+   The stacks are counted in a hash table of strings kept outside the
+   Arc heap, so that taking a sample disturbs the program as little as
+   possible. */
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+#include "arcueid.h"
+#include "vmengine.h"
+#include "../config.h"
+
+#ifdef HAVE_ALLOCA_H
+# include <alloca.h>
+#elif defined __GNUC__
+#ifndef alloca
+# define alloca __builtin_alloca
+#endif
+#elif defined _AIX
+# define alloca __alloca
+#elif defined _MSC_VER
+# include <malloc.h>
+# define alloca _alloca
+#else
+# include <stddef.h>
+void *alloca (size_t);
+#endif
+
+#define SPROF_DEFAULT_HZ 100
+#define SPROF_MAX_HZ 10000
+#define SPROF_HASHBITS 12
+#define SPROF_MAXDEPTH 256
+
+struct sprof_stack {
+  char *frames;
+  unsigned long long count;
+  struct sprof_stack *next;
+};
+
+struct sprofile {
+  int hz;
+  struct sigaction oldact;
+  struct sprof_stack *stacks[1 << SPROF_HASHBITS];
+};
+
+/* A growable C string */
+struct sbuf {
+  char *s;
+  int len;
+  int size;
+};
+
+volatile sig_atomic_t __arc_sprof_pending = 0;
+
+static void sprof_handler(int sig)
+{
+  __arc_sprof_pending++;
+}
+
+static void sbuf_append(struct sbuf *sb, const char *str, int len)
+{
+  if (sb->len + len + 1 > sb->size) {
+    while (sb->len + len + 1 > sb->size)
+      sb->size = (sb->size == 0) ? 256 : sb->size * 2;
+    sb->s = realloc(sb->s, sb->size);
+  }
+  memcpy(sb->s + sb->len, str, len);
+  sb->len += len;
+  sb->s[sb->len] = '\0';
+}
+
+static void sbuf_cstr(struct sbuf *sb, const char *str)
+{
+  sbuf_append(sb, str, strlen(str));
+}
+
+/* Append a symbol or string, with any semicolons in it, which would
+   otherwise be taken as frame separators, replaced. */
+static void sbuf_name(arc *c, struct sbuf *sb, value name)
+{
+  char *cstr, *p;
+
+  if (SYMBOL_P(name))
+    name = arc_sym2name(c, name);
+  if (TYPE(name) != T_STRING) {
+    sbuf_cstr(sb, "<anonymous>");
+    return;
+  }
+  cstr = alloca(sizeof(char)*(FIX2INT(arc_strutflen(c, name)) + 1));
+  arc_str2cstr(c, name, cstr);
+  for (p = cstr; *p; p++) {
+    if (*p == ';')
+      *p = ':';
+  }
+  sbuf_cstr(sb, cstr);
+}
+
+/* Append the name of the function and the file and line of the
+   instruction at offset ofs within it, if they are known. */
+static void sbuf_frame(arc *c, struct sbuf *sb, value fun, int ofs)
+{
+  value code, fileline;
+  char linestr[32];
+
+  if (TYPE(fun) == T_CCODE) {
+    sbuf_name(c, sb, __arc_ccode_name(c, fun));
+    return;
+  }
+  code = CLOS_CODE(fun);
+  sbuf_name(c, sb, (NIL_P(CODE_SRC(code))) ? CNIL
+	    : SRC_FUNCNAME(CODE_SRC(code)));
+  /* The offset is that of the instruction after the one being
+     executed, which might already be on the next line. */
+  if (ofs > 0)
+    ofs--;
+  fileline = __arc_code_lineno(c, fun, &XVINDEX(CODE_CODE(code), ofs));
+  if (!BOUND_P(fileline))
+    return;
+  sbuf_cstr(sb, " (");
+  if (!NIL_P(car(fileline)))
+    sbuf_name(c, sb, car(fileline));
+  snprintf(linestr, sizeof(linestr), ":%ld)", FIX2INT(cdr(fileline)));
+  sbuf_cstr(sb, linestr);
+}
+
+static void count_stack(struct sprofile *prof, const char *frames,
+			unsigned long long count)
+{
+  struct sprof_stack *st;
+  unsigned long h = 5381;
+  const char *p;
+
+  for (p = frames; *p; p++)
+    h = h * 33 + (unsigned char)*p;
+  h &= (1 << SPROF_HASHBITS) - 1;
+  for (st = prof->stacks[h]; st != NULL; st = st->next) {
+    if (strcmp(st->frames, frames) == 0) {
+      st->count += count;
+      return;
+    }
+  }
+  st = (struct sprof_stack *)malloc(sizeof(struct sprof_stack));
+  st->frames = strdup(frames);
+  st->count = count;
+  st->next = prof->stacks[h];
+  prof->stacks[h] = st;
+}
+
+/* Get the functions on the call stack of thr, innermost first, and
+   the offsets within them of the instructions they were executing.
+   Returns the number of frames, at most SPROF_MAXDEPTH. */
+static int stack_frames(arc *c, value thr, value *funs, int *ofs)
+{
+  value cont;
+  int n = 0;
+
+  if (TYPE(TFUNR(thr)) == T_CLOS) {
+    funs[n] = TFUNR(thr);
+    ofs[n++] = TIPP(thr) - &XVINDEX(CODE_CODE(CLOS_CODE(TFUNR(thr))), 0);
+  } else if (TYPE(TFUNR(thr)) == T_CCODE) {
+    funs[n] = TFUNR(thr);
+    ofs[n++] = 0;
+  }
+  for (cont = TCONR(thr); !NIL_P(cont) && n < SPROF_MAXDEPTH;) {
+    cont = __arc_cont_frame(c, thr, cont, &funs[n], &ofs[n]);
+    if (TYPE(funs[n]) == T_CLOS || TYPE(funs[n]) == T_CCODE)
+      n++;
+  }
+  return(n);
+}
+
+/* Take a sample of the call stack of thr, counting all the ticks of
+   the timer since the last sample.  If thr is nil, the ticks are
+   counted against the garbage collector instead. */
+void __arc_sprof_sample(arc *c, value thr)
+{
+  struct sprofile *prof = c->sprof;
+  value funs[SPROF_MAXDEPTH];
+  int ofs[SPROF_MAXDEPTH], n, i;
+  unsigned long long ticks;
+  struct sbuf sb = { NULL, 0, 0 };
+
+  ticks = __arc_sprof_pending;
+  __arc_sprof_pending = 0;
+  if (prof == NULL)
+    return;
+  if (NIL_P(thr)) {
+    count_stack(prof, "[gc]", ticks);
+    return;
+  }
+
+  n = stack_frames(c, thr, funs, ofs);
+  if (n == 0)
+    return;
+
+  /* The collapsed stack format puts the outermost frame first */
+  for (i=n-1; i>=0; i--) {
+    sbuf_frame(c, &sb, funs[i], ofs[i]);
+    if (i > 0)
+      sbuf_cstr(&sb, ";");
+  }
+  count_stack(prof, sb.s, ticks);
+  free(sb.s);
+}
+
+/* The call stack of thr as a list of strings, one for each function,
+   innermost first, giving its name and the file and line it was at. */
+value __arc_backtrace(arc *c, value thr)
+{
+  value funs[SPROF_MAXDEPTH], list = CNIL;
+  int ofs[SPROF_MAXDEPTH], n, i;
+  struct sbuf sb;
+
+  n = stack_frames(c, thr, funs, ofs);
+  for (i=n-1; i>=0; i--) {
+    sb.s = NULL;
+    sb.len = sb.size = 0;
+    sbuf_frame(c, &sb, funs[i], ofs[i]);
+    list = cons(c, arc_mkstringc(c, (sb.s == NULL) ? "" : sb.s), list);
+    free(sb.s);
+  }
+  return(list);
+}
+
+/* Start sampling hz times a second of CPU time, discarding any earlier
+   samples. */
+int arc_sprof_start(arc *c, int hz)
+{
+  struct sigaction act;
+  struct itimerval itv;
+
+  arc_sprof_stop(c);
+  if (hz <= 0)
+    hz = SPROF_DEFAULT_HZ;
+  if (hz > SPROF_MAX_HZ)
+    hz = SPROF_MAX_HZ;
+  c->sprof = (struct sprofile *)calloc(1, sizeof(struct sprofile));
+  if (c->sprof == NULL)
+    return(-1);
+  c->sprof->hz = hz;
+  __arc_sprof_pending = 0;
+
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = sprof_handler;
+  sigemptyset(&act.sa_mask);
+  act.sa_flags = SA_RESTART;
+  if (sigaction(SIGPROF, &act, &c->sprof->oldact) < 0) {
+    free(c->sprof);
+    c->sprof = NULL;
+    return(-1);
+  }
+  itv.it_interval.tv_sec = (1000000 / hz) / 1000000;
+  itv.it_interval.tv_usec = (1000000 / hz) % 1000000;
+  itv.it_value = itv.it_interval;
+  if (setitimer(ITIMER_PROF, &itv, NULL) < 0) {
+    arc_sprof_stop(c);
+    return(-1);
+  }
+  return(0);
+}
+
+/* Stop sampling and discard the samples */
+void arc_sprof_stop(arc *c)
+{
+  struct itimerval itv;
+  struct sprof_stack *st, *next;
+  int i;
+
+  if (c->sprof == NULL)
+    return;
+  memset(&itv, 0, sizeof(itv));
+  setitimer(ITIMER_PROF, &itv, NULL);
+  sigaction(SIGPROF, &c->sprof->oldact, NULL);
+  __arc_sprof_pending = 0;
+  for (i=0; i<(1 << SPROF_HASHBITS); i++) {
+    for (st = c->sprof->stacks[i]; st != NULL; st = next) {
+      next = st->next;
+      free(st->frames);
+      free(st);
+    }
+  }
+  free(c->sprof);
+  c->sprof = NULL;
+}
+
+static void collapsed(arc *c, struct sbuf *sb)
+{
+  struct sprof_stack *st;
+  char countstr[32];
+  int i;
+
+  if (c->sprof == NULL)
+    return;
+  for (i=0; i<(1 << SPROF_HASHBITS); i++) {
+    for (st = c->sprof->stacks[i]; st != NULL; st = st->next) {
+      sbuf_cstr(sb, st->frames);
+      snprintf(countstr, sizeof(countstr), " %llu\n", st->count);
+      sbuf_cstr(sb, countstr);
+    }
+  }
+}
+
+/* The samples so far in collapsed stack format, as a string */
+value arc_sprof_report(arc *c)
+{
+  struct sbuf sb = { NULL, 0, 0 };
+  value str;
+
+  if (c->sprof == NULL)
+    return(CNIL);
+  collapsed(c, &sb);
+  str = arc_mkstringc(c, (sb.s == NULL) ? "" : sb.s);
+  free(sb.s);
+  return(str);
+}
+
+/* Write the samples so far in collapsed stack format */
+void arc_sprof_dump(arc *c, FILE *fp)
+{
+  struct sbuf sb = { NULL, 0, 0 };
+
+  collapsed(c, &sb);
+  if (sb.s != NULL)
+    fputs(sb.s, fp);
+  free(sb.s);
+}
+
+/* (sample-profile t [hz]) starts sampling, (sample-profile) gets the
+   samples in collapsed stack format, and (sample-profile nil) stops
+   sampling. */
+AFFDEF(arc_sample_profile)
+{
+  AOARG(on, hz);
+  AFBEGIN;
+  if (!BOUND_P(AV(on)))
+    ARETURN(arc_sprof_report(c));
+  if (NIL_P(AV(on))) {
+    arc_sprof_stop(c);
+    ARETURN(CNIL);
+  }
+  if (BOUND_P(AV(hz))) {
+    TYPECHECK(AV(hz), T_FIXNUM);
+  }
+  if (arc_sprof_start(c, BOUND_P(AV(hz)) ? FIX2INT(AV(hz)) : 0) < 0) {
+    arc_err_cstrfmt(c, "cannot start sampling profiler");
+    ARETURN(CNIL);
+  }
+  ARETURN(CTRUE);
+  AFEND;
+}
+AFFEND
@@ -19,6 +19,7 @@
 #include "arcueid.h"
 #include "builtins.h"
 #include "io.h"
+#include "hash.h"
 
 #define READ(fp, eof, val)					\
   AFCALL(arc_mkaff(c, arc_sread, CNIL), fp, eof);	\
@@ -30,20 +31,9 @@
 
 value arc_ssyntax(arc *c, value x)
 {
-  value name;
-  int i;
-  Rune ch;
-
   if (TYPE(x) != T_SYMBOL)
     return(CNIL);
-
-  name = arc_sym2name(c, x);
-  for (i=0; i<arc_strlen(c, name); i++) {
-    ch = arc_strindex(c, name, i);
-    if (ch == ':' || ch == '~' || ch == '&' || ch == '.' || ch == '!')
-      return(CTRUE);
-  }
-  return(CNIL);
+  return((__arc_symflags(c, x) & SYMF_SSYNTAX) ? CTRUE : CNIL);
 }
 
 /* I imagine this can be done a lot more cleanly! */
@@ -216,6 +206,19 @@ static AFFDEF(expand_ssyntax)
 } 
 AFFEND
 
+/* Copy the conses of an expansion, so that the one kept in the cache
+   cannot be altered through what a caller was given. */
+static value copy_expansion(arc *c, value x)
+{
+  if (!CONS_P(x))
+    return(x);
+  return(cons(c, copy_expansion(c, car(x)), copy_expansion(c, cdr(x))));
+}
+
+/* Symbols whose names have no ssyntax characters (which is nearly all
+   of them) are recognized by their flags with no string work.  The
+   expansions of the rest are cached, so each is only read once, and
+   every caller gets its own copy. */
 AFFDEF(arc_ssexpand)
 {
   AARG(sym);
@@ -225,11 +228,20 @@ AFFDEF(arc_ssexpand)
   if (TYPE(AV(sym)) != T_SYMBOL)
     ARETURN(AV(sym));
 
-  if (AV(sym) == ARC_BUILTIN(c, S_RXMATCH))
+  if (!(__arc_symflags(c, AV(sym)) & SYMF_SSYNTAX)
+      || AV(sym) == ARC_BUILTIN(c, S_RXMATCH))
     ARETURN(CNIL);
 
-  x = arc_sym2name(c, AV(sym));
-  AFTCALL(arc_mkaff(c, expand_ssyntax, CNIL), x);
+  x = arc_hash_lookup(c, VINDEX(c->builtins, BI_ssyntax), AV(sym));
+  if (BOUND_P(x))
+    ARETURN(copy_expansion(c, x));
+
+  AFCALL(arc_mkaff(c, expand_ssyntax, CNIL), arc_sym2name(c, AV(sym)));
+  if (NIL_P(AFCRV))
+    ARETURN(CNIL);
+  arc_hash_insert(c, VINDEX(c->builtins, BI_ssyntax), AV(sym),
+		  copy_expansion(c, AFCRV));
+  ARETURN(AFCRV);
   AFEND;
 }
 AFFEND
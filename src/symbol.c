@@ -16,11 +16,58 @@
   You should have received a copy of the GNU Lesser General Public
   License along with this library; if not, see <http://www.gnu.org/licenses/>.
 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "arcueid.h"
 #include "builtins.h"
 #include "compiler.h"
 #include "hash.h"
 
+/* Compute the flags for a newly interned symbol */
+static void setflags(arc *c, int id, value name)
+{
+  unsigned char *nflags;
+  int i, nsize, flags = 0;
+  Rune ch;
+
+  if (id >= c->nsymflags) {
+    nsize = (c->nsymflags == 0) ? 1024 : c->nsymflags;
+    while (nsize <= id)
+      nsize *= 2;
+    nflags = realloc(c->symflags, nsize);
+    if (nflags == NULL) {
+      fprintf(stderr, "FATAL: failed to allocate memory for symbol flags\n");
+      exit(1);
+    }
+    memset(nflags + c->nsymflags, 0, nsize - c->nsymflags);
+    c->symflags = nflags;
+    c->nsymflags = nsize;
+  }
+
+  for (i=0; i<arc_strlen(c, name); i++) {
+    ch = arc_strindex(c, name, i);
+    if (ch == ':' || ch == '~' || ch == '&' || ch == '.' || ch == '!')
+      flags |= SYMF_SSYNTAX;
+  }
+  c->symflags[id] = flags;
+}
+
+int __arc_symflags(arc *c, value sym)
+{
+  unsigned long id = SYM2ID(sym);
+
+  return((id < (unsigned long)c->nsymflags) ? c->symflags[id] : 0);
+}
+
+void __arc_setsymflags(arc *c, value sym, int flags)
+{
+  unsigned long id = SYM2ID(sym);
+
+  if (id < (unsigned long)c->nsymflags)
+    c->symflags[id] = flags;
+}
+
 value arc_intern(arc *c, value name)
 {
   value symid, symval;
@@ -42,6 +89,7 @@ value arc_intern(arc *c, value name)
   symval = ID2SYM(symintid);
   arc_hash_insert(c, c->symtable, name, symid);
   arc_hash_insert(c, c->rsymtable, symid, name);
+  setflags(c, symintid, name);
   return(symval);
 }
 
@@ -85,7 +133,7 @@ static char *syms[] = { "fn", "_", "quote", "quasiquote", "unquote",
 			"sig", "stdin-fd", "stdout-fd", "stderr-fd",
 			"mac", "if", "assign", "o", ".", "car", "cdr",
 			"scar", "scdr", "is", "+", "-", "*", "/",
-			"and", "apply", "chan", "AF_UNIX", "AF_INET",
+			"<", ">", "len", "and", "apply", "chan", "AF_UNIX", "AF_INET",
 			"AF_INET6", "SOCK_STREAM", "SOCK_DGRAM",
 			"SOCK_RAW", "binary", "text", "append",
 			"atstrings", "lndata", "dlist", "eval",
@@ -108,12 +156,23 @@ void arc_init_symtable(arc *c)
   c->symtable = arc_mkwtable(c, ARC_HASHBITS);
   c->rsymtable = arc_mkwtable(c, ARC_HASHBITS);
   c->lastsym = 0;
+  c->symflags = NULL;
+  c->nsymflags = 0;
 
   /* Set up builtin symbols */
   SVINDEX(c->builtins, BI_syms, arc_mkvector(c, S_THE_END));
   for (i=0; i<S_THE_END; i++)
     SARC_BUILTIN(c, i, arc_intern(c, arc_mkstringc(c, syms[i])));
 
+  /* Expansions of symbols with ssyntax are cached here */
+  SVINDEX(c->builtins, BI_ssyntax, arc_mkhash(c, ARC_HASHBITS));
+
+  /* Inline expansion sites of global functions, by function name */
+  SVINDEX(c->builtins, BI_inline, arc_mkhash(c, ARC_HASHBITS));
+
+  /* Expansions of recently expanded macro forms */
+  __arc_macex_flush(c);
+
   /* Set up character escape table */
   SVINDEX(c->builtins, BI_charesc, arc_mkhash(c, ARC_HASHBITS));
   for (i=0; chartbl[i].str; i++) {
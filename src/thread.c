@@ -18,9 +18,12 @@
 */
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <errno.h>
 #include <time.h>
 #include <sys/time.h>
+#include <unistd.h>
+#include <sys/socket.h>
 #include "arcueid.h"
 #include "vmengine.h"
 #include "arith.h"
@@ -88,10 +91,23 @@ static void thread_marker(arc *c, value thr, int depth,
   mark(c, TEXH(thr), depth);
   mark(c, TCM(thr), depth);
   mark(c, TRVCH(thr), depth);
+  mark(c, TWAITON(thr), depth);
+  mark(c, TMACREADS(thr), depth);
   mark(c, TCH(thr), depth);
   mark(c, TBCH(thr), depth);
 }
 
+/* Where the stack of thr overflows.  Some of the stack is always
+   kept back, so that the thread can still handle the error. */
+static value *stklimit(arc *c, value thr)
+{
+  int reserve = (c->stksize/4 < TSTKRESERVE) ? c->stksize/4 : TSTKRESERVE;
+
+  if (TMAXSTACK(thr) > 0 && TMAXSTACK(thr) < TSTOP(thr) - TSBASE(thr) - reserve)
+    return(TSTOP(thr) - TMAXSTACK(thr));
+  return(TSBASE(thr) + reserve);
+}
+
 value arc_mkthread(arc *c)
 {
   value thr;
@@ -109,6 +125,8 @@ value arc_mkthread(arc *c)
 
   TSTATE(thr) = Tready;
   TTID(thr) = ++c->tid_nonce;
+  TPRIO(thr) = 0;
+  TSLICE(thr) = c->quantum;
   TQUANTA(thr) = 0;
   TTICKS(thr) = 0LL;
   TWAKEUP(thr) = 0LL;
@@ -117,8 +135,24 @@ value arc_mkthread(arc *c)
   TEXH(thr) = CNIL;
   TACELL(thr) = 0;
   TRVCH(thr) = arc_mkchan(c);
+  __arc_chan_sender(c, TRVCH(thr), thr);
   TCH(thr) = cons(c, INT2FIX(0xdead), CNIL);
   TBCH(thr) = TCH(thr);
+  TSCHEDQ(thr) = 0;
+  TSLEEPIDX(thr) = -1;
+  TIOREQ(thr) = NULL;
+  TIOJOB(thr) = NULL;
+  TWAITON(thr) = CNIL;
+  TMACREADS(thr) = CUNBOUND;
+  TREPORTED(thr) = 0LL;
+  TREPKIND(thr) = 0;
+  TCPUTIME(thr) = TINSTS(thr) = TALLOCATED(thr) = TNSWITCHES(thr) = 0LL;
+  memset(TWAITTIME(thr), 0, sizeof(TWAITTIME(thr)));
+  TWAITSINCE(thr) = __arc_usec();
+  TWAITSTATE(thr) = Tready;
+  TMAXINSTS(thr) = TMAXALLOC(thr) = 0LL;
+  TMAXSTACK(thr) = 0;
+  TSLIMIT(thr) = stklimit(c, thr);
   return(thr);
 }
 
@@ -198,42 +232,718 @@ value arc_ccmark(arc *c, value key)
   return(val);
 }
 
-#ifdef HAVE_SYS_EPOLL_H
+/* Charge the time since thr began what it was last doing to it, and
+   have it begin doing what its state says it does now. */
+static void charge_wait(value thr, unsigned long long now)
+{
+  if (now > TWAITSINCE(thr))
+    TWAITTIME(thr)[TWAITSTATE(thr)] += now - TWAITSINCE(thr);
+  TWAITSINCE(thr) = now;
+  TWAITSTATE(thr) = (RUNNABLE(thr)) ? Tready : TSTATE(thr);
+}
+
+/* Make thr resume in a call to arc_err with the message msg */
+static void thread_err(arc *c, value thr, const char *msg)
+{
+  typefn_t *tfn;
+
+  SVALR(thr, arc_mkaff(c, arc_err, CNIL));
+  CPUSH(thr, arc_mkstringc(c, msg));
+  TARGC(thr) = 1;
+  SFUNR(thr, TVALR(thr));
+  tfn = __arc_typefn(c, TVALR(thr));
+  tfn->apply(c, thr, TVALR(thr));
+}
+
+/* Called by CPUSH when the stack of thr reaches its limit.  The
+   thread gets the rest of its stack to handle the error with, and if
+   it uses that up too there is nothing more to be done. */
+void __arc_stkover(arc *c, value thr)
+{
+  if (TSLIMIT(thr) <= TSBASE(thr) || thr != c->curthread) {
+    if (TSP(thr) <= TSBASE(thr))
+      abort();
+    return;
+  }
+  TSLIMIT(thr) = TSBASE(thr);
+  arc_err_cstrfmt(c, "stack overflow");
+}
+
+/* Called by arc_mkobject when the running thread has allocated as
+   much as it may.  It stops at the next instruction, and the
+   dispatcher raises the error. */
+void __arc_alloc_limit(arc *c)
+{
+  c->alloclimit = ULLONG_MAX;
+  TQUANTA(c->curthread) = 1;
+}
+
+/* Keep the slice thr is about to run within its limits, and raise
+   an error in the thread if it has already gone past one.  Each limit
+   is removed once it has been exceeded, so that the thread can go on
+   to handle the error. */
+static void limit_slice(arc *c, value thr)
+{
+  if (TMAXINSTS(thr) > 0 && TINSTS(thr) >= TMAXINSTS(thr)) {
+    TMAXINSTS(thr) = 0LL;
+    thread_err(c, thr, "instruction limit exceeded");
+  } else if (TMAXALLOC(thr) > 0 && TALLOCATED(thr) >= TMAXALLOC(thr)) {
+    TMAXALLOC(thr) = 0LL;
+    thread_err(c, thr, "allocation limit exceeded");
+  }
+  if (TMAXINSTS(thr) > 0 && TQUANTA(thr) > TMAXINSTS(thr) - TINSTS(thr))
+    TQUANTA(thr) = TMAXINSTS(thr) - TINSTS(thr);
+  if (TMAXALLOC(thr) > 0)
+    c->alloclimit = c->allocated + (TMAXALLOC(thr) - TALLOCATED(thr)) - 1;
+  /* the thread has come back from a stack overflow */
+  if (TSP(thr) > stklimit(c, thr))
+    TSLIMIT(thr) = stklimit(c, thr);
+}
+
+/* The time slice a thread of priority prio starts with.  Threads of
+   higher priority get shorter slices, and those of lower priority
+   longer ones. */
+static unsigned long base_slice(arc *c, int prio)
+{
+  return((prio >= 0) ? c->quantum >> prio : c->quantum << -prio);
+}
+
+/* Adapt the time slice of thr to how it used the one it just had.  A
+   thread which used up its slice is doing a long computation, and its
+   slice is doubled, up to four times what it started with, so that
+   it is switched out less often.  A thread which gave up the
+   processor early is waiting for something, and goes back to the
+   slice it started with. */
+static void adapt_slice(arc *c, value thr)
+{
+  unsigned long base = base_slice(c, TPRIO(thr));
+
+  if (RUNNABLE(thr) && TQUANTA(thr) <= 0) {
+    if (TSLICE(thr) < base*4)
+      TSLICE(thr) *= 2;
+  } else {
+    TSLICE(thr) = base;
+  }
+}
+
+/* Put a thread on the run queue, if it is not already there.  A
+   thread which was waiting for something goes on the express queue,
+   to be run ahead of the others, if it has a high priority, or if it
+   has a normal priority and is not in the middle of a long
+   computation. */
+void __arc_thr_enqueue(arc *c, value thr)
+{
+  int express;
+
+  if (TSCHEDQ(thr) & TQ_RUN)
+    return;
+  /* It stops waiting for whatever it waited for, and begins waiting
+     to be run */
+  express = 0;
+  if (TWAITSTATE(thr) != Tready) {
+    charge_wait(thr, __arc_usec());
+    express = (TPRIO(thr) > 0 || (TPRIO(thr) == 0 && TSLICE(thr) <= c->quantum));
+  }
+  TSCHEDQ(thr) |= TQ_RUN;
+  if (express)
+    __arc_enqueue(c, thr, &c->expressq, &c->exprtail);
+  else
+    __arc_enqueue(c, thr, &c->vmthreads, &c->vmthrtail);
+}
+
+/* The sleeping threads are kept in a binary heap ordered by their
+   wakeup times, so the dispatcher need only look at the top of the
+   heap to find the threads it has to wake.  Every thread knows where
+   in the heap it is, so that a thread woken early can be taken out. */
+static void sleep_swap(arc *c, int i, int j)
+{
+  value t = c->sleepers[i];
+
+  c->sleepers[i] = c->sleepers[j];
+  c->sleepers[j] = t;
+  TSLEEPIDX(c->sleepers[i]) = i;
+  TSLEEPIDX(c->sleepers[j]) = j;
+}
+
+static void sleep_siftup(arc *c, int i)
+{
+  while (i > 0 && TWAKEUP(c->sleepers[i]) < TWAKEUP(c->sleepers[(i-1)/2])) {
+    sleep_swap(c, i, (i-1)/2);
+    i = (i-1)/2;
+  }
+}
+
+static void sleep_siftdown(arc *c, int i)
+{
+  int min, l, r;
+
+  for (;;) {
+    min = i;
+    l = 2*i + 1;
+    r = l + 1;
+    if (l < c->nsleepers
+	&& TWAKEUP(c->sleepers[l]) < TWAKEUP(c->sleepers[min]))
+      min = l;
+    if (r < c->nsleepers
+	&& TWAKEUP(c->sleepers[r]) < TWAKEUP(c->sleepers[min]))
+      min = r;
+    if (min == i)
+      return;
+    sleep_swap(c, i, min);
+    i = min;
+  }
+}
+
+static void sleep_insert(arc *c, value thr)
+{
+  if (TSLEEPIDX(thr) >= 0)
+    return;
+  if (c->nsleepers >= c->sleepersize) {
+    c->sleepersize = (c->sleepersize == 0) ? 64 : c->sleepersize * 2;
+    c->sleepers = (value *)realloc(c->sleepers,
+				   sizeof(value) * c->sleepersize);
+  }
+  c->sleepers[c->nsleepers] = thr;
+  TSLEEPIDX(thr) = c->nsleepers++;
+  sleep_siftup(c, TSLEEPIDX(thr));
+}
+
+static void sleep_remove(arc *c, value thr)
+{
+  int i = TSLEEPIDX(thr);
+  value last;
+
+  if (i < 0)
+    return;
+  TSLEEPIDX(thr) = -1;
+  if (i == --c->nsleepers)
+    return;
+  /* Move the last thread in the heap into the hole, and then whichever
+     way it needs to go to restore the heap order. */
+  last = c->sleepers[c->nsleepers];
+  c->sleepers[i] = last;
+  TSLEEPIDX(last) = i;
+  sleep_siftdown(c, i);
+  sleep_siftup(c, TSLEEPIDX(last));
+}
+
+/* Wake up the sleeping threads whose wakeup times have been reached */
+static void wake_sleepers(arc *c)
+{
+  unsigned long long now;
+  value thr;
+
+  if (c->nsleepers == 0)
+    return;
+  now = __arc_milliseconds();
+  while (c->nsleepers > 0 && TWAKEUP(c->sleepers[0]) <= now) {
+    thr = c->sleepers[0];
+    sleep_remove(c, thr);
+    if (TSTATE(thr) == Tsleep) {
+      TSTATE(thr) = Tready;
+      SVALR(thr, CNIL);
+    } else if (TSTATE(thr) == Talt) {
+      /* the timeout of an alt has passed */
+      TSTATE(thr) = Tready;
+    }
+    __arc_thr_enqueue(c, thr);
+  }
+}
+
+/* The threads waiting on I/O are kept in a table indexed by file
+   descriptor, each entry of which has the list of threads waiting to
+   read from or write to that descriptor. */
+struct iofd {
+  value waiters;		/* threads waiting on the descriptor */
+  int armed;			/* events the poller will report */
+  int registered;		/* has the descriptor been registered? */
+};
+
+/* A thread waiting for a receive it has asked the kernel to make,
+   rather than for a descriptor to become readable or writable, waits
+   with this in TWAITRW. */
+#define IOW_RECV 2
+
+/* A receive made by the kernel on behalf of a thread.  The buffer
+   belongs to the request and not to the thread, since the kernel may
+   still write to it after the thread has been killed. */
+struct ioreq {
+  value thr;			/* the thread, or nil if abandoned */
+  int done;			/* has the receive completed? */
+  int res;			/* bytes received, or -errno */
+  char data[1];
+};
+
+/* The functions each of the backends below provides */
+static void iowait_arm(arc *c, int fd);
+static void iowait_disarm(arc *c, int fd);
+static void iowait_cancel(arc *c, value thr);
+
+/* Put a thread which has just entered Tiowait into the table */
+static void iowait_add(arc *c, value thr)
+{
+  int fd = TWAITFD(thr), n;
+
+  if (TSCHEDQ(thr) & TQ_IOWAIT)
+    return;
+  if (fd >= c->niofds) {
+    n = (c->niofds == 0) ? 64 : c->niofds;
+    while (n <= fd)
+      n *= 2;
+    c->iofds = (struct iofd *)realloc(c->iofds, sizeof(struct iofd) * n);
+    for (; c->niofds < n; c->niofds++) {
+      c->iofds[c->niofds].waiters = CNIL;
+      c->iofds[c->niofds].armed = 0;
+      c->iofds[c->niofds].registered = 0;
+    }
+  }
+  TSCHEDQ(thr) |= TQ_IOWAIT;
+  c->niowait++;
+  c->iofds[fd].waiters = cons(c, thr, c->iofds[fd].waiters);
+  iowait_arm(c, fd);
+}
+
+/* Take a thread out of the table, if it is there */
+static void iowait_remove(arc *c, value thr)
+{
+  struct iofd *iofd;
+  value q, prev = CNIL;
+
+  if (!(TSCHEDQ(thr) & TQ_IOWAIT))
+    return;
+  TSCHEDQ(thr) &= ~TQ_IOWAIT;
+  c->niowait--;
+  if (TWAITRW(thr) == IOW_RECV)
+    iowait_cancel(c, thr);
+  iofd = &c->iofds[TWAITFD(thr)];
+  for (q = iofd->waiters; !NIL_P(q); prev = q, q = cdr(q)) {
+    if (car(q) != thr)
+      continue;
+    if (NIL_P(prev)) {
+      __arc_wb(iofd->waiters, cdr(q));
+      iofd->waiters = cdr(q);
+    } else {
+      scdr(prev, cdr(q));
+    }
+    break;
+  }
+  /* The descriptor may be closed and its number reused before anyone
+     waits on it again, so it should be armed afresh when they do. */
+  if (NIL_P(iofd->waiters) && iofd->armed != 0)
+    iowait_disarm(c, TWAITFD(thr));
+}
+
+/* Wake up the threads waiting to read from (if rd is true) or write to
+   (if wr is true) the file descriptor fd. */
+static void iowait_wake(arc *c, int fd, int rd, int wr)
+{
+  value q, next, thr;
+  int first = 1, ready;
+
+  if (fd < 0 || fd >= c->niofds)
+    return;
+  for (q = c->iofds[fd].waiters; !NIL_P(q); q = next) {
+    next = cdr(q);
+    thr = car(q);
+    if (TWAITRW(thr) == IOW_RECV || ((TWAITRW(thr)) ? !wr : !rd))
+      continue;
+    /* of the threads waiting on the I/O pool, only those whose jobs
+       are done */
+    ready = __arc_iojob_ready(c, thr, fd, first);
+    first = 0;
+    if (!ready)
+      continue;
+    iowait_remove(c, thr);
+    TWAITFD(thr) = -1;
+    __arc_thr_wakeup(c, thr);
+  }
+  /* Anyone still waiting needs the descriptor armed again */
+  if (!NIL_P(c->iofds[fd].waiters))
+    iowait_arm(c, fd);
+}
+
+/* Make a thread which is asleep, waiting on I/O, or blocked on a
+   channel ready to run again. */
+void __arc_thr_wakeup(arc *c, value thr)
+{
+  if (TSTATE(thr) == Trelease || TSTATE(thr) == Tbroken)
+    return;
+  sleep_remove(c, thr);
+  iowait_remove(c, thr);
+  TSTATE(thr) = Tready;
+  __arc_thr_enqueue(c, thr);
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <poll.h>
+
+#define URING_ENTRIES 256
+
+/* The user data of completions which need nothing done about them */
+#define URING_IGNORE 0ULL
+/* The user data of a poll for the events ev on the descriptor fd.  The
+   user data of a receive is the address of its request, which being
+   aligned can never be odd. */
+#define URING_POLL(fd, ev) ((((unsigned long long)(fd)) << 16)	\
+			    | (((unsigned long long)(ev)) << 1) | 1ULL)
+
+struct uring {
+  int fd;
+  unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+  unsigned sqentries;
+  struct io_uring_sqe *sqes;
+  unsigned *cqhead, *cqtail, *cqmask;
+  struct io_uring_cqe *cqes;
+  unsigned pending;		/* entries queued but not yet submitted */
+  void *sqring, *cqring;
+  size_t sqringsz, cqringsz, sqesz;
+};
+
+static void uring_free(struct uring *r)
+{
+  if (r->sqring != NULL && r->sqring != MAP_FAILED)
+    munmap(r->sqring, r->sqringsz);
+  if (r->cqring != NULL && r->cqring != MAP_FAILED)
+    munmap(r->cqring, r->cqringsz);
+  if (r->sqes != NULL && (void *)r->sqes != MAP_FAILED)
+    munmap(r->sqes, r->sqesz);
+  if (r->fd >= 0)
+    close(r->fd);
+  free(r);
+}
+
+/* Set up an io_uring, without the help of liburing */
+static struct uring *uring_setup(void)
+{
+  struct io_uring_params p;
+  struct uring *r;
+  char *sq, *cq;
+
+  r = (struct uring *)calloc(1, sizeof(struct uring));
+  /* Only the thread running the dispatcher ever uses the ring, so the
+     kernel can leave the work of completing requests until it next
+     asks for completions, instead of interrupting it to do so.  Older
+     kernels do not know these flags. */
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+  r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  if (r->fd < 0 && errno == EINVAL) {
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  }
+  if (r->fd < 0) {
+    uring_free(r);
+    return(NULL);
+  }
+  r->sqringsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cqringsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  r->sqesz = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqring = mmap(NULL, r->sqringsz, PROT_READ|PROT_WRITE,
+		   MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  r->cqring = mmap(NULL, r->cqringsz, PROT_READ|PROT_WRITE,
+		   MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+  r->sqes = mmap(NULL, r->sqesz, PROT_READ|PROT_WRITE,
+		 MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqring == MAP_FAILED || r->cqring == MAP_FAILED
+      || (void *)r->sqes == MAP_FAILED) {
+    uring_free(r);
+    return(NULL);
+  }
+  sq = (char *)r->sqring;
+  cq = (char *)r->cqring;
+  r->sqhead = (unsigned *)(sq + p.sq_off.head);
+  r->sqtail = (unsigned *)(sq + p.sq_off.tail);
+  r->sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+  r->sqarray = (unsigned *)(sq + p.sq_off.array);
+  r->sqentries = p.sq_entries;
+  r->cqhead = (unsigned *)(cq + p.cq_off.head);
+  r->cqtail = (unsigned *)(cq + p.cq_off.tail);
+  r->cqmask = (unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return(r);
+}
+
+/* Submit whatever is queued, and wait for at least wait completions.
+   Requests on sockets are completed by the kernel only when it is
+   entered, so this must be done even when not waiting to see them. */
+static int uring_enter(struct uring *r, unsigned wait)
+{
+  int ret;
+
+  ret = syscall(__NR_io_uring_enter, r->fd, r->pending, wait,
+		IORING_ENTER_GETEVENTS, NULL, 0);
+  if (ret > 0)
+    r->pending -= ret;
+  return(ret);
+}
+
+/* The ring, set up the first time it is wanted.  If it cannot be (the
+   kernel is too old, or io_uring has been disabled), the descriptors
+   are waited on with epoll or select instead, see iowait_arm. */
+static struct uring *uring_get(arc *c)
+{
+  if (c->uring == NULL && !c->nouring) {
+    c->uring = uring_setup();
+    c->nouring = (c->uring == NULL);
+  }
+  return(c->uring);
+}
+
+/* A cleared submission queue entry, which is queued by uring_push once
+   it has been filled in. */
+static struct io_uring_sqe *uring_sqe(struct uring *r)
+{
+  struct io_uring_sqe *sqe;
+  unsigned idx;
+
+  if (*r->sqtail - __atomic_load_n(r->sqhead, __ATOMIC_ACQUIRE)
+      >= r->sqentries)
+    uring_enter(r, 0);
+  idx = *r->sqtail & *r->sqmask;
+  sqe = &r->sqes[idx];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  r->sqarray[idx] = idx;
+  return(sqe);
+}
+
+static void uring_push(struct uring *r)
+{
+  __atomic_store_n(r->sqtail, *r->sqtail + 1, __ATOMIC_RELEASE);
+  r->pending++;
+}
+
+static void uring_poll_remove(struct uring *r, int fd, int ev)
+{
+  struct io_uring_sqe *sqe;
+
+  sqe = uring_sqe(r);
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->fd = -1;
+  sqe->addr = URING_POLL(fd, ev);
+  sqe->user_data = URING_IGNORE;
+  uring_push(r);
+}
+
+/* Readiness is waited for with one-shot polls, one for each set of
+   events asked for which is not already being polled. */
+static void uring_arm(arc *c, int fd)
+{
+  struct iofd *iofd = &c->iofds[fd];
+  struct io_uring_sqe *sqe;
+  struct uring *r;
+  value q;
+  int events = 0;
+
+  for (q = iofd->waiters; !NIL_P(q); q = cdr(q)) {
+    if (TWAITRW(car(q)) != IOW_RECV)
+      events |= (TWAITRW(car(q))) ? POLLOUT : POLLIN;
+  }
+  events &= ~iofd->armed;
+  if (events == 0)
+    return;
+  r = c->uring;
+  sqe = uring_sqe(r);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = events;
+  sqe->user_data = URING_POLL(fd, events);
+  uring_push(r);
+  iofd->armed |= events;
+}
+
+/* Cancel the polls still outstanding for a descriptor no one waits on
+   any longer, which would otherwise keep the file open even after the
+   descriptor is closed. */
+static void uring_disarm(arc *c, int fd)
+{
+  int armed = c->iofds[fd].armed;
+
+  c->iofds[fd].armed = 0;
+  if (c->uring == NULL)
+    return;
+  if (armed & POLLIN)
+    uring_poll_remove(c->uring, fd, POLLIN);
+  if (armed & POLLOUT)
+    uring_poll_remove(c->uring, fd, POLLOUT);
+  if ((armed & (POLLIN|POLLOUT)) == (POLLIN|POLLOUT))
+    uring_poll_remove(c->uring, fd, POLLIN|POLLOUT);
+}
+
+/* Abandon the receive a thread is waiting for */
+static void uring_cancel(arc *c, value thr)
+{
+  struct ioreq *req = (struct ioreq *)TIOREQ(thr);
+  struct io_uring_sqe *sqe;
+
+  if (req == NULL || req->done)
+    return;
+  req->thr = CNIL;
+  TIOREQ(thr) = NULL;
+  sqe = uring_sqe(c->uring);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = (unsigned long long)(unsigned long)req;
+  sqe->user_data = URING_IGNORE;
+  uring_push(c->uring);
+}
+
+static void uring_complete(arc *c, unsigned long long ud, int res)
+{
+  struct ioreq *req;
+  value thr;
+  int fd, ev;
+
+  if (ud == URING_IGNORE)
+    return;
+  if (ud & 1ULL) {
+    fd = (int)(ud >> 16);
+    ev = (int)((ud >> 1) & 0x7fff);
+    if (fd >= c->niofds)
+      return;
+    c->iofds[fd].armed &= ~ev;
+    /* a poll removed since no one was waiting any longer */
+    if (res == -ECANCELED)
+      return;
+    if (res < 0 || (res & (POLLERR|POLLHUP|POLLNVAL)))
+      res = POLLIN|POLLOUT;
+    iowait_wake(c, fd, res & POLLIN, res & POLLOUT);
+    return;
+  }
+  req = (struct ioreq *)(unsigned long)ud;
+  if (NIL_P(req->thr)) {
+    free(req);
+    return;
+  }
+  req->done = 1;
+  req->res = res;
+  thr = req->thr;
+  iowait_remove(c, thr);
+  TWAITFD(thr) = -1;
+  __arc_thr_wakeup(c, thr);
+}
+
+/* Version of process_iowait using io_uring.  Submitting what has been
+   queued and waiting for completions take a single system call. */
+static void uring_process_iowait(arc *c, int eptimeout)
+{
+  struct uring *r = c->uring;
+  struct io_uring_sqe *sqe;
+  struct __kernel_timespec ts;
+  unsigned long long ud;
+  unsigned head;
+  int wait, res;
+
+  if (r == NULL)
+    return;
+  wait = (eptimeout != 0
+	  && *r->cqhead == __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE));
+  if (wait && eptimeout > 0) {
+    ts.tv_sec = eptimeout / 1000;
+    ts.tv_nsec = (eptimeout % 1000) * 1000000L;
+    sqe = uring_sqe(r);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long long)(unsigned long)&ts;
+    sqe->len = 1;
+    sqe->user_data = URING_IGNORE;
+    uring_push(r);
+  }
+  if (uring_enter(r, wait) < 0) {
+    int en = errno;
+
+    /* A signal, e.g. from the sampling profiler, just ends the wait */
+    if (en != EINTR) {
+      arc_err_cstrfmt(c, "error waiting for Tiowait fds (%s; errno=%d)",
+		      strerror(en), en);
+      return;
+    }
+  }
+
+  head = *r->cqhead;
+  while (head != __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE)) {
+    ud = r->cqes[head & *r->cqmask].user_data;
+    res = r->cqes[head & *r->cqmask].res;
+    head++;
+    __atomic_store_n(r->cqhead, head, __ATOMIC_RELEASE);
+    uring_complete(c, ud, res);
+  }
+}
+
+#endif
+
+#if defined(HAVE_SYS_EPOLL_H)
 
 #include <sys/epoll.h>
 
-#define MAX_EVENTS 1048576
+#define MAX_EVENTS 256
 
-/* Version of process_iowait using epoll */
-static void process_iowait(arc *c, value iowaitdata, int eptimeout)
-{
-  value thr, iowaittbl;
-  int niowait=0, n, nfds;
-  static int epollfd = -1;
-  struct epoll_event *epevents, ev;
-
-  if (epollfd < 0)
-    epollfd = epoll_create(MAX_EVENTS);
-
-  iowaittbl = arc_mkhash(c, ARC_HASHBITS);
-  /* add fd's in list to epollfd */
-  for (thr = iowaitdata; thr; thr = cdr(thr)) {
-    niowait++;
-    ev.events = (TWAITRW(car(thr))) ? EPOLLOUT : EPOLLIN;
-    ev.data.u64 = 0LL;
-    ev.data.fd = TWAITFD(car(thr));
-    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, TWAITFD(car(thr)), &ev) < 0) {
-      int en = errno;
-      if (errno != EEXIST) {
-	arc_err_cstrfmt(c, "error setting epoll for thread on blocking fd (%s; errno=%d)", strerror(en), en);
-	return;
-      }
+/* Every file descriptor waited on is registered with epoll once, in
+   one-shot mode, so that after reporting an event it stays registered
+   but disarmed until someone waits on it again, which only needs it to
+   be rearmed.  The registration goes away by itself when the
+   descriptor is closed, so if rearming finds it gone, the descriptor
+   number has been reused, and it is registered again. */
+static void poll_arm(arc *c, int fd)
+{
+  struct iofd *iofd = &c->iofds[fd];
+  struct epoll_event ev;
+  value q;
+  int events = 0, op, ret;
+
+  for (q = iofd->waiters; !NIL_P(q); q = cdr(q))
+    events |= (TWAITRW(car(q))) ? EPOLLOUT : EPOLLIN;
+  if (events == 0 || (iofd->armed & events) == events)
+    return;
+  if (c->epollfd < 0)
+    c->epollfd = epoll_create(MAX_EVENTS);
+  ev.events = events | EPOLLONESHOT;
+  ev.data.u64 = 0LL;
+  ev.data.fd = fd;
+  op = (iofd->registered) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  ret = epoll_ctl(c->epollfd, op, fd, &ev);
+  if (ret < 0 && op == EPOLL_CTL_MOD && errno == ENOENT)
+    ret = epoll_ctl(c->epollfd, EPOLL_CTL_ADD, fd, &ev);
+  else if (ret < 0 && op == EPOLL_CTL_ADD && errno == EEXIST)
+    ret = epoll_ctl(c->epollfd, EPOLL_CTL_MOD, fd, &ev);
+  if (ret < 0) {
+    int en = errno;
+
+    /* Descriptors epoll cannot wait on, e.g. those of regular files,
+       are always ready. */
+    if (en == EPERM) {
+      iowait_wake(c, fd, 1, 1);
+      return;
     }
-    arc_hash_insert(c, iowaittbl, INT2FIX(TWAITFD(car(thr))), car(thr));
+    arc_err_cstrfmt(c, "error setting epoll for thread on blocking fd (%s; errno=%d)", strerror(en), en);
+    return;
   }
+  iofd->registered = 1;
+  iofd->armed = events;
+}
+
+static void poll_disarm(arc *c, int fd)
+{
+  c->iofds[fd].armed = 0;
+}
+
+static void poll_cancel(arc *c, value thr)
+{
+}
+
+/* Version of process_iowait using epoll */
+static void poll_process_iowait(arc *c, int eptimeout)
+{
+  struct epoll_event epevents[MAX_EVENTS];
+  int n, nfds, ev;
 
-  epevents = (struct epoll_event *)alloca(sizeof(struct epoll_event) * (niowait+2));
-  nfds = epoll_wait(epollfd, epevents, niowait, eptimeout);
+  nfds = epoll_wait(c->epollfd, epevents, MAX_EVENTS, eptimeout);
+  /* A signal, e.g. from the sampling profiler, just ends the wait */
+  if (nfds < 0 && errno == EINTR)
+    return;
   if (nfds < 0) {
     int en = errno;
     arc_err_cstrfmt(c, "error waiting for Tiowait fds (%s; errno=%d)",
@@ -242,50 +952,64 @@ static void process_iowait(arc *c, value iowaitdata, int eptimeout)
   }
 
   for (n=0; n<nfds; n++) {
-    int fd;
-    value thr;
-    fd  = epevents[n].data.fd;
-    thr = arc_hash_lookup(c, iowaittbl, INT2FIX(fd));
-    if (BOUND_P(thr)) {
-      TWAITFD(thr) = -1;
-      TSTATE(thr) = Tready;
-    }
-    epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, &ev);
+    ev = epevents[n].events;
+    if (ev & (EPOLLERR|EPOLLHUP))
+      ev |= EPOLLIN|EPOLLOUT;
+    /* the descriptor is disarmed once it has reported an event */
+    if (epevents[n].data.fd < c->niofds)
+      c->iofds[epevents[n].data.fd].armed = 0;
+    iowait_wake(c, epevents[n].data.fd, ev & EPOLLIN, ev & EPOLLOUT);
   }
 }
 
 #elif HAVE_SYS_SELECT_H
 
 #include <sys/select.h>
-#include <unistd.h>
+
+/* select needs no registration */
+static void poll_arm(arc *c, int fd)
+{
+}
+
+static void poll_disarm(arc *c, int fd)
+{
+}
+
+static void poll_cancel(arc *c, value thr)
+{
+}
 
 /* Version of process_iowait using select */
-static void process_iowait(arc *c, value iowaitdata, int eptimeout)
+static void poll_process_iowait(arc *c, int eptimeout)
 {
   fd_set rfds, wfds;
-  struct timeval tv;
+  struct timeval tv, *tvp;
   int retval;
-  value thr;
-  int niowait=0, nfds;
+  value q;
+  int fd, nfds;
 
   FD_ZERO(&rfds);
   FD_ZERO(&wfds);
   nfds = 0;
-  for (thr = iowaitdata; thr; thr = cdr(thr)) {
-    niowait++;
-    if (nfds < TWAITFD(car(thr)))
-      nfds = TWAITFD(car(thr));
-    if (TWAITRW(car(thr))) {
-      FD_SET(TWAITFD(car(thr)), &wfds);
-    } else {
-      FD_SET(TWAITFD(car(thr)), &rfds);
+  for (fd=0; fd<c->niofds; fd++) {
+    for (q = c->iofds[fd].waiters; !NIL_P(q); q = cdr(q)) {
+      nfds = fd;
+      if (TWAITRW(car(q))) {
+	FD_SET(fd, &wfds);
+      } else {
+	FD_SET(fd, &rfds);
+      }
     }
   }
 
   tv.tv_sec = eptimeout / 1000;
   tv.tv_usec = (eptimeout % 1000) * 1000L;
+  tvp = (eptimeout < 0) ? NULL : &tv;
 
-  retval = select(nfds+1, &rfds, &wfds, NULL, &tv);
+  retval = select(nfds+1, &rfds, &wfds, NULL, tvp);
+  /* A signal, e.g. from the sampling profiler, just ends the wait */
+  if (retval == -1 && errno == EINTR)
+    return;
   if (retval == -1) {
     int en = errno;
     arc_err_cstrfmt(c, "error waiting for Tiowait fds (%s; errno=%d)",
@@ -298,15 +1022,9 @@ static void process_iowait(arc *c, value iowaitdata, int eptimeout)
     return;
 
   /* Wake up all the waiting threads with fds for which select said ok */
-  for (thr = iowaitdata; thr; thr = cdr(thr)) {
-    int result;
-
-    result = (TWAITRW(car(thr))) ? FD_ISSET(TWAITFD(car(thr)), &wfds)
-      : FD_ISSET(TWAITFD(car(thr)), &rfds);
-    if (result) {
-      TWAITFD(car(thr)) = -1;
-      TSTATE(car(thr)) = Tready;
-    }
+  for (fd=0; fd<=nfds; fd++) {
+    if (FD_ISSET(fd, &rfds) || FD_ISSET(fd, &wfds))
+      iowait_wake(c, fd, FD_ISSET(fd, &rfds), FD_ISSET(fd, &wfds));
   }
 }
 
@@ -317,14 +1035,170 @@ static void process_iowait(arc *c, value iowaitdata, int eptimeout)
 
 #endif
 
+/* Use io_uring where it is compiled in and can be set up, and the
+   backend above otherwise. */
+static void iowait_arm(arc *c, int fd)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+  if (uring_get(c) != NULL) {
+    uring_arm(c, fd);
+    return;
+  }
+#endif
+  poll_arm(c, fd);
+}
+
+static void iowait_disarm(arc *c, int fd)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+  if (c->uring != NULL) {
+    uring_disarm(c, fd);
+    return;
+  }
+#endif
+  poll_disarm(c, fd);
+}
+
+static void iowait_cancel(arc *c, value thr)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+  if (c->uring != NULL) {
+    uring_cancel(c, thr);
+    return;
+  }
+#endif
+  poll_cancel(c, thr);
+}
+
+static void process_iowait(arc *c, int eptimeout)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+  if (c->uring != NULL) {
+    uring_process_iowait(c, eptimeout);
+    return;
+  }
+#endif
+  poll_process_iowait(c, eptimeout);
+}
+
+/* Wait until a receive of at most len bytes from the socket fd can
+   get something.  DO NOT USE THIS FUNCTION DIRECTLY.  It should only be
+   used from the AIORECV macro, after __arc_iorecv has found nothing to
+   receive.  With io_uring, the receive is handed to the kernel and the
+   thread waits until it completes, so that the next __arc_iorecv only
+   needs to collect what it got.  Otherwise, the thread waits for the
+   socket to become readable. */
+int __arc_affiorecv(arc *c, value thr, int line, int fd, size_t len)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+  struct io_uring_sqe *sqe;
+  struct ioreq *req;
+  struct uring *r;
+
+  if ((r = uring_get(c)) != NULL) {
+    req = (struct ioreq *)malloc(sizeof(struct ioreq) + len);
+    req->thr = thr;
+    req->done = 0;
+    req->res = 0;
+    sqe = uring_sqe(r);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long)(unsigned long)req->data;
+    sqe->len = len;
+    sqe->user_data = (unsigned long long)(unsigned long)req;
+    uring_push(r);
+    TIOREQ(thr) = req;
+    TWAITFD(thr) = fd;
+    TWAITRW(thr) = IOW_RECV;
+    TSTATE(thr) = Tiowait;
+    return(__arc_affyield(c, thr, line));
+  }
+#endif
+  return(__arc_affiowait(c, thr, line, fd, 0));
+}
+
+/* Receive at most len bytes from the socket fd into buf, without
+   blocking.  Returns the number of bytes received, or -1 with errno
+   set, EAGAIN meaning the thread should AIORECV and try again.  If an
+   AIORECV had the kernel make the receive, its result is returned
+   instead. */
+int __arc_iorecv(arc *c, value thr, int fd, void *buf, size_t len)
+{
+  struct ioreq *req = (struct ioreq *)TIOREQ(thr);
+  int n;
+
+  if (req == NULL)
+    return(recv(fd, buf, len, MSG_DONTWAIT));
+  TIOREQ(thr) = NULL;
+  n = req->res;
+  if (n > 0)
+    memcpy(buf, req->data, n);
+  free(req);
+  if (n < 0) {
+    errno = -n;
+    return(-1);
+  }
+  return(n);
+}
+
 extern value __arc_send_rvchan(arc *c, value chan, value val);
 extern int __arc_recv_rvchan(arc *c, value thr);
 
-/* Main dispatcher.  Will run each thread in the thread list for
-   at most c->quanta cycles or until the thread leaves ready state.
-   Also runs garbage collections periodically.  This should
-   be called with at least one thread already in the run queue.
-   Terminates when no more threads are available.
+/* Finish off a thread which has terminated */
+static void release_thread(arc *c, value thr)
+{
+  /* This will serve to wake up all the threads waiting on the return
+     value channel of the thread, so they can pick up the return value
+     now that it is available. */
+  if (TYPE(TRVCH(thr)) == T_CHAN)
+    __arc_send_rvchan(c, TRVCH(thr), TVALR(thr));
+  __arc_wb(TRVCH(thr), TVALR(thr));
+  TRVCH(thr) = TVALR(thr);
+  arc_hash_delete(c, c->allthreads, INT2FIX(TTID(thr)));
+  /* A thread killed while the I/O pool was doing something for it */
+  __arc_iojob_abandon(c, thr);
+}
+
+/* Put a thread which has just been run where the state it was left in
+   calls for.  A thread blocked on a channel goes nowhere: whichever
+   thread unblocks it puts it back on the run queue. */
+static void schedule(arc *c, value thr)
+{
+  switch (TSTATE(thr)) {
+  case Tready:
+  case Tcritical:
+    __arc_thr_enqueue(c, thr);
+    break;
+  case Tsleep:
+    sleep_insert(c, thr);
+    break;
+  case Talt:
+    /* an alt with a timeout also waits in the sleep heap */
+    if (TWAKEUP(thr) != 0LL)
+      sleep_insert(c, thr);
+    break;
+  case Tiowait:
+    iowait_add(c, thr);
+    break;
+  case Trelease:
+  case Tbroken:
+    /* A thread killed while it ran is already queued to be released */
+    if (!(TSCHEDQ(thr) & TQ_RUN))
+      release_thread(c, thr);
+    break;
+  default:
+    break;
+  }
+}
+
+/* Main dispatcher.  Will run each thread in the run queue for at most
+   its time slice or until the thread leaves ready state.  Threads
+   which are asleep, waiting on I/O, or blocked on channels are kept
+   off the run queue entirely, so the cost of a cycle depends only on
+   the number of threads which can actually run.  Also runs garbage
+   collections periodically.  This should be called with at least one
+   thread already in the run queue.  Terminates when no more threads
+   are available.
 
    全く, this is beginning to look a lot a like the reactor pattern!
 
@@ -333,76 +1207,82 @@ extern int __arc_recv_rvchan(arc *c, value thr);
 */
 void arc_thread_dispatch(arc *c)
 {
-  value thr;
-  int nthreads, blockedthreads, iowait, sleepthreads, runthreads;
-  int stoppedthreads, need_select;
-  unsigned long long minsleep;
-  value iowaitdata;
-  int eptimeout, gcstatus=0;
-  value vmqueue, prev;
+  value thr, runq;
+  unsigned long long now, cpu, t, q, allocated, tail;
+  unsigned long long polled = 0LL;
+  int eptimeout, gcstatus=0, express;
 
+  c->indispatch = 1;
   for (;;) {
-    nthreads = blockedthreads = iowait = stoppedthreads = 0;
-    sleepthreads = runthreads = need_select = 0;
-    minsleep = ULLONG_MAX;
-    iowaitdata = CNIL;
-    prev = CNIL;
-    /* XXX - see if we need more extensive use of the write barrier when
-       doing these thread manipulations */
-    for (vmqueue = c->vmthreads; vmqueue; vmqueue = cdr(vmqueue)) {
-      thr = car(vmqueue);
+    wake_sleepers(c);
+    now = __arc_usec();
+    cpu = __arc_cpu_usec();
+    /* Run each thread on the run queue once.  Threads which become
+       ready while these run go on a fresh queue for the next cycle.
+       Threads on the express queue are run ahead of these, but only
+       one between each of them, so that threads waking one another
+       up cannot keep the rest from running.  Once the run queue is
+       empty, threads on the express queue go on being run, until they
+       have run for as long as one ordinary time slice, so that threads
+       handing values to one another over channels do not each wait
+       for the end of the cycle and a collection step.  Sleepers are
+       woken, and at most every millisecond I/O is looked for, between
+       threads as well, so that threads which go on the express queue
+       when they wake need not wait for the end of the cycle. */
+    runq = c->vmthreads;
+    __arc_wb(c->vmthreads, CNIL);
+    c->vmthreads = CNIL;
+    __arc_wb(c->vmthrtail, CNIL);
+    c->vmthrtail = CNIL;
+    express = 0;
+    tail = 0LL;
+    for (;;) {
+      if (!express || NIL_P(runq)) {
+	wake_sleepers(c);
+	if (c->niowait > 0 && now - polled >= 1000) {
+	  process_iowait(c, 0);
+	  polled = now;
+	}
+      }
+      if (!express && !NIL_P(c->expressq)) {
+	thr = __arc_dequeue(c, &c->expressq, &c->exprtail);
+	express = 1;
+      } else if (!NIL_P(runq)) {
+	thr = car(runq);
+	runq = cdr(runq);
+	express = 0;
+      } else if (!NIL_P(c->expressq) && tail < c->quantum) {
+	thr = __arc_dequeue(c, &c->expressq, &c->exprtail);
+	express = 1;
+      } else {
+	break;
+      }
+      TSCHEDQ(thr) &= ~TQ_RUN;
       __arc_wb(c->curthread, thr);
       c->curthread = thr;
-      ++nthreads;
+      if (!RUNNABLE(thr)) {
+	schedule(c, thr);
+	continue;
+      }
+      charge_wait(thr, now);
+      /* what it waited on is kept until now, in case it is killed
+	 after being woken but before it could run */
+      __arc_wb(TWAITON(thr), CNIL);
+      TWAITON(thr) = CNIL;
+      allocated = c->allocated;
       switch (TSTATE(thr)) {
-	/* Remove a thread in Trelease or Tbroken state from the
-	   queue. */
-      case Trelease:
-      case Tbroken:
-	stoppedthreads++;
-	/* This will serve to wake up all the threads waiting on
-	   the return value channel of the thread, so they can pick
-	   up the return value now that it is available. */
-	if (TYPE(TRVCH(thr)) == T_CHAN)
-	  __arc_send_rvchan(c, TRVCH(thr), TVALR(thr));
-	__arc_wb(TRVCH(thr), TVALR(thr));
-	TRVCH(thr) = TVALR(thr);
-	/* unlink the thread from the queue */
-	if (prev == CNIL) {
-	  __arc_wb(c->vmthreads, cdr(vmqueue));
-	  c->vmthreads = cdr(vmqueue);
-	} else {
-	  scdr(prev, cdr(vmqueue));
-	}
-	if (NIL_P(cdr(vmqueue))) {
-	  __arc_wb(c->vmthrtail, prev);
-	  c->vmthrtail = prev;
-	}
-	goto finished;
-	break;
-      case Talt:
-      case Tsend:
-      case Trecv:
-	/* increment count of threads in blocked states */
-	++blockedthreads;
-	break;
-      case Tsleep:
-	/* Wake up a sleeping thread if the wakeup time is reached */
-	if (__arc_milliseconds() >= TWAKEUP(thr)) {
-	  TSTATE(thr) = Tready;
-	  SVALR(thr, CNIL);
-	} else {
-	  sleepthreads++;
-	  if (TWAKEUP(thr) < minsleep)
-	    minsleep = TWAKEUP(thr);
-	  goto finish_thread;
-	}
-	/* fall through and let the awakened thread run */
       case Tready:
 	/* let the thread run */
 	if (TQUANTA(thr) <= 0)
-	  TQUANTA(thr) = c->quantum;
+	  TQUANTA(thr) = TSLICE(thr);
+	limit_slice(c, thr);
+	q = TQUANTA(thr);
 	__arc_thr_trampoline(c, thr, TR_RESUME);
+	TINSTS(thr) += q - TQUANTA(thr);
+	if (NIL_P(runq))
+	  tail += q - TQUANTA(thr);
+	c->alloclimit = ULLONG_MAX;
+	adapt_slice(c, thr);
 	break;
       case Tcritical:
 	/* If we are in a critical section, allow the thread to keep
@@ -410,67 +1290,78 @@ void arc_thread_dispatch(arc *c)
 	while (TSTATE(thr) == Tcritical) {
 	  if (TQUANTA(thr) <= 0)
 	    TQUANTA(thr) = c->quantum;
+	  q = TQUANTA(thr);
 	  __arc_thr_trampoline(c, thr, TR_RESUME);
+	  TINSTS(thr) += q - TQUANTA(thr);
 	}
 	break;
-      case Tiowait:
-	/* Build up the list of threads for which I/O is pending */
-	iowait++;
-	need_select = 1;
-	iowaitdata = cons(c, thr, iowaitdata);
+      default:
 	break;
       }
-    finish_thread:
-      if (RUNNABLE(thr))
-	runthreads++;
-      prev = vmqueue;
-    finished:
-      ;
+      /* The little time taken between threads is charged to the
+	 next thread to run */
+      t = __arc_usec();
+      TTICKS(thr) += t - now;
+      now = t;
+      t = __arc_cpu_usec();
+      TCPUTIME(thr) += t - cpu;
+      cpu = t;
+      TALLOCATED(thr) += c->allocated - allocated;
+      TNSWITCHES(thr)++;
+      TWAITSINCE(thr) = now;
+      TWAITSTATE(thr) = (RUNNABLE(thr)) ? Tready : TSTATE(thr);
+      schedule(c, thr);
     }
-    /* XXX - should we print a warning message if we abort when all
-       threads are blocked?  I suppose it should be up to the caller
-       to decide whether this is a bad thing or no.  It isn't an
+
+    /* Nothing more can run.  Any threads still waiting on channels
+       are deadlocked, which the watchdog reports if it is on, but
+       whether that is a bad thing is up to the caller.  It isn't an
        issue for the REPL. */
-    if (nthreads == 0 || nthreads == blockedthreads)
+    if (NIL_P(c->vmthreads) && NIL_P(c->expressq) && c->nsleepers == 0
+	&& c->niowait == 0) {
+      __arc_watchdog(c, 1);
+      c->indispatch = 0;
       return;
+    }
 
-    /* We have now finished running all threads.  See if we need to
-       do some post-cleanup work */
-    if (need_select) {
-      if (gcstatus == 0) {
-	/* do not wait if the garbage collector reports it still needs
-	   to do something. */
-	eptimeout = 0;
-      } else if ((iowait + blockedthreads) == nthreads) {
-	/* If all threads are blocked on I/O or are waiting on channels,
-	   make epoll wait indefinitely until I/O is possible. */
-	eptimeout = -1;
-      } else if ((iowait + sleepthreads + blockedthreads) == nthreads) {
-	/* If all threads are either asleep, blocked, or waiting on
-	 I/O, wait for at most the time until the first sleep expires. */
-	eptimeout = (minsleep - __arc_milliseconds());
-      } else {
-	/* do not wait if there are any other threads which can run */
-	eptimeout = 0;
-      }
-      process_iowait(c, iowaitdata, eptimeout);
+    if (!NIL_P(c->vmthreads) || !NIL_P(c->expressq) || gcstatus == 0) {
+      /* do not wait if there are any other threads which can run, or
+	 if the garbage collector reports it still needs to do
+	 something. */
+      eptimeout = 0;
+    } else if (c->nsleepers == 0) {
+      /* If all threads are blocked on I/O or are waiting on channels,
+	 make epoll wait indefinitely until I/O is possible. */
+      eptimeout = -1;
+    } else {
+      /* Otherwise wait for at most the time until the first sleep
+	 expires. */
+      now = __arc_milliseconds();
+      eptimeout = (TWAKEUP(c->sleepers[0]) <= now) ? 0
+	: (TWAKEUP(c->sleepers[0]) - now > INT_MAX) ? INT_MAX
+	: (int)(TWAKEUP(c->sleepers[0]) - now);
     }
 
-    /* If all threads are asleep, use nanosleep to wait the the shortest
-       time until it's time for a thread to wake up */
-    if (sleepthreads == nthreads) {
-      unsigned long long st;
+    if (c->niowait > 0) {
+      process_iowait(c, eptimeout);
+      polled = __arc_usec();
+    } else if (eptimeout > 0) {
+      /* If all threads are asleep, use nanosleep to wait the the
+	 shortest time until it's time for a thread to wake up */
       struct timespec req;
 
-      st = minsleep - __arc_milliseconds();
-      req.tv_sec = st/1000;
-      req.tv_nsec = ((st % 1000) * 1000000L);
+      req.tv_sec = eptimeout/1000;
+      req.tv_nsec = ((eptimeout % 1000) * 1000000L);
       nanosleep(&req, NULL);
     }
     /* Perform garbage collection: should be done after every cycle
        with VCGC, as though it were a thread in our scheduler. */
     gcstatus = c->gc(c);
-    /* XXX - detect deadlock */
+    /* Charge to the collector the profiler ticks taken while it ran,
+       rather than to the next thread to run. */
+    if (__arc_sprof_pending)
+      __arc_sprof_sample(c, CNIL);
+    __arc_watchdog(c, 0);
   }
 }
 
@@ -498,7 +1389,8 @@ value arc_spawn(arc *c, value thunk)
     TRVCH(thr) = TVALR(thr);
   } else {
     /* Otherwise, queue the new thread and enqueue it in the dispatcher. */
-    __arc_enqueue(c, thr, &c->vmthreads, &c->vmthrtail);
+    arc_hash_insert(c, c->allthreads, INT2FIX(TTID(thr)), thr);
+    __arc_thr_enqueue(c, thr);
   }
   return(thr);
 }
@@ -529,6 +1421,127 @@ value arc_dead(arc *c, value thr)
   return((TSTATE(thr) == Trelease || TSTATE(thr) == Tbroken) ? CTRUE : CNIL);
 }
 
+/* All threads which have not yet terminated */
+value arc_threads(arc *c)
+{
+  value list = CNIL, key, val;
+  int i = 0;
+
+  while (__arc_hash_next(c, c->allthreads, &i, &key, &val))
+    list = cons(c, val, list);
+  return(list);
+}
+
+static const char *statenames[] = {
+  "alt", "send", "recv", "iowait", "sleep", "ready", "critical",
+  "release", "broken"
+};
+
+static void putstat(arc *c, value tbl, const char *name, value val)
+{
+  arc_hash_insert(c, tbl, arc_intern_cstr(c, name), val);
+}
+
+/* A table of what a thread has been doing.  Times are in microseconds:
+   time and cputime are the time the thread spent running, and the CPU
+   time used while it did, and ready, sleep, iowait, recv, send and alt
+   are the times it has spent waiting in each of those states.  insts
+   is the number of instructions it has executed, alloc the number of
+   bytes it has allocated, and switches the number of times the
+   dispatcher has run it. */
+value arc_thread_stats(arc *c, value thr)
+{
+  unsigned long long waittime[Tbroken+1];
+  value tbl;
+  int i;
+
+  TYPECHECK(thr, T_THREAD);
+  memcpy(waittime, TWAITTIME(thr), sizeof(waittime));
+  /* what it is doing now, unless it is running or has terminated */
+  if (thr != c->curthread && TSTATE(thr) != Trelease
+      && TSTATE(thr) != Tbroken && __arc_usec() > TWAITSINCE(thr))
+    waittime[TWAITSTATE(thr)] += __arc_usec() - TWAITSINCE(thr);
+
+  tbl = arc_mkhash(c, ARC_HASHBITS);
+  putstat(c, tbl, "tid", INT2FIX(TTID(thr)));
+  putstat(c, tbl, "state", arc_intern_cstr(c, statenames[TSTATE(thr)]));
+  putstat(c, tbl, "insts", __arc_ull2val(c, TINSTS(thr)));
+  putstat(c, tbl, "time", __arc_ull2val(c, TTICKS(thr)));
+  putstat(c, tbl, "cputime", __arc_ull2val(c, TCPUTIME(thr)));
+  putstat(c, tbl, "alloc", __arc_ull2val(c, TALLOCATED(thr)));
+  putstat(c, tbl, "switches", __arc_ull2val(c, TNSWITCHES(thr)));
+  for (i=Talt; i<=Tready; i++)
+    putstat(c, tbl, statenames[i], __arc_ull2val(c, waittime[i]));
+  return(tbl);
+}
+
+/* Limit what thr may do from now on.  If what is insts, it may
+   execute only n more instructions, if alloc, allocate only n more
+   bytes, and if stack, use only n values of stack.  A thread which
+   goes past a limit gets an error, which it may catch.  A limit of
+   nil removes the limit.  Instruction and allocation limits are
+   checked each time the thread is run, and are removed once they
+   have been exceeded. */
+value arc_thread_limit(arc *c, value thr, value what, value n)
+{
+  unsigned long long lim;
+
+  TYPECHECK(thr, T_THREAD);
+  if (!NIL_P(n)) {
+    TYPECHECK(n, T_FIXNUM);
+    if (FIX2INT(n) < 0) {
+      arc_err_cstrfmt(c, "thread-limit: negative limit");
+      return(CNIL);
+    }
+  }
+  lim = (NIL_P(n)) ? 0LL : (unsigned long long)FIX2INT(n);
+  if (what == arc_intern_cstr(c, "insts")) {
+    TMAXINSTS(thr) = (NIL_P(n)) ? 0LL : TINSTS(thr) + lim + 1;
+    if (thr == c->curthread && !NIL_P(n) && TQUANTA(thr) > lim + 1)
+      TQUANTA(thr) = lim + 1;
+  } else if (what == arc_intern_cstr(c, "alloc")) {
+    TMAXALLOC(thr) = (NIL_P(n)) ? 0LL : TALLOCATED(thr) + lim + 1;
+    if (thr == c->curthread && c->indispatch)
+      c->alloclimit = (NIL_P(n)) ? ULLONG_MAX : c->allocated + lim;
+  } else if (what == arc_intern_cstr(c, "stack")) {
+    TMAXSTACK(thr) = (NIL_P(n) || lim > INT_MAX) ? 0 : (int)lim;
+    TSLIMIT(thr) = stklimit(c, thr);
+    if (TSP(thr) <= TSLIMIT(thr))
+      TSLIMIT(thr) = TSBASE(thr);
+  } else {
+    arc_err_cstrfmt(c, "thread-limit: unknown limit");
+    return(CNIL);
+  }
+  return(thr);
+}
+
+/* Get the priority of thr, or set it to prio.  Priorities go from -2
+   to 2, and are 0 unless set.  Threads with a priority above 0 are
+   run ahead of the others whenever they become ready after waiting,
+   and get shorter time slices, which suits threads which respond to
+   requests.  Threads with a priority below 0 get longer time slices,
+   which suits threads doing long computations in the background. */
+AFFDEF(arc_thread_priority)
+{
+  AARG(tthr);
+  AOARG(prio);
+  AFBEGIN;
+  TYPECHECK(AV(tthr), T_THREAD);
+  if (BOUND_P(AV(prio))) {
+    TYPECHECK(AV(prio), T_FIXNUM);
+    if (FIX2INT(AV(prio)) < TPRIO_MIN || FIX2INT(AV(prio)) > TPRIO_MAX) {
+      arc_err_cstrfmt(c, "thread-priority: priority must be from %d to %d",
+		      TPRIO_MIN, TPRIO_MAX);
+      ARETURN(CNIL);
+    }
+    TPRIO(AV(tthr)) = FIX2INT(AV(prio));
+    TSLICE(AV(tthr)) = base_slice(c, TPRIO(AV(tthr)));
+  }
+  ARETURN(INT2FIX(TPRIO(AV(tthr))));
+  AFEND;
+}
+AFFEND
+
 AFFDEF(arc_atomic_cell)
 {
   AOARG(val);
@@ -547,7 +1560,15 @@ AFFDEF(arc_kill_thread)
   AVAR(achan);
   AFBEGIN;
   TYPECHECK(AV(tthr), T_THREAD);
-  TSTATE(AV(tthr)) = Tbroken;
+  if (NIL_P(arc_dead(c, AV(tthr)))) {
+    /* Take the thread off whichever queue it is on, and let the
+       dispatcher release it. */
+    sleep_remove(c, AV(tthr));
+    iowait_remove(c, AV(tthr));
+    __arc_chan_abandon(c, AV(tthr));
+    TSTATE(AV(tthr)) = Tbroken;
+    __arc_thr_enqueue(c, AV(tthr));
+  }
   if (TACELL(AV(tthr))) {
     /* release atomic cell */
     TACELL(AV(tthr)) = 0;
@@ -570,22 +1591,16 @@ AFFEND
    or receive from a channel. */
 value arc_break_thread(arc *c, value tthr)
 {
-  typefn_t *tfn;
-
   /* do nothing if the thread is in either state */
   if (!(TSTATE(tthr) == Tready || TSTATE(tthr) == Tsleep
 	|| TSTATE(tthr) == Tiowait))
     return(tthr);
 
   /* force the thread to become ready */
-  TSTATE(tthr) = Tready;
+  __arc_thr_wakeup(c, tthr);
 
   /* make the thread resume at a call to arc_err */
-  SVALR(tthr, arc_mkaff(c, arc_err, CNIL));
-  CPUSH(tthr, arc_mkstringc(c, "user break"));
-  SFUNR(tthr, TVALR(tthr));
-  tfn = __arc_typefn(c, TVALR(tthr));
-  tfn->apply(c, tthr, TVALR(tthr));
+  thread_err(c, tthr, "user break");
   return(tthr);
 }
 
@@ -610,10 +1625,60 @@ void arc_init_threads(arc *c)
 {
   c->vmthreads = CNIL;
   c->vmthrtail = CNIL;
+  c->expressq = CNIL;
+  c->exprtail = CNIL;
+  c->sleepers = NULL;
+  c->nsleepers = c->sleepersize = 0;
+  c->iofds = NULL;
+  c->niofds = c->niowait = 0;
+  c->epollfd = -1;
+  c->uring = NULL;
+  c->nouring = 0;
+  c->iopool = NULL;
+  c->indispatch = 0;
   c->curthread = CNIL;
+  c->allthreads = arc_mkhash(c, ARC_HASHBITS);
   c->tid_nonce = 0;
   c->stksize = TSTKSIZE;
   c->quantum = DEFAULT_QUANTUM;
+  c->watchdog = 0;
+  c->wdstall = c->wdchecked = 0LL;
+}
+
+void arc_deinit_threads(arc *c)
+{
+  c->allthreads = CNIL;
+  c->vmthreads = CNIL;
+  c->vmthrtail = CNIL;
+  c->expressq = CNIL;
+  c->exprtail = CNIL;
+  free(c->sleepers);
+  c->sleepers = NULL;
+  c->nsleepers = c->sleepersize = 0;
+  free(c->iofds);
+  c->iofds = NULL;
+  c->niofds = c->niowait = 0;
+  if (c->epollfd >= 0)
+    close(c->epollfd);
+  c->epollfd = -1;
+#ifdef HAVE_LINUX_IO_URING_H
+  if (c->uring != NULL)
+    uring_free(c->uring);
+#endif
+  c->uring = NULL;
+  __arc_iopool_free(c);
+}
+
+void __arc_thread_mark(arc *c, void (*markfn)(value))
+{
+  int i;
+
+  for (i=0; i<c->nsleepers; i++)
+    markfn(c->sleepers[i]);
+  for (i=0; i<c->niofds; i++)
+    markfn(c->iofds[i].waiters);
+  markfn(c->expressq);
+  markfn(c->allthreads);
 }
 
 typefn_t __arc_thread_typefn__ = {
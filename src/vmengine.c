@@ -19,6 +19,7 @@
 #include "arcueid.h"
 #include "vmengine.h"
 #include "arith.h"
+#include "builtins.h"
 
 #ifdef HAVE_ALLOCA_H
 # include <alloca.h>
@@ -88,7 +89,6 @@ void __arc_thr_trampoline(arc *c, value thr, enum tr_states_t state)
 
   jmpval = setjmp(TEJMP(thr));
   if (jmpval == 2) {
-    TQUANTA(thr) = 0;
     TSTATE(thr) = Tbroken;
     return;
   }
@@ -98,6 +98,8 @@ void __arc_thr_trampoline(arc *c, value thr, enum tr_states_t state)
   }
 
   for (;;) {
+    if (__arc_sprof_pending)
+      __arc_sprof_sample(c, thr);
     switch (state) {
     case TR_RESUME:
       /* Resume execution of the current virtual machine state. */
@@ -122,7 +124,6 @@ void __arc_thr_trampoline(arc *c, value thr, enum tr_states_t state)
 	/* There was no available continuation on the continuation
 	   register.  If this happens, the current thread should
 	   terminate. */
-	TQUANTA(thr) = 0;
 	TSTATE(thr) = Trelease;
 	return;
       }
@@ -180,7 +181,297 @@ void __arc_init_tracing(arc *c)
 
 #endif
 
+/* The bytecode profiler.  While a profile is active, a virtual machine
+   built with HAVE_PROFILING counts every instruction it executes, by
+   opcode, by pair of consecutive opcodes, and by the code object that
+   executes it.  Without it, a profile can still be started, but it
+   will remain empty, and the virtual machine does not check for one. */
+static const char *opnames[VMPROF_NOPS] = {
+#define OPNAME(x) [x] = #x
+  OPNAME(inop), OPNAME(ipush), OPNAME(ipop), OPNAME(ildl), OPNAME(ildi),
+  OPNAME(ildg), OPNAME(istg), OPNAME(ilde), OPNAME(iste), OPNAME(icont),
+  OPNAME(iself), OPNAME(ienv), OPNAME(ienvr), OPNAME(iinl), OPNAME(ienvd),
+  OPNAME(ienvs), OPNAME(irest),
+  OPNAME(iapply), OPNAME(iret), OPNAME(ijmp), OPNAME(ijt), OPNAME(ijf),
+  OPNAME(ijbnd), OPNAME(itrue), OPNAME(inil), OPNAME(ihlt), OPNAME(iadd),
+  OPNAME(isub), OPNAME(imul), OPNAME(idiv), OPNAME(icons), OPNAME(icar),
+  OPNAME(icdr), OPNAME(iscar), OPNAME(iscdr), OPNAME(iis), OPNAME(idup),
+  OPNAME(icls), OPNAME(iconsr), OPNAME(imenv), OPNAME(idcar),
+  OPNAME(idcdr), OPNAME(ispl), OPNAME(ifxadd), OPNAME(ifxsub),
+  OPNAME(ifxmul), OPNAME(ifxlt), OPNAME(ifxgt)
+#undef OPNAME
+};
+
+/* Number of entries of each kind printed by arc_vmprof_dump */
+#define VMPROF_DUMPMAX 40
+
+struct vmprof_count {
+  unsigned long long count;
+  int a, b;
+  struct vmprof_fn *fn;
+};
+
+int arc_vmprof_start(arc *c)
+{
+  arc_vmprof_stop(c);
+  c->vmprof = (struct vmprofile *)calloc(1, sizeof(struct vmprofile));
+  return((c->vmprof == NULL) ? -1 : 0);
+}
+
+void arc_vmprof_stop(arc *c)
+{
+  struct vmprof_fn *fn, *next;
+  int i;
+
+  if (c->vmprof == NULL)
+    return;
+  for (i=0; i<(1 << VMPROF_HASHBITS); i++) {
+    for (fn = c->vmprof->fns[i]; fn != NULL; fn = next) {
+      next = fn->next;
+      free(fn);
+    }
+  }
+  free(c->vmprof);
+  c->vmprof = NULL;
+}
+
+struct vmprof_fn *__arc_vmprof_fn(arc *c, value code)
+{
+  struct vmprofile *prof = c->vmprof;
+  struct vmprof_fn *fn;
+  int h;
+
+  h = (((unsigned long)code) >> 4) & ((1 << VMPROF_HASHBITS) - 1);
+  for (fn = prof->fns[h]; fn != NULL; fn = fn->next) {
+    if (fn->code == code)
+      return(fn);
+  }
+  fn = (struct vmprof_fn *)malloc(sizeof(struct vmprof_fn));
+  fn->code = code;
+  fn->calls = fn->insts = 0;
+  fn->next = prof->fns[h];
+  prof->fns[h] = fn;
+  prof->nfns++;
+  return(fn);
+}
+
+void __arc_vmprof_mark(arc *c, void (*markfn)(value))
+{
+  struct vmprof_fn *fn;
+  int i;
+
+  if (c->vmprof == NULL)
+    return;
+  for (i=0; i<(1 << VMPROF_HASHBITS); i++) {
+    for (fn = c->vmprof->fns[i]; fn != NULL; fn = fn->next)
+      markfn(fn->code);
+  }
+}
+
+static int count_cmp(const void *a, const void *b)
+{
+  const struct vmprof_count *ca = a, *cb = b;
+
+  if (ca->count != cb->count)
+    return((ca->count < cb->count) ? -1 : 1);
+  if (ca->fn != NULL && ca->fn->calls != cb->fn->calls)
+    return((ca->fn->calls < cb->fn->calls) ? -1 : 1);
+  return(0);
+}
+
+/* Get the non-zero opcode counts (kind 0), opcode pair counts (kind 1),
+   or code object instruction counts (kind 2) of the profile, in
+   ascending order. */
+static struct vmprof_count *sorted_counts(struct vmprofile *prof, int kind,
+					  int *n)
+{
+  struct vmprof_count *counts;
+  struct vmprof_fn *fn;
+  int i, j;
+
+  *n = 0;
+  switch (kind) {
+  case 0:
+    counts = malloc(sizeof(struct vmprof_count) * VMPROF_NOPS);
+    for (i=0; i<VMPROF_NOPS; i++) {
+      if (prof->ops[i] == 0)
+	continue;
+      counts[*n].count = prof->ops[i];
+      counts[*n].a = i;
+      counts[(*n)++].fn = NULL;
+    }
+    break;
+  case 1:
+    counts = malloc(sizeof(struct vmprof_count) * VMPROF_NOPS * VMPROF_NOPS);
+    for (i=0; i<VMPROF_NOPS; i++) {
+      for (j=0; j<VMPROF_NOPS; j++) {
+	if (prof->pairs[i][j] == 0)
+	  continue;
+	counts[*n].count = prof->pairs[i][j];
+	counts[*n].a = i;
+	counts[*n].b = j;
+	counts[(*n)++].fn = NULL;
+      }
+    }
+    break;
+  default:
+    counts = malloc(sizeof(struct vmprof_count) * (prof->nfns + 1));
+    for (i=0; i<(1 << VMPROF_HASHBITS); i++) {
+      for (fn = prof->fns[i]; fn != NULL; fn = fn->next) {
+	counts[*n].count = fn->insts;
+	counts[(*n)++].fn = fn;
+      }
+    }
+    break;
+  }
+  qsort(counts, *n, sizeof(struct vmprof_count), count_cmp);
+  return(counts);
+}
+
+static value fnname(arc *c, value code)
+{
+  value src = CODE_SRC(code);
+
+  return((NIL_P(src)) ? CNIL : SRC_FUNCNAME(src));
+}
+
+/* The profile as a list of three lists: the opcodes executed and the
+   number of times each was executed, the pairs of opcodes executed one
+   after the other and the number of times each was, and the name of
+   each function executed, with the number of calls made to it and the
+   number of instructions it executed.  Each is in descending order. */
+value arc_vmprof_report(arc *c)
+{
+  struct vmprofile *prof = c->vmprof;
+  struct vmprof_count *counts;
+  value res[3], elt;
+  int i, n, kind;
+
+  if (prof == NULL)
+    return(CNIL);
+  for (kind=0; kind<3; kind++) {
+    counts = sorted_counts(prof, kind, &n);
+    res[kind] = CNIL;
+    for (i=0; i<n; i++) {
+      switch (kind) {
+      case 0:
+	elt = cons(c, arc_intern_cstr(c, opnames[counts[i].a]),
+		   __arc_ull2val(c, counts[i].count));
+	break;
+      case 1:
+	elt = cons(c, cons(c, arc_intern_cstr(c, opnames[counts[i].a]),
+			   arc_intern_cstr(c, opnames[counts[i].b])),
+		   __arc_ull2val(c, counts[i].count));
+	break;
+      default:
+	elt = cons(c, fnname(c, counts[i].fn->code),
+		   cons(c, __arc_ull2val(c, counts[i].fn->calls),
+			cons(c, __arc_ull2val(c, counts[i].fn->insts),
+			     CNIL)));
+	break;
+      }
+      res[kind] = cons(c, elt, res[kind]);
+    }
+    free(counts);
+  }
+  return(cons(c, res[0], cons(c, res[1], cons(c, res[2], CNIL))));
+}
+
+static void dump_fnname(arc *c, FILE *fp, value code)
+{
+  value name = fnname(c, code);
+  char *cstr;
+
+  if (SYMBOL_P(name))
+    name = arc_sym2name(c, name);
+  if (TYPE(name) != T_STRING) {
+    fprintf(fp, "%-32s", "<anonymous>");
+    return;
+  }
+  cstr = alloca(sizeof(char)*(FIX2INT(arc_strutflen(c, name)) + 1));
+  arc_str2cstr(c, name, cstr);
+  fprintf(fp, "%-32s", cstr);
+}
+
+/* Print the most frequently executed opcodes, opcode pairs, and
+   functions of the profile. */
+void arc_vmprof_dump(arc *c, FILE *fp)
+{
+  struct vmprofile *prof = c->vmprof;
+  struct vmprof_count *counts;
+  unsigned long long total = 0;
+  int i, n, kind;
+
+  if (prof == NULL)
+    return;
+  for (i=0; i<VMPROF_NOPS; i++)
+    total += prof->ops[i];
+  fprintf(fp, "%llu instructions executed\n", total);
+  if (total == 0)
+    return;
+  for (kind=0; kind<3; kind++) {
+    counts = sorted_counts(prof, kind, &n);
+    if (kind == 2)
+      fprintf(fp, "\n%-32s%12s%12s%8s\n", "function", "calls",
+	      "count", "%");
+    else
+      fprintf(fp, "\n%-32s%12s%8s\n", (kind == 0) ? "opcode" : "opcode pair",
+	      "count", "%");
+    for (i=n-1; i>=0 && i>=n-VMPROF_DUMPMAX; i--) {
+      switch (kind) {
+      case 0:
+	fprintf(fp, "%-32s", opnames[counts[i].a]);
+	break;
+      case 1:
+	fprintf(fp, "%-8s %-23s", opnames[counts[i].a], opnames[counts[i].b]);
+	break;
+      default:
+	dump_fnname(c, fp, counts[i].fn->code);
+	fprintf(fp, "%12llu", counts[i].fn->calls);
+	break;
+      }
+      fprintf(fp, "%12llu%8.2f\n", counts[i].count,
+	      100.0 * (double)counts[i].count / (double)total);
+    }
+    free(counts);
+  }
+}
+
+/* (vm-profile) gets the current profile, (vm-profile t) starts a new
+   one, and (vm-profile nil) stops profiling. */
+AFFDEF(arc_vm_profile)
+{
+  AOARG(on);
+  AFBEGIN;
+  if (!BOUND_P(AV(on)))
+    ARETURN(arc_vmprof_report(c));
+  if (NIL_P(AV(on))) {
+    arc_vmprof_stop(c);
+    ARETURN(CNIL);
+  }
+  if (arc_vmprof_start(c) < 0) {
+    arc_err_cstrfmt(c, "cannot allocate profile");
+    ARETURN(CNIL);
+  }
+  ARETURN(CTRUE);
+  AFEND;
+}
+AFFEND
+
 /* instruction decoding macros */
+#ifdef HAVE_PROFILING
+#define PROFILE {						\
+    if (prof != NULL) {						\
+      int op = FIX2INT(*TIPP(thr));				\
+      prof->ops[op]++;						\
+      prof->pairs[prof->lastop][op]++;				\
+      prof->lastop = op;					\
+      pfn->insts++;						\
+    } }
+#else
+#define PROFILE
+#endif
+
 #ifdef HAVE_THREADED_INTERPRETER
 /* threaded interpreter */
 #define INST(name) lbl_##name
@@ -191,11 +482,13 @@ void __arc_init_tracing(arc *c)
       goto endquantum;						\
     if (vmtrace)						\
       trace(c, thr);						\
+    PROFILE;							\
     goto *(JTBASE + jumptbl[*TIPP(thr)++]); }
 #else
 #define NEXT {							\
     if (--TQUANTA(thr) <= 0)					\
       goto endquantum;						\
+    PROFILE;							\
     goto *(JTBASE + jumptbl[*TIPP(thr)++]); }
 #endif
 
@@ -216,15 +509,24 @@ int __arc_vmengine(arc *c, value thr)
 #else
   value curr_instr;
 #endif
+#ifdef HAVE_PROFILING
+  /* The function being executed does not change until we return to
+     the trampoline, so its counts need only be found here. */
+  struct vmprofile *prof = c->vmprof;
+  struct vmprof_fn *pfn = (prof == NULL) ? NULL
+    : __arc_vmprof_fn(c, CLOS_CODE(TFUNR(thr)));
+#endif
 
 #ifdef HAVE_THREADED_INTERPRETER
 #ifdef HAVE_TRACING
   if (vmtrace)
     trace(c, thr);
 #endif
+  PROFILE;
   goto *(void *)(JTBASE + jumptbl[*TIPP(thr)++]);
 #else
   for (;;) {
+    PROFILE;
     curr_instr = *TIPP(thr)++;
     switch (FIX2INT(curr_instr)) {
 #endif
@@ -254,6 +556,8 @@ int __arc_vmengine(arc *c, value thr)
 	   it should be possible to use anything besides symbols to index
 	   the global top-level environment. */
 	SVALR(thr, arc_gbind(c, tmp));
+	if (TMACREADS(thr) != CUNBOUND)
+	  __arc_macex_read(c, thr, tmp, TVALR(thr));
 	if (TVALR(thr) == CUNBOUND) {
 	  tmpstr = arc_sym2name(c, tmp);
 	  cstr = alloca(sizeof(char)*(FIX2INT(arc_strutflen(c, tmpstr)) + 1));
@@ -265,6 +569,8 @@ int __arc_vmengine(arc *c, value thr)
       }
       NEXT;
     INST(istg):
+      if (TMACREADS(thr) != CUNBOUND)
+	__arc_macex_write(c, thr);
       arc_bindsym(c, CODE_LITERAL(CLOS_CODE(TFUNR(thr)),
 				  FIX2INT(*TIPP(thr)++)),
 		  TVALR(thr));
@@ -297,6 +603,43 @@ int __arc_vmengine(arc *c, value thr)
 	SCONR(thr, __arc_mkcont(c, thr, icofs));
       }
       NEXT;
+    INST(iself):
+      {
+	int n = FIX2INT(*TIPP(thr)++);
+	int itarget = FIX2INT(*TIPP(thr)++);
+
+	/* Only loop if the function being called really is the one
+	   running now.  Otherwise fall through to an ordinary tail call. */
+	if (TVALR(thr) == TFUNR(thr)) {
+	  __arc_loopenv(c, thr, n);
+	  TIPP(thr) += itarget-3;
+	}
+      }
+      NEXT;
+    INST(iinl):
+      {
+	int idx = FIX2INT(*TIPP(thr)++);
+	int argc = FIX2INT(*TIPP(thr)++);
+	int itarget = FIX2INT(*TIPP(thr)++);
+	value code = CLOS_CODE(TFUNR(thr));
+
+	if (TMACREADS(thr) != CUNBOUND) {
+	  value name = INL_NAME(CODE_LITERAL(code, idx));
+
+	  __arc_macex_read(c, thr, name, arc_gbind(c, name));
+	}
+	/* Use the inline expansion that follows only while the global
+	   it was expanded from is unchanged, otherwise jump to the
+	   ordinary call. */
+	if (INL_STATE(CODE_LITERAL(code, idx)) == CTRUE
+	    || __arc_inline_check(c, code, idx)) {
+	  if (argc >= 0)
+	    TARGC(thr) = argc;
+	} else {
+	  TIPP(thr) += itarget-4;
+	}
+      }
+      NEXT;
     INST(ienv):
       {
 	int minenv, dsenv, optenv;
@@ -341,6 +684,95 @@ int __arc_vmengine(arc *c, value thr)
 	}
       }
       NEXT;
+    INST(ienvd):
+      {
+	int minenv, dsenv, optenv;
+
+	/* As ienvr, for a rest parameter which is never used, so the
+	   extra arguments are simply dropped. */
+	minenv = FIX2INT(*TIPP(thr)++);
+	dsenv = FIX2INT(*TIPP(thr)++);
+	optenv = FIX2INT(*TIPP(thr)++);
+	if (TARGC(thr) < minenv) {
+	  arc_err_cstrfmt(c, "too few arguments, at least %d required, %d passed", minenv, TARGC(thr));
+	} else {
+	  if (TARGC(thr) > minenv + optenv) {
+	    TSP(thr) += TARGC(thr) - (minenv + optenv);
+	    TARGC(thr) = minenv + optenv;
+	  }
+	  __arc_mkenv(c, thr, TARGC(thr),
+		      minenv + optenv - TARGC(thr) + dsenv + 1);
+	  __arc_putenv(c, thr, 0, minenv + optenv + dsenv, CNIL);
+	}
+      }
+      NEXT;
+    INST(ienvs):
+      {
+	int minenv, dsenv, optenv, i, nrest;
+	value *rest;
+
+	/* As ienvr, but the extra arguments are left in the environment
+	   after the rest parameter and a count of them, and the rest
+	   parameter is CUNDEF until irest makes a list of them.  There
+	   are no destructuring binds, so the rest parameter is last. */
+	minenv = FIX2INT(*TIPP(thr)++);
+	dsenv = FIX2INT(*TIPP(thr)++);
+	optenv = FIX2INT(*TIPP(thr)++);
+	if (TARGC(thr) < minenv) {
+	  arc_err_cstrfmt(c, "too few arguments, at least %d required, %d passed", minenv, TARGC(thr));
+	} else {
+	  nrest = TARGC(thr) - (minenv + optenv);
+	  if (nrest < 0)
+	    nrest = 0;
+	  rest = alloca(sizeof(value)*(nrest+1));
+	  for (i=nrest-1; i>=0; i--)
+	    rest[i] = CPOP(thr);
+	  i = TARGC(thr) - nrest;
+	  __arc_mkenv(c, thr, i, minenv + optenv - i + dsenv + 2 + nrest);
+	  __arc_putenv(c, thr, 0, minenv + optenv, CUNDEF);
+	  __arc_putenv(c, thr, 0, minenv + optenv + 1, INT2FIX(nrest));
+	  for (i=0; i<nrest; i++)
+	    __arc_putenv(c, thr, 0, minenv + optenv + 2 + i, rest[i]);
+	}
+      }
+      NEXT;
+    INST(irest):
+      {
+	int ienv, iindx, op, n;
+	value rest;
+
+	ienv = FIX2INT(*TIPP(thr)++);
+	iindx = FIX2INT(*TIPP(thr)++);
+	op = FIX2INT(*TIPP(thr)++);
+	rest = __arc_getenv(c, thr, ienv, iindx);
+	if (rest == CUNDEF) {
+	  /* The arguments are still where ienvs left them.  Only a use
+	     of the rest parameter itself needs a list made of them. */
+	  n = FIX2INT(__arc_getenv(c, thr, ienv, iindx + 1));
+	  if (op == IREST_CAR) {
+	    SVALR(thr, (n > 0) ? __arc_getenv(c, thr, ienv, iindx + 2) : CNIL);
+	  } else if (op == IREST_NO || op == IREST_SOME) {
+	    SVALR(thr, ((n > 0) == (op == IREST_SOME)) ? CTRUE : CNIL);
+	  } else {
+	    for (rest = CNIL; n > 0; n--)
+	      rest = cons(c, __arc_getenv(c, thr, ienv, iindx + 1 + n), rest);
+	    __arc_putenv(c, thr, ienv, iindx, rest);
+	    SVALR(thr, rest);
+	  }
+	} else if (op == IREST_CAR) {
+	  if (NIL_P(rest))
+	    SVALR(thr, CNIL);
+	  else if (TYPE(rest) != T_CONS)
+	    arc_err_cstrfmt(c, "can't take car of value");
+	  else
+	    SVALR(thr, car(rest));
+	} else if (op == IREST_NO || op == IREST_SOME) {
+	  SVALR(thr, (NIL_P(rest) == (op == IREST_NO)) ? CTRUE : CNIL);
+	} else {
+	  SVALR(thr, rest);
+	}
+      }
+      NEXT;
     INST(iapply):
       {
 	/* Set up the argc based on the call.  Everything else required
@@ -391,6 +823,21 @@ int __arc_vmengine(arc *c, value thr)
       TSTATE(thr) = Trelease;
       goto endquantum;
       NEXT;
+    INST(ifxadd):
+      {
+	/* Fixnums are tagged with a low bit of 1, so the sum of the
+	   tagged values less one is the tagged sum. */
+	value arg1 = *(TSP(thr)+1), arg2 = TVALR(thr);
+	long sum;
+
+	if (FIXNUM_P(arg1) && FIXNUM_P(arg2)
+	    && !__builtin_add_overflow((long)arg1, (long)arg2 - 1, &sum)) {
+	  TSP(thr)++;
+	  SVALR(thr, (value)sum);
+	  NEXT;
+	}
+      }
+      /* anything else falls through to the generic version */
     INST(iadd):
       {
 	/* I really hate how the + operator has been so overloaded */
@@ -414,9 +861,35 @@ int __arc_vmengine(arc *c, value thr)
 	}
       }
       NEXT;
+    INST(ifxsub):
+      {
+	value arg1 = *(TSP(thr)+1), arg2 = TVALR(thr);
+	long diff;
+
+	if (FIXNUM_P(arg1) && FIXNUM_P(arg2)
+	    && !__builtin_sub_overflow((long)arg1, (long)arg2 - 1, &diff)) {
+	  TSP(thr)++;
+	  SVALR(thr, (value)diff);
+	  NEXT;
+	}
+      }
     INST(isub):
       SVALR(thr, __arc_sub2(c, CPOP(thr), TVALR(thr)));
       NEXT;
+    INST(ifxmul):
+      {
+	value arg1 = *(TSP(thr)+1), arg2 = TVALR(thr);
+	long prod;
+
+	/* the product of an untagged and a tagged value less one is
+	   even, and one more than it is the tagged product */
+	if (FIXNUM_P(arg1) && FIXNUM_P(arg2)
+	    && !__builtin_mul_overflow(FIX2INT(arg1), (long)arg2 - 1, &prod)) {
+	  TSP(thr)++;
+	  SVALR(thr, (value)(prod + 1));
+	  NEXT;
+	}
+      }
     INST(imul):
       SVALR(thr, __arc_mul2(c, CPOP(thr), TVALR(thr)));
       NEXT;
@@ -448,6 +921,34 @@ int __arc_vmengine(arc *c, value thr)
     INST(iscdr):
       scdr(CPOP(thr), TVALR(thr));
       NEXT;
+    INST(ifxlt):
+    INST(ifxgt):
+      {
+	value arg1 = CPOP(thr), arg2 = TVALR(thr);
+	int lt = (*(TIPP(thr)-1) == INT2FIX(ifxlt));
+	value op = ARC_BUILTIN(c, lt ? S_LT : S_GT);
+
+	/* tagging preserves the order of fixnums */
+	if (FIXNUM_P(arg1) && FIXNUM_P(arg2)
+	    && (__arc_symflags(c, op) & SYMF_BUILTIN)) {
+	  SVALR(thr, (lt ? ((long)arg1 < (long)arg2)
+		      : ((long)arg1 > (long)arg2)) ? CTRUE : CNIL);
+	} else {
+	  /* fake a call to the global < or > for anything else, or if
+	     it has been redefined since the code was compiled */
+	  SCONR(thr, __arc_mkcont(c, thr, TIPP(thr)
+				  - &XVINDEX(CODE_CODE(CLOS_CODE(TFUNR(thr))),
+					     0)));
+	  CPUSH(thr, arg1);
+	  CPUSH(thr, arg2);
+	  TARGC(thr) = 2;
+	  SVALR(thr, arc_gbind(c, op));
+	  if (TMACREADS(thr) != CUNBOUND)
+	    __arc_macex_read(c, thr, op, TVALR(thr));
+	  return(TR_FNAPP);
+	}
+      }
+      NEXT;
     INST(iis):
       SVALR(thr, arc_is2(c, TVALR(thr), CPOP(thr)));
       NEXT;
@@ -615,6 +1116,10 @@ static AFFDEF(contwrapper)
     TBCH(thr) = __arc_getenv(c, thr, 1, 4);
   }
   AFCALL(arc_mkaff(c, __arc_reroot, CNIL), __arc_getenv(c, thr, 1, 3));
+  /* restore the exception handler that was active when the
+     continuation was captured (index 6 is texh from arc_callcc) */
+  __arc_wb(TEXH(thr), __arc_getenv(c, thr, 1, 6));
+  TEXH(thr) = __arc_getenv(c, thr, 1, 6);
   /* call the continuation in the environment of arc_callcc */
   cont = __arc_getenv(c, thr, 1, 1);
   /* special case -- when ccc is a tail call */
@@ -629,7 +1134,7 @@ AFFEND
 AFFDEF(arc_callcc)
 {
   AARG(thunk);
-  AVAR(tcr, func, tch, tbch, cthr);
+  AVAR(tcr, func, tch, tbch, cthr, texh);
   AFBEGIN;
   /* First move the continuations to the heap if needed */
   SCONR(thr, __arc_cont2heap(c, thr, TCONR(thr)));
@@ -637,6 +1142,7 @@ AFFDEF(arc_callcc)
   WV(tch, TCH(thr));
   WV(tbch, TBCH(thr));
   WV(cthr, thr);
+  WV(texh, TEXH(thr));
   /* Save the environment of this call/cc invocation so contwrapper
      can have access to it later */
   SENVR(thr, __arc_env2heap(c, thr, TENVR(thr)));
@@ -652,6 +1158,85 @@ AFFDEF(arc_callcc)
 }
 AFFEND
 
+/* Escape continuations.  These are one-shot continuations that can
+   only be used to escape upward, while the function application that
+   created them is still active.  Unlike full continuations, creating
+   one doesn't require moving the continuations and environments
+   on the stack to the heap, so they are much cheaper, and are used
+   for things like on-err and catch, where the continuation is only
+   ever used to escape.
+
+   An escape continuation is identified by a frame, which is the
+   function whose application must still be live on the continuation
+   register when the escape continuation is invoked.  Invoking the
+   escape continuation unwinds to the continuation of the call made
+   by the frame, making it return the value passed.  The environment
+   of the escaper is a heap environment with the following layout:
+
+   __arc_getenv(c, thr, 1, 0) -> the frame
+   __arc_getenv(c, thr, 1, 1) -> the value of TCH when created
+   __arc_getenv(c, thr, 1, 2) -> the value of TEXH when created
+*/
+static AFFDEF(ecwrapper)
+{
+  AARG(arg);
+  AFBEGIN;
+  if (NIL_P(__arc_findcont(c, thr, __arc_getenv(c, thr, 1, 0)))) {
+    /* Restore the exception handler before signalling the error, so
+       that a stale handler can't invoke us again. */
+    __arc_wb(TEXH(thr), __arc_getenv(c, thr, 1, 2));
+    TEXH(thr) = __arc_getenv(c, thr, 1, 2);
+    arc_err_cstrfmt(c, "escape continuation invoked outside its extent");
+    ARETURN(CNIL);
+  }
+  AFCALL(arc_mkaff(c, __arc_reroot, CNIL), __arc_getenv(c, thr, 1, 1));
+  __arc_wb(TEXH(thr), __arc_getenv(c, thr, 1, 2));
+  TEXH(thr) = __arc_getenv(c, thr, 1, 2);
+  /* Unwind to the frame's continuation, which must be looked up again
+     as the after thunks run by the reroot may have moved it to the
+     heap. */
+  SCONR(thr, __arc_findcont(c, thr, __arc_getenv(c, thr, 1, 0)));
+  ARETURN(AV(arg));
+  AFEND;
+}
+AFFEND
+
+/* Make an escape continuation for frame, which should be the currently
+   running function. */
+value __arc_mkecont(arc *c, value thr, value frame)
+{
+  value env;
+
+  /* index 0 is the parent environment */
+  env = arc_mkvector(c, 4);
+  SVINDEX(env, 1, frame);
+  SVINDEX(env, 2, TCH(thr));
+  SVINDEX(env, 3, TEXH(thr));
+  return(arc_mkaff2(c, ecwrapper, CNIL, env));
+}
+
+static AFFDEF(ecframe)
+{
+  AARG(thunk);
+  AFBEGIN;
+  AFCALL(AV(thunk), __arc_mkecont(c, thr, TFUNR(thr)));
+  ARETURN(AFCRV);
+  AFEND;
+}
+AFFEND
+
+/* Call with escape continuation.  Each invocation uses a fresh frame
+   so that escape continuations from nested invocations can be told
+   apart. */
+AFFDEF(arc_callec)
+{
+  AARG(thunk);
+  AFBEGIN;
+  AFTCALL(arc_mkaff(c, ecframe, CNIL), AV(thunk));
+  AFEND;
+}
+AFFEND
+
 AFFDEF(arc_dynamic_wind)
 {
   AARG(before, during, after);
@@ -21,6 +21,7 @@
 #define _VMENGINE_H_
 
 #include <setjmp.h>
+#include <signal.h>
 
 enum vminst {
   inop=0,
@@ -33,8 +34,13 @@ enum vminst {
   ilde=135,
   iste=136,
   icont=137,
+  iself=138,
   ienv=202,
   ienvr=203,
+  iinl=204,
+  ienvd=205,
+  ienvs=206,
+  irest=207,
   iapply=76,
   iret=13,
   ijmp=78,
@@ -60,7 +66,20 @@ enum vminst {
   imenv=101,
   idcar=38,
   idcdr=39,
-  ispl=40
+  ispl=40,
+  ifxadd=41,
+  ifxsub=42,
+  ifxmul=43,
+  ifxlt=44,
+  ifxgt=45
+};
+
+/* What irest gives of a rest parameter */
+enum irest_ops {
+  IREST_LIST=0,			/* the rest parameter itself */
+  IREST_CAR=1,			/* its car */
+  IREST_NO=2,			/* t if it is empty */
+  IREST_SOME=3			/* t if it is not */
 };
 
 #define CODE_CODE(c) (VINDEX((c), 0))
@@ -76,13 +95,54 @@ enum vminst {
 #define CLOS_CODE(cl) (car(cl))
 #define CLOS_ENV(cl) (cdr(cl))
 
-/* The source information is a hash table, whose keys are code offsets
-   into the function and whose values are line numbers.  The following
-   special negative indexes are used for metadata. */
-/* File name of the compiled file */
-#define SRC_FILENAME (-1)
-/* Function name */
-#define SRC_FUNCNAME (-2)
+/* The source information is a vector containing a line number table,
+   the file name, and the function name.  The line number table is a
+   byte string, packed seven bytes to a fixnum, holding a sequence of
+   pairs of variable-length integers: the offset of the first
+   instruction on a new line relative to the previous pair, and the
+   zigzag-encoded difference between the lines.  Only instructions
+   that begin a new line get an entry.  The next three slots are only
+   used while the table is being built.  The last two hold the source
+   of the function if calls to it may be expanded inline, and the
+   indexes of the literals of the code that are inline expansion
+   sites. */
+#define SRC_LINES(s) (VINDEX((s), 0))
+#define SRC_FILENAME(s) (VINDEX((s), 1))
+#define SRC_FUNCNAME(s) (VINDEX((s), 2))
+#define SRC_NBYTES(s) (VINDEX((s), 3))
+#define SRC_LASTOFS(s) (VINDEX((s), 4))
+#define SRC_LASTLINE(s) (VINDEX((s), 5))
+#define SRC_INLINE(s) (VINDEX((s), 6))
+#define SRC_INLINED(s) (VINDEX((s), 7))
+#define SRC_SIZE 8
+
+#define SSRC_LINES(s, val) (SVINDEX((s), 0, val))
+#define SSRC_FILENAME(s, val) (SVINDEX((s), 1, val))
+#define SSRC_FUNCNAME(s, val) (SVINDEX((s), 2, val))
+#define SSRC_NBYTES(s, val) (SVINDEX((s), 3, val))
+#define SSRC_LASTOFS(s, val) (SVINDEX((s), 4, val))
+#define SSRC_LASTLINE(s, val) (SVINDEX((s), 5, val))
+#define SSRC_INLINE(s, val) (SVINDEX((s), 6, val))
+#define SSRC_INLINED(s, val) (SVINDEX((s), 7, val))
+
+/* An inline expansion site is a vector holding the name of the global
+   function whose body was expanded there, the source of that body,
+   and its state: t while the global still has that definition, nil
+   once it has been redefined, and unbound if that has not been
+   checked since the code was loaded. */
+#define INL_NAME(x) (VINDEX((x), 0))
+#define INL_SRC(x) (VINDEX((x), 1))
+#define INL_STATE(x) (VINDEX((x), 2))
+#define INL_SIZE 3
+
+#define SINL_NAME(x, val) (SVINDEX((x), 0, val))
+#define SINL_SRC(x, val) (SVINDEX((x), 1, val))
+#define SINL_STATE(x, val) (SVINDEX((x), 2, val))
+
+/* Number of bytes packed into each fixnum of a line number table.  A
+   fixnum gives up one bit of a value to its tag, so every byte but
+   one of the word is usable. */
+#define SRC_BYTESPERFIX ((int)sizeof(value) - 1)
 
 extern void arc_emit(arc *c, value cctx, int inst, value fl);
 extern void arc_emit1(arc *c, value cctx, int inst, value arg,
@@ -101,7 +161,7 @@ extern value arc_cctx_mksrc(arc *c, value cctx);
 extern value __arc_code_lineno(arc *c, value fun, value *ipptr);
 
 enum threadstate {
-  Talt,				/* blocked in alt instruction */
+  Talt,				/* blocked in alt */
   Tsend,			/* waiting to send */
   Trecv,			/* waiting to recv */
   Tiowait,			/* I/O wait */
@@ -132,8 +192,10 @@ struct vmthread_t {
 
   enum threadstate state;	/* thread state */
   int tid;			/* thread ID */
+  int priority;			/* scheduling priority */
+  unsigned long slice;		/* time slice it is given to run */
   unsigned long quanta;		/* time slice */
-  unsigned long long ticks;	/* time used */
+  unsigned long long ticks;	/* time spent running (usec) */
   unsigned long long wakeuptime; /* wakeup time */
   int waitfd;			 /* file descriptor to wait on */
   int waitrw;			 /* wait on read or write */
@@ -145,8 +207,35 @@ struct vmthread_t {
   value conthere;		/* here for this thread */
   value baseconthere;		/* base cont here */
   int atomic_cell;		/* atomic cell -- do we hold the channel? */
+  int schedq;			/* scheduler queues the thread is on */
+  int sleepidx;			/* index in the sleep heap, or -1 */
+  void *ioreq;			/* receive in progress, if any */
+  struct iojob *iojob;		/* job given to the I/O pool, if any */
+  value waiton;			/* channel, or alternatives, waited on */
+  value macreads;		/* globals read by a macro being expanded */
+  unsigned long long reported;	/* waitsince of the wait last reported */
+  int reportkind;		/* what that wait was last reported as */
+
+  /* Accounting */
+  unsigned long long cputime;	/* CPU time used while running (usec) */
+  unsigned long long insts;	/* instructions executed */
+  unsigned long long allocated;	/* bytes allocated */
+  unsigned long long nswitches;	/* times run by the dispatcher */
+  unsigned long long waittime[Tbroken+1]; /* time in each state (usec) */
+  unsigned long long waitsince;	/* when it began waitstate */
+  enum threadstate waitstate;	/* what it has been doing since */
+
+  /* Limits */
+  unsigned long long maxinsts;	/* instructions it may execute, or 0 */
+  unsigned long long maxalloc;	/* bytes it may allocate, or 0 */
+  int maxstack;			/* stack depth it may use, or 0 */
+  value *stklimit;		/* pushing past this overflows the stack */
 };
 
+/* Scheduler queues a thread may be on */
+#define TQ_RUN 1		/* the run queue */
+#define TQ_IOWAIT 2		/* the table of threads waiting on I/O */
+
 
 static inline value TFUNR(value t)
 {
@@ -208,6 +297,8 @@ static inline value SCONR(value t, value nv)
 #define TSTATE(t) (((struct vmthread_t *)REP(t))->state)
 #define TTID(t) (((struct vmthread_t *)REP(t))->tid)
 #define TQUANTA(t) (((struct vmthread_t *)REP(t))->quanta)
+#define TPRIO(t) (((struct vmthread_t *)REP(t))->priority)
+#define TSLICE(t) (((struct vmthread_t *)REP(t))->slice)
 #define TTICKS(t) (((struct vmthread_t *)REP(t))->ticks)
 #define TWAKEUP(t) (((struct vmthread_t *)REP(t))->wakeuptime)
 #define TWAITFD(t) (((struct vmthread_t *)REP(t))->waitfd)
@@ -217,20 +308,45 @@ static inline value SCONR(value t, value nv)
 #define TCM(t) (((struct vmthread_t *)REP(t))->cmarks)
 #define TACELL(t) (((struct vmthread_t *)REP(t))->atomic_cell)
 #define TRVCH(t) (((struct vmthread_t *)REP(t))->rvch)
+#define TSCHEDQ(t) (((struct vmthread_t *)REP(t))->schedq)
+#define TSLEEPIDX(t) (((struct vmthread_t *)REP(t))->sleepidx)
+#define TIOREQ(t) (((struct vmthread_t *)REP(t))->ioreq)
+#define TIOJOB(t) (((struct vmthread_t *)REP(t))->iojob)
+#define TWAITON(t) (((struct vmthread_t *)REP(t))->waiton)
+#define TMACREADS(t) (((struct vmthread_t *)REP(t))->macreads)
+#define TREPORTED(t) (((struct vmthread_t *)REP(t))->reported)
+#define TREPKIND(t) (((struct vmthread_t *)REP(t))->reportkind)
+#define TCPUTIME(t) (((struct vmthread_t *)REP(t))->cputime)
+#define TINSTS(t) (((struct vmthread_t *)REP(t))->insts)
+#define TALLOCATED(t) (((struct vmthread_t *)REP(t))->allocated)
+#define TNSWITCHES(t) (((struct vmthread_t *)REP(t))->nswitches)
+#define TWAITTIME(t) (((struct vmthread_t *)REP(t))->waittime)
+#define TWAITSINCE(t) (((struct vmthread_t *)REP(t))->waitsince)
+#define TWAITSTATE(t) (((struct vmthread_t *)REP(t))->waitstate)
+#define TMAXINSTS(t) (((struct vmthread_t *)REP(t))->maxinsts)
+#define TMAXALLOC(t) (((struct vmthread_t *)REP(t))->maxalloc)
+#define TMAXSTACK(t) (((struct vmthread_t *)REP(t))->maxstack)
+#define TSLIMIT(t) (((struct vmthread_t *)REP(t))->stklimit)
 
 #define TCH(t) (((struct vmthread_t *)REP(t))->conthere)
 #define TBCH(t) (((struct vmthread_t *)REP(t))->baseconthere)
 
 #if 1
 /* XXX - this should incorporate write barrier code */
-#define CPUSH(thr, val) do { if (TSP(thr) <= TSBASE(thr)) { abort(); } (*(TSP(thr)--) = (val)); } while (0)
+#define CPUSH(thr, val) do { if (TSP(thr) <= TSLIMIT(thr)) { __arc_stkover(c, thr); } (*(TSP(thr)--) = (val)); } while (0)
 #else
 #define CPUSH(thr, val) (*(TSP(thr)--) = (val))
 #endif
 
 #define CPOP(thr) (*(++TSP(thr)))
+/* Thread priorities */
+#define TPRIO_MIN -2
+#define TPRIO_MAX 2
+
 /* Default thread stack size */
 #define TSTKSIZE 65536
+/* Stack kept back for handling a stack overflow */
+#define TSTKRESERVE 1024
 
 /* A code generation context (cctx) is a vector with the following
    items as indexes:
@@ -239,6 +355,22 @@ static inline value SCONR(value t, value nv)
    1. A vmcode object.
    2. A pointer into the literal vector (usually a fixnum)
    3. A vector of literals
+   4. Line number information, if any
+   5. A hash index of the literals
+   6-9. If the function being compiled is bound to a name, that name,
+        the compiler environment of its body, the number of its
+        arguments, and the address where the body begins, so that
+        tail calls it makes to itself can become loops.
+   10. The source of the function, if calls to it may be expanded
+       inline.
+   11. A list of the indexes of the literals which are inline
+       expansion sites.
+   12. A list of the names of the functions currently being expanded
+       inline, innermost first.
+   13. A list of the local variables believed to hold fixnums, each
+       as a pair of its name and the environment frame binding it.
+   14. The parameters of a fn being applied directly whose arguments
+       are believed to be fixnums, passed on to compile_fn.
 
    The following macros are intended to manage the data
    structure, and to generate code and literals for the
@@ -250,13 +382,33 @@ static inline value SCONR(value t, value nv)
 #define CCTX_LPTR(cctx) (VINDEX(cctx, 2))
 #define CCTX_LITS(cctx) (VINDEX(cctx, 3))
 #define CCTX_SRC(cctx) (VINDEX(cctx, 4))
-#define CCTX_SIZE 5
+#define CCTX_LITIDX(cctx) (VINDEX(cctx, 5))
+#define CCTX_SELF(cctx) (VINDEX(cctx, 6))
+#define CCTX_SELFENV(cctx) (VINDEX(cctx, 7))
+#define CCTX_SELFARGS(cctx) (VINDEX(cctx, 8))
+#define CCTX_SELFTOP(cctx) (VINDEX(cctx, 9))
+#define CCTX_INLINE(cctx) (VINDEX(cctx, 10))
+#define CCTX_INLINED(cctx) (VINDEX(cctx, 11))
+#define CCTX_INLINING(cctx) (VINDEX(cctx, 12))
+#define CCTX_FXVARS(cctx) (VINDEX(cctx, 13))
+#define CCTX_FXARGS(cctx) (VINDEX(cctx, 14))
+#define CCTX_SIZE 15
 
 #define SCCTX_VCPTR(cctx, val) (SVINDEX(cctx, 0, val))
 #define SCCTX_VCODE(cctx, val) (SVINDEX(cctx, 1, val))
 #define SCCTX_LPTR(cctx, val) (SVINDEX(cctx, 2, val))
 #define SCCTX_LITS(cctx, val) (SVINDEX(cctx, 3, val))
 #define SCCTX_SRC(cctx, val) (SVINDEX(cctx, 4, val))
+#define SCCTX_LITIDX(cctx, val) (SVINDEX(cctx, 5, val))
+#define SCCTX_SELF(cctx, val) (SVINDEX(cctx, 6, val))
+#define SCCTX_SELFENV(cctx, val) (SVINDEX(cctx, 7, val))
+#define SCCTX_SELFARGS(cctx, val) (SVINDEX(cctx, 8, val))
+#define SCCTX_SELFTOP(cctx, val) (SVINDEX(cctx, 9, val))
+#define SCCTX_INLINE(cctx, val) (SVINDEX(cctx, 10, val))
+#define SCCTX_INLINED(cctx, val) (SVINDEX(cctx, 11, val))
+#define SCCTX_INLINING(cctx, val) (SVINDEX(cctx, 12, val))
+#define SCCTX_FXVARS(cctx, val) (SVINDEX(cctx, 13, val))
+#define SCCTX_FXARGS(cctx, val) (SVINDEX(cctx, 14, val))
 
 /* Continuations are vectors with the following items as indexes:
 
@@ -276,20 +428,57 @@ static inline value SCONR(value t, value nv)
 
 #define CONT_SIZE 6
 
+/* The bytecode profile.  This counts the number of times each opcode
+   and each pair of consecutive opcodes has been executed, and the
+   number of calls to and instructions executed by each code object.
+   The code objects are kept in a hash table keyed by address, and are
+   kept alive by the profile until it is discarded. */
+#define VMPROF_NOPS 256
+#define VMPROF_HASHBITS 10
+
+struct vmprof_fn {
+  value code;
+  unsigned long long calls;
+  unsigned long long insts;
+  struct vmprof_fn *next;
+};
+
+struct vmprofile {
+  unsigned long long ops[VMPROF_NOPS];
+  unsigned long long pairs[VMPROF_NOPS][VMPROF_NOPS];
+  int lastop;
+  int nfns;
+  struct vmprof_fn *fns[1 << VMPROF_HASHBITS];
+};
+
 extern void arc_jmpoffset(arc *c, value cctx, int jmpinst, int destoffset);
 
 extern void __arc_thr_trampoline(arc *c, value thr, enum tr_states_t result);
 extern int __arc_resume_aff(arc *c, value thr);
 extern void arc_restorecont(arc *c, value thr, value cont);
 extern int __arc_vmengine(arc *c, value thr);
+extern struct vmprof_fn *__arc_vmprof_fn(arc *c, value code);
+
+/* Sampling profiler */
+extern volatile sig_atomic_t __arc_sprof_pending;
+extern void __arc_sprof_sample(arc *c, value thr);
+extern value __arc_backtrace(arc *c, value thr);
 
 extern void __arc_clos_env2heap(arc *c, value thr, value clos);
 
 extern value __arc_env2heap(arc *c, value thr, value env);
 extern void __arc_menv(arc *c, value thr, int n);
+extern void __arc_loopenv(arc *c, value thr, int n);
+extern int __arc_inline_check(arc *c, value code, int idx);
+extern void __arc_macex_read(arc *c, value thr, value sym, value val);
+extern void __arc_macex_write(arc *c, value thr);
 
 extern void __arc_update_cont_envs(arc *c, value thr, value oldenv, value nenv);
 extern value __arc_cont2heap(arc *c, value thr, value cont);
+extern value __arc_findcont(arc *c, value thr, value fun);
+extern value __arc_cont_frame(arc *c, value thr, value cont, value *fun,
+			      int *ofs);
+extern value __arc_mkecont(arc *c, value thr, value frame);
 
 /* Closures */
 extern value arc_mkclos(arc *c, value code, value env);
@@ -307,13 +496,33 @@ extern value arc_current_thread(arc *c);
 extern value arc_break_thread(arc *c, value thr);
 extern int arc_kill_thread(arc *c, value thr);
 extern value arc_dead(arc *c, value thr);
+extern value arc_threads(arc *c);
+extern value arc_thread_stats(arc *c, value thr);
+extern value arc_thread_limit(arc *c, value thr, value what, value n);
+extern int arc_thread_priority(arc *c, value thr);
+extern void __arc_stkover(arc *c, value thr);
+extern void __arc_alloc_limit(arc *c);
 extern int arc_sleep(arc *c, value thr);
 extern int arc_atomic_cell(arc *c, value thr);
 extern int arc_join_thread(arc *c, value thr);
+extern void __arc_thr_enqueue(arc *c, value thr);
+extern void __arc_thr_wakeup(arc *c, value thr);
 
 /* Channels */
 extern value arc_mkchan(arc *c);
+extern value arc_mkchanbuf(arc *c, int capacity);
+extern int arc_chan(arc *c, value thr);
 extern int arc_recv_channel(arc *c, value thr);
 extern int arc_send_channel(arc *c, value thr);
+extern int arc_alt(arc *c, value thr);
+extern void __arc_chan_sender(arc *c, value chan, value thr);
+extern value __arc_chan_peer(arc *c, value chan, int send);
+extern void __arc_chan_abandon(arc *c, value thr);
+
+/* Deadlock detection */
+extern int arc_deadlocks(arc *c, value thr);
+extern value arc_thread_backtrace(arc *c, value thr);
+extern int arc_deadlock_watchdog(arc *c, value thr);
+extern void __arc_watchdog(arc *c, int force);
 
 #endif
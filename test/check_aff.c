@@ -53,6 +53,24 @@ AFFDEF(doubler)
 }
 AFFEND
 
+/* a minus the sum of the rest of the arguments, and them as a list */
+AFFDEF(restsum)
+{
+  AARG(a);
+  AVAR(sum, i);
+  ASARG(rest);
+  AFBEGIN;
+  WV(sum, INT2FIX(0));
+  for (WV(i, INT2FIX(0)); FIX2INT(AV(i)) < ARESTC(rest);
+       WV(i, INT2FIX(FIX2INT(AV(i)) + 1)))
+    WV(sum, INT2FIX(FIX2INT(AV(sum)) + FIX2INT(ARESTV(rest, FIX2INT(AV(i))))));
+  /* the rest arguments remain after a call */
+  AFCALL(arc_mkaff(c, subtractor, CNIL), AV(a), AV(sum));
+  ARETURN(cons(c, AFCRV, ARESTLIST(rest)));
+  AFEND;
+}
+AFFEND
+
 START_TEST(test_aff_simple)
 {
   value thr;
@@ -93,6 +111,33 @@ START_TEST(test_aff_doubler)
 }
 END_TEST
 
+START_TEST(test_aff_stack_rest)
+{
+  value thr, ret;
+
+  thr = arc_mkthread(c);
+  SVALR(thr, arc_mkaff(c, restsum, arc_mkstringc(c, "restsum")));
+  CPUSH(thr, INT2FIX(10));
+  CPUSH(thr, INT2FIX(1));
+  CPUSH(thr, INT2FIX(2));
+  CPUSH(thr, INT2FIX(3));
+  TARGC(thr) = 4;
+  __arc_thr_trampoline(c, thr, TR_FNAPP);
+  ret = TVALR(thr);
+  fail_unless(car(ret) == INT2FIX(4));
+  fail_unless(arc_list_length(c, cdr(ret)) == INT2FIX(3));
+  fail_unless(car(cdr(ret)) == INT2FIX(1));
+
+  SVALR(thr, arc_mkaff(c, restsum, arc_mkstringc(c, "restsum")));
+  CPUSH(thr, INT2FIX(10));
+  TARGC(thr) = 1;
+  __arc_thr_trampoline(c, thr, TR_FNAPP);
+  ret = TVALR(thr);
+  fail_unless(car(ret) == INT2FIX(10));
+  fail_unless(NIL_P(cdr(ret)));
+}
+END_TEST
+
 int main(void)
 {
   int number_failed;
@@ -106,6 +151,7 @@ int main(void)
   tcase_add_test(tc_aff, test_aff_simple);
   tcase_add_test(tc_aff, test_aff_subtractor);
   tcase_add_test(tc_aff, test_aff_doubler);
+  tcase_add_test(tc_aff, test_aff_stack_rest);
 
   suite_add_tcase(s, tc_aff);
   sr = srunner_create(s);
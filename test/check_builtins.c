@@ -1104,6 +1104,16 @@ START_TEST(test_ssexpand)
   fail_unless(car(cdr(cdr(sexpr))) == arc_intern(c, arc_mkstringc(c, "bar")));
   fail_unless(TYPE(car(cdr(cdr(cdr(sexpr))))) == T_SYMBOL);
   fail_unless(car(cdr(cdr(cdr(sexpr)))) == arc_intern(c, arc_mkstringc(c, "baz")));
+
+  TEST("(ssexpand 'xyzzy)");
+  fail_unless(NIL_P(ret));
+
+  /* expansions are cached, but each caller gets its own copy */
+  TEST("(is (ssexpand 'foo!bar) (ssexpand 'foo!bar))");
+  fail_unless(NIL_P(ret));
+  TEST("(scar (ssexpand 'foo!bar) 'quux)");
+  TEST("(car (ssexpand 'foo!bar))");
+  fail_unless(ret == arc_intern(c, arc_mkstringc(c, "foo")));
 }
 END_TEST
 
@@ -706,6 +706,277 @@ START_TEST(test_compile_inline_div)
 }
 END_TEST
 
+/* Check for the instruction inst in code or any code among its
+   literals */
+static int has_inst(value code, int inst)
+{
+  int i;
+
+  for (i=0; i<VECLEN(CODE_CODE(code)); i++) {
+    if (FIX2INT(XVINDEX(CODE_CODE(code), i)) == inst)
+      return(1);
+  }
+  for (i=2; i<VECLEN(code); i++) {
+    if (TYPE(VINDEX(code, i)) == T_CODE && has_inst(VINDEX(code, i), inst))
+      return(1);
+  }
+  return(0);
+}
+
+START_TEST(test_compile_fn_unused_rest)
+{
+  value thr, cctx, clos, code, ret;
+
+  thr = arc_mkthread(c);
+  /* A rest parameter which is never used is never made */
+  TEST("((fn (a . r) a) 1 2 3)");
+  fail_unless(has_inst(code, ienvd));
+  fail_unless(ret == INT2FIX(1));
+  TEST("((fn (a (o b 2) . r) (+ a b)) 1)");
+  fail_unless(has_inst(code, ienvd));
+  fail_unless(ret == INT2FIX(3));
+  TEST("((fn (a (o b 2) . r) (+ a b)) 1 3 5 7)");
+  fail_unless(ret == INT2FIX(4));
+
+  /* but it is if a function within refers to it */
+  TEST("(((fn (a . r) (fn (x) r)) 1 2 3) 4)");
+  fail_unless(!has_inst(code, ienvd));
+  fail_unless(CONS_P(ret) && car(ret) == INT2FIX(2));
+  TEST("(((fn r (fn () r)) 1 2))");
+  fail_unless(!has_inst(code, ienvd));
+  fail_unless(CONS_P(ret) && car(ret) == INT2FIX(1));
+}
+END_TEST
+
+/* Whether code or any code among its literals reads a rest parameter
+   with an irest of op */
+static int has_irest(value code, int op)
+{
+  int i, inst;
+
+  for (i=0; i<VECLEN(CODE_CODE(code));
+       i += 1 + ((inst == icont) ? 1 : inst >> 6)) {
+    inst = FIX2INT(XVINDEX(CODE_CODE(code), i));
+    if (inst == irest && FIX2INT(XVINDEX(CODE_CODE(code), i+3)) == op)
+      return(1);
+  }
+  for (i=2; i<VECLEN(code); i++) {
+    if (TYPE(VINDEX(code, i)) == T_CODE && has_irest(VINDEX(code, i), op))
+      return(1);
+  }
+  return(0);
+}
+
+START_TEST(test_compile_fn_rest_view)
+{
+  value thr, cctx, clos, code, ret;
+
+  thr = arc_mkthread(c);
+  /* A rest parameter which is only tested or has its car taken is
+     read where the arguments are, and never made into a list */
+  TEST("(assign no (fn (x) (is x nil)))");
+  TEST("(assign rv (fn args (if args (car args) 0)))");
+  fail_unless(has_inst(code, ienvs));
+  fail_unless(has_irest(code, IREST_SOME) && has_irest(code, IREST_CAR));
+  fail_unless(!has_irest(code, IREST_LIST));
+  TEST("(rv)");
+  fail_unless(ret == INT2FIX(0));
+  TEST("(rv 5 6)");
+  fail_unless(ret == INT2FIX(5));
+  TEST("(((fn r (fn () (car r)))))");
+  fail_unless(NIL_P(ret));
+  TEST("(((fn (a . r) (fn (x) (car r))) 1 2 3) 4)");
+  fail_unless(ret == INT2FIX(2));
+
+  /* Any other use gets a list, made once */
+  TEST("((fn (a . r) (cons a r)) 1 2 3)");
+  fail_unless(has_irest(code, IREST_LIST));
+  fail_unless(CONS_P(ret) && car(ret) == INT2FIX(1)
+	      && FIX2INT(arc_len(c, ret)) == 3);
+  TEST("((fn r (is r r)) 1 2)");
+  fail_unless(ret == CTRUE);
+  TEST("((fn r (cons (car r) r)) 1 2)");
+  fail_unless(CONS_P(ret) && car(ret) == INT2FIX(1)
+	      && CONS_P(cdr(ret)) && car(cdr(ret)) == INT2FIX(1));
+  TEST("((fn r (no r)) 1)");
+  fail_unless(NIL_P(ret));
+
+  /* and one which has been assigned to is what it was given */
+  TEST("((fn r (assign r 5) r) 1 2)");
+  fail_unless(ret == INT2FIX(5));
+  TEST("((fn r (assign r '(7)) (car r)) 1)");
+  fail_unless(ret == INT2FIX(7));
+  TEST("((fn r (assign r nil) (if r 1 2)) 1)");
+  fail_unless(ret == INT2FIX(2));
+}
+END_TEST
+
+START_TEST(test_compile_fixnum_arith)
+{
+  value thr, cctx, clos, code, ret;
+  char str[64];
+
+  thr = arc_mkthread(c);
+  TEST("(assign fxa 3)");
+  TEST("(+ fxa 1)");
+  fail_unless(has_inst(code, ifxadd));
+  fail_unless(ret == INT2FIX(4));
+  TEST("(- fxa 5)");
+  fail_unless(has_inst(code, ifxsub));
+  fail_unless(ret == INT2FIX(-2));
+  TEST("(* fxa -2)");
+  fail_unless(has_inst(code, ifxmul));
+  fail_unless(ret == INT2FIX(-6));
+  TEST("(< fxa 4)");
+  fail_unless(has_inst(code, ifxlt));
+  fail_unless(ret == CTRUE);
+  TEST("(> fxa 4)");
+  fail_unless(has_inst(code, ifxgt));
+  fail_unless(NIL_P(ret));
+
+  /* Parameters bound to fixnums are known to be fixnums too */
+  TEST("((fn (x y) (+ x y)) (len \"abc\") 2)");
+  fail_unless(has_inst(code, ifxadd));
+  fail_unless(ret == INT2FIX(5));
+
+  /* Nothing is known about the types of globals alone */
+  TEST("(+ fxa fxa)");
+  fail_unless(!has_inst(code, ifxadd));
+  fail_unless(ret == INT2FIX(6));
+
+  /* Anything other than fixnums uses the generic operation */
+  TEST("(assign fxa 1.5)");
+  TEST("(+ fxa 1)");
+  fail_unless(TYPE(ret) == T_FLONUM);
+  fail_unless(fabs(REPFLO(ret) - 2.5) < 1e-6);
+  TEST("(assign fxa \"a\")");
+  TEST("(< fxa \"b\")");
+  fail_unless(ret == CTRUE);
+
+  /* as does overflow */
+  snprintf(str, sizeof(str), "(assign fxa %ld)", FIXNUM_MAX);
+  TEST(str);
+  TEST("(+ fxa 1)");
+  fail_unless(TYPE(ret) != T_FIXNUM);
+  TEST("(* fxa 2)");
+  fail_unless(TYPE(ret) != T_FIXNUM);
+  TEST("(- (- 0 fxa) 2)");
+  fail_unless(TYPE(ret) != T_FIXNUM);
+}
+END_TEST
+
+START_TEST(test_compile_fixnum_cmp_rebind)
+{
+  value thr, cctx, clos, code, ret;
+
+  thr = arc_mkthread(c);
+  /* a local < is called rather than compared inline */
+  TEST("((fn (< x) (< x 2)) (fn (a b) 'shadow) 1)");
+  fail_unless(!has_inst(code, ifxlt));
+  fail_unless(ret == arc_intern_cstr(c, "shadow"));
+
+  /* code compiled while < was the builtin calls a redefinition */
+  TEST("(assign fxlt (fn () (< 1 2)))");
+  fail_unless(has_inst(code, ifxlt));
+  TEST("(assign fxoldlt <)");
+  TEST("(assign < (fn args 'redef))");
+  TEST("(fxlt)");
+  fail_unless(ret == arc_intern_cstr(c, "redef"));
+  TEST("(< 1 2)");
+  fail_unless(!has_inst(code, ifxlt));
+  fail_unless(ret == arc_intern_cstr(c, "redef"));
+  TEST("(assign < fxoldlt)");
+  TEST("(fxlt)");
+  fail_unless(ret == CTRUE);
+}
+END_TEST
+
+START_TEST(test_compile_constfold)
+{
+  value thr, cctx, clos, code, ret;
+
+  thr = arc_mkthread(c);
+  /* a constant expression compiles down to a single literal load */
+  TEST("(* 60 60 24)");
+  fail_unless(FIX2INT(ret) == 86400);
+  fail_unless(FIX2INT(XVINDEX(CODE_CODE(code), 0)) == ildi);
+
+  TEST("(+ 1 2.5)");
+  fail_unless(TYPE(ret) == T_FLONUM);
+  fail_unless(fabs(REPFLO(ret) - 3.5) < 1e-6);
+
+  TEST("(assign no (fn (x) (is x nil)))");
+  TEST("(if (no 1) 1 2)");
+  fail_unless(FIX2INT(ret) == 2);
+
+  /* nor is no once it is something else */
+  TEST("(assign no (fn (x) x))");
+  TEST("(if (no 1) 1 2)");
+  fail_unless(FIX2INT(ret) == 1);
+  TEST("(assign no (fn (x) (is x nil)))");
+
+  /* division by zero is left for run time */
+  TEST("(if nil (/ 1 0) 5)");
+  fail_unless(FIX2INT(ret) == 5);
+}
+END_TEST
+
+START_TEST(test_compile_selfloop)
+{
+  value thr, cctx, clos, code, ret;
+
+  thr = arc_mkthread(c);
+  /* A self tail call from within an if is made into a loop */
+  TEST("((fn () (assign cnt (fn (n acc) (if (is n 0) acc (cnt (- n 1) (+ acc 2))))) (cnt 1000 0)))");
+  fail_unless(FIX2INT(ret) == 2000);
+
+  /* Closures made in each iteration still get bindings of their own */
+  TEST("((fn () (assign mk (fn (n acc) (if (is n 0) acc (mk (- n 1) (cons (fn () n) acc))))) ((car (mk 3 nil)))))");
+  fail_unless(FIX2INT(ret) == 1);
+
+  /* If the name no longer refers to the function, a tail call to it is
+     an ordinary call */
+  TEST("((fn () (assign f1 (fn (n) (if (is n 0) 'done (f1 (- n 1))))) (assign f2 f1) (assign f1 (fn (n) n)) (f2 5)))");
+  fail_unless(FIX2INT(ret) == 4);
+}
+END_TEST
+
+START_TEST(test_compile_inline_global)
+{
+  value thr, cctx, clos, code, ret;
+
+  thr = arc_mkthread(c);
+  TEST("(assign sq (fn (x) (* x x)))");
+  /* A call with trivial arguments substitutes them into the body */
+  TEST("(sq 3)");
+  fail_unless(FIX2INT(XVINDEX(CODE_CODE(code), 0)) == iinl);
+  fail_unless(FIX2INT(ret) == 9);
+  TEST("((fn (y) (+ 1 (sq y))) 4)");
+  fail_unless(FIX2INT(ret) == 17);
+
+  /* Other arguments are bound as in a call */
+  TEST("((fn (y) (+ 1 (sq (+ y 1)))) 2)");
+  fail_unless(FIX2INT(ret) == 10);
+  TEST("((fn (y) (sq (+ y 1))) 2)");
+  fail_unless(FIX2INT(ret) == 9);
+
+  /* Code which expanded the old definition uses the new one */
+  TEST("(assign f1 (fn (y) (sq y)))");
+  TEST("(assign f2 (fn (y) (- (sq (- y 1)) 1)))");
+  TEST("(assign sq (fn (x) (+ x x)))");
+  TEST("(f1 5)");
+  fail_unless(FIX2INT(ret) == 10);
+  TEST("(f2 5)");
+  fail_unless(FIX2INT(ret) == 7);
+
+  /* Recursive functions are not expanded */
+  TEST("(assign fact (fn (n) (if (is n 0) 1 (* n (fact (- n 1))))))");
+  TEST("(fact 5)");
+  fail_unless(FIX2INT(XVINDEX(CODE_CODE(code), 0)) != iinl);
+  fail_unless(FIX2INT(ret) == 120);
+}
+END_TEST
+
 START_TEST(test_compile_macro)
 {
   value thr, cctx, clos, code, ret;
@@ -740,6 +1011,77 @@ START_TEST(test_compile_macro)
 }
 END_TEST
 
+START_TEST(test_compile_macro_cache)
+{
+  value thr, cctx, clos, code, ret, prev;
+
+  thr = arc_mkthread(c);
+  /* Each expansion of mc gives a fresh symbol, so whether the
+     expansion was taken from the cache can be told by the result */
+  TEST("(assign mdbg nil)");
+  TEST("(assign mc (annotate 'mac (fn () (list 'quote (list mdbg (uniq))))))");
+  TEST("(assign mform '(mc))");
+
+  /* The same form is expanded only once */
+  TEST("(eval mform)");
+  prev = ret;
+  TEST("(eval mform)");
+  fail_unless(ret == prev);
+  TEST("(cadr (macex mform))");
+  fail_unless(ret == prev);
+
+  /* but again once a global the macro read has changed */
+  TEST("(assign mdbg t)");
+  TEST("(eval mform)");
+  fail_unless(ret != prev && car(ret) == CTRUE);
+  prev = ret;
+  TEST("(eval mform)");
+  fail_unless(ret == prev);
+
+  /* or the form has been changed */
+  TEST("(assign mc (annotate 'mac (fn (x) (list 'quote (list x (uniq))))))");
+  TEST("(assign mform '(mc 1))");
+  TEST("(eval mform)");
+  fail_unless(car(ret) == INT2FIX(1));
+  TEST("(scar (cdr mform) 2)");
+  TEST("(eval mform)");
+  fail_unless(car(ret) == INT2FIX(2));
+  prev = ret;
+
+  /* or the expansion given out has been changed */
+  TEST("(scar (cadr (macex mform)) 3)");
+  TEST("(eval mform)");
+  fail_unless(ret != prev && car(ret) == INT2FIX(2));
+  prev = ret;
+
+  /* or the macro has been redefined */
+  TEST("(assign mc (annotate 'mac (fn (x) (list 'quote (list x (uniq))))))");
+  TEST("(eval mform)");
+  fail_unless(ret != prev && car(ret) == INT2FIX(2));
+
+  /* A macro which assigns a global is always expanded again */
+  TEST("(assign mcnt 0)");
+  TEST("(assign mc (annotate 'mac (fn () (assign mcnt (+ mcnt 1)) mcnt)))");
+  TEST("(assign mform '(mc))");
+  TEST("(eval mform)");
+  fail_unless(ret == INT2FIX(1));
+  TEST("(eval mform)");
+  fail_unless(ret == INT2FIX(2));
+
+  /* as is one which closes over a variable */
+  TEST("(assign mc ((fn (n) (annotate 'mac (fn () (assign n (+ n 1)) n))) 0))");
+  TEST("(eval mform)");
+  fail_unless(ret == INT2FIX(1));
+  TEST("(eval mform)");
+  fail_unless(ret == INT2FIX(2));
+
+  /* A symbol which is no longer a macro is called */
+  TEST("(assign mc (fn () 42))");
+  TEST("(eval '(mc))");
+  fail_unless(FIX2INT(ret) == 42);
+}
+END_TEST
+
 static void errhandler(arc *c, value thr, value str)
 {
   fprintf(stderr, "Error\n");
@@ -791,7 +1133,15 @@ int main(void)
   tcase_add_test(tc_compiler, test_compile_inline_times);
   tcase_add_test(tc_compiler, test_compile_inline_minus);
   tcase_add_test(tc_compiler, test_compile_inline_div);
+  tcase_add_test(tc_compiler, test_compile_fn_unused_rest);
+  tcase_add_test(tc_compiler, test_compile_fn_rest_view);
+  tcase_add_test(tc_compiler, test_compile_fixnum_arith);
+  tcase_add_test(tc_compiler, test_compile_fixnum_cmp_rebind);
+  tcase_add_test(tc_compiler, test_compile_constfold);
+  tcase_add_test(tc_compiler, test_compile_selfloop);
+  tcase_add_test(tc_compiler, test_compile_inline_global);
   tcase_add_test(tc_compiler, test_compile_macro);
+  tcase_add_test(tc_compiler, test_compile_macro_cache);
 
   suite_add_tcase(s, tc_compiler);
   sr = srunner_create(s);
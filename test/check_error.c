@@ -164,6 +164,24 @@ START_TEST(test_on_err_nested)
 }
 END_TEST
 
+START_TEST(test_on_err_reraise)
+{
+  value ret, cctx, code, clos;
+
+  c->errhandler = errhandler2;
+  if (setjmp(errbuf) == 1) {
+    fail("on-err did not catch the exception!");
+    return;
+  }
+  /* an error raised by the handler of an inner on-err goes to the outer
+     one, and each returns to its own caller */
+  TEST("(+ 1 (on-err (fn (x) 10) (fn () (+ 100 (on-err (fn (x) (err \"again\")) (fn () (+ 1000 (err \"first\"))))))))");
+  fail_unless(ret == INT2FIX(11));
+  TEST("(+ 1 (on-err (fn (x) 10) (fn () (+ 100 (on-err (fn (x) 20) (fn () (+ 1000 (err \"first\"))))))))");
+  fail_unless(ret == INT2FIX(121));
+}
+END_TEST
+
 START_TEST(test_ccc)
 {
   value ret, cctx, code, clos;
@@ -298,6 +316,7 @@ int main(void)
   tcase_add_test(tc_err, test_err);
   tcase_add_test(tc_err, test_on_err);
   tcase_add_test(tc_err, test_on_err_nested);
+  tcase_add_test(tc_err, test_on_err_reraise);
   tcase_add_test(tc_err, test_ccc);
   tcase_add_test(tc_err, test_protect_noerr);
   tcase_add_test(tc_err, test_protect_ccc);
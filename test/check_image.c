@@ -0,0 +1,164 @@
+/*
+  Copyright (C) 2013 Rafael R. Sevilla
+
+  This file is part of Arcueid
+
+  Arcueid is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <unistd.h>
+#include <check.h>
+#include "../src/arcueid.h"
+#include "../src/vmengine.h"
+#include "../src/builtins.h"
+#include "../src/compiler.h"
+#include "../src/io.h"
+#include "../config.h"
+
+extern void __arc_print_string(arc *c, value ppstr);
+
+arc cc;
+arc *c;
+
+#define QUANTA 65536
+
+#define IMAGE_FILE "check_image.img"
+
+#define CPUSH_(val) CPUSH(thr, val)
+
+#define XCALL0(clos) do {			\
+    c->curthread = thr;				\
+    TQUANTA(thr) = QUANTA;			\
+    SVALR(thr, clos);				\
+    TARGC(thr) = 0;				\
+    __arc_thr_trampoline(c, thr, TR_FNAPP);	\
+  } while (0)
+
+#define XCALL(fname, ...) do {			\
+    c->curthread = thr;				\
+    SVALR(thr, arc_mkaff(c, fname, CNIL));	\
+    TARGC(thr) = NARGS(__VA_ARGS__);		\
+    FOR_EACH(CPUSH_, __VA_ARGS__);		\
+    __arc_thr_trampoline(c, thr, TR_FNAPP);	\
+  } while (0)
+
+#define TEST(sexpr)				\
+  COMPILE(sexpr);				\
+  cctx = TVALR(thr);				\
+  code = arc_cctx2code(c, cctx);		\
+  clos = arc_mkclos(c, code, CNIL);		\
+  XCALL0(clos);					\
+  ret = TVALR(thr)
+
+AFFDEF(compile_something)
+{
+  AARG(something);
+  value sexpr;
+  AVAR(sio);
+  AFBEGIN;
+  TQUANTA(thr) = QUANTA;	/* needed so macros can execute */
+  WV(sio, arc_instring(c, AV(something), CNIL));
+  AFCALL(arc_mkaff(c, arc_sread, CNIL), AV(sio), CNIL);
+  sexpr = AFCRV;
+  AFTCALL(arc_mkaff(c, arc_compile, CNIL), sexpr, arc_mkcctx(c), CNIL, CTRUE);
+  AFEND;
+}
+AFFEND
+
+#define COMPILE(str) XCALL(compile_something, arc_mkstringc(c, str))
+
+/* Dump an image, clobber the globals it holds, and restore it.
+   Whatever was bound then must behave as it did before. */
+START_TEST(test_image_roundtrip)
+{
+  value thr, cctx, clos, code, ret, skipped;
+
+  thr = arc_mkthread(c);
+  TEST("(assign imgx '(1 \"two\" #\\3 4.5))");
+  TEST("(assign imgm (annotate 'mac "
+       "(fn (x) (cons 'cons (cons x (cons x nil))))))");
+  TEST("(assign imgf ((fn (n) (fn () (assign n (+ n 1)))) 10))");
+  TEST("(imgf)");
+  fail_unless(ret == INT2FIX(11));
+  TEST("(assign imgsq (fn (x) (* x x)))");
+  TEST("(assign imgg (fn (y) (imgsq y)))");
+  TEST("(imgg 3)");
+  fail_unless(ret == INT2FIX(9));
+
+  fail_unless(arc_image_save(c, IMAGE_FILE, &skipped) == 0);
+  fail_unless(NIL_P(skipped));
+  TEST("(assign imgx nil)");
+  TEST("(assign imgm nil)");
+  TEST("(assign imgf nil)");
+  TEST("(assign imgsq nil)");
+  TEST("(assign imgg nil)");
+  fail_unless(arc_image_load(c, IMAGE_FILE) == 0);
+  unlink(IMAGE_FILE);
+
+  /* globals */
+  TEST("imgx");
+  fail_unless(CONS_P(ret) && car(ret) == INT2FIX(1));
+  TEST("(car (cdr imgx))");
+  fail_unless(TYPE(ret) == T_STRING);
+  TEST("(car (cdr (cdr imgx)))");
+  fail_unless(TYPE(ret) == T_CHAR && arc_char2rune(c, ret) == '3');
+
+  /* a macro is bound through arc_bindsym, so it is expanded again */
+  TEST("(imgm 7)");
+  fail_unless(CONS_P(ret) && car(ret) == INT2FIX(7)
+	      && cdr(ret) == INT2FIX(7));
+
+  /* a closure keeps the state of its environment */
+  TEST("(imgf)");
+  fail_unless(ret == INT2FIX(12));
+  TEST("(imgf)");
+  fail_unless(ret == INT2FIX(13));
+
+  /* code which expanded a global inline still follows its
+     redefinition */
+  TEST("(imgg 4)");
+  fail_unless(ret == INT2FIX(16));
+  TEST("(assign imgsq (fn (x) (+ x x)))");
+  TEST("(imgg 4)");
+  fail_unless(ret == INT2FIX(8));
+}
+END_TEST
+
+static void errhandler(arc *c, value thr, value str)
+{
+  fprintf(stderr, "Error\n");
+  __arc_print_string(c, str);
+  abort();
+}
+
+int main(void)
+{
+  int number_failed;
+  Suite *s = suite_create("Image");
+  TCase *tc_image = tcase_create("Image");
+  SRunner *sr;
+
+  c = &cc;
+  arc_init(c);
+  c->errhandler = errhandler;
+
+  tcase_add_test(tc_image, test_image_roundtrip);
+
+  suite_add_tcase(s, tc_image);
+  sr = srunner_create(s);
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return((number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
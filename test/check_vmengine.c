@@ -17,6 +17,7 @@
   along with this program; if not, see <http://www.gnu.org/licenses/>.
 */
 #include <check.h>
+#include <string.h>
 #include "../src/arcueid.h"
 #include "../src/vmengine.h"
 #include "../src/arith.h"
@@ -914,6 +915,158 @@ START_TEST(test_callcc)
 }
 END_TEST
 
+START_TEST(test_lineno)
+{
+  value cctx, code, clos, fl, file;
+  int i;
+
+  file = arc_mkstringc(c, "test.arc");
+  cctx = arc_mkcctx(c);
+  arc_cctx_mksrc(c, cctx);
+  arc_emit(c, cctx, inop, cons(c, file, INT2FIX(10)));
+  arc_emit1(c, cctx, ildi, INT2FIX(1), cons(c, file, INT2FIX(10)));
+  arc_emit(c, cctx, inop, cons(c, file, INT2FIX(500)));
+  arc_emit(c, cctx, inop, CNIL);
+  arc_emit(c, cctx, inop, cons(c, file, INT2FIX(3)));
+  for (i=0; i<100; i++)
+    arc_emit(c, cctx, inop, cons(c, file, INT2FIX(3)));
+  arc_emit(c, cctx, ihlt, cons(c, file, INT2FIX(4)));
+  code = arc_cctx2code(c, cctx);
+  clos = arc_mkclos(c, code, CNIL);
+
+  fl = __arc_code_lineno(c, clos, &XVINDEX(CODE_CODE(code), 0));
+  fail_unless(arc_is2(c, car(fl), file) == CTRUE);
+  fail_unless(cdr(fl) == INT2FIX(10));
+  fl = __arc_code_lineno(c, clos, &XVINDEX(CODE_CODE(code), 1));
+  fail_unless(cdr(fl) == INT2FIX(10));
+  fl = __arc_code_lineno(c, clos, &XVINDEX(CODE_CODE(code), 3));
+  fail_unless(cdr(fl) == INT2FIX(500));
+  /* no line information, so it should have the previous line */
+  fl = __arc_code_lineno(c, clos, &XVINDEX(CODE_CODE(code), 4));
+  fail_unless(cdr(fl) == INT2FIX(500));
+  fl = __arc_code_lineno(c, clos, &XVINDEX(CODE_CODE(code), 5));
+  fail_unless(cdr(fl) == INT2FIX(3));
+  fl = __arc_code_lineno(c, clos, &XVINDEX(CODE_CODE(code), 105));
+  fail_unless(cdr(fl) == INT2FIX(3));
+  fl = __arc_code_lineno(c, clos, &XVINDEX(CODE_CODE(code), 106));
+  fail_unless(cdr(fl) == INT2FIX(4));
+
+  /* no line number information at all */
+  cctx = arc_mkcctx(c);
+  arc_emit(c, cctx, ihlt, cons(c, file, INT2FIX(4)));
+  code = arc_cctx2code(c, cctx);
+  clos = arc_mkclos(c, code, CNIL);
+  fl = __arc_code_lineno(c, clos, &XVINDEX(CODE_CODE(code), 0));
+  fail_unless(!BOUND_P(fl));
+}
+END_TEST
+
+START_TEST(test_profile)
+{
+  value cctx, code, clos, prof, fns;
+  value thr;
+
+  cctx = arc_mkcctx(c);
+  arc_emit1(c, cctx, ildi, INT2FIX(4), CNIL);
+  arc_emit(c, cctx, ipush, CNIL);
+  arc_emit1(c, cctx, ildi, INT2FIX(8), CNIL);
+  arc_emit(c, cctx, icons, CNIL);
+  arc_emit(c, cctx, icdr, CNIL);
+  arc_emit(c, cctx, ihlt, CNIL);
+  code = arc_cctx2code(c, cctx);
+  clos = arc_mkclos(c, code, CNIL);
+  thr = arc_mkthread(c);
+  fail_unless(NIL_P(arc_vmprof_report(c)));
+  fail_unless(arc_vmprof_start(c) == 0);
+  XCALL0(clos);
+  fail_unless(TVALR(thr) == INT2FIX(8));
+  prof = arc_vmprof_report(c);
+  fns = car(cdr(cdr(prof)));
+#ifdef HAVE_PROFILING
+  fail_unless(c->vmprof->ops[ildi] == 2);
+  fail_unless(c->vmprof->ops[ihlt] == 1);
+  fail_unless(c->vmprof->pairs[ipush][ildi] == 1);
+  fail_unless(c->vmprof->pairs[icons][icdr] == 1);
+  /* the most frequent opcode comes first */
+  fail_unless(car(car(car(prof))) == arc_intern_cstr(c, "ildi"));
+  fail_unless(cdr(car(car(prof))) == INT2FIX(2));
+  fail_unless(arc_list_length(c, fns) == INT2FIX(1));
+  fail_unless(car(cdr(car(fns))) == INT2FIX(1));
+  fail_unless(car(cdr(cdr(car(fns)))) == INT2FIX(6));
+#else
+  fail_unless(NIL_P(car(prof)));
+  fail_unless(NIL_P(fns));
+#endif
+  arc_vmprof_stop(c);
+  fail_unless(c->vmprof == NULL);
+  fail_unless(NIL_P(arc_vmprof_report(c)));
+}
+END_TEST
+
+START_TEST(test_sample_profile)
+{
+  value cctx, code, clos, str;
+  value thr;
+  char buf[64];
+
+  cctx = arc_mkcctx(c);
+  arc_emit(c, cctx, ihlt, CNIL);
+  code = arc_cctx2code(c, cctx);
+  clos = arc_mkclos(c, code, CNIL);
+  thr = arc_mkthread(c);
+  fail_unless(NIL_P(arc_sprof_report(c)));
+  /* sample slowly enough that the timer does not tick during the test */
+  fail_unless(arc_sprof_start(c, 1) == 0);
+  __arc_sprof_pending = 2;
+  __arc_sprof_sample(c, CNIL);
+  fail_unless(__arc_sprof_pending == 0);
+  SFUNR(thr, clos);
+  TIPP(thr) = &XVINDEX(CODE_CODE(code), 0);
+  __arc_sprof_pending = 3;
+  __arc_sprof_sample(c, thr);
+  str = arc_sprof_report(c);
+  fail_unless(arc_strlen(c, str) < 64);
+  arc_str2cstr(c, str, buf);
+  fail_unless(strstr(buf, "[gc] 2\n") != NULL);
+  fail_unless(strstr(buf, "<anonymous> 3\n") != NULL);
+  arc_sprof_stop(c);
+  fail_unless(NIL_P(arc_sprof_report(c)));
+}
+END_TEST
+
+START_TEST(test_alloc_profile)
+{
+  value cctx, code, clos, thr, oldthr, rep, elt;
+  int found = 0;
+
+  cctx = arc_mkcctx(c);
+  arc_emit(c, cctx, ihlt, CNIL);
+  code = arc_cctx2code(c, cctx);
+  clos = arc_mkclos(c, code, CNIL);
+  thr = arc_mkthread(c);
+  SFUNR(thr, clos);
+  TIPP(thr) = &XVINDEX(CODE_CODE(code), 0);
+  oldthr = c->curthread;
+  c->curthread = thr;
+  fail_unless(NIL_P(arc_aprof_report(c)));
+  /* a rate of one samples every byte allocated */
+  fail_unless(arc_aprof_start(c, 1) == 0);
+  cons(c, CNIL, CNIL);
+  c->curthread = oldthr;
+  for (rep = arc_aprof_report(c); !NIL_P(rep); rep = cdr(rep)) {
+    /* (fnname file line cname type bytes live) */
+    elt = cdr(cdr(cdr(cdr(car(rep)))));
+    if (car(elt) == arc_intern_cstr(c, "cons")) {
+      fail_unless(FIX2INT(cadr(elt)) > 0);
+      found = 1;
+    }
+  }
+  fail_unless(found);
+  arc_aprof_stop(c);
+  fail_unless(NIL_P(arc_aprof_report(c)));
+}
+END_TEST
+
 int main(void)
 {
   int number_failed;
@@ -955,6 +1108,10 @@ int main(void)
 
   tcase_add_test(tc_vm, test_funarg);
   tcase_add_test(tc_vm, test_callcc);
+  tcase_add_test(tc_vm, test_lineno);
+  tcase_add_test(tc_vm, test_profile);
+  tcase_add_test(tc_vm, test_sample_profile);
+  tcase_add_test(tc_vm, test_alloc_profile);
 
   suite_add_tcase(s, tc_vm);
   sr = srunner_create(s);